@@ -0,0 +1,549 @@
+// rmt bench - end-to-end benchmark driver
+//
+// Builds a synthetic remote tree, then times rmt through mount, a no-op
+// sync, an edit-heavy sync, a sync with both-sides edits, a sync of remote
+// deletes (whose outcome is checked) and unmount. Each
+// phase records wall time, peak RSS, and the counters rmt writes to
+// RMT_STATS_JSON (forks, files/bytes moved, bytes hashed). The result is
+// JSON; --baseline compares it with an earlier result and fails on
+// regressions.
+#define _POSIX_C_SOURCE 200809L
+#define _DARWIN_C_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define MAX_PATH_LEN 4096
+#define MAX_PHASES   8
+#define LINE_LEN     48
+
+typedef struct {
+    const char *rmt;
+    const char *out;
+    const char *baseline;
+    const char *transport;  // local: ssh stand-in that runs commands here; ssh: real ssh;
+                            // file: rmt's native file:// backend, no ssh or rsync
+    const char *host;
+    double threshold;       // allowed slowdown before a metric counts as a regression, %
+    int small;              // number of small text files
+    int small_kb;           // their approximate size
+    int huge;               // number of large binary files
+    int huge_mb;
+    int depth;              // directory nesting of the small files
+    int fanout;             // subdirectories per level
+    int edit_pct;           // small files edited on each side before the edit sync
+    int conflict_pct;       // small files edited on both sides before the conflict sync
+    unsigned long long seed;
+    int keep;               // leave the work directory behind
+} BenchConfig;
+
+typedef struct {
+    const char *name;
+    int rc;
+    double wall_ms;
+    long long max_rss_kb;
+    long long forks, files_down, bytes_down, files_up, bytes_up, hash_files, hash_bytes;
+} Phase;
+
+static BenchConfig g_cfg = {
+    "./bin/remote", NULL, NULL, "local", "localhost",
+    10.0, 2000, 4, 2, 64, 6, 4, 5, 2, 1, 0
+};
+
+#define WORK_LEN 256                    // work paths are short mkdtemp names
+
+static char g_work[WORK_LEN];           // mkdtemp root
+static char g_remote[WORK_LEN + 16];    // synthetic remote tree
+static char g_local[WORK_LEN + 16];     // mount point
+static char g_spec[MAX_PATH_LEN];       // host:remote or file://remote
+static unsigned long long g_rng;
+
+// ---------------------------------------------------------------------------
+// Synthetic tree
+// ---------------------------------------------------------------------------
+
+static unsigned long long rng_next(void) {
+    // xorshift64*: deterministic for a given --seed, which is all we need
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 2685821657736338717ULL;
+}
+
+static int mkdir_p(const char *path) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Random lowercase text, LINE_LEN bytes per line, so merges work line-wise
+static void write_text(FILE *f, size_t bytes) {
+    char line[LINE_LEN + 1];
+    for (size_t done = 0; done < bytes; done += LINE_LEN) {
+        for (int i = 0; i < LINE_LEN - 1; i++) {
+            unsigned r = (unsigned)(rng_next() >> 40) % 32;
+            line[i] = r < 26 ? (char)('a' + r) : ' ';
+        }
+        line[LINE_LEN - 1] = '\n';
+        fwrite(line, 1, LINE_LEN, f);
+    }
+}
+
+static void small_path(const char *root, int i, char *out, size_t len) {
+    int n = snprintf(out, len, "%s", root);
+    int div = 1;
+    for (int d = 0; d < g_cfg.depth; d++) {
+        n += snprintf(out + n, len - (size_t)n, "/d%d", (i / div) % g_cfg.fanout);
+        div *= g_cfg.fanout;
+    }
+    snprintf(out + n, len - (size_t)n, "/f%d.txt", i);
+}
+
+// Generated files are dated an hour back, like a tree that has been sitting
+// on the remote: mtimes close to a manifest save count as racy and would
+// make every phase re-fetch the whole tree.
+static int backdate(const char *path) {
+    struct timeval tv[2];
+    gettimeofday(&tv[0], NULL);
+    tv[0].tv_sec -= 3600;
+    tv[1] = tv[0];
+    return utimes(path, tv);
+}
+
+static int gen_tree(const char *root) {
+    char path[MAX_PATH_LEN];
+    for (int i = 0; i < g_cfg.small; i++) {
+        small_path(root, i, path, sizeof(path));
+        char *slash = strrchr(path, '/');
+        *slash = '\0';
+        if (mkdir_p(path) != 0) return -1;
+        *slash = '/';
+        FILE *f = fopen(path, "w");
+        if (!f) return -1;
+        size_t kb = (size_t)g_cfg.small_kb;
+        write_text(f, kb * 512 + (size_t)(rng_next() % (kb * 1024)));
+        if (fclose(f) != 0 || backdate(path) != 0) return -1;
+    }
+
+    static unsigned long long block[1 << 14];
+    for (int i = 0; i < g_cfg.huge; i++) {
+        snprintf(path, sizeof(path), "%s/huge%d.bin", root, i);
+        FILE *f = fopen(path, "w");
+        if (!f) return -1;
+        for (long long left = (long long)g_cfg.huge_mb << 20; left > 0; left -= (long long)sizeof(block)) {
+            for (size_t k = 0; k < sizeof(block) / sizeof(block[0]); k++) block[k] = rng_next();
+            fwrite(block, 1, left < (long long)sizeof(block) ? (size_t)left : sizeof(block), f);
+        }
+        if (fclose(f) != 0 || backdate(path) != 0) return -1;
+    }
+    return 0;
+}
+
+// Edit small file i under root: local edits rewrite the first line and
+// remote edits append, so both-sides edits merge without conflict markers.
+static int edit_small(const char *root, int i, int at_end) {
+    char path[MAX_PATH_LEN];
+    small_path(root, i, path, sizeof(path));
+    if (at_end) {
+        FILE *f = fopen(path, "a");
+        if (!f) return -1;
+        write_text(f, LINE_LEN);
+        return fclose(f);
+    }
+    FILE *f = fopen(path, "r+");
+    if (!f) return -1;
+    fputs("edited locally", f);
+    fclose(f);
+    // Same size: move mtime so the edit cannot hide inside one timestamp tick
+    struct timeval tv[2];
+    gettimeofday(&tv[0], NULL);
+    tv[0].tv_sec += 2;
+    tv[1] = tv[0];
+    return utimes(path, tv);
+}
+
+// Pick count distinct small files, recorded in used[] so sides never overlap
+static int pick(int *used, int count, int *out) {
+    int n = 0;
+    for (int tries = 0; n < count && tries < g_cfg.small * 4; tries++) {
+        int i = (int)(rng_next() % (unsigned long long)g_cfg.small);
+        if (used[i]) continue;
+        used[i] = 1;
+        out[n++] = i;
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Running rmt
+// ---------------------------------------------------------------------------
+
+static long long json_int(const char *json, const char *key) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = json ? strstr(json, pat) : NULL;
+    return p ? strtoll(p + strlen(pat), NULL, 10) : -1;
+}
+
+static double json_num(const char *json, const char *key) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = json ? strstr(json, pat) : NULL;
+    return p ? strtod(p + strlen(pat), NULL) : -1;
+}
+
+static char *read_all(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t cap = 4096, n = 0, nr;
+    char *buf = malloc(cap);
+    while ((nr = fread(buf + n, 1, cap - n - 1, f)) > 0) {
+        n += nr;
+        if (n + 1 == cap) { cap *= 2; buf = realloc(buf, cap); }
+    }
+    buf[n] = '\0';
+    fclose(f);
+    return buf;
+}
+
+// Run rmt with argv (NULL-terminated, without argv[0]) as one phase
+static int run_phase(Phase *ph, const char *name, const char **args) {
+    char stats[MAX_PATH_LEN], logp[MAX_PATH_LEN], home[MAX_PATH_LEN], path_env[MAX_PATH_LEN * 2];
+    snprintf(stats, sizeof(stats), "%s/stats.json", g_work);
+    snprintf(logp,  sizeof(logp),  "%s/rmt.log", g_work);
+    snprintf(home,  sizeof(home),  "%s/home", g_work);
+    unlink(stats);
+
+    const char *argv[16];
+    int n = 0;
+    argv[n++] = g_cfg.rmt;
+    if (strcmp(g_cfg.transport, "local") == 0) argv[n++] = "--no-mux";
+    for (int i = 0; args[i] && n < 15; i++) argv[n++] = args[i];
+    argv[n] = NULL;
+
+    memset(ph, 0, sizeof(*ph));
+    ph->name = name;
+    fprintf(stderr, "  %-14s", name);
+    fflush(stderr);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        setenv("HOME", home, 1);
+        setenv("RMT_STATS_JSON", stats, 1);
+        if (strcmp(g_cfg.transport, "local") == 0) {
+            const char *old = getenv("PATH");
+            snprintf(path_env, sizeof(path_env), "%s/shim:%s", g_work, old ? old : "/usr/bin:/bin");
+            setenv("PATH", path_env, 1);
+        }
+        int in  = open("/dev/null", O_RDONLY);
+        int out = open(logp, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (in >= 0)  dup2(in, STDIN_FILENO);
+        if (out >= 0) { dup2(out, STDOUT_FILENO); dup2(out, STDERR_FILENO); }
+        execv(g_cfg.rmt, (char **)argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) { perror("wait4"); return -1; }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ph->rc         = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    ph->wall_ms    = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+#ifdef __APPLE__
+    ph->max_rss_kb = ru.ru_maxrss / 1024;   // bytes on macOS
+#else
+    ph->max_rss_kb = ru.ru_maxrss;
+#endif
+    char *js = read_all(stats);
+    ph->forks      = json_int(js, "forks");
+    ph->files_down = json_int(js, "files_down");
+    ph->bytes_down = json_int(js, "bytes_down");
+    ph->files_up   = json_int(js, "files_up");
+    ph->bytes_up   = json_int(js, "bytes_up");
+    ph->hash_files = json_int(js, "hash_files");
+    ph->hash_bytes = json_int(js, "hash_bytes");
+    free(js);
+
+    fprintf(stderr, "%9.1f ms  rss %6lld KB  forks %4lld  rc %d\n",
+            ph->wall_ms, ph->max_rss_kb, ph->forks, ph->rc);
+    return ph->rc;
+}
+
+// Stand-in for ssh: skip options and the host, run the command here. rsync
+// started over it still speaks its remote protocol through the pipe.
+static int write_shim(void) {
+    char dir[WORK_LEN + 16], path[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s/shim", g_work);
+    snprintf(path, sizeof(path), "%s/ssh", dir);
+    if (mkdir_p(dir) != 0) return -1;
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    fputs("#!/bin/sh\n"
+          "# rmt bench: runs the remote command locally\n"
+          "while [ $# -gt 0 ]; do\n"
+          "  case \"$1\" in\n"
+          "    -o|-S|-p|-l|-i|-c|-e|-F|-J|-O) shift 2 ;;\n"
+          "    -*) shift ;;\n"
+          "    *) break ;;\n"
+          "  esac\n"
+          "done\n"
+          "[ $# -gt 0 ] || exit 255\n"
+          "shift\n"
+          "exec sh -c \"$*\"\n", f);
+    fclose(f);
+    return chmod(path, 0755);
+}
+
+// ---------------------------------------------------------------------------
+// Report
+// ---------------------------------------------------------------------------
+
+static void write_json(FILE *f, const Phase *ph, int n) {
+    fprintf(f, "{\n  \"config\": {\"small\": %d, \"small_kb\": %d, \"huge\": %d, \"huge_mb\": %d, "
+               "\"depth\": %d, \"fanout\": %d, \"edit_pct\": %d, \"conflict_pct\": %d, "
+               "\"seed\": %llu, \"transport\": \"%s\"},\n  \"phases\": [\n",
+            g_cfg.small, g_cfg.small_kb, g_cfg.huge, g_cfg.huge_mb, g_cfg.depth, g_cfg.fanout,
+            g_cfg.edit_pct, g_cfg.conflict_pct, g_cfg.seed, g_cfg.transport);
+    for (int i = 0; i < n; i++) {
+        const Phase *p = &ph[i];
+        fprintf(f, "    {\"name\": \"%s\", \"rc\": %d, \"wall_ms\": %.1f, \"max_rss_kb\": %lld, "
+                   "\"forks\": %lld, \"files_down\": %lld, \"bytes_down\": %lld, "
+                   "\"files_up\": %lld, \"bytes_up\": %lld, \"hash_files\": %lld, "
+                   "\"hash_bytes\": %lld}%s\n",
+                p->name, p->rc, p->wall_ms, p->max_rss_kb, p->forks, p->files_down,
+                p->bytes_down, p->files_up, p->bytes_up, p->hash_files, p->hash_bytes,
+                i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Compare with a saved result. Wall time ignores differences under 5 ms,
+// which are noise at this scale. Returns the number of regressions.
+static int compare_baseline(const char *path, const Phase *ph, int n) {
+    char *base = read_all(path);
+    if (!base) { fprintf(stderr, "Cannot read baseline %s: %s\n", path, strerror(errno)); return -1; }
+
+    static const char *metrics[] = { "wall_ms", "max_rss_kb", "forks" };
+    int regressions = 0;
+    fprintf(stderr, "\n  %-14s %-11s %12s %12s %8s\n", "phase", "metric", "baseline", "now", "change");
+    for (int i = 0; i < n; i++) {
+        char pat[64];
+        snprintf(pat, sizeof(pat), "\"name\": \"%s\"", ph[i].name);
+        const char *obj = strstr(base, pat);
+        if (!obj) continue;
+        const char *end = strchr(obj, '}');
+        size_t len = end ? (size_t)(end - obj) : strlen(obj);
+        char *one = malloc(len + 1);
+        memcpy(one, obj, len);
+        one[len] = '\0';
+
+        for (int k = 0; k < 3; k++) {
+            double was = json_num(one, metrics[k]);
+            double now = k == 0 ? ph[i].wall_ms : k == 1 ? (double)ph[i].max_rss_kb : (double)ph[i].forks;
+            if (was < 0 || now < 0) continue;
+            double pct = was > 0 ? (now - was) * 100.0 / was : 0;
+            int bad = pct > g_cfg.threshold && !(k == 0 && now - was < 5.0);
+            regressions += bad;
+            fprintf(stderr, "  %-14s %-11s %12.1f %12.1f %+7.1f%%%s\n",
+                    ph[i].name, metrics[k], was, now, pct, bad ? "  REGRESSION" : "");
+        }
+        free(one);
+    }
+    free(base);
+    return regressions;
+}
+
+// ---------------------------------------------------------------------------
+// Main
+// ---------------------------------------------------------------------------
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n\n"
+        "  --rmt=PATH          rmt binary to measure (default ./bin/remote)\n"
+        "  --out=FILE          write the JSON result to FILE instead of stdout\n"
+        "  --baseline=FILE     compare with an earlier result; exit 1 on regressions\n"
+        "  --threshold=PCT     allowed slowdown per metric (default 10)\n"
+        "  --transport=local   run remote commands through a local ssh stand-in (default)\n"
+        "  --transport=ssh     use real ssh to --host (default localhost)\n"
+        "  --transport=file    mount the remote tree as file:// (no ssh or rsync)\n"
+        "  --small=N           small text files (default 2000), --small-kb=N their size\n"
+        "  --huge=N            large binary files (default 2), --huge-mb=N their size\n"
+        "  --depth=N           directory nesting (default 6), --fanout=N per level\n"
+        "  --edit=PCT          files edited on each side for the edit sync (default 5)\n"
+        "  --conflict=PCT      files edited on both sides for the conflict sync, and\n"
+        "                      deleted remotely for the delete sync (default 2)\n"
+        "  --seed=N            tree and edit seed (default 1)\n"
+        "  --keep              keep the work directory\n", prog);
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = strchr(a, '=');
+        v = v ? v + 1 : "";
+        if      (strncmp(a, "--rmt=", 6) == 0)        g_cfg.rmt = v;
+        else if (strncmp(a, "--out=", 6) == 0)        g_cfg.out = v;
+        else if (strncmp(a, "--baseline=", 11) == 0)  g_cfg.baseline = v;
+        else if (strncmp(a, "--threshold=", 12) == 0) g_cfg.threshold = atof(v);
+        else if (strncmp(a, "--transport=", 12) == 0) g_cfg.transport = v;
+        else if (strncmp(a, "--host=", 7) == 0)       g_cfg.host = v;
+        else if (strncmp(a, "--small=", 8) == 0)      g_cfg.small = atoi(v);
+        else if (strncmp(a, "--small-kb=", 11) == 0)  g_cfg.small_kb = atoi(v);
+        else if (strncmp(a, "--huge=", 7) == 0)       g_cfg.huge = atoi(v);
+        else if (strncmp(a, "--huge-mb=", 10) == 0)   g_cfg.huge_mb = atoi(v);
+        else if (strncmp(a, "--depth=", 8) == 0)      g_cfg.depth = atoi(v);
+        else if (strncmp(a, "--fanout=", 9) == 0)     g_cfg.fanout = atoi(v);
+        else if (strncmp(a, "--edit=", 7) == 0)       g_cfg.edit_pct = atoi(v);
+        else if (strncmp(a, "--conflict=", 11) == 0)  g_cfg.conflict_pct = atoi(v);
+        else if (strncmp(a, "--seed=", 7) == 0)       g_cfg.seed = strtoull(v, NULL, 10);
+        else if (strcmp(a, "--keep") == 0)            g_cfg.keep = 1;
+        else { usage(argv[0]); return -1; }
+    }
+    if (strcmp(g_cfg.transport, "local") != 0 && strcmp(g_cfg.transport, "ssh") != 0
+        && strcmp(g_cfg.transport, "file") != 0) {
+        fprintf(stderr, "Unknown transport: %s (expected local, ssh or file)\n", g_cfg.transport);
+        return -1;
+    }
+    if (g_cfg.small < 1 || g_cfg.small_kb < 1 || g_cfg.huge < 0 || g_cfg.huge_mb < 0
+        || g_cfg.depth < 0 || g_cfg.fanout < 1
+        || g_cfg.edit_pct < 0 || g_cfg.conflict_pct < 0 || g_cfg.edit_pct * 2 + g_cfg.conflict_pct * 3 > 100) {
+        fprintf(stderr, "Invalid tree or edit parameters\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) != 0) return 2;
+    if (access(g_cfg.rmt, X_OK) != 0) {
+        fprintf(stderr, "Cannot run %s: %s\n", g_cfg.rmt, strerror(errno));
+        return 2;
+    }
+    // execv runs rmt from the work directory's environment, not ours
+    static char rmt_abs[MAX_PATH_LEN];
+    if (realpath(g_cfg.rmt, rmt_abs)) g_cfg.rmt = rmt_abs;
+    g_rng = g_cfg.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    snprintf(g_work, sizeof(g_work), "/tmp/rmt_bench_XXXXXX");
+    if (!mkdtemp(g_work)) { perror("mkdtemp"); return 2; }
+    snprintf(g_remote, sizeof(g_remote), "%s/remote", g_work);
+    snprintf(g_local,  sizeof(g_local),  "%s/local", g_work);
+    if (strcmp(g_cfg.transport, "file") == 0)
+        snprintf(g_spec, sizeof(g_spec), "file://%s", g_remote);
+    else
+        snprintf(g_spec, sizeof(g_spec), "%s:%s", g_cfg.host, g_remote);
+    char home[MAX_PATH_LEN];
+    snprintf(home, sizeof(home), "%s/home", g_work);
+
+    fprintf(stderr, "Generating %d small + %d x %d MiB files in %s...\n",
+            g_cfg.small, g_cfg.huge, g_cfg.huge_mb, g_work);
+    if (mkdir_p(home) != 0 || mkdir_p(g_remote) != 0 || gen_tree(g_remote) != 0
+        || (strcmp(g_cfg.transport, "local") == 0 && write_shim() != 0)) {
+        fprintf(stderr, "Failed to set up %s: %s\n", g_work, strerror(errno));
+        return 2;
+    }
+
+    Phase ph[MAX_PHASES];
+    int n = 0, failed = 0;
+    int *used  = calloc((size_t)g_cfg.small, sizeof(int));
+    int *picks = malloc((size_t)g_cfg.small * sizeof(int));
+
+    const char *mount[]  = { "mount", g_spec, g_local, NULL };
+    const char *sync[]   = { "sync", g_local, NULL };
+    const char *umount[] = { "unmount", g_local, NULL };
+
+    fprintf(stderr, "Running %s:\n", g_cfg.rmt);
+    if (run_phase(&ph[n++], "mount", mount) != 0) failed = 1;
+    if (!failed && run_phase(&ph[n++], "sync-noop", sync) != 0) failed = 1;
+
+    if (!failed) {
+        int k = pick(used, g_cfg.small * g_cfg.edit_pct / 100, picks);
+        for (int i = 0; i < k; i++) edit_small(g_local, picks[i], 0);
+        k = pick(used, g_cfg.small * g_cfg.edit_pct / 100, picks);
+        for (int i = 0; i < k; i++) edit_small(g_remote, picks[i], 1);
+        if (run_phase(&ph[n++], "sync-edit", sync) != 0) failed = 1;
+    }
+    if (!failed) {
+        int k = pick(used, g_cfg.small * g_cfg.conflict_pct / 100, picks);
+        for (int i = 0; i < k; i++) {
+            edit_small(g_local,  picks[i], 0);
+            edit_small(g_remote, picks[i], 1);
+        }
+        if (run_phase(&ph[n++], "sync-conflict", sync) != 0) failed = 1;
+    }
+    if (!failed) {
+        // Remote deletes: files untouched locally go locally too, files
+        // edited locally are pushed back
+        int k = pick(used, g_cfg.small * g_cfg.conflict_pct / 100, picks);
+        int *kept = picks + k;
+        int m = pick(used, g_cfg.small * g_cfg.conflict_pct / 100, kept);
+        char path[MAX_PATH_LEN];
+        for (int i = 0; i < k + m; i++) {
+            if (i >= k) edit_small(g_local, picks[i], 0);
+            small_path(g_remote, picks[i], path, sizeof(path));
+            unlink(path);
+        }
+        if (run_phase(&ph[n++], "sync-delete", sync) != 0) failed = 1;
+        int wrong = 0;
+        for (int i = 0; !failed && i < k + m; i++) {
+            small_path(i < k ? g_local : g_remote, picks[i], path, sizeof(path));
+            if ((access(path, F_OK) == 0) != (i >= k)) wrong++;
+        }
+        if (wrong > 0) {
+            fprintf(stderr, "  %d remote delete%s not carried through\n", wrong, wrong == 1 ? "" : "s");
+            failed = 1;
+        }
+    }
+    if (!failed && run_phase(&ph[n++], "unmount", umount) != 0) failed = 1;
+    free(used);
+    free(picks);
+
+    if (failed) fprintf(stderr, "Phase %s failed; see %s/rmt.log\n", ph[n - 1].name, g_work);
+
+    FILE *out = stdout;
+    if (g_cfg.out && !(out = fopen(g_cfg.out, "w"))) {
+        fprintf(stderr, "Cannot write %s: %s\n", g_cfg.out, strerror(errno));
+        out = stdout;
+    }
+    write_json(out, ph, n);
+    if (out != stdout) fclose(out);
+
+    int regressions = 0;
+    if (g_cfg.baseline) {
+        regressions = compare_baseline(g_cfg.baseline, ph, n);
+        if (regressions > 0)  fprintf(stderr, "\n%d regression%s over %.0f%%\n",
+                                      regressions, regressions == 1 ? "" : "s", g_cfg.threshold);
+        if (regressions == 0) fprintf(stderr, "\nNo regressions\n");
+    }
+
+    if (!g_cfg.keep && !failed) {
+        char cmd[MAX_PATH_LEN + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", g_work);
+        system(cmd);
+    }
+    return (failed || regressions != 0) ? 1 : 0;
+}
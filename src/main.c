@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -16,84 +18,517 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <signal.h>
+#include <poll.h>
 #include <pthread.h>
-#define MAX_MOUNTS   32
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #define MAX_PATH_LEN 4096
 #define VERSION      "1.1.0"
 #define COMP_BIN     "/usr/local/bin/comp"
 #define BASE_DIR_NAME ".rmt-base"
+#define MANIFEST_NAME ".rmt-manifest"
+// rsync filter shared by every transfer so the manifest (and a pre-object-store
+// base cache) never leave the mount
+#define RMT_EXCLUDES  "--exclude=" BASE_DIR_NAME "/ --exclude=/" MANIFEST_NAME "*"
+// Remote spec prefix for a directory on this machine (local disk, NFS, ...)
+#define FILE_SCHEME   "file://"
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st) ((long)(st).st_mtimespec.tv_nsec)
+#define ST_CTIME_NSEC(st) ((long)(st).st_ctimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((long)(st).st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st) ((long)(st).st_ctim.tv_nsec)
+#endif
 
 typedef struct {
-    char local_path[MAX_PATH_LEN];
-    char remote_spec[MAX_PATH_LEN];  // user@host:/path
+    const char *local_path;   // resolved; owned by the registry
+    const char *remote_spec;  // user@host:/path or file:///path
     time_t mounted_at;
     time_t last_sync;
+    long long files;          // as of the last full sync, -1 = unknown
+    long long bytes;
+    long long sync_ms;        // duration of the last sync, -1 = unknown
 } Mount;
 
-typedef struct {
-    Mount mounts[MAX_MOUNTS];
-    int count;
-} MountRegistry;
-
 // --- Forward declarations ---
-static int cmd_mount(const char *remote, const char *local);
+static int cmd_mount(const char *remote, const char *local, int lazy);
 static int cmd_sync(const char *local, int dry_run, int pull_only, int push_only);
 static int cmd_unmount(const char *local, int keep_local);
 static int cmd_status(void);
+static int cmd_gc(int dry_run);
+static int cmd_watch(const char *local, int interval_ms, int poll_s);
 static void usage(const char *prog);
 static int smart_sync(const char *local_root, const char *remote_spec, int dry_run);
+static void transport_open(const char *remote_spec);
+static int manifest_rebuild(const char *local_root);
+
+// ---------------------------------------------------------------------------
+// Run counters — written as JSON at exit when RMT_STATS_JSON names a file,
+// so a benchmark can see what a run cost without scraping its output
+// ---------------------------------------------------------------------------
+
+// Counters may be bumped from pool workers
+#define STAT_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+static struct {
+    long long forks;        // shell commands and child processes started
+    long long ssh_sessions; // of those, ssh and rsync runs
+    long long files_down;   // fetched from the remote by a sync
+    long long bytes_down;
+    long long files_up;     // pushed to the remote by a sync
+    long long bytes_up;
+    long long bytes_copied; // written locally by the copy engine
+    long long delta_files;  // sent either way as a delta against their base
+    long long delta_saved;  // bytes those deltas kept off the wire
+    long long chunk_files;  // large files moved in pieces over parallel streams
+    long long chunk_saved;  // bytes of unchanged pieces not sent
+    long long comp_in;      // file data rsync moved
+    long long comp_out;     // ...and the bytes that took on the wire
+    long long comp_cpu_ns;  // CPU time of the rsync processes
+    long long comp_levels;  // bit per CompLevel used
+} g_run_stats;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 // ---------------------------------------------------------------------------
-// Progress: spinner (for black-box ops) + fill bar (for file loop)
+// Instrumentation — scoped timers around phases, external processes and
+// per-file work. Totals feed the --stats table; with --trace=FILE every span
+// is also kept and written at exit in Chrome trace-event format (load it in
+// chrome://tracing or ui.perfetto.dev).
 // ---------------------------------------------------------------------------
 
+static int         g_stats_table = 0;    // --stats
+static const char *g_trace_path  = NULL; // --trace=FILE
+
+#define MAX_TIMERS 64
+
 typedef struct {
-    const char *label;
-    volatile int done;
-} SpinnerArgs;
-
-static void *spinner_thread(void *arg) {
-    SpinnerArgs *s = (SpinnerArgs *)arg;
-    const char *frames[] = {"⠋","⠙","⠹","⠸","⠼","⠴","⠦","⠧","⠇","⠏"};
-    int nf = 10, f = 0;
-    struct timespec ts = {0, 80000000};
-    while (!s->done) {
-        fprintf(stderr, "\r  %s %s  ", frames[f++ % nf], s->label);
-        fflush(stderr);
-        nanosleep(&ts, NULL);
+    char *name;
+    const char *cat;
+    long long calls, total_ns, max_ns;
+} TimerStat;
+
+typedef struct {
+    const TimerStat *timer;
+    char *detail;           // e.g. the path or command line; may be NULL
+    long long ts_ns, dur_ns;
+    int tid;
+} TraceEvent;
+
+static struct {
+    pthread_mutex_t lock;
+    TimerStat timers[MAX_TIMERS];
+    int ntimers;
+    TraceEvent *events;
+    int nevents, cap;
+    pthread_t threads[256];  // trace tids are indexes into this
+    int nthreads;
+    long long t0;
+} g_instr = { PTHREAD_MUTEX_INITIALIZER, {{0}}, 0, NULL, 0, 0, {0}, 0, 0 };
+
+// Returns the start time to hand to timer_stop, or 0 when nothing is recorded.
+static long long timer_start(void) {
+    return (g_stats_table || g_trace_path) ? now_ns() : 0;
+}
+
+static TimerStat *timer_find(const char *cat, const char *name) {
+    for (int i = 0; i < g_instr.ntimers; i++)
+        if (strcmp(g_instr.timers[i].cat, cat) == 0 && strcmp(g_instr.timers[i].name, name) == 0)
+            return &g_instr.timers[i];
+    if (g_instr.ntimers == MAX_TIMERS) return NULL;
+    TimerStat *t = &g_instr.timers[g_instr.ntimers++];
+    t->name = strdup(name);
+    t->cat  = cat;
+    return t;
+}
+
+static int trace_tid(void) {
+    pthread_t self = pthread_self();
+    for (int i = 0; i < g_instr.nthreads; i++)
+        if (pthread_equal(g_instr.threads[i], self)) return i;
+    if (g_instr.nthreads == 256) return 255;
+    g_instr.threads[g_instr.nthreads] = self;
+    return g_instr.nthreads++;
+}
+
+// Close the span opened by timer_start. cat groups spans in the trace
+// viewer ("phase", "exec", "file"); detail, if given, is copied.
+static void timer_stop(const char *cat, const char *name, long long t0, const char *detail) {
+    if (t0 == 0) return;
+    long long dur = now_ns() - t0;
+    pthread_mutex_lock(&g_instr.lock);
+    TimerStat *t = timer_find(cat, name);
+    if (t) {
+        t->calls++;
+        t->total_ns += dur;
+        if (dur > t->max_ns) t->max_ns = dur;
     }
-    // Clear the spinner line so subsequent output is clean
-    fprintf(stderr, "\r  \033[2K");
-    fflush(stderr);
-    return NULL;
+    if (g_trace_path && t) {
+        if (g_instr.nevents == g_instr.cap) {
+            g_instr.cap = g_instr.cap ? g_instr.cap * 2 : 1024;
+            g_instr.events = realloc(g_instr.events, g_instr.cap * sizeof(TraceEvent));
+        }
+        TraceEvent *e = &g_instr.events[g_instr.nevents++];
+        e->timer  = t;
+        e->detail = detail ? strdup(detail) : NULL;
+        e->ts_ns  = t0;
+        e->dur_ns = dur;
+        e->tid    = trace_tid();
+    }
+    pthread_mutex_unlock(&g_instr.lock);
 }
 
-// Run cmd via system() while showing an animated spinner on stderr.
-// Returns the exit code of the command.
-static int system_with_spinner(const char *cmd, const char *label) {
-    SpinnerArgs args = { label, 0 };
-    pthread_t tid;
-    pthread_create(&tid, NULL, spinner_thread, &args);
+// Name an external command by its program: "ssh", "rsync", "comp", ...
+static void exec_name(const char *cmd, char *out, size_t len) {
+    size_t n = strcspn(cmd, " \t");
+    const char *base = cmd;
+    for (size_t i = 0; i < n; i++) if (cmd[i] == '/') base = cmd + i + 1;
+    n -= (size_t)(base - cmd);
+    if (n >= len) n = len - 1;
+    memcpy(out, base, n);
+    out[n] = '\0';
+}
+
+static void exec_begin(const char *cmd) {
+    STAT_ADD(g_run_stats.forks, 1);
+    if (strncmp(cmd, "ssh ", 4) == 0 || strncmp(cmd, "rsync ", 6) == 0)
+        STAT_ADD(g_run_stats.ssh_sessions, 1);
+}
+
+static void exec_end(const char *cmd, long long t0) {
+    if (t0 == 0) return;
+    char name[64];
+    exec_name(cmd, name, sizeof(name));
+    timer_stop("exec", name, t0, cmd);
+}
+
+static int run_system(const char *cmd) {
+    exec_begin(cmd);
+    long long t0 = timer_start();
     int rc = system(cmd);
-    args.done = 1;
-    pthread_join(tid, NULL);
+    exec_end(cmd, t0);
     return rc;
 }
 
-// Draw an in-place fill bar on stderr.
-// Call with current == total to finalise (prints newline).
-#define BAR_WIDTH 35
-static void draw_bar(int current, int total, const char *label) {
-    int filled = (total > 0) ? (current * BAR_WIDTH) / total : BAR_WIDTH;
-    int pct    = (total > 0) ? (current * 100) / total : 100;
-    fprintf(stderr, "\r  %-18s [", label);
-    for (int i = 0; i < BAR_WIDTH; i++)
-        fputc(i < filled ? '#' : '-', stderr);
-    fprintf(stderr, "] %3d%%  ", pct);
+// The command is timed by the caller, up to its pclose
+static FILE *run_popen(const char *cmd) {
+    exec_begin(cmd);
+    return popen(cmd, "r");
+}
+
+static void json_put_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if      (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20)              fprintf(f, "\\u%04x", c);
+        else                            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// atexit handler for --trace
+static void write_trace(void) {
+    if (!g_trace_path) return;
+    FILE *f = fopen(g_trace_path, "w");
+    if (!f) { fprintf(stderr, "Cannot write trace %s: %s\n", g_trace_path, strerror(errno)); return; }
+    long pid = (long)getpid();
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int i = 0; i < g_instr.nthreads; i++)
+        fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, \"tid\": %d, "
+                   "\"args\": {\"name\": \"%s %d\"}},\n",
+                pid, i, i == 0 ? "main" : "thread", i);
+    for (int i = 0; i < g_instr.nevents; i++) {
+        const TraceEvent *e = &g_instr.events[i];
+        fprintf(f, "{\"name\": ");
+        json_put_string(f, e->timer->name);
+        fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"pid\": %ld, \"tid\": %d",
+                e->timer->cat, (e->ts_ns - g_instr.t0) / 1e3, e->dur_ns / 1e3, pid, e->tid);
+        if (e->detail) {
+            fprintf(f, ", \"args\": {\"detail\": ");
+            json_put_string(f, e->detail);
+            fputc('}', f);
+        }
+        fprintf(f, "},\n");
+    }
+    // Totals as counter samples so they show up alongside the spans
+    fprintf(f, "{\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": %ld, \"args\": "
+               "{\"forks\": %lld, \"ssh_sessions\": %lld, \"bytes_down\": %lld, "
+               "\"bytes_up\": %lld, \"bytes_copied\": %lld}}\n]}\n",
+            (now_ns() - g_instr.t0) / 1e3, pid, g_run_stats.forks, g_run_stats.ssh_sessions,
+            g_run_stats.bytes_down, g_run_stats.bytes_up, g_run_stats.bytes_copied);
+    fclose(f);
+}
+
+// ---------------------------------------------------------------------------
+// Progress — one meter at a time. Work on any thread adds files and bytes
+// to its atomic counters; a single render thread draws it at most 10 times
+// a second with throughput and time left, as a bar on stderr or, with
+// --progress=json, as a JSON object per line for whatever runs us.
+// ---------------------------------------------------------------------------
+
+enum { PROGRESS_OFF, PROGRESS_BAR, PROGRESS_JSON };
+static int g_progress = PROGRESS_BAR;  // off in children whose output is collected
+
+#define PROGRESS_TICK_NS 100000000LL   // redraw period
+#define PROGRESS_JSON_NS 1000000000LL  // json lines come at most this often
+#define BAR_WIDTH 30
+
+static struct {
+    char label[64];
+    long long files, files_total;   // a total of 0 is not known (yet)
+    long long bytes, bytes_total;
+    long long t0;
+    int depth;                      // meters begun inside a meter fold into it
+    int stop;
+    int thread;                     // render thread running
+    pthread_t tid;
+    int ticks;
+    long long json_ns;              // last json line
+    double brate, frate;            // smoothed bytes and files per second
+    long long rate_ns, rate_b, rate_f;
+} g_meter;
+
+static void progress_add(long long files, long long bytes) {
+    if (files) __atomic_fetch_add(&g_meter.files, files, __ATOMIC_RELAXED);
+    if (bytes) __atomic_fetch_add(&g_meter.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Absolute figures from a source that counts for itself (rsync)
+static void progress_set(long long files, long long files_total, long long bytes, long long bytes_total) {
+    __atomic_store_n(&g_meter.files, files, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_meter.files_total, files_total, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_meter.bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_meter.bytes_total, bytes_total, __ATOMIC_RELAXED);
+}
+
+static void fmt_bytes(char *out, size_t n, double b) {
+    if (b >= 1024.0 * 1024 * 1024) snprintf(out, n, "%.2f GiB", b / (1024.0 * 1024 * 1024));
+    else if (b >= 1024.0 * 1024)   snprintf(out, n, "%.1f MiB", b / (1024.0 * 1024));
+    else                           snprintf(out, n, "%.0f KiB", b / 1024.0);
+}
+
+static void fmt_secs(char *out, size_t n, double s) {
+    long t = (long)(s + 0.5);
+    if (t >= 3600) snprintf(out, n, "%ld:%02ld:%02ld", t / 3600, t / 60 % 60, t % 60);
+    else           snprintf(out, n, "%ld:%02ld", t / 60, t % 60);
+}
+
+static void progress_draw(int final) {
+    static const char *const frames[] = {"⠋","⠙","⠹","⠸","⠼","⠴","⠦","⠧","⠇","⠏"};
+    long long now = now_ns();
+    long long files = __atomic_load_n(&g_meter.files, __ATOMIC_RELAXED);
+    long long ftot  = __atomic_load_n(&g_meter.files_total, __ATOMIC_RELAXED);
+    long long bytes = __atomic_load_n(&g_meter.bytes, __ATOMIC_RELAXED);
+    long long btot  = __atomic_load_n(&g_meter.bytes_total, __ATOMIC_RELAXED);
+    double elapsed = (now - g_meter.t0) / 1e9;
+
+    // Throughput averaged over the whole run for the first second, then
+    // smoothed so it follows changes without jumping on every tick
+    if (elapsed < 1.0) {
+        g_meter.brate = elapsed > 0 ? bytes / elapsed : 0;
+        g_meter.frate = elapsed > 0 ? files / elapsed : 0;
+    } else if (now > g_meter.rate_ns) {
+        double dt = (now - g_meter.rate_ns) / 1e9;
+        g_meter.brate = 0.85 * g_meter.brate + 0.15 * (bytes - g_meter.rate_b) / dt;
+        g_meter.frate = 0.85 * g_meter.frate + 0.15 * (files - g_meter.rate_f) / dt;
+    }
+    g_meter.rate_ns = now;
+    g_meter.rate_b  = bytes;
+    g_meter.rate_f  = files;
+
+    // Done so far by bytes when their total is known, by files otherwise
+    double frac = -1, eta = -1;
+    if (btot > 0)      frac = (double)bytes / btot;
+    else if (ftot > 0) frac = (double)files / ftot;
+    if (frac > 1 || (final && frac >= 0)) frac = 1;
+    if (!final && btot > 0 && g_meter.brate > 0)      eta = (btot - bytes) / g_meter.brate;
+    else if (!final && ftot > 0 && g_meter.frate > 0) eta = (ftot - files) / g_meter.frate;
+
+    if (g_progress == PROGRESS_JSON) {
+        if (!final && now - g_meter.json_ns < PROGRESS_JSON_NS) return;
+        g_meter.json_ns = now;
+        char *line = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&line, &len);
+        if (!f) return;
+        fprintf(f, "{\"progress\": ");
+        json_put_string(f, g_meter.label);
+        fprintf(f, ", \"files\": %lld, \"files_total\": %lld, \"bytes\": %lld, \"bytes_total\": %lld, "
+                   "\"bytes_per_sec\": %.0f, \"files_per_sec\": %.1f, \"elapsed_s\": %.1f, \"eta_s\": ",
+                files, ftot, bytes, btot, g_meter.brate, g_meter.frate, elapsed);
+        if (eta >= 0) fprintf(f, "%.1f", eta);
+        else          fprintf(f, "null");
+        fprintf(f, ", \"done\": %s}\n", final ? "true" : "false");
+        fclose(f);
+        fputs(line, stderr);
+        fflush(stderr);
+        free(line);
+        return;
+    }
+
+    // The line is built whole and written once
+    char line[512], a[32], b[32];
+    int k;
+    if (frac < 0) {
+        if (final) { fputs("\r  \033[2K", stderr); fflush(stderr); return; }
+        k = snprintf(line, sizeof(line), "\r  %s %s", frames[g_meter.ticks % 10], g_meter.label);
+    } else {
+        int filled = (int)(frac * BAR_WIDTH);
+        int pct = (int)(frac * 100);
+        if (!final && pct > 99) pct = 99;
+        k = snprintf(line, sizeof(line), "\r  %-18s [", g_meter.label);
+        for (int i = 0; i < BAR_WIDTH && k < (int)sizeof(line) - 1; i++) line[k++] = i < filled ? '#' : '-';
+        k += snprintf(line + k, sizeof(line) - k, "] %3d%%", pct);
+    }
+    if (ftot > 0 && k < (int)sizeof(line))
+        k += snprintf(line + k, sizeof(line) - k, "  %lld/%lld", files, ftot);
+    if (bytes > 0 && k < (int)sizeof(line)) {
+        fmt_bytes(a, sizeof(a), (double)bytes);
+        fmt_bytes(b, sizeof(b), g_meter.brate);
+        k += snprintf(line + k, sizeof(line) - k, "  %s  %s/s", a, b);
+    }
+    if (k < (int)sizeof(line)) {
+        if (final)        fmt_secs(a, sizeof(a), elapsed);
+        else if (eta >= 0) fmt_secs(a, sizeof(a), eta);
+        if (final || eta >= 0)
+            k += snprintf(line + k, sizeof(line) - k, "  %s %s", final ? "in" : "ETA", a);
+    }
+    if (k < (int)sizeof(line)) snprintf(line + k, sizeof(line) - k, "\033[K%s", final ? "\n" : "");
+    fputs(line, stderr);
     fflush(stderr);
-    if (current >= total) fprintf(stderr, "\n");
+}
+
+static void *progress_thread(void *arg) {
+    (void)arg;
+    struct timespec ts = {0, PROGRESS_TICK_NS};
+    while (!__atomic_load_n(&g_meter.stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        if (__atomic_load_n(&g_meter.stop, __ATOMIC_ACQUIRE)) break;
+        g_meter.ticks++;
+        progress_draw(0);
+    }
+    return NULL;
+}
+
+// Start the meter; totals of 0 are unknown until progress_set says more.
+// Pairs with progress_end on the same thread.
+static void progress_begin(const char *label, long long files_total, long long bytes_total) {
+    if (g_meter.depth++ > 0) return;
+    snprintf(g_meter.label, sizeof(g_meter.label), "%s", label);
+    progress_set(0, files_total, 0, bytes_total);
+    g_meter.t0      = now_ns();
+    g_meter.ticks   = 0;
+    g_meter.json_ns = 0;
+    g_meter.brate   = 0;
+    g_meter.frate   = 0;
+    g_meter.rate_ns = g_meter.t0;
+    g_meter.rate_b  = 0;
+    g_meter.rate_f  = 0;
+    g_meter.stop    = 0;
+    g_meter.thread  = g_progress != PROGRESS_OFF
+                      && pthread_create(&g_meter.tid, NULL, progress_thread, NULL) == 0;
+}
+
+static void progress_end(void) {
+    if (g_meter.depth == 0 || --g_meter.depth > 0) return;
+    if (!g_meter.thread) return;
+    __atomic_store_n(&g_meter.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(g_meter.tid, NULL);
+    g_meter.thread = 0;
+    progress_draw(1);
+}
+
+// One line of rsync --info=progress2, e.g.
+//   "   1,234,567  45%   12.34MB/s    0:00:12 (xfr#3, to-chk=10/20)"
+static int rsync_progress_line(const char *s, size_t n) {
+    char line[256];
+    if (n == 0 || n >= sizeof(line)) return 0;
+    memcpy(line, s, n);
+    line[n] = '\0';
+    const char *p = line;
+    while (*p == ' ') p++;
+    long long bytes = 0;
+    int digits = 0;
+    for (; isdigit((unsigned char)*p) || *p == ','; p++)
+        if (*p != ',') { bytes = bytes * 10 + (*p - '0'); digits++; }
+    if (digits == 0 || *p != ' ') return 0;
+    while (*p == ' ') p++;
+    int pct = 0;
+    if (!isdigit((unsigned char)*p)) return 0;
+    while (isdigit((unsigned char)*p)) pct = pct * 10 + (*p++ - '0');
+    if (*p != '%' || !strstr(p, "/s")) return 0;
+
+    long long left = 0, total = 0;
+    const char *chk = strstr(p, "-chk=");
+    if (chk && sscanf(chk + 5, "%lld/%lld", &left, &total) != 2) total = 0;
+    progress_set(total > 0 ? total - left : 0, total,
+                 bytes, pct > 0 ? bytes * 100 / pct : 0);
+    return 1;
+}
+
+// Run cmd and capture its stdout under a progress meter (label may be NULL).
+// rsync progress lines are followed on the meter and left out of the
+// output. Returns the malloc'd, NUL-terminated output with its length in
+// *len and the command's exit code in *status; NULL if it could not start.
+static char *run_capture(const char *cmd, const char *label, size_t *len, int *status) {
+    long long t0 = timer_start();
+    FILE *fp = run_popen(cmd);
+    if (!fp) return NULL;
+    if (label) progress_begin(label, 0, 0);
+
+    // Read as it comes (not fread, which waits for a full buffer) and cut
+    // out every \r- or \n-ended piece that is a progress line
+    int fd = fileno(fp);
+    size_t cap = 1 << 16, n = 0, seg = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (n + 1 >= cap) { cap *= 2; buf = realloc(buf, cap); }
+        ssize_t nr = read(fd, buf + n, cap - n - 1);
+        if (nr < 0 && errno == EINTR) continue;
+        if (nr <= 0) break;
+        size_t end = n + (size_t)nr;
+        size_t i = n;
+        while (i < end) {
+            if (buf[i] != '\r' && buf[i] != '\n') { i++; continue; }
+            if (rsync_progress_line(buf + seg, i - seg)) {
+                memmove(buf + seg, buf + i + 1, end - i - 1);
+                end -= i + 1 - seg;
+                i = seg;
+            } else {
+                seg = ++i;
+            }
+        }
+        n = end;
+    }
+    buf[n] = '\0';
+    int rc = pclose(fp);
+    exec_end(cmd, t0);
+
+    if (label) progress_end();
+    *len    = n;
+    *status = WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    return buf;
 }
 
 // ---------------------------------------------------------------------------
@@ -102,7 +537,7 @@ static void draw_bar(int current, int total, const char *label) {
 static const char *find_rsync_path(void) {
     static char path[PATH_MAX];
 
-    FILE *fp = popen("command -v rsync 2>/dev/null", "r");
+    FILE *fp = run_popen("command -v rsync 2>/dev/null");
     if (fp) {
         if (fgets(path, sizeof(path), fp)) {
             path[strcspn(path, "\n")] = '\0';
@@ -118,17 +553,18 @@ static const char *find_rsync_path(void) {
     return "rsync";
 }
 
-static int rsync_version_major(const char *rsync_path) {
+// Local rsync version as major * 100 + minor (3.2.7 -> 302), 0 if unknown
+static int rsync_version(const char *rsync_path) {
     if (!rsync_path) rsync_path = "rsync";
 
     char cmd[PATH_MAX + 64];
     snprintf(cmd, sizeof(cmd), "%s --version 2>/dev/null", rsync_path);
 
-    FILE *fp = popen(cmd, "r");
+    FILE *fp = run_popen(cmd);
     if (!fp) return 0;
 
     char line[256];
-    int major = 0;
+    int major = 0, minor = 0;
 
     if (fgets(line, sizeof(line), fp)) {
         char *p = strstr(line, "version");
@@ -136,10 +572,12 @@ static int rsync_version_major(const char *rsync_path) {
             p += (int)strlen("version");
             while (*p && isspace((unsigned char)*p)) p++;
             major = atoi(p);
+            p = strchr(p, '.');
+            if (p) minor = atoi(p + 1);
         }
     }
     pclose(fp);
-    return major;
+    return major * 100 + minor;
 }
 
 static char *shell_quote(const char *in) {
@@ -222,8 +660,84 @@ static int mkdir_p(const char *path) {
     return 0;
 }
 
+// Create the directory that will hold path. Unlike dirname() this is
+// safe to call from pool workers.
+static int mkdir_parent(const char *path) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash || slash == dir) return 0;
+    *slash = '\0';
+    return mkdir_p(dir);
+}
+
+// Bump allocator: many small allocations freed in one pass (merge line
+// tables, scanned paths).
+typedef union { long long l; long double d; void *p; } ArenaAlign;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, cap;
+    ArenaAlign data[];
+} ArenaBlock;
+
+typedef struct { ArenaBlock *head; } Arena;
+
+#define ARENA_BLOCK_MIN (256 * 1024)
+
+static void *arena_alloc(Arena *a, size_t n) {
+    n = (n + sizeof(ArenaAlign) - 1) & ~(sizeof(ArenaAlign) - 1);
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = n > ARENA_BLOCK_MIN ? n : ARENA_BLOCK_MIN;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) return NULL;
+        b->next = a->head;
+        b->used = 0;
+        b->cap  = cap;
+        a->head = b;
+    }
+    void *p = (char *)b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+static void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+static char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    if (!p) return NULL;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+// Move every block of src into dst; src is left empty.
+static void arena_adopt(Arena *dst, Arena *src) {
+    if (!src->head) return;
+    ArenaBlock *last = src->head;
+    while (last->next) last = last->next;
+    last->next = dst->head;
+    dst->head  = src->head;
+    src->head  = NULL;
+}
+
+static int is_file_spec(const char *spec) {
+    return strncmp(spec, FILE_SCHEME, strlen(FILE_SCHEME)) == 0;
+}
+
 static int validate_remote_spec(const char *spec) {
     if (!spec || !*spec) return 0;
+    if (is_file_spec(spec)) {
+        const char *path = spec + strlen(FILE_SCHEME);
+        return path[0] == '/' && path[1] != '\0';
+    }
     const char *colon = strchr(spec, ':');
     if (!colon || colon == spec) return 0;
     if (!*(colon + 1)) return 0;
@@ -235,6 +749,21 @@ static int validate_remote_spec(const char *spec) {
     return 1;
 }
 
+// Split user@host:/path into its ssh destination and path parts.
+// file:// specs have no host and are rejected.
+static int split_remote_spec(const char *spec, char *host, size_t hlen,
+                             char *path, size_t plen) {
+    if (is_file_spec(spec)) return -1;
+    const char *colon = strchr(spec, ':');
+    if (!colon) return -1;
+    size_t n = (size_t)(colon - spec);
+    if (n >= hlen) return -1;
+    memcpy(host, spec, n);
+    host[n] = '\0';
+    snprintf(path, plen, "%s", colon + 1);
+    return 0;
+}
+
 static void normalize_path(char *path) {
     if (!path) return;
     int len = strlen(path);
@@ -269,742 +798,7652 @@ static const char *get_registry_path(void) {
 }
 
 // ---------------------------------------------------------------------------
-// Base cache helpers
+// Worker pool — bounded set of threads for per-file work (--jobs N)
 // ---------------------------------------------------------------------------
 
-static void base_path_for(const char *local_root, const char *rel,
-                           char *out, size_t out_len)
-{
-    snprintf(out, out_len, "%s/%s/%s", local_root, BASE_DIR_NAME, rel);
-}
-
-static int base_update(const char *local_root, const char *rel,
-                       const char *src_path)
-{
-    char base[MAX_PATH_LEN];
-    base_path_for(local_root, rel, base, sizeof(base));
+static int g_jobs = 0;   // 0 = one per online CPU
 
-    char base_copy[MAX_PATH_LEN];
-    strncpy(base_copy, base, sizeof(base_copy) - 1);
-    if (mkdir_p(dirname(base_copy)) != 0) return -1;
+static int pool_jobs(void) {
+    if (g_jobs > 0) return g_jobs;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
 
-    char tmp[MAX_PATH_LEN];
-    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", base);
-    int fd = mkstemp(tmp);
-    if (fd < 0) { perror("mkstemp"); return -1; }
+typedef int (*PoolFn)(void *arg, int i);
 
-    FILE *in  = fopen(src_path, "rb");
-    FILE *out_f = fdopen(fd, "wb");
-    if (!in || !out_f) {
-        if (in)    fclose(in);
-        if (out_f) fclose(out_f); else close(fd);
-        unlink(tmp);
-        return -1;
+typedef struct {
+    PoolFn fn;
+    void *arg;
+    int count;
+    int next;           // next index to claim
+    int done;           // items finished
+    int stop;           // set once fn returns non-zero
+    int running;        // live workers
+    int metered;        // items count on the progress meter
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} Pool;
+
+static void *pool_worker(void *arg) {
+    Pool *p = arg;
+    while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        int i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (i >= p->count) break;
+        if (p->fn(p->arg, i) != 0) __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&p->done, 1, __ATOMIC_RELAXED);
+        if (p->metered) progress_add(1, 0);
     }
+    pthread_mutex_lock(&p->lock);
+    p->running--;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
 
-    char buf[8192];
-    size_t nr;
-    int rc = 0;
-    while ((nr = fread(buf, 1, sizeof(buf), in)) > 0)
-        if (fwrite(buf, 1, nr, out_f) != nr) { rc = -1; break; }
-
-    fclose(in);
-    fclose(out_f);
+// Run fn(arg, i) for every i in [0, count) on up to --jobs threads under a
+// progress meter (bar_label may be NULL). Items are
+// claimed in index order, so once a call returns non-zero and no new items
+// start, the finished set is still a prefix of the input plus whatever was
+// in flight. Returns 1 if the pool stopped early.
+static int pool_run(PoolFn fn, void *arg, int count, const char *bar_label) {
+    if (count == 0) return 0;
+    Pool p;
+    memset(&p, 0, sizeof(p));
+    p.fn    = fn;
+    p.arg   = arg;
+    p.count = count;
+    p.metered = bar_label != NULL;
+    if (bar_label) progress_begin(bar_label, count, 0);
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    int jobs = pool_jobs();
+    if (jobs > count) jobs = count;
+    pthread_t *tids = malloc(jobs * sizeof(pthread_t));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 1 << 20);   // hashing uses large stack buffers
+
+    int started = 0;
+    for (int t = 0; t < jobs; t++) {
+        pthread_mutex_lock(&p.lock);
+        p.running++;
+        pthread_mutex_unlock(&p.lock);
+        if (pthread_create(&tids[started], &attr, pool_worker, &p) != 0) {
+            pthread_mutex_lock(&p.lock);
+            p.running--;
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) pool_worker(&p);   // no threads available: run inline
+
+    pthread_mutex_lock(&p.lock);
+    while (p.running > 0) pthread_cond_wait(&p.cond, &p.lock);
+    pthread_mutex_unlock(&p.lock);
+
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    if (bar_label) progress_end();
+    return p.stop;
+}
 
-    if (rc == 0 && rename(tmp, base) != 0) { perror("rename"); unlink(tmp); rc = -1; }
-    else if (rc != 0) unlink(tmp);
+// ---------------------------------------------------------------------------
+// SSH connection sharing — one ControlMaster per remote host per run; every
+// ssh and rsync -e invocation goes through its socket, so each remote
+// operation costs one round trip instead of a full TCP + SSH handshake.
+// ---------------------------------------------------------------------------
 
-    return rc;
+#define SSH_KEEP_PERSIST "10m"
+// Without --keep-ssh the master is closed at exit; the bound only matters
+// when rmt dies before it gets there
+#define SSH_RUN_PERSIST  "60s"
+
+static struct {
+    int disabled;       // --no-mux, or the master failed to start
+    int keep;           // --keep-ssh: leave masters running for the next run
+    char **hosts;       // masters started by this process
+    int nhosts;
+} g_mux;
+
+static const char *ssh_control_path(void) {
+    static char path[64];
+    // Short fixed dir: unix socket paths are limited to ~104 bytes
+    snprintf(path, sizeof(path), "/tmp/rmt-ssh-%ld/%%C", (long)getuid());
+    return path;
 }
 
-static void base_delete(const char *local_root, const char *rel)
-{
-    char base[MAX_PATH_LEN];
-    base_path_for(local_root, rel, base, sizeof(base));
-    unlink(base);
+// The ssh command line every remote invocation uses. Without a live master
+// socket ssh simply connects directly, so this is always safe to use.
+static const char *ssh_cmd(void) {
+    static char cmd[128];
+    if (g_mux.disabled) return "ssh";
+    snprintf(cmd, sizeof(cmd), "ssh -o ControlPath=%s", ssh_control_path());
+    return cmd;
 }
 
-static int base_init(const char *local_root)
-{
-    char base_dir[MAX_PATH_LEN];
-    snprintf(base_dir, sizeof(base_dir), "%s/%s", local_root, BASE_DIR_NAME);
-    if (mkdir_p(base_dir) != 0) return -1;
+// "-e '<ssh_cmd>' " for rsync, or "" when multiplexing is off
+static const char *rsync_rsh(void) {
+    static char opt[160];
+    if (g_mux.disabled) return "";
+    snprintf(opt, sizeof(opt), "-e '%s' ", ssh_cmd());
+    return opt;
+}
 
-    char *qlocal = shell_quote(local_root);
-    char *qbase  = shell_quote(base_dir);
-    if (!qlocal || !qbase) { free(qlocal); free(qbase); return -1; }
+static void ssh_mux_begin(const char *remote_spec) {
+    if (g_mux.disabled) return;
+    char host[MAX_PATH_LEN], rpath[MAX_PATH_LEN];
+    if (split_remote_spec(remote_spec, host, sizeof(host), rpath, sizeof(rpath)) != 0) return;
+    for (int i = 0; i < g_mux.nhosts; i++)
+        if (strcmp(g_mux.hosts[i], host) == 0) return;
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/rmt-ssh-%ld", (long)getuid());
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) { g_mux.disabled = 1; return; }
+
+    char *qhost = shell_quote(host);
+    if (!qhost) return;
+    char cmd[MAX_PATH_LEN + 256];
+
+    // A master kept alive by an earlier --keep-ssh run is reused, and is
+    // closed with ours at the end unless this run also passes --keep-ssh
+    snprintf(cmd, sizeof(cmd), "%s -O check %s >/dev/null 2>&1", ssh_cmd(), qhost);
+    if (run_system(cmd) != 0) {
+        snprintf(cmd, sizeof(cmd),
+                 "%s -o ControlMaster=yes -o ControlPersist=%s -fN %s >/dev/null 2>&1",
+                 ssh_cmd(), g_mux.keep ? SSH_KEEP_PERSIST : SSH_RUN_PERSIST, qhost);
+        if (run_system(cmd) != 0) {
+            // Old ssh or unreachable host: fall back to plain per-call connections
+            g_mux.disabled = 1;
+            free(qhost);
+            return;
+        }
+    }
+    free(qhost);
 
-    char cmd[MAX_PATH_LEN * 2 + 256];
-    snprintf(cmd, sizeof(cmd),
-             "rsync -a --exclude=%s/ %s/ %s/ 2>/dev/null",
-             BASE_DIR_NAME, qlocal, qbase);
-    free(qlocal);
-    free(qbase);
+    g_mux.hosts = realloc(g_mux.hosts, (g_mux.nhosts + 1) * sizeof(char *));
+    g_mux.hosts[g_mux.nhosts++] = strdup(host);
+}
 
-    int rc = system_with_spinner(cmd, "Building base cache");
-    return rc == 0 ? 0 : -1;
+static void ssh_mux_end_all(void) {
+    for (int i = 0; i < g_mux.nhosts; i++) {
+        if (!g_mux.keep) {
+            char *qhost = shell_quote(g_mux.hosts[i]);
+            if (qhost) {
+                char cmd[MAX_PATH_LEN + 128];
+                snprintf(cmd, sizeof(cmd), "%s -O exit %s >/dev/null 2>&1", ssh_cmd(), qhost);
+                run_system(cmd);
+                free(qhost);
+            }
+        }
+        free(g_mux.hosts[i]);
+    }
+    free(g_mux.hosts);
+    g_mux.hosts  = NULL;
+    g_mux.nhosts = 0;
 }
 
 // ---------------------------------------------------------------------------
-// Registry operations
+// Content hashing — in-process replacement for forking `comp diff`.
+//   fast:   128-bit stripe hash in the style of XXH3 (8 x 64-bit lanes over
+//           64-byte stripes, SSE2 when available, auto-vectorisable otherwise)
+//   sha256: strong hash for when collisions must be ruled out
 // ---------------------------------------------------------------------------
 
-static int load_registry(MountRegistry *reg) {
-    memset(reg, 0, sizeof(*reg));
-    FILE *f = fopen(get_registry_path(), "r");
-    if (!f) { if (errno == ENOENT) return 0; return -1; }
-    int fd = fileno(f);
-    if (flock(fd, LOCK_SH) != 0) { fclose(f); return -1; }
+typedef enum { HASH_FAST = 0, HASH_SHA256 = 1 } HashAlgo;
 
-    char line[MAX_PATH_LEN * 2 + 64];
-    while (fgets(line, sizeof(line), f) && reg->count < MAX_MOUNTS) {
-        line[strcspn(line, "\n")] = '\0';
-        if (line[0] == '#' || line[0] == '\0') continue;
+typedef struct {
+    HashAlgo algo;
+    int len;
+    unsigned char b[32];
+} Digest;
 
-        Mount *m = &reg->mounts[reg->count];
-        char mounted_at_s[32], last_sync_s[32];
+static HashAlgo g_hash_algo = HASH_FAST;  // --hash=fast|sha256
+static int      g_hash_comp = 0;          // --hash=comp: legacy fork-per-compare
 
-        char *p = line;
-        char *tok;
+// Throughput counters reported at the end of a sync
+static struct {
+    long long files;
+    long long bytes;
+    long long ns;
+    long long comp_forks;
+} g_hash_stats;
 
-        #define NEXT_FIELD(dst, dstsz) \
-            tok = p; \
-            p = strchr(p, '|'); \
-            if (!p) goto bad_line; \
-            *p++ = '\0'; \
-            strncpy(dst, tok, (dstsz) - 1); \
-            dst[(dstsz) - 1] = '\0';
 
-        NEXT_FIELD(m->local_path,  MAX_PATH_LEN)
-        NEXT_FIELD(m->remote_spec, MAX_PATH_LEN)
-        NEXT_FIELD(mounted_at_s,   sizeof(mounted_at_s))
+// --- fast 128-bit stripe hash ---
 
-        strncpy(last_sync_s, p, sizeof(last_sync_s) - 1);
-        last_sync_s[sizeof(last_sync_s) - 1] = '\0';
+#define FH_STRIPE  64
+#define FH_BLOCK   16      // stripes per scramble
+#define FH_PRIME32 0x9E3779B1U
+#define FH_PRIME64 0x9E3779B185EBCA87ULL
 
-        #undef NEXT_FIELD
+static const uint64_t fh_key[16] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+    0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+    0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL,
+};
 
-        m->mounted_at = (time_t)strtoll(mounted_at_s, NULL, 10);
-        m->last_sync  = (time_t)strtoll(last_sync_s,  NULL, 10);
-        reg->count++;
-        continue;
+typedef struct {
+    uint64_t acc[8];
+    unsigned char buf[FH_STRIPE];
+    size_t buflen;
+    uint64_t total;
+    unsigned stripe;       // stripes consumed in the current block
+} FastHash;
+
+#if !defined(__SSE2__)
+static uint64_t rd64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+#endif
+
+static uint64_t fh_mul_fold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t p = (__uint128_t)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static uint64_t fh_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
 
-    bad_line:
-        fprintf(stderr, "Warning: skipping malformed registry line\n");
+static void fh_stripe(uint64_t *acc, const unsigned char *p, unsigned koff) {
+#if defined(__SSE2__)
+    for (int i = 0; i < 8; i += 2) {
+        __m128i d   = _mm_loadu_si128((const __m128i *)(const void *)(p + i * 8));
+        __m128i k   = _mm_set_epi64x((long long)fh_key[(koff + i + 1) & 15],
+                                     (long long)fh_key[(koff + i) & 15]);
+        __m128i dk  = _mm_xor_si128(d, k);
+        __m128i prd = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i sw  = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        __m128i a   = _mm_loadu_si128((const __m128i *)(void *)(acc + i));
+        a = _mm_add_epi64(a, _mm_add_epi64(prd, sw));
+        _mm_storeu_si128((__m128i *)(void *)(acc + i), a);
+    }
+#else
+    uint64_t d[8];
+    for (int i = 0; i < 8; i++) d[i] = rd64(p + i * 8);
+    for (int i = 0; i < 8; i++) {
+        uint64_t dk = d[i] ^ fh_key[(koff + i) & 15];
+        acc[i] += d[i ^ 1] + (dk & 0xFFFFFFFF) * (dk >> 32);
     }
+#endif
+}
 
-    flock(fd, LOCK_UN);
-    fclose(f);
-    return 0;
+static void fh_scramble(uint64_t *acc) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= fh_key[(i + 8) & 15];
+        acc[i] = a * FH_PRIME32;
+    }
 }
 
-static int save_registry(const MountRegistry *reg) {
-    if (mkdir_p(get_rmt_dir()) != 0) return -1;
-    int fd = open(get_registry_path(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0) return -1;
-    if (flock(fd, LOCK_EX) != 0) { close(fd); return -1; }
-    FILE *f = fdopen(fd, "w");
-    if (!f) { flock(fd, LOCK_UN); close(fd); return -1; }
+static void fh_init(FastHash *h) {
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < 8; i++) h->acc[i] = fh_key[i] ^ (FH_PRIME64 * (uint64_t)(i + 1));
+}
 
-    fprintf(f, "# rmt registry v2 do not edit manually\n");
-    for (int i = 0; i < reg->count; i++) {
-        const Mount *m = &reg->mounts[i];
-        fprintf(f, "%s|%s|%lld|%lld\n",
-                m->local_path,
-                m->remote_spec,
-                (long long)m->mounted_at,
-                (long long)m->last_sync);
+static void fh_consume(FastHash *h, const unsigned char *p) {
+    fh_stripe(h->acc, p, h->stripe);
+    if (++h->stripe == FH_BLOCK) { fh_scramble(h->acc); h->stripe = 0; }
+}
+
+static void fh_update(FastHash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    h->total += len;
+    if (h->buflen) {
+        size_t take = FH_STRIPE - h->buflen;
+        if (take > len) take = len;
+        memcpy(h->buf + h->buflen, p, take);
+        h->buflen += take; p += take; len -= take;
+        if (h->buflen < FH_STRIPE) return;
+        fh_consume(h, h->buf);
+        h->buflen = 0;
     }
+    while (len >= FH_STRIPE) { fh_consume(h, p); p += FH_STRIPE; len -= FH_STRIPE; }
+    if (len) { memcpy(h->buf, p, len); h->buflen = len; }
+}
 
-    flock(fd, LOCK_UN);
-    fclose(f);
-    return 0;
+static void fh_final(FastHash *h, unsigned char out[16]) {
+    uint64_t acc[8];
+    memcpy(acc, h->acc, sizeof(acc));
+    if (h->buflen) {
+        unsigned char last[FH_STRIPE];
+        memset(last, 0, sizeof(last));
+        memcpy(last, h->buf, h->buflen);
+        fh_stripe(acc, last, h->stripe + 7);
+    }
+    uint64_t lo = h->total * FH_PRIME64, hi = ~h->total * FH_PRIME32;
+    for (int i = 0; i < 8; i += 2) {
+        lo += fh_mul_fold(acc[i] ^ fh_key[i],     acc[i + 1] ^ fh_key[i + 1]);
+        hi += fh_mul_fold(acc[i] ^ fh_key[i + 8], acc[i + 1] ^ fh_key[i + 9]);
+    }
+    lo = fh_avalanche(lo);
+    hi = fh_avalanche(hi ^ lo);
+    for (int i = 0; i < 8; i++) {
+        out[i]     = (unsigned char)(hi >> (56 - i * 8));
+        out[i + 8] = (unsigned char)(lo >> (56 - i * 8));
+    }
 }
 
-static Mount *find_mount(MountRegistry *reg, const char *local) {
-    char resolved[MAX_PATH_LEN];
-    if (realpath(local, resolved)) {
-        normalize_path(resolved);
-        for (int i = 0; i < reg->count; i++)
-            if (strcmp(reg->mounts[i].local_path, resolved) == 0) return &reg->mounts[i];
-        return NULL;
+// --- SHA-256 (FIPS 180-4) ---
+
+typedef struct {
+    uint32_t s[8];
+    unsigned char buf[64];
+    size_t buflen;
+    uint64_t total;
+} Sha256;
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha_block(Sha256 *c, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19)  ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
     }
-    if (local[0] != '/') {
-        char cwd[MAX_PATH_LEN];
-        if (getcwd(cwd, sizeof(cwd))) {
-            snprintf(resolved, sizeof(resolved), "%s/%s", cwd, local);
-            normalize_path(resolved);
-            for (int i = 0; i < reg->count; i++)
-                if (strcmp(reg->mounts[i].local_path, resolved) == 0) return &reg->mounts[i];
-        }
+    uint32_t a = c->s[0], b = c->s[1], cc = c->s[2], d = c->s[3];
+    uint32_t e = c->s[4], f = c->s[5], g = c->s[6], h = c->s[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
     }
-    return NULL;
+    c->s[0] += a; c->s[1] += b; c->s[2] += cc; c->s[3] += d;
+    c->s[4] += e; c->s[5] += f; c->s[6] += g;  c->s[7] += h;
 }
 
-static int remove_mount_by_resolved(MountRegistry *reg, const char *resolved) {
-    for (int i = 0; i < reg->count; i++) {
-        if (strcmp(reg->mounts[i].local_path, resolved) == 0) {
-            for (int j = i; j < reg->count - 1; j++) reg->mounts[j] = reg->mounts[j+1];
-            reg->count--;
-            return 0;
-        }
+static void sha_init(Sha256 *c) {
+    static const uint32_t iv[8] = {
+        0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19,
+    };
+    memset(c, 0, sizeof(*c));
+    memcpy(c->s, iv, sizeof(iv));
+}
+
+static void sha_update(Sha256 *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->total += len;
+    if (c->buflen) {
+        size_t take = 64 - c->buflen;
+        if (take > len) take = len;
+        memcpy(c->buf + c->buflen, p, take);
+        c->buflen += take; p += take; len -= take;
+        if (c->buflen < 64) return;
+        sha_block(c, c->buf);
+        c->buflen = 0;
     }
-    return -1;
+    while (len >= 64) { sha_block(c, p); p += 64; len -= 64; }
+    if (len) { memcpy(c->buf, p, len); c->buflen = len; }
 }
 
-static int cmd_unmount(const char *local, int keep_local) {
-    MountRegistry reg = {0};
-    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+static void sha_final(Sha256 *c, unsigned char out[32]) {
+    uint64_t bits = c->total * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (c->buflen < 56) ? 56 - c->buflen : 120 - c->buflen;
+    unsigned char lenb[8];
+    for (int i = 0; i < 8; i++) lenb[i] = (unsigned char)(bits >> (56 - i * 8));
+    sha_update(c, pad, padlen);
+    sha_update(c, lenb, 8);
+    for (int i = 0; i < 8; i++) {
+        out[i*4]   = (unsigned char)(c->s[i] >> 24);
+        out[i*4+1] = (unsigned char)(c->s[i] >> 16);
+        out[i*4+2] = (unsigned char)(c->s[i] >> 8);
+        out[i*4+3] = (unsigned char)(c->s[i]);
+    }
+}
 
-    Mount *m = find_mount(&reg, local);
-    if (!m) { fprintf(stderr, "%s is not a mounted path\n", local); return 1; }
+// --- Hasher: algorithm-agnostic streaming interface ---
 
-    char resolved[MAX_PATH_LEN];
-    strncpy(resolved, m->local_path, sizeof(resolved) - 1);
-    resolved[sizeof(resolved) - 1] = '\0';
+typedef struct {
+    HashAlgo algo;
+    union { FastHash f; Sha256 s; } u;
+} Hasher;
+
+static void hasher_init(Hasher *h, HashAlgo algo) {
+    h->algo = algo;
+    if (algo == HASH_SHA256) sha_init(&h->u.s);
+    else                     fh_init(&h->u.f);
+}
 
-    if (!keep_local) {
-        printf("Doing final sync before unmount...\n");
-        int rc = smart_sync(m->local_path, m->remote_spec, 0);
-        if (rc == 1) {
-            fprintf(stderr, "\nCannot unmount: unresolved conflicts.\n");
-            fprintf(stderr, "Resolve conflicts then run: rmt unmount %s\n", local);
-            return 1;
-        } else if (rc != 0) {
-            fprintf(stderr, "\nWarning: final sync failed\n");
-            fprintf(stderr, "Continue with unmount anyway? [y/N] ");
-            char resp[16];
-            if (!fgets(resp, sizeof(resp), stdin) || (resp[0] != 'y' && resp[0] != 'Y')) {
-                printf("Unmount cancelled\n");
-                return 1;
-            }
-        }
-    }
+static void hasher_update(Hasher *h, const void *data, size_t len) {
+    if (h->algo == HASH_SHA256) sha_update(&h->u.s, data, len);
+    else                        fh_update(&h->u.f, data, len);
+}
 
-    if (remove_mount_by_resolved(&reg, resolved) != 0) {
-        fprintf(stderr, "Failed to remove from registry\n");
-        return 1;
-    }
-    if (save_registry(&reg) != 0) fprintf(stderr, "Warning: Failed to save registry\n");
+static void hasher_final(Hasher *h, Digest *d) {
+    memset(d, 0, sizeof(*d));
+    d->algo = h->algo;
+    if (h->algo == HASH_SHA256) { sha_final(&h->u.s, d->b); d->len = 32; }
+    else                        { fh_final(&h->u.f, d->b);  d->len = 16; }
+}
 
-    printf("✓ Unmounted %s\n", resolved);
+static const char *hash_algo_name(HashAlgo algo) {
+    return algo == HASH_SHA256 ? "sha256" : "fast";
+}
 
-    if (keep_local) {
-        printf("  Local files kept at: %s\n", resolved);
-        printf("  Note: .rmt-base cache kept alongside local files\n");
-    } else {
-        printf("  Deleting local copy...\n");
-        char *quoted = shell_quote(resolved);
-        if (!quoted) { fprintf(stderr, "  Warning: OOM quoting path\n"); return 1; }
-        char cmd[MAX_PATH_LEN * 2 + 16];
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", quoted);
-        free(quoted);
-        if (system(cmd) == 0) printf("  ✓ Deleted %s\n", resolved);
-        else fprintf(stderr, "  Warning: Failed to delete local files\n");
+static int digest_eq(const Digest *a, const Digest *b) {
+    return a->algo == b->algo && a->len == b->len && memcmp(a->b, b->b, a->len) == 0;
+}
+
+// "fast:<hex>" / "sha256:<hex>"; out must hold at least 72 bytes
+static void digest_format(const Digest *d, char *out, size_t out_len) {
+    size_t j = (size_t)snprintf(out, out_len, "%s:", hash_algo_name(d->algo));
+    for (int i = 0; i < d->len && j + 2 < out_len; i++, j += 2)
+        snprintf(out + j, out_len - j, "%02x", d->b[i]);
+}
+
+static int digest_parse(const char *s, Digest *d) {
+    memset(d, 0, sizeof(*d));
+    const char *hex;
+    if      (strncmp(s, "fast:", 5) == 0)   { d->algo = HASH_FAST;   d->len = 16; hex = s + 5; }
+    else if (strncmp(s, "sha256:", 7) == 0) { d->algo = HASH_SHA256; d->len = 32; hex = s + 7; }
+    else return -1;
+    if (strlen(hex) != (size_t)d->len * 2) return -1;
+    for (int i = 0; i < d->len; i++) {
+        unsigned v;
+        if (sscanf(hex + i * 2, "%2x", &v) != 1) return -1;
+        d->b[i] = (unsigned char)v;
     }
+    return 0;
+}
 
+static int parse_hash_option(const char *val) {
+    if      (strcmp(val, "fast")   == 0) { g_hash_algo = HASH_FAST;   g_hash_comp = 0; }
+    else if (strcmp(val, "sha256") == 0) { g_hash_algo = HASH_SHA256; g_hash_comp = 0; }
+    else if (strcmp(val, "comp")   == 0) { g_hash_comp = 1; }
+    else return -1;
     return 0;
 }
 
-// ---------------------------------------------------------------------------
-// rsync wrappers — spinner for all blocking rsync calls
-// ---------------------------------------------------------------------------
+#define HASH_MMAP_MIN (256 * 1024)
 
-static int rsync_pull(const char *remote, const char *local, int dry_run) {
-    char *remote_arg = rsync_escape_remote_spec_legacy(remote);
-    if (!remote_arg) return -1;
+// Hash a file's contents: mmap for large files, a stack buffer otherwise.
+static int hash_file(const char *path, HashAlgo algo, Digest *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
 
-    char *qremote = shell_quote(remote_arg);
-    char *qlocal  = shell_quote(local);
-    free(remote_arg);
+    long long t0 = now_ns();
+    Hasher h;
+    hasher_init(&h, algo);
+    int rc = 0;
 
-    if (!qremote || !qlocal) { free(qremote); free(qlocal); return -1; }
+    void *map = MAP_FAILED;
+    if (st.st_size >= HASH_MMAP_MIN)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+        posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+        hasher_update(&h, map, (size_t)st.st_size);
+        munmap(map, (size_t)st.st_size);
+    } else {
+        unsigned char buf[65536];
+        ssize_t nr;
+        while ((nr = read(fd, buf, sizeof(buf))) > 0) hasher_update(&h, buf, (size_t)nr);
+        if (nr < 0) rc = -1;
+    }
+    close(fd);
+    if (rc != 0) return -1;
+    hasher_final(&h, out);
+
+    STAT_ADD(g_hash_stats.files, 1);
+    STAT_ADD(g_hash_stats.bytes, (long long)st.st_size);
+    STAT_ADD(g_hash_stats.ns,    now_ns() - t0);
+    progress_add(0, (long long)st.st_size);
+    return 0;
+}
 
-    char cmd[8192];
-    snprintf(cmd, sizeof(cmd),
-        "rsync -az%s --exclude=%s/ %s/ %s/ 2>/dev/null",
-        dry_run ? "n" : "", BASE_DIR_NAME, qremote, qlocal);
+// Byte-for-byte comparison. Returns 0 if equal, 1 if different, -1 on error.
+static int files_differ(const char *a, const char *b) {
+    struct stat sa, sb;
+    if (stat(a, &sa) != 0 || stat(b, &sb) != 0) return -1;
+    if (sa.st_size != sb.st_size) return 1;
 
-    free(qremote);
-    free(qlocal);
+    int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+    if (fa < 0 || fb < 0) { if (fa >= 0) close(fa); if (fb >= 0) close(fb); return -1; }
 
-    if (dry_run) {
-        printf("Dry run (pull): %s -> %s\n", remote, local);
-        int rc = system(cmd);
-        return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    long long t0 = now_ns();
+    int rc = 0;
+    unsigned char ba[65536], bb[65536];
+    for (;;) {
+        ssize_t na = read(fa, ba, sizeof(ba));
+        if (na <= 0) { if (na < 0) rc = -1; break; }
+        ssize_t got = 0;
+        while (got < na) {
+            ssize_t nb = read(fb, bb + got, (size_t)(na - got));
+            if (nb <= 0) { rc = nb < 0 ? -1 : 1; break; }
+            got += nb;
+        }
+        if (rc != 0) break;
+        if (memcmp(ba, bb, (size_t)na) != 0) { rc = 1; break; }
     }
+    close(fa);
+    close(fb);
 
-    int rc = system_with_spinner(cmd, "Pulling from remote");
-    return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    STAT_ADD(g_hash_stats.files, 2);
+    STAT_ADD(g_hash_stats.bytes, 2 * (long long)sa.st_size);
+    STAT_ADD(g_hash_stats.ns,    now_ns() - t0);
+    return rc;
 }
 
-static int rsync_push(const char *local, const char *remote, int dry_run) {
-    char *remote_arg = rsync_escape_remote_spec_legacy(remote);
-    if (!remote_arg) return -1;
+// atexit handler; multi-mount children _exit, so only this process counts.
+static void write_run_stats(void) {
+    const char *path = getenv("RMT_STATS_JSON");
+    if (!path || !*path) return;
+    FILE *f = fopen(path, "w");
+    if (!f) return;
+    fprintf(f, "{\"forks\": %lld, \"ssh_sessions\": %lld, \"files_down\": %lld, "
+               "\"bytes_down\": %lld, \"files_up\": %lld, \"bytes_up\": %lld, "
+               "\"bytes_copied\": %lld, \"delta_files\": %lld, \"delta_saved\": %lld, "
+               "\"chunk_files\": %lld, \"chunk_saved\": %lld, "
+               "\"rsync_data\": %lld, \"rsync_wire\": %lld, \"rsync_cpu_ms\": %lld, "
+               "\"hash_files\": %lld, \"hash_bytes\": %lld, \"comp_forks\": %lld}\n",
+            g_run_stats.forks, g_run_stats.ssh_sessions, g_run_stats.files_down,
+            g_run_stats.bytes_down, g_run_stats.files_up, g_run_stats.bytes_up,
+            g_run_stats.bytes_copied, g_run_stats.delta_files, g_run_stats.delta_saved,
+            g_run_stats.chunk_files, g_run_stats.chunk_saved,
+            g_run_stats.comp_in, g_run_stats.comp_out, g_run_stats.comp_cpu_ns / 1000000,
+            g_hash_stats.files, g_hash_stats.bytes, g_hash_stats.comp_forks);
+    fclose(f);
+}
 
-    char *qlocal  = shell_quote(local);
-    char *qremote = shell_quote(remote_arg);
-    free(remote_arg);
+static int timer_cmp(const void *a, const void *b) {
+    long long x = ((const TimerStat *)a)->total_ns, y = ((const TimerStat *)b)->total_ns;
+    return (x < y) - (x > y);
+}
 
-    if (!qlocal || !qremote) { free(qlocal); free(qremote); return -1; }
+// --stats: where the time went, slowest first, then the counters
+static void print_stats_table(void) {
+    if (!g_stats_table) return;
+    pthread_mutex_lock(&g_instr.lock);
+    TimerStat *t = malloc((g_instr.ntimers ? g_instr.ntimers : 1) * sizeof(TimerStat));
+    memcpy(t, g_instr.timers, g_instr.ntimers * sizeof(TimerStat));
+    int n = g_instr.ntimers;
+    pthread_mutex_unlock(&g_instr.lock);
+    qsort(t, n, sizeof(TimerStat), timer_cmp);
+
+    printf("\n  %-6s %-18s %8s %11s %10s %10s\n", "", "timer", "calls", "total ms", "mean ms", "max ms");
+    for (int i = 0; i < n; i++)
+        printf("  %-6s %-18.18s %8lld %11.1f %10.2f %10.2f\n", t[i].cat, t[i].name, t[i].calls,
+               t[i].total_ns / 1e6, t[i].total_ns / 1e6 / t[i].calls, t[i].max_ns / 1e6);
+    free(t);
+
+    double mib = 1024.0 * 1024.0;
+    printf("\n  forks %lld (%lld ssh/rsync), fetched %lld file%s / %.1f MiB, "
+           "pushed %lld file%s / %.1f MiB\n",
+           g_run_stats.forks, g_run_stats.ssh_sessions,
+           g_run_stats.files_down, g_run_stats.files_down == 1 ? "" : "s", g_run_stats.bytes_down / mib,
+           g_run_stats.files_up, g_run_stats.files_up == 1 ? "" : "s", g_run_stats.bytes_up / mib);
+    printf("  read %.1f MiB hashing %lld file%s, wrote %.1f MiB copying\n",
+           g_hash_stats.bytes / mib, g_hash_stats.files, g_hash_stats.files == 1 ? "" : "s",
+           g_run_stats.bytes_copied / mib);
+    if (g_run_stats.delta_files > 0)
+        printf("  %lld file%s sent as deltas, %.1f MiB not transferred\n",
+               g_run_stats.delta_files, g_run_stats.delta_files == 1 ? "" : "s",
+               g_run_stats.delta_saved / mib);
+    if (g_run_stats.chunk_files > 0)
+        printf("  %lld large file%s sent in pieces, %.1f MiB of unchanged pieces not transferred\n",
+               g_run_stats.chunk_files, g_run_stats.chunk_files == 1 ? "" : "s",
+               g_run_stats.chunk_saved / mib);
+    if (g_run_stats.comp_in > 0) {
+        printf("  rsync moved %.1f MiB as %.1f MiB on the wire (%.2fx,",
+               g_run_stats.comp_in / mib, g_run_stats.comp_out / mib,
+               g_run_stats.comp_out ? (double)g_run_stats.comp_in / g_run_stats.comp_out : 0.0);
+        static const char *const levels[] = { "none", "fast", "high" };
+        for (int i = 0; i < 3; i++)
+            if (g_run_stats.comp_levels & (1 << i)) printf(" %s", levels[i]);
+        printf(") in %.0f ms CPU\n", g_run_stats.comp_cpu_ns / 1e6);
+    }
+}
 
-    char cmd[8192];
-    snprintf(cmd, sizeof(cmd),
-        "rsync -az%s --exclude=%s/ %s/ %s/ 2>/dev/null",
-        dry_run ? "n" : "", BASE_DIR_NAME, qlocal, qremote);
+static void print_hash_stats(void) {
+    if (g_hash_stats.files == 0 && g_hash_stats.comp_forks == 0) return;
+    double secs = g_hash_stats.ns / 1e9;
+    double mib  = g_hash_stats.bytes / (1024.0 * 1024.0);
+    printf("  hashed:  %lld file%s, %.1f MiB", g_hash_stats.files,
+           g_hash_stats.files == 1 ? "" : "s", mib);
+    if (g_hash_stats.files > 0 && secs > 0)
+        printf(" at %.0f MiB/s (%.1f us/file)", mib / secs,
+               g_hash_stats.ns / 1e3 / g_hash_stats.files);
+    printf(" [%s]\n", g_hash_comp ? "comp" : hash_algo_name(g_hash_algo));
+    if (g_hash_stats.comp_forks > 0)
+        printf("  comp:    %lld fork%s\n", g_hash_stats.comp_forks,
+               g_hash_stats.comp_forks == 1 ? "" : "s");
+}
 
-    free(qlocal);
-    free(qremote);
+// ---------------------------------------------------------------------------
+// Sync manifest — per-path stat tuple + content hash as of the last sync.
+// Stored as <mount>/.rmt-manifest; the hashes name base objects in the store.
+// ---------------------------------------------------------------------------
 
-    if (dry_run) {
-        printf("Dry run (push): %s -> %s\n", local, remote);
-        int rc = system(cmd);
-        return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+// The stat fields the manifest compares, as kept per scanned file.
+typedef struct {
+    long long size;
+    long long mtime_s;
+    long      mtime_ns;
+    long long ino;
+    long long ctime_s;
+    long      ctime_ns;
+} FileStat;
+
+static void filestat_from(FileStat *fs, const struct stat *st) {
+    fs->size     = (long long)st->st_size;
+    fs->mtime_s  = (long long)st->st_mtime;
+    fs->mtime_ns = ST_MTIME_NSEC(*st);
+    fs->ino      = (long long)st->st_ino;
+    fs->ctime_s  = (long long)st->st_ctime;
+    fs->ctime_ns = ST_CTIME_NSEC(*st);
+}
+
+typedef struct {
+    char *rel;
+    long long size;
+    long long mtime_s;
+    long      mtime_ns;
+    long long ino;
+    long long ctime_s;
+    long      ctime_ns;
+    Digest hash;                // content hash of the base (last synced) version
+    int has_hash;
+    long long rsize;            // remote size/mtime as of last sync
+    long long rmtime;
+    int lazy;                   // placeholder: on the remote, not fetched yet
+    int live;                   // 0 = tombstone left by manifest_remove
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry *entries;
+    int count, cap;
+    int *index;                 // open addressing into entries, -1 = empty
+    int index_cap;
+    int dirty;
+    long long saved_at;         // mtime of the manifest file when loaded
+    pthread_mutex_t lock;       // held by pool workers around updates
+} Manifest;
+
+static unsigned long long fnv1a(const void *data, size_t len, unsigned long long h) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 0x100000001b3ULL; }
+    return h;
+}
+#define FNV_SEED 0xcbf29ce484222325ULL
+
+static void manifest_init(Manifest *mf) {
+    memset(mf, 0, sizeof(*mf));
+    pthread_mutex_init(&mf->lock, NULL);
+}
+
+static void manifest_free(Manifest *mf) {
+    for (int i = 0; i < mf->count; i++) free(mf->entries[i].rel);
+    free(mf->entries);
+    free(mf->index);
+    pthread_mutex_destroy(&mf->lock);
+    memset(mf, 0, sizeof(*mf));
+}
+
+static void manifest_reindex(Manifest *mf) {
+    int cap = mf->index_cap ? mf->index_cap * 2 : 1024;
+    while (cap < mf->cap * 2) cap *= 2;
+    free(mf->index);
+    mf->index = malloc(cap * sizeof(int));
+    mf->index_cap = cap;
+    for (int i = 0; i < cap; i++) mf->index[i] = -1;
+    for (int i = 0; i < mf->count; i++) {
+        const char *rel = mf->entries[i].rel;
+        size_t slot = fnv1a(rel, strlen(rel), FNV_SEED) & (size_t)(cap - 1);
+        while (mf->index[slot] >= 0) slot = (slot + 1) & (size_t)(cap - 1);
+        mf->index[slot] = i;
     }
+}
 
-    int rc = system_with_spinner(cmd, "Pushing to remote");
-    return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+// Returns the slot holding rel, or the empty slot where it would go.
+static size_t manifest_slot(const Manifest *mf, const char *rel) {
+    size_t mask = (size_t)(mf->index_cap - 1);
+    size_t slot = fnv1a(rel, strlen(rel), FNV_SEED) & mask;
+    while (mf->index[slot] >= 0 && strcmp(mf->entries[mf->index[slot]].rel, rel) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
 }
 
-static int rsync_push_file(const char *src_path, const char *remote_spec,
-                           const char *rel) {
-    char remote_file[MAX_PATH_LEN * 2];
-    snprintf(remote_file, sizeof(remote_file), "%s/%s", remote_spec, rel);
+static ManifestEntry *manifest_find(Manifest *mf, const char *rel) {
+    if (!mf || mf->index_cap == 0) return NULL;
+    int i = mf->index[manifest_slot(mf, rel)];
+    if (i < 0 || !mf->entries[i].live) return NULL;
+    return &mf->entries[i];
+}
 
-    char *remote_arg = rsync_escape_remote_spec_legacy(remote_file);
-    if (!remote_arg) return -1;
+// Find or create the entry for rel.
+static ManifestEntry *manifest_get(Manifest *mf, const char *rel) {
+    if (mf->index_cap == 0) manifest_reindex(mf);
+    int i = mf->index[manifest_slot(mf, rel)];
+    if (i >= 0) {
+        ManifestEntry *e = &mf->entries[i];
+        if (!e->live) {
+            char *keep = e->rel;
+            memset(e, 0, sizeof(*e));
+            e->rel  = keep;
+            e->live = 1;
+        }
+        return e;
+    }
+    if (mf->count == mf->cap) {
+        mf->cap = mf->cap ? mf->cap * 2 : 256;
+        mf->entries = realloc(mf->entries, mf->cap * sizeof(ManifestEntry));
+    }
+    ManifestEntry *e = &mf->entries[mf->count];
+    memset(e, 0, sizeof(*e));
+    e->rel  = strdup(rel);
+    e->live = 1;
+    mf->count++;
+    if (mf->count * 2 > mf->index_cap) manifest_reindex(mf);
+    else mf->index[manifest_slot(mf, rel)] = mf->count - 1;
+    return e;
+}
 
-    char *qsrc = shell_quote(src_path);
-    char *qdst = shell_quote(remote_arg);
-    free(remote_arg);
+static void manifest_remove(Manifest *mf, const char *rel) {
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (!e) return;
+    e->live = 0;
+    mf->dirty = 1;
+}
+
+static void manifest_set_local(ManifestEntry *e, const FileStat *fs) {
+    e->size     = fs->size;
+    e->mtime_s  = fs->mtime_s;
+    e->mtime_ns = fs->mtime_ns;
+    e->ino      = fs->ino;
+    e->ctime_s  = fs->ctime_s;
+    e->ctime_ns = fs->ctime_ns;
+}
+
+// A file modified in the same second the manifest was written may have
+// changed again after it was recorded without its timestamp moving, so
+// its stat tuple cannot be trusted (git's "racily clean" problem).
+static int manifest_racy(const Manifest *mf, long long mtime_s) {
+    return mtime_s >= mf->saved_at - 1;
+}
+
+// True when the local file is exactly as it was when the manifest was written.
+static int manifest_stat_matches(const Manifest *mf, const ManifestEntry *e,
+                                 const FileStat *fs) {
+    return !manifest_racy(mf, e->mtime_s)
+        && e->size     == fs->size
+        && e->mtime_s  == fs->mtime_s
+        && e->mtime_ns == fs->mtime_ns
+        && e->ino      == fs->ino
+        && e->ctime_s  == fs->ctime_s
+        && e->ctime_ns == fs->ctime_ns;
+}
 
-    if (!qsrc || !qdst) { free(qsrc); free(qdst); return -1; }
-
-    char rel_dir[MAX_PATH_LEN];
-    strncpy(rel_dir, rel, sizeof(rel_dir) - 1);
-    rel_dir[sizeof(rel_dir) - 1] = '\0';
-
-    char *rd = dirname(rel_dir);
-    if (strcmp(rd, ".") != 0) {
-        char ssh_host[MAX_PATH_LEN], remote_path[MAX_PATH_LEN];
-        const char *colon = strchr(remote_spec, ':');
-        if (colon) {
-            size_t hlen = (size_t)(colon - remote_spec);
-            if (hlen >= sizeof(ssh_host)) hlen = sizeof(ssh_host) - 1;
-            strncpy(ssh_host, remote_spec, hlen);
-            ssh_host[hlen] = '\0';
-
-            snprintf(remote_path, sizeof(remote_path), "%s/%s", colon + 1, rd);
-
-            char *qhost  = shell_quote(ssh_host);
-            char *qrpath = shell_quote(remote_path);
-            if (qhost && qrpath) {
-                char mkdir_cmd[8192];
-                snprintf(mkdir_cmd, sizeof(mkdir_cmd),
-                         "ssh %s mkdir -p %s 2>/dev/null", qhost, qrpath);
-                system(mkdir_cmd);
+// Hash column of a placeholder entry, which has no base yet
+#define MANIFEST_LAZY "lazy"
+
+static void manifest_path_for(const char *local_root, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/%s", local_root, MANIFEST_NAME);
+}
+
+static int manifest_load(const char *local_root, Manifest *mf) {
+    manifest_init(mf);
+    char path[MAX_PATH_LEN];
+    manifest_path_for(local_root, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (!f) return errno == ENOENT ? 0 : -1;
+    struct stat mst;
+    if (fstat(fileno(f), &mst) == 0) mf->saved_at = (long long)mst.st_mtime;
+
+    char line[MAX_PATH_LEN + 256];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue;
+
+        // size|mtime_s|mtime_ns|ino|ctime_s|ctime_ns|hash|rsize|rmtime|path
+        long long v[9];
+        char hash_s[80] = "";
+        char *p = line;
+        int ok = 1;
+        for (int k = 0; k < 9 && ok; k++) {
+            char *bar = strchr(p, '|');
+            if (!bar) { ok = 0; break; }
+            *bar = '\0';
+            if (k == 6) {
+                // No hash is this long: treat the line as malformed
+                if (snprintf(hash_s, sizeof(hash_s), "%s", p) >= (int)sizeof(hash_s)) ok = 0;
+                v[k] = 0;
+            } else {
+                v[k] = strtoll(p, NULL, 10);
             }
-            free(qhost);
-            free(qrpath);
+            p = bar + 1;
         }
+        if (!ok || !*p) { fprintf(stderr, "Warning: skipping malformed manifest line\n"); continue; }
+
+        ManifestEntry *e = manifest_get(mf, p);
+        e->size     = v[0];
+        e->mtime_s  = v[1];
+        e->mtime_ns = (long)v[2];
+        e->ino      = v[3];
+        e->ctime_s  = v[4];
+        e->ctime_ns = (long)v[5];
+        e->has_hash = (digest_parse(hash_s, &e->hash) == 0);
+        e->lazy     = (strcmp(hash_s, MANIFEST_LAZY) == 0);
+        e->rsize    = v[7];
+        e->rmtime   = v[8];
     }
+    fclose(f);
+    mf->dirty = 0;
+    return 0;
+}
 
-    char cmd[8192];
-    snprintf(cmd, sizeof(cmd), "rsync -az %s %s 2>/dev/null", qsrc, qdst);
+static int me_cmp(const void *a, const void *b) {
+    return strcmp((*(const ManifestEntry **)a)->rel, (*(const ManifestEntry **)b)->rel);
+}
 
-    free(qsrc);
-    free(qdst);
+// Live entries in path order — of only[0..nonly) when only is non-NULL.
+// The manifest is saved sorted, so this is usually one linear check and no
+// sort. Pointers are valid until the next manifest_get.
+static ManifestEntry **manifest_sorted(Manifest *mf, char **only, int nonly, int *out_n) {
+    int cap = only ? nonly : mf->count;
+    ManifestEntry **live = malloc((cap ? cap : 1) * sizeof(ManifestEntry *));
+    int n = 0;
+    if (only) {
+        for (int i = 0; i < nonly; i++) {
+            ManifestEntry *e = manifest_find(mf, only[i]);
+            if (e) live[n++] = e;
+        }
+    } else {
+        for (int i = 0; i < mf->count; i++) if (mf->entries[i].live) live[n++] = &mf->entries[i];
+    }
+    for (int i = 1; i < n; i++) {
+        if (strcmp(live[i - 1]->rel, live[i]->rel) >= 0) {
+            qsort(live, n, sizeof(ManifestEntry *), me_cmp);
+            break;
+        }
+    }
+    *out_n = n;
+    return live;
+}
 
-    // per-file push: no spinner (called inside the file loop which has its own bar)
-    int rc = system(cmd);
-    return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+// Written to a temp file and renamed into place so a crash never leaves a torn manifest.
+static int manifest_save(const char *local_root, Manifest *mf) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN + 16];
+    manifest_path_for(local_root, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return -1;
+    FILE *f = fdopen(fd, "w");
+    if (!f) { close(fd); unlink(tmp); return -1; }
+
+    int n;
+    ManifestEntry **live = manifest_sorted(mf, NULL, 0, &n);
+
+    fprintf(f, "# rmt manifest v2 do not edit manually\n");
+    for (int i = 0; i < n; i++) {
+        const ManifestEntry *e = live[i];
+        char hash_s[80];
+        if (e->has_hash)  digest_format(&e->hash, hash_s, sizeof(hash_s));
+        else if (e->lazy) snprintf(hash_s, sizeof(hash_s), MANIFEST_LAZY);
+        else              snprintf(hash_s, sizeof(hash_s), "-");
+        fprintf(f, "%lld|%lld|%ld|%lld|%lld|%ld|%s|%lld|%lld|%s\n",
+                e->size, e->mtime_s, e->mtime_ns, e->ino, e->ctime_s, e->ctime_ns,
+                hash_s, e->rsize, e->rmtime, e->rel);
+    }
+    free(live);
+
+    int rc = (fflush(f) == 0 && fsync(fd) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmp);
+    else mf->dirty = 0;
+    return rc;
 }
 
-typedef struct { char **paths; int count; int cap; } PathList;
+// Serializes manifest updates between rmt processes working on one mount
+// (a sync and the background hydrator, say). Returns the fd to unlock.
+static int mount_lock(const char *local_root) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.lock", local_root, MANIFEST_NAME);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) { close(fd); return -1; }
+    }
+    return fd;
+}
 
-static void pl_push(PathList *pl, const char *rel) {
-    if (pl->count == pl->cap) {
-        pl->cap *= 2;
-        pl->paths = realloc(pl->paths, pl->cap * sizeof(char *));
+static void mount_unlock(int fd) {
+    if (fd < 0) return;
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Copy engine — cheapest way the kernel offers to duplicate a file: reflink,
+// then in-kernel copy, then a large userspace buffer.
+// ---------------------------------------------------------------------------
+
+#define COPY_BUF_SIZE (1 << 20)
+
+// Copy size bytes from in to out (both at offset 0). Each step falls through
+// to the next when the filesystem or kernel does not support it.
+static int copy_fd(int in, int out, off_t size) {
+#if defined(__linux__) && defined(FICLONE)
+    // Shares extents on btrfs/XFS: no data is read or written
+    if (ioctl(out, FICLONE, in) == 0) return 0;
+#endif
+
+    off_t done = 0;
+    (void)size;         // only the in-kernel paths need it
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    // In-kernel copy; server-side on NFS 4.2, reflinks where it can
+    while (done < size) {
+        loff_t ioff = done, ooff = done;
+        ssize_t n = syscall(SYS_copy_file_range, in, &ioff, out, &ooff,
+                            (size_t)(size - done), 0u);
+        if (n <= 0) break;
+        done += n;
     }
-    pl->paths[pl->count++] = strdup(rel);
+    if (done >= size) return 0;
+#endif
+#if defined(__linux__)
+    // Cross-filesystem copies on older kernels still avoid the user copy
+    while (done < size) {
+        off_t off = done;
+        ssize_t n = sendfile(out, in, &off, (size_t)(size - done));
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done >= size) return 0;
+#endif
+
+    if (lseek(in, done, SEEK_SET) < 0 || lseek(out, done, SEEK_SET) < 0) return -1;
+    char *buf = malloc(COPY_BUF_SIZE);
+    if (!buf) return -1;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = read(in, buf, COPY_BUF_SIZE);
+        if (n == 0) break;
+        if (n < 0) { if (errno == EINTR) continue; rc = -1; break; }
+        for (ssize_t w = 0; w < n; ) {
+            ssize_t m = write(out, buf + w, (size_t)(n - w));
+            if (m < 0) { if (errno == EINTR) continue; rc = -1; break; }
+            w += m;
+        }
+        if (rc != 0) break;
+    }
+    free(buf);
+    return rc;
 }
 
-static int pl_cmp(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+// Copy src_path's contents and permission bits into the open file out.
+// st, if not NULL, receives src's stat taken before the copy started.
+static int copy_into(const char *src_path, int out, struct stat *st) {
+    struct stat sst;
+    int in = open(src_path, O_RDONLY);
+    if (in < 0) return -1;
+    int rc = (fstat(in, &sst) == 0 && S_ISREG(sst.st_mode)) ? 0 : -1;
+    if (rc == 0) rc = copy_fd(in, out, sst.st_size);
+    if (rc == 0) {
+        STAT_ADD(g_run_stats.bytes_copied, (long long)sst.st_size);
+        progress_add(0, (long long)sst.st_size);
+    }
+    if (rc == 0 && fchmod(out, sst.st_mode & 07777) != 0) rc = -1;
+    close(in);
+    if (rc == 0 && st) *st = sst;
+    return rc;
 }
 
-static void walk_dir(const char *root, const char *rel, PathList *pl) {
-    char full[MAX_PATH_LEN];
-    if (rel[0] == '\0') snprintf(full, sizeof(full), "%s", root);
-    else                snprintf(full, sizeof(full), "%s/%s", root, rel);
+// Copy src_path to dst_path atomically: the data goes to a temp file next to
+// dst, which is then renamed over it.
+static int copy_file(const char *src_path, const char *dst_path, struct stat *st) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", dst_path);
+    int out = mkstemp(tmp);
+    if (out < 0) { perror("mkstemp"); return -1; }
+
+    int rc = copy_into(src_path, out, st);
+    if (close(out) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, dst_path) != 0) { perror("rename"); rc = -1; }
+    if (rc != 0) unlink(tmp);
+    return rc;
+}
 
-    DIR *d = opendir(full);
-    if (!d) return;
+typedef struct {
+    const char *data;
+    size_t len;
+    int mapped;
+} MappedFile;
+
+// Empty for anything that is not a regular file with content (e.g. /dev/null).
+static int map_file(const char *path, MappedFile *mf) {
+    memset(mf, 0, sizeof(*mf));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) { close(fd); return -1; }
+        mf->data   = p;
+        mf->len    = (size_t)st.st_size;
+        mf->mapped = 1;
+    }
+    close(fd);
+    return 0;
+}
 
-    struct dirent *ent;
-    while ((ent = readdir(d)) != NULL) {
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
-        if (strcmp(ent->d_name, BASE_DIR_NAME) == 0) continue;
+static void unmap_file(MappedFile *mf) {
+    if (mf->mapped) munmap((void *)mf->data, mf->len);
+    memset(mf, 0, sizeof(*mf));
+}
 
-        char entry_rel[MAX_PATH_LEN];
-        if (rel[0] == '\0') snprintf(entry_rel, sizeof(entry_rel), "%s", ent->d_name);
-        else                snprintf(entry_rel, sizeof(entry_rel), "%s/%s", rel, ent->d_name);
+// ---------------------------------------------------------------------------
+// Object store — base versions are kept once per content hash under
+// ~/.rmt/objects/<2 hex>/<rest>, shared by every mount. A mount's manifest
+// is its path -> hash index; objects nobody references go away in rmt gc.
+// ---------------------------------------------------------------------------
 
-        char entry_full[MAX_PATH_LEN];
-        snprintf(entry_full, sizeof(entry_full), "%s/%s", root, entry_rel);
+#define OBJECT_GC_GRACE (60 * 60)   // never prune objects touched within the hour
 
-        struct stat st;
-        if (lstat(entry_full, &st) != 0) continue;
+static const char *get_objects_dir(void) {
+    static char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/objects", get_rmt_dir());
+    return path;
+}
+
+static void object_path(const Digest *d, char *out, size_t out_len) {
+    char hex[72];
+    digest_format(d, hex, sizeof(hex));
+    const char *h = strchr(hex, ':') + 1;
+    snprintf(out, out_len, "%s/%.2s/%s", get_objects_dir(), h, h + 2);
+}
+
+// An object that is being (re)referenced gets a fresh mtime so a concurrent
+// rmt gc, which only prunes past the grace period, leaves it alone.
+static int object_touch(const Digest *d) {
+    char path[MAX_PATH_LEN];
+    object_path(d, path, sizeof(path));
+    return utimes(path, NULL);
+}
+
+// Copy src_path into the store. The object id is the hash of the copy, so it
+// always matches the stored bytes even if the source changes meanwhile; st
+// receives the source's stat from before the copy.
+static int object_store(const char *src_path, Digest *out, struct stat *st) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp_XXXXXX", get_objects_dir());
+    if (mkdir_p(get_objects_dir()) != 0) return -1;
+    int fd = mkstemp(tmp);
+    if (fd < 0) { perror("mkstemp"); return -1; }
+
+    int rc = copy_into(src_path, fd, st);
+    if (close(fd) != 0) rc = -1;
+    if (rc == 0) rc = hash_file(tmp, g_hash_algo, out);
+    if (rc != 0) { unlink(tmp); return -1; }
 
-        if (S_ISDIR(st.st_mode)) walk_dir(root, entry_rel, pl);
-        else if (S_ISREG(st.st_mode)) pl_push(pl, entry_rel);
+    char obj[MAX_PATH_LEN];
+    object_path(out, obj, sizeof(obj));
+    if (access(obj, F_OK) == 0) {       // already stored: keep the old copy
+        unlink(tmp);
+        object_touch(out);
+        return 0;
     }
-    closedir(d);
+    chmod(tmp, 0444);                   // objects are immutable
+    if (mkdir_parent(obj) != 0 || rename(tmp, obj) != 0) {
+        perror("rename");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
 }
 
-static PathList *local_files(const char *local_root) {
-    PathList *pl = malloc(sizeof(PathList));
-    pl->cap   = 64;
-    pl->count = 0;
-    pl->paths = malloc(pl->cap * sizeof(char *));
-    walk_dir(local_root, "", pl);
-    qsort(pl->paths, pl->count, sizeof(char *), pl_cmp);
-    return pl;
+// ---------------------------------------------------------------------------
+// Base cache helpers — the base of rel is the object its manifest entry names
+// ---------------------------------------------------------------------------
+
+// Object path of rel's base version; -1 if the manifest records none.
+// The object is not probed: gc never removes one a manifest references.
+static int base_path_for(Manifest *mf, const char *rel, char *out, size_t out_len) {
+    pthread_mutex_lock(&mf->lock);
+    ManifestEntry *e = manifest_find(mf, rel);
+    Digest d;
+    int has = e && e->has_hash;
+    if (has) d = e->hash;
+    pthread_mutex_unlock(&mf->lock);
+
+    if (!has) { snprintf(out, out_len, "/dev/null"); return -1; }
+    object_path(&d, out, out_len);
+    return 0;
 }
 
-static void pl_free(PathList *pl) {
-    if (!pl) return;
-    for (int i = 0; i < pl->count; i++) free(pl->paths[i]);
-    free(pl->paths);
-    free(pl);
+// Make src_path the base of rel: store its content as an object and record
+// its stat tuple and hash in the manifest.
+static int base_update(const char *local_root, const char *rel,
+                       const char *src_path, Manifest *mf)
+{
+    (void)local_root;
+    struct stat st;
+    Digest d;
+    long long t = timer_start();
+    int rc = object_store(src_path, &d, &st);
+    timer_stop("file", "store base", t, rel);
+    if (rc != 0) return -1;
+
+    FileStat fs;
+    filestat_from(&fs, &st);
+    pthread_mutex_lock(&mf->lock);
+    ManifestEntry *e = manifest_get(mf, rel);
+    manifest_set_local(e, &fs);
+    e->hash     = d;
+    e->has_hash = 1;
+    e->lazy     = 0;
+    mf->dirty   = 1;
+    pthread_mutex_unlock(&mf->lock);
+    return 0;
+}
+
+// Drop rel's base; the object itself stays until rmt gc finds it unreferenced.
+static void base_delete(const char *local_root, const char *rel, Manifest *mf)
+{
+    (void)local_root;
+    pthread_mutex_lock(&mf->lock);
+    manifest_remove(mf, rel);
+    pthread_mutex_unlock(&mf->lock);
+}
+
+// Hash the tree and store any content the object store lacks; every file's
+// current version becomes its base.
+static int base_init(const char *local_root)
+{
+    return manifest_rebuild(local_root);
 }
 
 // ---------------------------------------------------------------------------
-// comp-based smart sync
+// Registry operations
 // ---------------------------------------------------------------------------
 
-static int run_comp_diff(const char *a, const char *b) {
-    char *qa = shell_quote(a);
-    char *qb = shell_quote(b);
-    if (!qa || !qb) { free(qa); free(qb); return -1; }
-    char cmd[8192];
-    snprintf(cmd, sizeof(cmd), COMP_BIN " diff %s %s > /dev/null 2>&1", qa, qb);
-    free(qa);
-    free(qb);
-    int rc = system(cmd);
-    if (!WIFEXITED(rc)) return -1;
-    int ex = WEXITSTATUS(rc);
-    if (ex == 0) return 0;
-    if (ex == 1) return 1;
-    return -1;
+// One "local|remote|mounted_at|last_sync|files|bytes|sync_ms" line per
+// mount. Loading maps the file copy-on-write and splits it in place. Writers
+// hold registry.lock around reload-modify-save and rename a complete file
+// over the old one, so readers take no lock and never see a partial file.
+
+typedef struct {
+    Mount *mounts;
+    int count, cap;
+    int *index;             // open addressing by local_path, -1 = empty
+    int index_cap;
+    char *map;              // the registry file, privately mapped
+    size_t map_len;
+    Arena strs;             // paths not backed by the map
+} MountRegistry;
+
+static size_t registry_slot(const MountRegistry *reg, const char *local) {
+    size_t mask = (size_t)(reg->index_cap - 1);
+    size_t slot = fnv1a(local, strlen(local), FNV_SEED) & mask;
+    while (reg->index[slot] >= 0 && strcmp(reg->mounts[reg->index[slot]].local_path, local) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
 }
 
-static int run_comp_merge(const char *base, const char *ours, const char *theirs,
-                          const char *out) {
-    char *qb   = shell_quote(base);
-    char *qo   = shell_quote(ours);
-    char *qt   = shell_quote(theirs);
-    char *qout = shell_quote(out);
-    if (!qb || !qo || !qt || !qout) {
-        free(qb); free(qo); free(qt); free(qout); return -1;
+static void registry_reindex(MountRegistry *reg) {
+    int cap = 16;
+    while (cap < reg->count * 2) cap <<= 1;
+    free(reg->index);
+    reg->index = malloc(cap * sizeof(int));
+    reg->index_cap = cap;
+    for (int i = 0; i < cap; i++) reg->index[i] = -1;
+    for (int i = 0; i < reg->count; i++)
+        reg->index[registry_slot(reg, reg->mounts[i].local_path)] = i;
+}
+
+static Mount *registry_lookup(MountRegistry *reg, const char *resolved) {
+    if (reg->index_cap == 0) return NULL;
+    int i = reg->index[registry_slot(reg, resolved)];
+    return i >= 0 ? &reg->mounts[i] : NULL;
+}
+
+// Append a mount; the strings are used in place and must outlive reg.
+static Mount *registry_push(MountRegistry *reg, const char *local, const char *remote) {
+    if (reg->count == reg->cap) {
+        reg->cap = reg->cap ? reg->cap * 2 : 16;
+        reg->mounts = realloc(reg->mounts, reg->cap * sizeof(Mount));
     }
-    char cmd[8192];
-    snprintf(cmd, sizeof(cmd),
-             COMP_BIN " merge %s %s %s %s 2>/dev/null", qb, qo, qt, qout);
-    free(qb); free(qo); free(qt); free(qout);
-    int rc = system(cmd);
-    if (!WIFEXITED(rc)) return -1;
-    int ex = WEXITSTATUS(rc);
-    if (ex == 0) return 0;
-    if (ex == 1) return 1;
-    return -1;
+    Mount *m = &reg->mounts[reg->count++];
+    memset(m, 0, sizeof(*m));
+    m->local_path  = local;
+    m->remote_spec = remote;
+    m->files = m->bytes = m->sync_ms = -1;
+    if (reg->count * 2 > reg->index_cap) registry_reindex(reg);
+    else reg->index[registry_slot(reg, local)] = reg->count - 1;
+    return m;
 }
 
-static void print_conflict(const char *local_file) {
-    printf("\n");
-    printf("╔══════════════════════════════════════════════════════════╗\n");
-    printf("║                   MERGE CONFLICT                        ║\n");
-    printf("╠══════════════════════════════════════════════════════════╣\n");
-    printf("║  File: %-50s║\n", local_file);
-    printf("╠══════════════════════════════════════════════════════════╣\n");
-    printf("║  Both local and remote changed this file since last      ║\n");
-    printf("║  sync and the changes could not be merged automatically. ║\n");
-    printf("║                                                          ║\n");
-    printf("║  The file has been written with conflict markers:        ║\n");
-    printf("║    <<<<<<< ours                                          ║\n");
-    printf("║    =======                                               ║\n");
-    printf("║    >>>>>>> theirs                                        ║\n");
-    printf("║                                                          ║\n");
-    printf("║  Resolve the conflict, then run:                        ║\n");
-    printf("║    rmt sync <path> --push                                ║\n");
-    printf("╚══════════════════════════════════════════════════════════╝\n");
+static Mount *registry_add(MountRegistry *reg, const char *local, const char *remote) {
+    const char *l = arena_strndup(&reg->strs, local,  strlen(local));
+    const char *r = arena_strndup(&reg->strs, remote, strlen(remote));
+    if (!l || !r) return NULL;
+    Mount *m = registry_push(reg, l, r);
+    m->mounted_at = time(NULL);
+    m->last_sync  = m->mounted_at;
+    return m;
+}
+
+static int registry_remove(MountRegistry *reg, const char *resolved) {
+    Mount *m = registry_lookup(reg, resolved);
+    if (!m) return -1;
+    int i = (int)(m - reg->mounts);
+    memmove(m, m + 1, (reg->count - i - 1) * sizeof(Mount));
+    reg->count--;
+    registry_reindex(reg);
+    return 0;
+}
+
+static void free_registry(MountRegistry *reg) {
+    free(reg->mounts);
+    free(reg->index);
+    if (reg->map) munmap(reg->map, reg->map_len);
+    arena_free(&reg->strs);
+    memset(reg, 0, sizeof(*reg));
+}
+
+static int load_registry(MountRegistry *reg) {
+    memset(reg, 0, sizeof(*reg));
+    int fd = open(get_registry_path(), O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) { close(fd); return -1; }
+        reg->map     = p;
+        reg->map_len = (size_t)st.st_size;
+    }
+    close(fd);
+
+    char *p = reg->map, *end = reg->map + reg->map_len;
+    while (p < end) {
+        char *line = p;
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (nl) { *nl = '\0'; p = nl + 1; }
+        else {
+            // No room for a terminator in the map: copy the last line out
+            line = arena_strndup(&reg->strs, p, (size_t)(end - p));
+            p = end;
+            if (!line) break;
+        }
+        if (line[0] == '#' || line[0] == '\0') continue;
+
+        // v2 lines stop after last_sync
+        char *f[7] = { line, NULL, NULL, NULL, NULL, NULL, NULL };
+        int nf = 1;
+        for (char *q = line; *q && nf < 7; q++)
+            if (*q == '|') { *q = '\0'; f[nf++] = q + 1; }
+        if (nf < 4 || !f[0][0] || registry_lookup(reg, f[0])) {
+            fprintf(stderr, "Warning: skipping malformed registry line\n");
+            continue;
+        }
+
+        Mount *m = registry_push(reg, f[0], f[1]);
+        m->mounted_at = (time_t)strtoll(f[2], NULL, 10);
+        m->last_sync  = (time_t)strtoll(f[3], NULL, 10);
+        if (nf == 7) {
+            m->files   = strtoll(f[4], NULL, 10);
+            m->bytes   = strtoll(f[5], NULL, 10);
+            m->sync_ms = strtoll(f[6], NULL, 10);
+        }
+    }
+    if (reg->index_cap == 0) registry_reindex(reg);
+    return 0;
+}
+
+// Written to a temp file and renamed into place. Callers that read the
+// registry first should hold registry_lock() across both.
+static int save_registry(const MountRegistry *reg) {
+    if (mkdir_p(get_rmt_dir()) != 0) return -1;
+    const char *path = get_registry_path();
+    char tmp[MAX_PATH_LEN + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return -1;
+    FILE *f = fdopen(fd, "w");
+    if (!f) { close(fd); unlink(tmp); return -1; }
+
+    fprintf(f, "# rmt registry v3 do not edit manually\n");
+    for (int i = 0; i < reg->count; i++) {
+        const Mount *m = &reg->mounts[i];
+        fprintf(f, "%s|%s|%lld|%lld|%lld|%lld|%lld\n",
+                m->local_path,
+                m->remote_spec,
+                (long long)m->mounted_at,
+                (long long)m->last_sync,
+                m->files, m->bytes, m->sync_ms);
+    }
+
+    int rc = (fflush(f) == 0 && fsync(fd) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmp);
+    return rc;
+}
+
+// Serialises read-modify-write cycles between rmt processes. Returns the
+// lock fd for registry_unlock, or -1.
+static int registry_lock(void) {
+    if (mkdir_p(get_rmt_dir()) != 0) return -1;
+    char path[MAX_PATH_LEN + 8];
+    snprintf(path, sizeof(path), "%s.lock", get_registry_path());
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) { close(fd); return -1; }
+    }
+    return fd;
+}
+
+static void registry_unlock(int fd) {
+    if (fd < 0) return;
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Stamp a finished sync on the mount at local_path; negative stats keep
+// their previous value. Reloads under the lock so other processes'
+// updates survive.
+static int registry_record_sync(const char *local_path, long long files,
+                                long long bytes, long long sync_ms) {
+    int lk = registry_lock();
+    if (lk < 0) return -1;
+    MountRegistry reg;
+    int rc = -1;
+    if (load_registry(&reg) == 0) {
+        Mount *m = registry_lookup(&reg, local_path);
+        if (m) {
+            m->last_sync = time(NULL);
+            if (files   >= 0) m->files   = files;
+            if (bytes   >= 0) m->bytes   = bytes;
+            if (sync_ms >= 0) m->sync_ms = sync_ms;
+            rc = save_registry(&reg);
+        }
+        free_registry(&reg);
+    }
+    registry_unlock(lk);
+    return rc;
+}
+
+static Mount *find_mount(MountRegistry *reg, const char *local) {
+    char resolved[MAX_PATH_LEN];
+    if (realpath(local, resolved)) {
+        normalize_path(resolved);
+        return registry_lookup(reg, resolved);
+    }
+    if (local[0] != '/') {
+        char cwd[MAX_PATH_LEN];
+        if (getcwd(cwd, sizeof(cwd))) {
+            snprintf(resolved, sizeof(resolved), "%s/%s", cwd, local);
+            normalize_path(resolved);
+            return registry_lookup(reg, resolved);
+        }
+    }
+    return NULL;
+}
+
+static int cmd_unmount(const char *local, int keep_local) {
+    MountRegistry reg = {0};
+    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+
+    Mount *m = find_mount(&reg, local);
+    if (!m) { fprintf(stderr, "%s is not a mounted path\n", local); return 1; }
+
+    char resolved[MAX_PATH_LEN];
+    strncpy(resolved, m->local_path, sizeof(resolved) - 1);
+    resolved[sizeof(resolved) - 1] = '\0';
+
+    if (!keep_local) {
+        transport_open(m->remote_spec);
+        printf("Doing final sync before unmount...\n");
+        int rc = smart_sync(m->local_path, m->remote_spec, 0);
+        if (rc == 1) {
+            fprintf(stderr, "\nCannot unmount: unresolved conflicts.\n");
+            fprintf(stderr, "Resolve conflicts then run: rmt unmount %s\n", local);
+            return 1;
+        } else if (rc != 0) {
+            fprintf(stderr, "\nWarning: final sync failed\n");
+            fprintf(stderr, "Continue with unmount anyway? [y/N] ");
+            char resp[16];
+            if (!fgets(resp, sizeof(resp), stdin) || (resp[0] != 'y' && resp[0] != 'Y')) {
+                printf("Unmount cancelled\n");
+                return 1;
+            }
+        }
+    }
+
+    free_registry(&reg);
+    int lk = registry_lock();
+    if (lk < 0 || load_registry(&reg) != 0 || registry_remove(&reg, resolved) != 0) {
+        fprintf(stderr, "Failed to remove from registry\n");
+        free_registry(&reg);
+        registry_unlock(lk);
+        return 1;
+    }
+    if (save_registry(&reg) != 0) fprintf(stderr, "Warning: Failed to save registry\n");
+    free_registry(&reg);
+    registry_unlock(lk);
+
+    printf("✓ Unmounted %s\n", resolved);
+
+    if (keep_local) {
+        printf("  Local files kept at: %s\n", resolved);
+        printf("  Note: .rmt-manifest kept alongside local files\n");
+    } else {
+        printf("  Deleting local copy...\n");
+        char *quoted = shell_quote(resolved);
+        if (!quoted) { fprintf(stderr, "  Warning: OOM quoting path\n"); return 1; }
+        char cmd[MAX_PATH_LEN * 2 + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", quoted);
+        free(quoted);
+        if (run_system(cmd) == 0) printf("  ✓ Deleted %s\n", resolved);
+        else fprintf(stderr, "  Warning: Failed to delete local files\n");
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Ignore rules — <mount>/.rmtignore in gitignore syntax, then --exclude and
+// --include, compiled once per sync. Plain names, anchored paths and "*.ext"
+// suffixes become hash lookups; any other pattern is turned into a small
+// automaton run over the path with one bit per state. As in git, the last
+// rule that matches decides, and an excluded directory is never descended.
+// ---------------------------------------------------------------------------
+
+#define IGNORE_FILE   ".rmtignore"
+#define IGNORE_STATES 64    // NFA states per glob; longer globs use fnmatch
+
+typedef struct {
+    char *rsync;        // the rule as an rsync filter pattern
+    int negate;         // "!pat" re-includes what an earlier rule excluded
+    int dir_only;       // "pat/" only matches directories
+    int anchored;       // matched against the whole path, not the last name
+    // Glob automaton: bit i is "the first i tokens matched". cmask[c] has
+    // bit i when token i consumes c; star tokens loop on anything but '/',
+    // gstar ("**") on anything. eps1 states may be passed without reading
+    // a character; eps3 states may skip the next three ("**/" as a whole).
+    int ntok;
+    uint64_t *cmask, star, gstar, eps1, eps3;
+    char *fn;           // fnmatch pattern for globs with too many tokens
+} IgRule;
+
+// key -> highest index of a literal rule with that key
+typedef struct { char **keys; int *vals; int cap, count; } IgTable;
+
+typedef struct {
+    IgRule *rules;
+    int count, cap;
+    IgTable names[2], paths[2], suffixes[2];    // [1]: directory-only rules
+    uint64_t suffix_lens[2];                    // bit n: a suffix of n bytes exists
+    int *globs, nglobs;                         // every other rule, ascending
+} Ignore;
+
+static Ignore g_ignore;
+static const char **g_ignore_cli;   // --exclude=PAT, and --include=PAT as "!PAT"
+static int g_ignore_ncli;
+
+static int igt_slot(const IgTable *t, const char *key, size_t len) {
+    size_t mask = (size_t)(t->cap - 1);
+    size_t slot = fnv1a(key, len, FNV_SEED) & mask;
+    while (t->keys[slot] && (strncmp(t->keys[slot], key, len) != 0 || t->keys[slot][len]))
+        slot = (slot + 1) & mask;
+    return (int)slot;
+}
+
+static void igt_put(IgTable *t, const char *key, int val) {
+    if ((t->count + 1) * 2 > t->cap) {
+        IgTable n = { NULL, NULL, t->cap ? t->cap * 2 : 16, 0 };
+        n.keys = calloc(n.cap, sizeof(char *));
+        n.vals = malloc(n.cap * sizeof(int));
+        for (int i = 0; i < t->cap; i++) {
+            if (!t->keys[i]) continue;
+            int s = igt_slot(&n, t->keys[i], strlen(t->keys[i]));
+            n.keys[s] = t->keys[i];
+            n.vals[s] = t->vals[i];
+            n.count++;
+        }
+        free(t->keys);
+        free(t->vals);
+        *t = n;
+    }
+    int s = igt_slot(t, key, strlen(key));
+    if (!t->keys[s]) { t->keys[s] = strdup(key); t->vals[s] = val; t->count++; }
+    else if (val > t->vals[s]) t->vals[s] = val;
+}
+
+static int igt_get(const IgTable *t, const char *key, size_t len) {
+    if (t->count == 0) return -1;
+    int s = igt_slot(t, key, len);
+    return t->keys[s] ? t->vals[s] : -1;
+}
+
+static void igt_free(IgTable *t) {
+    for (int i = 0; i < t->cap; i++) free(t->keys[i]);
+    free(t->keys);
+    free(t->vals);
+    memset(t, 0, sizeof(*t));
+}
+
+static void ignore_free(Ignore *ig) {
+    for (int i = 0; i < ig->count; i++) {
+        free(ig->rules[i].rsync);
+        free(ig->rules[i].cmask);
+        free(ig->rules[i].fn);
+    }
+    free(ig->rules);
+    free(ig->globs);
+    for (int k = 0; k < 2; k++) {
+        igt_free(&ig->names[k]);
+        igt_free(&ig->paths[k]);
+        igt_free(&ig->suffixes[k]);
+    }
+    memset(ig, 0, sizeof(*ig));
+}
+
+typedef enum { IG_LIT, IG_ANY, IG_CLASS, IG_STAR, IG_GSTAR, IG_DIRS } IgTokKind;
+
+typedef struct {
+    IgTokKind kind;
+    unsigned char c;        // IG_LIT
+    unsigned char set[32];  // IG_CLASS
+} IgTok;
+
+// Split a gitignore pattern into tokens. "**/" is IG_DIRS (any run of
+// whole directories, possibly none) and a "**" closing the pattern is
+// IG_GSTAR; a '*' anywhere else stays within one path component.
+static int ig_tokenize(const char *p, IgTok *tok) {
+    int n = 0;
+    for (size_t i = 0; p[i]; i++) {
+        IgTok *t = &tok[n++];
+        memset(t, 0, sizeof(*t));
+        if (p[i] == '\\' && p[i + 1]) { t->kind = IG_LIT; t->c = (unsigned char)p[++i]; continue; }
+        if (p[i] == '?') { t->kind = IG_ANY; continue; }
+        if (p[i] == '*') {
+            int run = 1;
+            while (p[i + 1] == '*') { i++; run++; }
+            int whole = run == 2 && (i == 1 || p[i - 2] == '/');
+            if (whole && p[i + 1] == '/') { t->kind = IG_DIRS; i++; }
+            else if (whole && !p[i + 1])  t->kind = IG_GSTAR;
+            else                          t->kind = IG_STAR;
+            continue;
+        }
+        if (p[i] == '[') {
+            size_t j = i + 1;
+            int neg = p[j] == '!' || p[j] == '^';
+            if (neg) j++;
+            size_t first = j;
+            while (p[j] && (p[j] != ']' || j == first)) j++;
+            if (p[j] == ']') {
+                t->kind = IG_CLASS;
+                for (size_t k = first; k < j; k++) {
+                    unsigned char lo = (unsigned char)p[k], hi = lo;
+                    if (p[k + 1] == '-' && k + 2 < j) { hi = (unsigned char)p[k + 2]; k += 2; }
+                    for (unsigned c = lo; c <= hi; c++) t->set[c >> 3] |= (unsigned char)(1u << (c & 7));
+                }
+                if (neg) for (int k = 0; k < 32; k++) t->set[k] = (unsigned char)~t->set[k];
+                t->set['/' >> 3] &= (unsigned char)~(1u << ('/' & 7));
+                i = j;
+                continue;
+            }
+        }
+        t->kind = IG_LIT;
+        t->c = (unsigned char)p[i];
+    }
+    return n;
+}
+
+// Build the automaton of a glob rule; -1 when it needs more states than fit.
+static int ig_compile(IgRule *r, const IgTok *tok, int ntok) {
+    int nstates = ntok;
+    for (int i = 0; i < ntok; i++) if (tok[i].kind == IG_DIRS) nstates += 2;
+    if (nstates >= IGNORE_STATES) return -1;
+    r->cmask = calloc(256, sizeof(uint64_t));
+    if (!r->cmask) return -1;
+    int s = 0;
+    for (int i = 0; i < ntok; i++, s++) {
+        uint64_t bit = 1ULL << s;
+        switch (tok[i].kind) {
+        case IG_LIT:   r->cmask[tok[i].c] |= bit; break;
+        case IG_ANY:   for (int c = 0; c < 256; c++) if (c != '/') r->cmask[c] |= bit; break;
+        case IG_CLASS: for (int c = 0; c < 256; c++) if (tok[i].set[c >> 3] & (1u << (c & 7))) r->cmask[c] |= bit; break;
+        case IG_STAR:  r->star  |= bit; r->eps1 |= bit; break;
+        case IG_GSTAR: r->gstar |= bit; r->eps1 |= bit; break;
+        case IG_DIRS:  // an entry state, then "**" and '/'; entry may skip all three
+            r->eps3  |= bit;
+            r->eps1  |= bit | bit << 1;
+            r->gstar |= bit << 1;
+            r->cmask['/'] |= bit << 2;
+            s += 2;
+            break;
+        }
+    }
+    r->ntok = s;
+    return 0;
+}
+
+static uint64_t ig_closure(const IgRule *r, uint64_t d) {
+    for (;;) {
+        uint64_t n = d | ((d & r->eps1) << 1) | ((d & r->eps3) << 3);
+        if (n == d) return d;
+        d = n;
+    }
+}
+
+static int ig_glob_match(const IgRule *r, const char *s) {
+    if (r->fn) return fnmatch(r->fn, s, r->anchored ? FNM_PATHNAME : 0) == 0;
+    uint64_t d = ig_closure(r, 1);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        uint64_t loop = d & (*p == '/' ? r->gstar : (r->star | r->gstar));
+        d = ((d & r->cmask[*p]) << 1) | loop;
+        if (!d) return 0;
+        d = ig_closure(r, d);
+    }
+    return (int)((d >> r->ntok) & 1);
+}
+
+// Add one line of gitignore syntax; blank lines and comments are skipped.
+static void ignore_add(Ignore *ig, const char *line) {
+    size_t len = strcspn(line, "\r\n");
+    while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) len--;
+    if (len == 0 || line[0] == '#') return;
+
+    IgRule r;
+    memset(&r, 0, sizeof(r));
+    if (line[0] == '!') { r.negate = 1; line++; len--; }
+    if (len > 0 && line[len - 1] == '/') { r.dir_only = 1; len--; }
+    if (len == 0) return;
+
+    char *pat = strndup(line, len);
+    char *p = pat;
+    // "**/name" is just an unanchored name; any other inner '/' anchors
+    if (strncmp(p, "**/", 3) == 0 && !strchr(p + 3, '/')) p += 3;
+    else if (strchr(p, '/')) r.anchored = 1;
+    if (*p == '/') p++;
+    if (!*p) { free(pat); return; }
+
+    size_t plen = strlen(p);
+    r.rsync = malloc(plen + 3);
+    snprintf(r.rsync, plen + 3, "%s%s%s", r.anchored && strncmp(p, "**/", 3) != 0 ? "/" : "",
+             p, r.dir_only ? "/" : "");
+
+    IgTok *tok = malloc((plen + 1) * sizeof(IgTok));
+    int ntok = ig_tokenize(p, tok);
+    int nlit = 0;
+    for (int i = 0; i < ntok; i++) nlit += tok[i].kind == IG_LIT;
+    // The literal text the tables are keyed by, escapes removed
+    char *lit = malloc(ntok + 1);
+    int k = 0;
+    for (int i = 0; i < ntok; i++) if (tok[i].kind == IG_LIT) lit[k++] = (char)tok[i].c;
+    lit[k] = '\0';
+
+    if (ig->count == ig->cap) {
+        ig->cap = ig->cap ? ig->cap * 2 : 16;
+        ig->rules = realloc(ig->rules, ig->cap * sizeof(IgRule));
+    }
+    int idx = ig->count;
+    int d = r.dir_only;
+    if (nlit == ntok) {
+        igt_put(r.anchored ? &ig->paths[d] : &ig->names[d], lit, idx);
+    } else if (!r.anchored && tok[0].kind == IG_STAR && nlit == ntok - 1 && k < 64) {
+        igt_put(&ig->suffixes[d], lit, idx);
+        ig->suffix_lens[d] |= 1ULL << k;
+    } else {
+        if (ig_compile(&r, tok, ntok) != 0) r.fn = strdup(p);
+        ig->globs = realloc(ig->globs, (ig->nglobs + 1) * sizeof(int));
+        ig->globs[ig->nglobs++] = idx;
+    }
+    ig->rules[ig->count++] = r;
+    free(lit);
+    free(tok);
+    free(pat);
+}
+
+// Replace g_ignore with the rules for the mount at root.
+static void ignore_load(const char *root) {
+    ignore_free(&g_ignore);
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/" IGNORE_FILE, root);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[MAX_PATH_LEN];
+        while (fgets(line, sizeof(line), f)) ignore_add(&g_ignore, line);
+        fclose(f);
+    }
+    for (int i = 0; i < g_ignore_ncli; i++) ignore_add(&g_ignore, g_ignore_cli[i]);
+}
+
+// Is rel itself excluded? Its parent directories are not looked at.
+static int ignore_match(const Ignore *ig, const char *rel, int is_dir) {
+    if (ig->count == 0) return 0;
+    const char *slash = strrchr(rel, '/');
+    const char *name  = slash ? slash + 1 : rel;
+    size_t nlen = strlen(name);
+
+    int best = -1;
+    for (int d = 0; d <= is_dir; d++) {
+        int v = igt_get(&ig->names[d], name, nlen);
+        if (v > best) best = v;
+        v = igt_get(&ig->paths[d], rel, strlen(rel));
+        if (v > best) best = v;
+        for (uint64_t m = ig->suffix_lens[d]; m; m &= m - 1) {
+            size_t sl = (size_t)__builtin_ctzll(m);
+            if (sl > nlen) break;
+            v = igt_get(&ig->suffixes[d], name + nlen - sl, sl);
+            if (v > best) best = v;
+        }
+    }
+    for (int k = ig->nglobs - 1; k >= 0 && ig->globs[k] > best; k--) {
+        const IgRule *r = &ig->rules[ig->globs[k]];
+        if (r->dir_only && !is_dir) continue;
+        if (ig_glob_match(r, r->anchored ? rel : name)) { best = ig->globs[k]; break; }
+    }
+    return best >= 0 && !ig->rules[best].negate;
+}
+
+// Is the file rel excluded, by its own name or by a directory above it?
+static int ignore_path(const Ignore *ig, const char *rel) {
+    if (ig->count == 0) return 0;
+    char buf[MAX_PATH_LEN];
+    size_t n = strlen(rel);
+    if (n >= sizeof(buf)) return 0;
+    memcpy(buf, rel, n + 1);
+    for (char *s = strchr(buf, '/'); s; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        int hit = ignore_match(ig, buf, 1);
+        *s = '/';
+        if (hit) return 1;
+    }
+    return ignore_match(ig, buf, 0);
+}
+
+// The rules as an rsync filter file for whole-tree transfers. rsync stops
+// at the first match, so they are written last rule first.
+typedef struct { char path[64]; char opt[96]; } IgFilter;
+
+static const char *ignore_filter_begin(IgFilter *f) {
+    f->path[0] = f->opt[0] = '\0';
+    if (g_ignore.count == 0) return f->opt;
+    snprintf(f->path, sizeof(f->path), "/tmp/rmt_filter_XXXXXX");
+    int fd = mkstemp(f->path);
+    FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        if (fd >= 0) { close(fd); unlink(f->path); }
+        f->path[0] = '\0';
+        return f->opt;
+    }
+    for (int i = g_ignore.count - 1; i >= 0; i--) {
+        const IgRule *r = &g_ignore.rules[i];
+        char sign = r->negate ? '+' : '-';
+        fprintf(out, "%c %s\n", sign, r->rsync);
+        // rsync's "a/**/b" needs a directory in between; git's also matches "a/b"
+        const char *dirs = strstr(r->rsync, "/**/");
+        if (dirs) fprintf(out, "%c %.*s%s\n", sign, (int)(dirs - r->rsync), r->rsync, dirs + 3);
+    }
+    if (fclose(out) != 0) { unlink(f->path); f->path[0] = '\0'; return f->opt; }
+    snprintf(f->opt, sizeof(f->opt), " --filter='merge %s'", f->path);
+    return f->opt;
+}
+
+static void ignore_filter_end(IgFilter *f) {
+    if (f->path[0]) unlink(f->path);
+    f->path[0] = '\0';
+}
+
+// ---------------------------------------------------------------------------
+// Compression policy — how hard rsync compresses a transfer. Files are
+// classed by extension, or by the byte entropy of their first block, as
+// not worth compressing, worth a fast level or worth a high one. rsync takes
+// one level per run, so the byte mix of the classes picks it (incompressible
+// types are left out through --skip-compress), and the link and CPU
+// throughput measured on earlier transfers to the host move it up or down.
+// ---------------------------------------------------------------------------
+
+typedef enum { COMP_NONE, COMP_FAST, COMP_HIGH, COMP_AUTO } CompLevel;
+
+static CompLevel g_compress = COMP_AUTO;   // --compress=auto|none|fast|high
+
+#define COMP_SAMPLE        4096     // bytes read from the start of a file
+#define COMP_SAMPLE_FILES  256      // files sampled per transfer
+#define COMP_LEVEL_FAST    1
+#define COMP_LEVEL_HIGH    9        // zstd 9; the zlib maximum when rsync falls back
+#define COMP_MEASURE_MIN   (1 << 20)    // wire bytes before a transfer is timed
+
+// Already compressed: passed to rsync as --skip-compress. Sorted for bsearch.
+static const char *const comp_skip_ext[] = {
+    "3gp", "7z", "aac", "apk", "avi", "br", "bz2", "deb", "dmg", "docx",
+    "flac", "gif", "gpg", "gz", "heic", "iso", "jar", "jpeg", "jpg", "lz",
+    "lz4", "lzma", "lzo", "m4a", "m4v", "mkv", "mov", "mp3", "mp4", "mpeg",
+    "mpg", "npz", "odt", "ogg", "opus", "orc", "parquet", "png", "pptx", "rar",
+    "rpm", "squashfs", "tbz", "tbz2", "tgz", "txz", "webm", "webp", "whl", "xlsx",
+    "xz", "z", "zip", "zst",
+};
+
+// Text that rewards a high level. Sorted for bsearch.
+static const char *const comp_text_ext[] = {
+    "c", "cc", "cpp", "css", "csv", "go", "h", "hpp", "htm", "html", "ini",
+    "java", "js", "json", "jsonl", "log", "md", "ndjson", "out", "py", "rs",
+    "sql", "svg", "ts", "tsv", "txt", "xml", "yaml", "yml",
+};
+
+static int comp_ext_cmp(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int comp_ext_in(const char *ext, const char *const *set, size_t n) {
+    return bsearch(&ext, set, n, sizeof(char *), comp_ext_cmp) != NULL;
+}
+
+// log2 of x >= 1 without libm: integer part by halving, fraction by
+// repeated squaring
+static double comp_log2(double x) {
+    double r = 0;
+    while (x >= 2) { x /= 2; r += 1; }
+    double bit = 0.5;
+    for (int i = 0; i < 24; i++, bit /= 2) {
+        x *= x;
+        if (x >= 2) { x /= 2; r += bit; }
+    }
+    return r;
+}
+
+// Shannon entropy of the bytes, in bits per byte (8 = random):
+// sum of c/n * log2(n/c) over the byte counts c
+static double comp_entropy(const unsigned char *p, size_t n) {
+    if (n == 0) return 0;
+    unsigned counts[256] = {0};
+    for (size_t i = 0; i < n; i++) counts[p[i]]++;
+    double h = 0, log_n = comp_log2((double)n);
+    for (int i = 0; i < 256; i++)
+        if (counts[i]) h += counts[i] * (log_n - comp_log2((double)counts[i]));
+    return h / n;
+}
+
+// Class of one file by its name, then by a sample of its content when path
+// is readable; *size gets its size, 0 when unknown.
+static CompLevel comp_class(const char *path, const char *rel, long long *size) {
+    char ext[16];
+    const char *base = strrchr(rel, '/');
+    const char *dot  = strrchr(base ? base + 1 : rel, '.');
+    size_t n = 0;
+    if (dot && dot[1] && strlen(dot + 1) < sizeof(ext))
+        for (const char *s = dot + 1; *s; s++) ext[n++] = (char)tolower((unsigned char)*s);
+    ext[n] = '\0';
+    *size = 0;
+
+    struct stat st;
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd >= 0 && fstat(fd, &st) == 0) *size = (long long)st.st_size;
+
+    CompLevel c = COMP_FAST;
+    if (n && comp_ext_in(ext, comp_skip_ext, sizeof(comp_skip_ext) / sizeof(char *))) {
+        c = COMP_NONE;
+    } else if (n && comp_ext_in(ext, comp_text_ext, sizeof(comp_text_ext) / sizeof(char *))) {
+        c = COMP_HIGH;
+    } else if (fd >= 0) {
+        unsigned char buf[COMP_SAMPLE];
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got >= 512) {
+            double h = comp_entropy(buf, (size_t)got);
+            c = h > 7.2 ? COMP_NONE : h < 5.0 ? COMP_HIGH : COMP_FAST;
+        }
+    }
+    if (fd >= 0) close(fd);
+    return c;
+}
+
+// What compressing has cost and bought with one host, kept in ~/.rmt/links
+// as "<host> <wire bytes/s> <cpu bytes/s>" so a run starts from the last one's.
+typedef struct {
+    double wire_bps;    // bytes on the wire per second of transfer
+    double cpu_bps;     // bytes rsync moved per second of its CPU time
+} CompLink;
+
+static const char *comp_links_path(void) {
+    static char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/links", get_rmt_dir());
+    return path;
+}
+
+static int comp_link_load(const char *host, CompLink *l) {
+    memset(l, 0, sizeof(*l));
+    FILE *f = fopen(comp_links_path(), "r");
+    if (!f) return -1;
+    char line[MAX_PATH_LEN + 64], name[MAX_PATH_LEN];
+    int found = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%4095s %lf %lf", name, &l->wire_bps, &l->cpu_bps) == 3
+            && strcmp(name, host) == 0) { found = 0; break; }
+    fclose(f);
+    if (found != 0) memset(l, 0, sizeof(*l));
+    return found;
+}
+
+// Written to a temp file and renamed into place; concurrent runs may drop
+// each other's update, which only costs a less recent measurement.
+static void comp_link_save(const char *host, const CompLink *l) {
+    if (mkdir_p(get_rmt_dir()) != 0) return;
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", comp_links_path());
+    int fd = mkstemp(tmp);
+    if (fd < 0) return;
+    FILE *out = fdopen(fd, "w");
+    if (!out) { close(fd); unlink(tmp); return; }
+    FILE *in = fopen(comp_links_path(), "r");
+    char line[MAX_PATH_LEN + 64], name[MAX_PATH_LEN];
+    while (in && fgets(line, sizeof(line), in))
+        if (sscanf(line, "%4095s", name) == 1 && strcmp(name, host) != 0) fputs(line, out);
+    if (in) fclose(in);
+    fprintf(out, "%s %.0f %.0f\n", host, l->wire_bps, l->cpu_bps);
+    if (fclose(out) != 0 || rename(tmp, comp_links_path()) != 0) unlink(tmp);
+}
+
+// A transfer's plan: the level, and the host whose link it is measured against
+typedef struct {
+    CompLevel level;
+    char host[MAX_PATH_LEN];
+    long long t0;
+    struct timeval cpu0;
+} CompPlan;
+
+static void comp_child_cpu(struct timeval *tv) {
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    timeradd(&ru.ru_utime, &ru.ru_stime, tv);
+}
+
+// Pick the level for sending rels (paths under root, which may be NULL or
+// hold older copies) to or from remote_spec; rels NULL for a whole tree.
+static void comp_plan(CompPlan *p, const char *remote_spec, const char *root,
+                      char **rels, int count) {
+    char rpath[MAX_PATH_LEN];
+    if (split_remote_spec(remote_spec, p->host, sizeof(p->host), rpath, sizeof(rpath)) != 0)
+        p->host[0] = '\0';
+    if (g_compress != COMP_AUTO) { p->level = g_compress; return; }
+
+    // Byte mix of an even spread of the files
+    long long bytes[3] = {0, 0, 0};
+    int step = count > COMP_SAMPLE_FILES ? count / COMP_SAMPLE_FILES : 1;
+    for (int i = 0; rels && i < count; i += step) {
+        char path[MAX_PATH_LEN];
+        long long size;
+        if (root) snprintf(path, sizeof(path), "%s/%s", root, rels[i]);
+        CompLevel c = comp_class(root ? path : NULL, rels[i], &size);
+        bytes[c] += size > 0 ? size : 1;
+    }
+    long long total = bytes[0] + bytes[1] + bytes[2];
+    if (total == 0)                       p->level = COMP_FAST;
+    else if (bytes[COMP_NONE] * 10 >= total * 9) p->level = COMP_NONE;
+    else if (bytes[COMP_HIGH] * 2 >= total)      p->level = COMP_HIGH;
+    else                                  p->level = COMP_FAST;
+
+    // A link faster than rsync can compress for gains nothing from it; one
+    // far slower is worth the extra CPU of a high level
+    CompLink l;
+    if (p->level == COMP_NONE || comp_link_load(p->host, &l) != 0
+        || l.wire_bps <= 0 || l.cpu_bps <= 0) return;
+    if (l.wire_bps >= l.cpu_bps)                           p->level = COMP_NONE;
+    else if (l.wire_bps * 8 > l.cpu_bps && p->level == COMP_HIGH) p->level = COMP_FAST;
+    else if (l.wire_bps * 32 < l.cpu_bps)                  p->level = COMP_HIGH;
+}
+
+// rsync options for the plan ("" or ending in a space). rsync 3.2+ is asked
+// to prefer zstd; both ends negotiate, so an older remote still gets zlib.
+static const char *comp_rsync_opts(const CompPlan *p) {
+    static char opts[1024];
+    if (p->level == COMP_NONE) return "";
+    static int version = -1;
+    if (version < 0) {
+        version = rsync_version(NULL);
+        if (version >= 302) setenv("RSYNC_COMPRESS_LIST", "zstd lz4 zlibx zlib", 0);
+    }
+    size_t n = (size_t)snprintf(opts, sizeof(opts), "-z --compress-level=%d --skip-compress=",
+                                p->level == COMP_HIGH ? COMP_LEVEL_HIGH : COMP_LEVEL_FAST);
+    for (size_t i = 0; i < sizeof(comp_skip_ext) / sizeof(char *); i++)
+        n += (size_t)snprintf(opts + n, sizeof(opts) - n, "%s%s", i ? "/" : "", comp_skip_ext[i]);
+    snprintf(opts + n, sizeof(opts) - n, " ");
+    return opts;
+}
+
+static void comp_begin(CompPlan *p) {
+    p->t0 = now_ns();
+    comp_child_cpu(&p->cpu0);
+}
+
+// Value of "<key>: 1,234" in rsync --stats output, or -1
+static long long comp_stat(const char *out, const char *key) {
+    const char *s = strstr(out, key);
+    if (!s) return -1;
+    long long v = 0;
+    int digits = 0;
+    for (s += strlen(key); *s && *s != '\n'; s++) {
+        if (isdigit((unsigned char)*s)) { v = v * 10 + (*s - '0'); digits++; }
+        else if (digits && *s != ',' && *s != '.') break;
+    }
+    return digits ? v : -1;
+}
+
+// Account a finished rsync run from its --stats output; sent is 1 when the
+// data went from here to the remote.
+static void comp_end(CompPlan *p, const char *out, int sent) {
+    long long wall = now_ns() - p->t0;
+    struct timeval cpu1, d;
+    comp_child_cpu(&cpu1);
+    timersub(&cpu1, &p->cpu0, &d);
+    long long cpu_ns = (long long)d.tv_sec * 1000000000LL + d.tv_usec * 1000LL;
+    long long data = out ? comp_stat(out, "Literal data:") : -1;
+    long long wire = out ? comp_stat(out, sent ? "Total bytes sent:" : "Total bytes received:") : -1;
+    if (data < 0 || wire < 0) return;
+
+    STAT_ADD(g_run_stats.comp_in, data);
+    STAT_ADD(g_run_stats.comp_out, wire);
+    STAT_ADD(g_run_stats.comp_cpu_ns, cpu_ns);
+    __atomic_fetch_or(&g_run_stats.comp_levels, 1LL << p->level, __ATOMIC_RELAXED);
+
+    if (!p->host[0] || wire < COMP_MEASURE_MIN || wall <= 0 || cpu_ns <= 0) return;
+    CompLink l, prev;
+    l.wire_bps = wire * 1e9 / wall;
+    l.cpu_bps  = data * 1e9 / cpu_ns;
+    int have = comp_link_load(p->host, &prev) == 0;
+    if (have) {
+        l.wire_bps = (l.wire_bps + prev.wire_bps) / 2;
+        l.cpu_bps  = (l.cpu_bps + prev.cpu_bps) / 2;
+    }
+    // An uncompressed run says nothing about what compressing costs
+    if (p->level == COMP_NONE) l.cpu_bps = have ? prev.cpu_bps : 0;
+    comp_link_save(p->host, &l);
+}
+
+// ---------------------------------------------------------------------------
+// rsync wrappers — a progress meter for all blocking rsync calls
+// ---------------------------------------------------------------------------
+
+// rsync 3.1+ reports overall bytes and files as it goes, which run_capture
+// puts on the meter; older ones leave it a spinner
+static const char *rsync_progress_opt(void) {
+    static int version = -1;
+    if (g_progress == PROGRESS_OFF) return "";
+    if (version < 0) version = rsync_version(NULL);
+    return version >= 301 ? "--info=progress2 " : "";
+}
+
+// max_size > 0 leaves files of that many bytes or more to the caller
+static int rsync_pull_sized(const char *remote, const char *local, int dry_run,
+                            long long max_size) {
+    char *remote_arg = rsync_escape_remote_spec_legacy(remote);
+    if (!remote_arg) return -1;
+
+    char *qremote = shell_quote(remote_arg);
+    char *qlocal  = shell_quote(local);
+    free(remote_arg);
+
+    if (!qremote || !qlocal) { free(qremote); free(qlocal); return -1; }
+
+    CompPlan plan;
+    comp_plan(&plan, remote, NULL, NULL, 0);
+    IgFilter filt;
+    const char *filt_opt = ignore_filter_begin(&filt);
+    char max_opt[48] = "";
+    if (max_size > 0) snprintf(max_opt, sizeof(max_opt), " --max-size=%lld", max_size - 1);
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd),
+        "rsync -a%s %s%s%s" RMT_EXCLUDES "%s%s %s/ %s/ 2>/dev/null",
+        dry_run ? "n" : " --stats", comp_rsync_opts(&plan), dry_run ? "" : rsync_progress_opt(),
+        rsync_rsh(), filt_opt, max_opt, qremote, qlocal);
+
+    free(qremote);
+    free(qlocal);
+
+    if (dry_run) {
+        printf("Dry run (pull): %s -> %s\n", remote, local);
+        int rc = run_system(cmd);
+        ignore_filter_end(&filt);
+        return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    }
+
+    size_t len;
+    int status;
+    comp_begin(&plan);
+    char *out = run_capture(cmd, "Pulling from remote", &len, &status);
+    ignore_filter_end(&filt);
+    if (!out) return -1;
+    comp_end(&plan, out, 0);
+    free(out);
+    return status;
+}
+
+static int rsync_pull(const char *remote, const char *local, int dry_run) {
+    return rsync_pull_sized(remote, local, dry_run, 0);
+}
+
+static int rsync_push(const char *local, const char *remote, int dry_run) {
+    char *remote_arg = rsync_escape_remote_spec_legacy(remote);
+    if (!remote_arg) return -1;
+
+    char *qlocal  = shell_quote(local);
+    char *qremote = shell_quote(remote_arg);
+    free(remote_arg);
+
+    if (!qlocal || !qremote) { free(qlocal); free(qremote); return -1; }
+
+    CompPlan plan;
+    comp_plan(&plan, remote, NULL, NULL, 0);
+    IgFilter filt;
+    const char *filt_opt = ignore_filter_begin(&filt);
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd),
+        "rsync -a%s %s%s%s" RMT_EXCLUDES "%s %s/ %s/ 2>/dev/null",
+        dry_run ? "n" : " --stats", comp_rsync_opts(&plan), dry_run ? "" : rsync_progress_opt(),
+        rsync_rsh(), filt_opt, qlocal, qremote);
+
+    free(qlocal);
+    free(qremote);
+
+    if (dry_run) {
+        printf("Dry run (push): %s -> %s\n", local, remote);
+        int rc = run_system(cmd);
+        ignore_filter_end(&filt);
+        return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    }
+
+    size_t len;
+    int status;
+    comp_begin(&plan);
+    char *out = run_capture(cmd, "Pushing to remote", &len, &status);
+    ignore_filter_end(&filt);
+    if (!out) return -1;
+    comp_end(&plan, out, 1);
+    free(out);
+    return status;
+}
+
+typedef struct { char **paths; int count; int cap; } PathList;
+
+static void pl_push(PathList *pl, const char *rel) {
+    if (pl->count == pl->cap) {
+        pl->cap *= 2;
+        pl->paths = realloc(pl->paths, pl->cap * sizeof(char *));
+    }
+    pl->paths[pl->count++] = strdup(rel);
+}
+
+static int pl_cmp(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static PathList *pl_new(void) {
+    PathList *pl = malloc(sizeof(PathList));
+    pl->cap   = 64;
+    pl->count = 0;
+    pl->paths = malloc(pl->cap * sizeof(char *));
+    return pl;
+}
+
+static void pl_free(PathList *pl) {
+    if (!pl) return;
+    for (int i = 0; i < pl->count; i++) free(pl->paths[i]);
+    free(pl->paths);
+    free(pl);
+}
+
+// ---------------------------------------------------------------------------
+// Scanner — walks the local tree relative to directory fds (no full-path
+// rebuilds), reads entries in large getdents64 batches on Linux, trusts
+// d_type so only regular files are stat'ed, and spreads directories over
+// worker threads that steal from each other when they run dry.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char *rel;    // in the list's arena
+    unsigned len;       // strlen(rel)
+    unsigned dirlen;    // length of the directory prefix including its '/'
+    FileStat st;
+} ScanEntry;
+
+// Paths share one arena, so a million-file scan is a handful of large
+// allocations instead of one strdup per path.
+typedef struct {
+    ScanEntry *e;
+    int count, cap;
+    Arena names;
+} ScanList;
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define SCAN_GETDENTS 1
+#define SCAN_BUF (64 * 1024)
+
+struct rmt_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+#else
+#define SCAN_GETDENTS 0
+#endif
+
+// Sequential reader over one open directory fd.
+typedef struct {
+    int fd;
+#if SCAN_GETDENTS
+    char *buf;          // SCAN_BUF bytes, owned by the worker
+    long pos, len;
+#else
+    DIR *d;
+#endif
+} DirReader;
+
+static int dr_open(DirReader *r, int fd) {
+    r->fd = fd;
+#if SCAN_GETDENTS
+    r->pos = r->len = 0;
+    return 0;
+#else
+    r->d = fdopendir(fd);
+    if (!r->d) { close(fd); return -1; }
+    return 0;
+#endif
+}
+
+// Next entry other than . and ..; returns 0 at the end of the directory
+// and -1 when it cannot be read.
+static int dr_next(DirReader *r, const char **name, unsigned char *type) {
+    for (;;) {
+#if SCAN_GETDENTS
+        if (r->pos >= r->len) {
+            long n = syscall(SYS_getdents64, r->fd, r->buf, SCAN_BUF);
+            if (n < 0) return -1;
+            if (n == 0) return 0;
+            r->len = n;
+            r->pos = 0;
+        }
+        struct rmt_dirent64 *de = (struct rmt_dirent64 *)(r->buf + r->pos);
+        r->pos += de->d_reclen;
+        *name = de->d_name;
+        *type = de->d_type;
+#else
+        errno = 0;
+        struct dirent *de = readdir(r->d);
+        if (!de) return errno ? -1 : 0;
+        *name = de->d_name;
+        *type = de->d_type;
+#endif
+        if ((*name)[0] == '.' && ((*name)[1] == '\0' || ((*name)[1] == '.' && (*name)[2] == '\0')))
+            continue;
+        return 1;
+    }
+}
+
+static void dr_close(DirReader *r) {
+#if SCAN_GETDENTS
+    close(r->fd);
+#else
+    closedir(r->d);
+#endif
+}
+
+// rel must already live in sl->names (or outlive the list).
+static void sl_push(ScanList *sl, const char *rel, unsigned len, unsigned dirlen,
+                    const struct stat *st) {
+    if (sl->count == sl->cap) {
+        sl->cap = sl->cap ? sl->cap * 2 : 256;
+        sl->e = realloc(sl->e, sl->cap * sizeof(ScanEntry));
+    }
+    ScanEntry *e = &sl->e[sl->count++];
+    e->rel    = rel;
+    e->len    = len;
+    e->dirlen = dirlen;
+    filestat_from(&e->st, st);
+}
+
+static int se_cmp(const void *a, const void *b) {
+    return strcmp(((const ScanEntry *)a)->rel, ((const ScanEntry *)b)->rel);
+}
+
+static void scan_free(ScanList *sl) {
+    if (!sl) return;
+    arena_free(&sl->names);
+    free(sl->e);
+    free(sl);
+}
+
+// Directory queue of one worker: the owner pushes and pops at the tail
+// (depth-first, warm dentries); thieves take from the head (big subtrees).
+typedef struct {
+    const char **dirs;  // paths live in the owning worker's arena
+    int head, tail, cap;
+    pthread_mutex_t lock;
+} ScanDeque;
+
+typedef struct {
+    int root_fd;
+    int nworkers;
+    ScanDeque *dq;
+    ScanList *out;      // one per worker, merged at the end
+    int pending;        // directories queued or being read
+    int failed;         // something could not be read: the list is partial
+} ScanCtx;
+
+typedef struct { ScanCtx *c; int id; } ScanWorkerArg;
+
+static void scan_enqueue(ScanCtx *c, int id, const char *rel) {
+    ScanDeque *q = &c->dq[id];
+    __atomic_fetch_add(&c->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&q->lock);
+    if (q->head > 0 && q->tail == q->cap) {
+        memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(const char *));
+        q->tail -= q->head;
+        q->head  = 0;
+    }
+    if (q->tail == q->cap) {
+        q->cap  = q->cap ? q->cap * 2 : 64;
+        q->dirs = realloc(q->dirs, q->cap * sizeof(const char *));
+    }
+    q->dirs[q->tail++] = rel;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static const char *scan_dequeue(ScanCtx *c, int id) {
+    ScanDeque *q = &c->dq[id];
+    const char *rel = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) rel = q->dirs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    for (int k = 1; !rel && k < c->nworkers; k++) {
+        ScanDeque *v = &c->dq[(id + k) % c->nworkers];
+        pthread_mutex_lock(&v->lock);
+        if (v->tail > v->head) rel = v->dirs[v->head++];
+        pthread_mutex_unlock(&v->lock);
+    }
+    return rel;
+}
+
+static void scan_fail(ScanCtx *c) {
+    __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void scan_dir(ScanCtx *c, int id, const char *rel, char *buf) {
+    int dfd = openat(c->root_fd, rel[0] ? rel : ".",
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0) {
+        // Removed or replaced since its parent was read: nothing to list
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP) scan_fail(c);
+        return;
+    }
+    DirReader r;
+#if SCAN_GETDENTS
+    r.buf = buf;
+#else
+    (void)buf;
+#endif
+    if (dr_open(&r, dfd) != 0) { scan_fail(c); return; }
+
+    size_t rlen = strlen(rel);
+    const char *name;
+    unsigned char type;
+    int more;
+    while ((more = dr_next(&r, &name, &type)) > 0) {
+        if (strcmp(name, BASE_DIR_NAME) == 0) continue;
+        if (rlen == 0 && strncmp(name, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0) continue;
+        if (type != DT_DIR && type != DT_REG && type != DT_UNKNOWN) continue;
+
+        size_t nlen = strlen(name);
+        size_t dirlen = rlen ? rlen + 1 : 0;
+        char *child = arena_alloc(&c->out[id].names, dirlen + nlen + 1);
+        if (!child) { scan_fail(c); continue; }
+        if (rlen) { memcpy(child, rel, rlen); child[rlen] = '/'; }
+        memcpy(child + dirlen, name, nlen + 1);
+        // Excluded directories are never opened, excluded files never stat'ed
+        unsigned char known = type;
+        if (known != DT_UNKNOWN && ignore_match(&g_ignore, child, type == DT_DIR)) continue;
+
+        struct stat st;
+        int have_st = 0;
+        if (type != DT_DIR) {
+            // Regular files need their stat tuple anyway; DT_UNKNOWN needs the type
+            if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                if (errno != ENOENT) scan_fail(c);
+                continue;
+            }
+            have_st = 1;
+            if (S_ISDIR(st.st_mode)) type = DT_DIR;
+            else if (!S_ISREG(st.st_mode)) continue;
+        }
+        if (known == DT_UNKNOWN && ignore_match(&g_ignore, child, type == DT_DIR)) continue;
+
+        if (type == DT_DIR) scan_enqueue(c, id, child);
+        else if (have_st)   sl_push(&c->out[id], child, (unsigned)(dirlen + nlen), (unsigned)dirlen, &st);
+    }
+    if (more < 0) scan_fail(c);
+    dr_close(&r);
+}
+
+static void *scan_worker(void *arg) {
+    ScanWorkerArg *w = arg;
+    ScanCtx *c = w->c;
+#if SCAN_GETDENTS
+    char *buf = malloc(SCAN_BUF);
+#else
+    char *buf = NULL;
+#endif
+    for (;;) {
+        const char *rel = scan_dequeue(c, w->id);
+        if (rel) {
+            scan_dir(c, w->id, rel, buf);
+            __atomic_fetch_sub(&c->pending, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&c->pending, __ATOMIC_ACQUIRE) == 0) break;
+        struct timespec ts = {0, 50000};    // others are still reading: wait for spill-over
+        nanosleep(&ts, NULL);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Every regular file under root with its stat tuple, sorted by path. NULL
+// when part of the tree could not be read: the files a partial list misses
+// would look deleted.
+static ScanList *scan_tree(const char *root) {
+    ScanCtx c;
+    memset(&c, 0, sizeof(c));
+    c.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (c.root_fd < 0) return NULL;
+    ScanList *res = calloc(1, sizeof(ScanList));
+
+    c.nworkers = pool_jobs();
+    c.dq  = calloc(c.nworkers, sizeof(ScanDeque));
+    c.out = calloc(c.nworkers, sizeof(ScanList));
+    for (int i = 0; i < c.nworkers; i++) pthread_mutex_init(&c.dq[i].lock, NULL);
+    scan_enqueue(&c, 0, "");
+
+    ScanWorkerArg *args = malloc(c.nworkers * sizeof(ScanWorkerArg));
+    pthread_t *tids = malloc(c.nworkers * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; i < c.nworkers; i++) {
+        args[i].c = &c;
+        args[i].id = i;
+        if (pthread_create(&tids[started], NULL, scan_worker, &args[i]) == 0) started++;
+    }
+    args[0].c = &c;
+    args[0].id = 0;
+    scan_worker(&args[0]);      // the caller is worker 0
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    int total = 0;
+    for (int i = 0; i < c.nworkers; i++) total += c.out[i].count;
+    res->cap = total ? total : 1;
+    res->e   = malloc(res->cap * sizeof(ScanEntry));
+    for (int i = 0; i < c.nworkers; i++) {
+        memcpy(res->e + res->count, c.out[i].e, c.out[i].count * sizeof(ScanEntry));
+        res->count += c.out[i].count;
+        arena_adopt(&res->names, &c.out[i].names);
+        free(c.out[i].e);
+        free(c.dq[i].dirs);
+        pthread_mutex_destroy(&c.dq[i].lock);
+    }
+    qsort(res->e, res->count, sizeof(ScanEntry), se_cmp);
+
+    free(args);
+    free(tids);
+    free(c.dq);
+    free(c.out);
+    close(c.root_fd);
+    if (c.failed) { scan_free(res); return NULL; }
+    return res;
+}
+
+// Stat just rels (rmt watch); paths that are not regular files, or that the
+// ignore rules exclude, are left out. NULL, as for scan_tree, when one of
+// them exists but cannot be stat'ed.
+static ScanList *scan_paths(const char *root, char **rels, int count) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return NULL;
+    ScanList *res = calloc(1, sizeof(ScanList));
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (ignore_path(&g_ignore, rels[i])) continue;
+        if (fstatat(root_fd, rels[i], &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno == ENOENT || errno == ENOTDIR) continue;
+            close(root_fd);
+            scan_free(res);
+            return NULL;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        size_t len = strlen(rels[i]);
+        const char *slash = strrchr(rels[i], '/');
+        const char *rel = arena_strndup(&res->names, rels[i], len);
+        if (!rel) { close(root_fd); scan_free(res); return NULL; }
+        sl_push(res, rel, (unsigned)len, slash ? (unsigned)(slash - rels[i] + 1) : 0, &st);
+    }
+    close(root_fd);
+    qsort(res->e, res->count, sizeof(ScanEntry), se_cmp);
+    return res;
+}
+
+
+// Write rels as a NUL-separated list to a fresh temp file (name in path).
+static int write_nul_list(char **rels, int count, char *path) {
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); return -1; }
+    FILE *lf = fdopen(fd, "w");
+    if (!lf) { close(fd); unlink(path); return -1; }
+    for (int i = 0; i < count; i++) fwrite(rels[i], 1, strlen(rels[i]) + 1, lf);
+    if (fclose(lf) != 0) { unlink(path); return -1; }
+    return 0;
+}
+
+// Mark ok[i] for every rel named in a list of confirmed paths (rels sorted).
+static void mark_confirmed(char **rels, int count, int *ok, char *out, size_t len, char sep) {
+    char *p = out, *end = out + len;
+    while (p < end) {
+        char *nl = memchr(p, sep, (size_t)(end - p));
+        if (!nl) nl = end;
+        *nl = '\0';
+        char **hit = bsearch(&p, rels, count, sizeof(char *), pl_cmp);
+        if (hit) ok[hit - rels] = 1;
+        p = nl + 1;
+    }
+}
+
+// Rebuild the manifest after a full pull: every local file was just copied
+// from the remote with rsync -a, so its size/mtime are also the remote's.
+// Each file's content becomes its base; only objects the store lacks are written.
+static int manifest_rebuild(const char *local_root) {
+    ScanList *files = scan_tree(local_root);
+    if (!files) { fprintf(stderr, "Cannot read %s\n", local_root); return -1; }
+    Manifest mf;
+    manifest_init(&mf);
+
+    if (files->count > 0) progress_begin("Indexing", files->count, 0);
+    for (int i = 0; i < files->count; i++) {
+        progress_add(1, 0);
+        const char *rel = files->e[i].rel;
+        char full[MAX_PATH_LEN];
+        snprintf(full, sizeof(full), "%s/%s", local_root, rel);
+
+        FileStat fs = files->e[i].st;
+        Digest h;
+        if (hash_file(full, g_hash_algo, &h) != 0) continue;
+        struct stat st;
+        if (object_touch(&h) != 0) {
+            if (object_store(full, &h, &st) != 0) {
+                fprintf(stderr, "\nWarning: could not store base of %s\n", rel);
+                continue;
+            }
+            filestat_from(&fs, &st);
+        }
+
+        ManifestEntry *e = manifest_get(&mf, rel);
+        manifest_set_local(e, &fs);
+        e->hash     = h;
+        e->has_hash = 1;
+        e->rsize    = fs.size;
+        e->rmtime   = fs.mtime_s;
+    }
+    if (files->count > 0) progress_end();
+
+    int rc = manifest_save(local_root, &mf);
+    manifest_free(&mf);
+    scan_free(files);
+    return rc;
+}
+
+// Mounts created before the object store kept a full copy of the tree in
+// <mount>/.rmt-base. Move those bases into the store, then drop the copy.
+static void base_migrate_legacy(const char *local_root, Manifest *mf) {
+    char legacy[MAX_PATH_LEN];
+    snprintf(legacy, sizeof(legacy), "%s/%s", local_root, BASE_DIR_NAME);
+    struct stat st;
+    if (stat(legacy, &st) != 0 || !S_ISDIR(st.st_mode)) return;
+
+    printf("Moving %s into the shared object store...\n", BASE_DIR_NAME);
+    ScanList *files = scan_tree(legacy);
+    if (!files) {
+        fprintf(stderr, "Warning: could not migrate %s, leaving it in place\n", legacy);
+        return;
+    }
+    int failed = 0;
+    for (int i = 0; i < files->count; i++) {
+        char old[MAX_PATH_LEN];
+        snprintf(old, sizeof(old), "%s/%s", legacy, files->e[i].rel);
+        Digest d;
+        struct stat ost;
+        if (object_store(old, &d, &ost) != 0) { failed++; continue; }
+        ManifestEntry *e = manifest_get(mf, files->e[i].rel);
+        if (!e->has_hash || !digest_eq(&d, &e->hash)) {
+            // The base copy is what the last sync agreed on; it wins.
+            e->hash     = d;
+            e->has_hash = 1;
+            e->mtime_s  = -1;       // force a content check of the local file
+        }
+        mf->dirty = 1;
+    }
+    scan_free(files);
+    if (failed > 0 || (mf->dirty && manifest_save(local_root, mf) != 0)) {
+        fprintf(stderr, "Warning: could not migrate %s, leaving it in place\n", legacy);
+        return;
+    }
+
+    char *q = shell_quote(legacy);
+    if (q) {
+        char cmd[MAX_PATH_LEN * 2 + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", q);
+        run_system(cmd);
+        free(q);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Remote listing — one ssh round trip for path/size/mtime of every remote
+// file, so only files that changed since base are ever transferred.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char *rel;          // points into the list's capture buffer
+    long long size;
+    long long mtime;
+    Digest hash;
+    int has_hash;
+    int fetched;        // copy present in the sync's tmp dir
+} RemoteEntry;
+
+typedef struct { RemoteEntry *e; int count; int cap; char *buf; } RemoteList;
+
+static int g_remote_hash = 0;   // --remote-hash: ask the remote to hash recent files
+
+// Remote mtimes come from the remote clock; hash a margin before the last sync
+#define REMOTE_HASH_SKEW 300
+
+static int re_cmp(const void *a, const void *b) {
+    return strcmp(((const RemoteEntry *)a)->rel, ((const RemoteEntry *)b)->rel);
+}
+
+static RemoteEntry *rl_find(RemoteList *rl, const char *rel) {
+    RemoteEntry key;
+    key.rel = (char *)rel;
+    return bsearch(&key, rl->e, rl->count, sizeof(RemoteEntry), re_cmp);
+}
+
+static void rl_free(RemoteList *rl) {
+    free(rl->e);
+    free(rl->buf);
+    memset(rl, 0, sizeof(*rl));
+}
+
+// Drop the entries the ignore rules exclude; the list stays sorted.
+static void rl_apply_ignore(RemoteList *rl) {
+    if (g_ignore.count == 0) return;
+    int n = 0;
+    for (int i = 0; i < rl->count; i++)
+        if (!ignore_path(&g_ignore, rl->e[i].rel)) rl->e[n++] = rl->e[i];
+    rl->count = n;
+}
+
+static const char *strip_dot_slash(const char *p) {
+    while (p[0] == '.' && p[1] == '/') p += 2;
+    return p;
+}
+
+// Parse "<size> <mtime[.frac]> <path>\0" records, then after a "#hash\0"
+// marker optional "<sha256>  <path>\0" records from sha256sum -z.
+// Takes ownership of buf; entry paths point into it.
+static void rl_parse(RemoteList *rl, char *buf, size_t len) {
+    rl->buf = buf;
+    int in_hashes = 0;
+    char *p = buf, *end = buf + len;
+    while (p < end) {
+        char *rec = p;
+        size_t rlen = strnlen(rec, (size_t)(end - p));
+        p += rlen + 1;
+        if (rlen == 0) continue;
+        if (strcmp(rec, "#hash") == 0) {
+            qsort(rl->e, rl->count, sizeof(RemoteEntry), re_cmp);
+            in_hashes = 1;
+            continue;
+        }
+
+        if (in_hashes) {
+            char *sp = strstr(rec, "  ");
+            if (!sp || sp - rec != 64) continue;
+            *sp = '\0';
+            RemoteEntry *re = rl_find(rl, strip_dot_slash(sp + 2));
+            if (!re) continue;
+            char tagged[80];
+            snprintf(tagged, sizeof(tagged), "sha256:%s", rec);
+            re->has_hash = (digest_parse(tagged, &re->hash) == 0);
+            continue;
+        }
+
+        char *end1, *end2;
+        long long size  = strtoll(rec, &end1, 10);
+        if (*end1 != ' ') continue;
+        long long mtime = strtoll(end1 + 1, &end2, 10);
+        while (*end2 && *end2 != ' ') end2++;   // skip fractional seconds
+        if (*end2 != ' ') continue;
+        char *rel = (char *)strip_dot_slash(end2 + 1);
+        if (!*rel) continue;
+        if (strncmp(rel, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0 && !strchr(rel, '/')) continue;
+
+        if (rl->count == rl->cap) {
+            rl->cap = rl->cap ? rl->cap * 2 : 256;
+            rl->e = realloc(rl->e, rl->cap * sizeof(RemoteEntry));
+        }
+        RemoteEntry *re = &rl->e[rl->count++];
+        memset(re, 0, sizeof(*re));
+        re->rel   = rel;
+        re->size  = size;
+        re->mtime = mtime;
+    }
+    if (!in_hashes) qsort(rl->e, rl->count, sizeof(RemoteEntry), re_cmp);
+}
+
+// List every regular file under the remote root. Uses GNU find -printf when
+// available and BSD stat otherwise, so nothing needs installing remotely.
+// hash_since > 0 also requests sha256 of files modified after that time
+// (only useful, and only done, with --hash=sha256).
+// Only rels[0..count) when rels is non-NULL; missing paths are simply absent.
+static int remote_list(const char *remote_spec, long long hash_since,
+                       char **rels, int count, RemoteList *rl) {
+    memset(rl, 0, sizeof(*rl));
+    char host[MAX_PATH_LEN], rpath[MAX_PATH_LEN];
+    if (split_remote_spec(remote_spec, host, sizeof(host), rpath, sizeof(rpath)) != 0) return -1;
+
+    char *qpath = shell_quote(rpath);
+    if (!qpath) return -1;
+
+    char list[MAX_PATH_LEN] = "";
+    char script[MAX_PATH_LEN * 2 + 1024];
+    int n;
+    if (rels) {
+        // Paths arrive NUL-separated on stdin and are prefixed with ./ so
+        // none of them can be taken for a find option.
+        snprintf(list, sizeof(list), "/tmp/rmt_list_XXXXXX");
+        if (write_nul_list(rels, count, list) != 0) { free(qpath); return -1; }
+        // Missing paths are skipped up front, so any error left is a real one.
+        n = snprintf(script, sizeof(script),
+            "cd %s || exit 3; "
+            "if find . -maxdepth 0 -printf '' >/dev/null 2>&1; then "
+              "xargs -0 sh -c 'for f; do [ -e \"./$f\" ] && set -- \"$@\" \"./$f\"; shift; done; "
+                "[ $# -eq 0 ] || find \"$@\" -maxdepth 0 -type f -printf \"%%s %%T@ %%p\\0\"' sh; "
+              "rc=$?; "
+            "else "
+              "exec 4>&1; "
+              "rc=$({ { xargs -0 sh -c 'for f; do [ -f \"./$f\" ] || continue; "
+                "stat -f \"%%z %%m %%N\" \"./$f\" || exit 1; done' sh; echo $? >&3; }"
+                " | tr '\\n' '\\0' >&4; } 3>&1); "
+            "fi",
+            qpath);
+        hash_since = 0;
+    } else {
+        if (g_hash_algo != HASH_SHA256) hash_since = 0;
+        n = snprintf(script, sizeof(script),
+            "cd %s || exit 3; "
+            "if find . -maxdepth 0 -printf '' >/dev/null 2>&1; then "
+              "find . -name %s -prune -o -type f -printf '%%s %%T@ %%P\\0'; rc=$?; "
+            "else "
+              "exec 4>&1; "
+              "rc=$({ { find . -name %s -prune -o -type f -exec stat -f '%%z %%m %%N' {} +; echo $? >&3; }"
+                " | tr '\\n' '\\0' >&4; } 3>&1); "
+            "fi",
+            qpath, BASE_DIR_NAME, BASE_DIR_NAME);
+    }
+    free(qpath);
+    if (n < 0 || (size_t)n >= sizeof(script)) { if (list[0]) unlink(list); return -1; }
+    // The hashes are an optimisation and may come up short; the listing may
+    // not, since a path it misses is taken as deleted remotely. The script
+    // exits with the listing's own status, which a pipe would otherwise hide.
+    if (hash_since > 0)
+        n += snprintf(script + n, sizeof(script) - (size_t)n,
+            "; printf '#hash\\0'; "
+            "find . -name %s -prune -o -type f -newermt @%lld -print0 2>/dev/null"
+            " | xargs -0 sha256sum -z 2>/dev/null",
+            BASE_DIR_NAME, hash_since);
+    if ((size_t)n >= sizeof(script) - 16) { if (list[0]) unlink(list); return -1; }
+    snprintf(script + n, sizeof(script) - (size_t)n, "; exit $rc");
+
+    char *qhost   = shell_quote(host);
+    char *qscript = shell_quote(script);
+    if (!qhost || !qscript) { free(qhost); free(qscript); return -1; }
+    char *cmd = malloc(strlen(ssh_cmd()) + strlen(qhost) + strlen(qscript) + sizeof(list) + 48);
+    sprintf(cmd, "%s %s %s 2>/dev/null < %s", ssh_cmd(), qhost, qscript, list[0] ? list : "/dev/null");
+    free(qhost);
+    free(qscript);
+
+    size_t len;
+    int status;
+    char *buf = run_capture(cmd, NULL, &len, &status);
+    free(cmd);
+    if (list[0]) unlink(list);
+    if (!buf) return -1;
+    if (status != 0) { free(buf); return -1; }
+
+    rl_parse(rl, buf, len);
+    return 0;
+}
+
+// Fetch the given remote paths into dst in one rsync --files-from transfer.
+static int rsync_fetch_files(const char *remote_spec, const char *dst,
+                             char **rels, int count) {
+    if (count == 0) return 0;
+
+    char list[] = "/tmp/rmt_files_XXXXXX";
+    if (write_nul_list(rels, count, list) != 0) return -1;
+
+    char *remote_arg = rsync_escape_remote_spec_legacy(remote_spec);
+    char *qremote = remote_arg ? shell_quote(remote_arg) : NULL;
+    char *qdst    = shell_quote(dst);
+    free(remote_arg);
+    if (!qremote || !qdst) { free(qremote); free(qdst); unlink(list); return -1; }
+
+    // Local copies about to be replaced stand in for the remote content
+    CompPlan plan;
+    comp_plan(&plan, remote_spec, dst, rels, count);
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd),
+             "rsync -a --stats %s%s%s--files-from=%s --from0 %s/ %s/ 2>/dev/null",
+             comp_rsync_opts(&plan), rsync_progress_opt(), rsync_rsh(), list, qremote, qdst);
+    free(qremote);
+    free(qdst);
+
+    char label[64];
+    snprintf(label, sizeof(label), "Fetching %d changed file%s", count, count == 1 ? "" : "s");
+    size_t len;
+    int status;
+    comp_begin(&plan);
+    char *out = run_capture(cmd, label, &len, &status);
+    unlink(list);
+    if (!out) return -1;
+    comp_end(&plan, out, 0);
+    free(out);
+    return status == 0 ? 0 : -1;
+}
+
+// Push rels (relative to local_root, sorted) in one rsync --files-from
+// transfer; rsync creates any missing parent directories itself. ok[i] is
+// set for each file the transfer is known to have delivered.
+static int rsync_push_files(const char *local_root, const char *remote_spec,
+                            char **rels, int count, int *ok) {
+    char list[] = "/tmp/rmt_files_XXXXXX";
+    if (write_nul_list(rels, count, list) != 0) return -1;
+
+    char *remote_arg = rsync_escape_remote_spec_legacy(remote_spec);
+    char *qremote = remote_arg ? shell_quote(remote_arg) : NULL;
+    char *qlocal  = shell_quote(local_root);
+    free(remote_arg);
+    if (!qremote || !qlocal) { free(qremote); free(qlocal); unlink(list); return -1; }
+
+    CompPlan plan;
+    comp_plan(&plan, remote_spec, local_root, rels, count);
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd),
+             "rsync -a --stats %s%s%s--files-from=%s --from0 --out-format=%%n %s/ %s/ 2>/dev/null",
+             comp_rsync_opts(&plan), rsync_progress_opt(), rsync_rsh(), list, qlocal, qremote);
+    free(qremote);
+    free(qlocal);
+
+    char label[64];
+    snprintf(label, sizeof(label), "Pushing %d file%s", count, count == 1 ? "" : "s");
+    size_t len;
+    int status;
+    comp_begin(&plan);
+    char *out = run_capture(cmd, label, &len, &status);
+    unlink(list);
+    if (!out) return -1;
+    comp_end(&plan, out, 1);
+
+    // Exit 0 means everything arrived; on a partial failure trust only the
+    // names rsync reported as transferred.
+    if (status == 0) for (int i = 0; i < count; i++) ok[i] = 1;
+    else             mark_confirmed(rels, count, ok, out, len, '\n');
+    free(out);
+    return status;
+}
+
+// Delete rels on the remote in a single ssh session fed a NUL-separated
+// list on stdin. The remote echoes each path it removed so ok[i] is exact.
+static int ssh_delete_files(const char *remote_spec, char **rels, int count, int *ok) {
+    char host[MAX_PATH_LEN], rpath[MAX_PATH_LEN];
+    if (split_remote_spec(remote_spec, host, sizeof(host), rpath, sizeof(rpath)) != 0) return -1;
+
+    char list[] = "/tmp/rmt_files_XXXXXX";
+    if (write_nul_list(rels, count, list) != 0) return -1;
+
+    char *qpath = shell_quote(rpath);
+    if (!qpath) { unlink(list); return -1; }
+    char script[MAX_PATH_LEN * 2 + 256];
+    snprintf(script, sizeof(script),
+             "cd %s || exit 3; "
+             "xargs -0 sh -c 'for f; do rm -f -- \"$f\" && printf \"%%s\\0\" \"$f\"; done' sh",
+             qpath);
+    free(qpath);
+
+    char *qhost   = shell_quote(host);
+    char *qscript = shell_quote(script);
+    if (!qhost || !qscript) { free(qhost); free(qscript); unlink(list); return -1; }
+    char *cmd = malloc(strlen(ssh_cmd()) + strlen(qhost) + strlen(qscript) + sizeof(list) + 32);
+    sprintf(cmd, "%s %s %s < %s 2>/dev/null", ssh_cmd(), qhost, qscript, list);
+    free(qhost);
+    free(qscript);
+
+    size_t len;
+    int status;
+    char *out = run_capture(cmd, "Deleting on remote", &len, &status);
+    free(cmd);
+    unlink(list);
+    if (!out) return -1;
+    mark_confirmed(rels, count, ok, out, len, '\0');
+    free(out);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Remote agent — `rmt serve <root>` started once per remote over ssh. The
+// two sides exchange length-prefixed frames on the agent's stdin/stdout:
+//   u32 payload length (big-endian), u8 op, payload
+// Requests are pipelined and answered in order, each with AG_OK or AG_ERR
+// (file reads send their contents as AG_DATA frames first), so listing,
+// fetching, pushing or deleting thousands of files costs a few round trips
+// and no remote process spawns. Files that have a base on the receiving
+// side travel as deltas against it. Without an agent on the remote every
+// operation falls back to the rsync and shell commands above.
+// ---------------------------------------------------------------------------
+
+#define AGENT_PROTO     2                   // 2: chunked transfers
+#define AGENT_PROTO_MIN 1
+#define AGENT_CHUNK     (1 << 20)           // file data per AG_DATA frame
+#define AGENT_WINDOW    (256 * 1024)        // requests queued ahead of the agent
+#define AGENT_MAX_FRAME (1u << 30)
+
+enum {
+    AG_HELLO = 1,   // -> OK u32 proto, str version
+    AG_LIST,        // u8 algo, u64 hash_since, u8 subset, [u32 n, str rel...]
+                    // -> OK u32 n, n x (str rel, u64 size, u64 mtime, u8 hlen, hash)
+    AG_READ,        // str rel -> DATA..., OK u64 mtime_s, u32 mtime_ns, u32 mode
+    AG_WRITE,       // str rel, u32 mode, u64 mtime_s, u32 mtime_ns; DATA...; END
+    AG_DATA,        // raw bytes
+    AG_END,         // u8 complete -> OK once the file is renamed into place
+    AG_MKDIR,       // str rel
+    AG_DELETE,      // str rel (already absent counts as deleted)
+    AG_RENAME,      // str from, str to
+    AG_PATCH,       // str rel, u32 mode, u64 mtime_s, u32 mtime_ns, digest; DATA (delta)...;
+                    // END -> OK once the delta, applied to the current file, gave digest
+    AG_READ_DELTA,  // str rel, signature -> DATA..., OK u64 mtime_s, u32 mtime_ns,
+                    // u32 mode, u64 size, u8 is_delta, digest (when is_delta)
+    AG_CHUNK_SUMS,  // str rel, u32 chunk -> OK u64 size, u64 mtime_s, u32 mtime_ns,
+                    // u32 mode, u32 n, n x digest
+    AG_READ_RANGE,  // str rel, u64 off, u64 len -> DATA..., OK
+    AG_STAGE,       // str rel, u64 size -> OK str tmp: a copy of rel (or nothing) at size
+    AG_WRITE_RANGE, // str tmp, u64 off, digest; DATA...; END -> OK once written, data = digest
+    AG_COMMIT,      // str tmp, str rel, u32 mode, u64 mtime_s, u32 mtime_ns, u32 chunk,
+                    // digest -> OK once tmp's chunk_root is digest and it replaced rel
+    AG_OK = 100,
+    AG_ERR          // str message
+};
+
+static const char *g_agent_bin = "rmt";    // --agent=PATH: rmt on the remote
+static int g_agent_off = 0;                // --no-agent
+
+typedef struct { unsigned char *b; size_t len, cap, off; } Buf;
+
+static void buf_reserve(Buf *b, size_t n) {
+    if (b->len + n <= b->cap) return;
+    b->cap = (b->len + n) * 2;
+    b->b = realloc(b->b, b->cap);
+}
+
+static void buf_put(Buf *b, const void *p, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->b + b->len, p, n);
+    b->len += n;
+}
+
+static void buf_u8(Buf *b, unsigned v) {
+    unsigned char c = (unsigned char)v;
+    buf_put(b, &c, 1);
+}
+
+static void buf_u32(Buf *b, uint32_t v) {
+    unsigned char c[4] = { v >> 24, v >> 16, v >> 8, v };
+    buf_put(b, c, 4);
+}
+
+static void buf_u64(Buf *b, uint64_t v) {
+    buf_u32(b, (uint32_t)(v >> 32));
+    buf_u32(b, (uint32_t)v);
+}
+
+// Strings travel with their NUL so the reader can point into the frame
+static void buf_str(Buf *b, const char *s) {
+    size_t n = strlen(s);
+    buf_u32(b, (uint32_t)n);
+    buf_put(b, s, n + 1);
+}
+
+static size_t frame_begin(Buf *b, int op) {
+    size_t at = b->len;
+    buf_u32(b, 0);
+    buf_u8(b, (unsigned)op);
+    return at;
+}
+
+static void frame_end(Buf *b, size_t at) {
+    uint32_t n = (uint32_t)(b->len - at - 5);
+    b->b[at] = n >> 24; b->b[at + 1] = n >> 16; b->b[at + 2] = n >> 8; b->b[at + 3] = n;
+    if ((unsigned char)b->b[at + 4] == AG_DATA) progress_add(0, n);  // file data going out
+}
+
+typedef struct { const unsigned char *p, *end; int bad; } Rd;
+
+static uint32_t rd_u32(Rd *r) {
+    if (r->end - r->p < 4) { r->bad = 1; return 0; }
+    uint32_t v = (uint32_t)r->p[0] << 24 | (uint32_t)r->p[1] << 16 | (uint32_t)r->p[2] << 8 | r->p[3];
+    r->p += 4;
+    return v;
+}
+
+static uint64_t rd_u64(Rd *r) {
+    uint64_t hi = rd_u32(r);
+    return hi << 32 | rd_u32(r);
+}
+
+static unsigned rd_u8(Rd *r) {
+    if (r->p >= r->end) { r->bad = 1; return 0; }
+    return *r->p++;
+}
+
+static const char *rd_str(Rd *r) {
+    uint32_t n = rd_u32(r);
+    if (r->bad || (size_t)(r->end - r->p) < (size_t)n + 1 || r->p[n] != '\0') { r->bad = 1; return ""; }
+    const char *s = (const char *)r->p;
+    r->p += n + 1;
+    return s;
+}
+
+// Next complete frame in `in`: 1 with op and payload set, 0 if more input
+// is needed, -1 on a malformed stream. Payloads stay valid until frame_fill.
+static int frame_next(Buf *in, int *op, Rd *payload) {
+    size_t avail = in->len - in->off;
+    if (avail < 5) return 0;
+    const unsigned char *h = in->b + in->off;
+    uint32_t n = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+    if (n > AGENT_MAX_FRAME) return -1;
+    if (avail < 5 + (size_t)n) return 0;
+    *op = h[4];
+    payload->p   = h + 5;
+    payload->end = h + 5 + n;
+    payload->bad = 0;
+    in->off += 5 + n;
+    return 1;
+}
+
+static ssize_t frame_fill(Buf *in, int fd) {
+    if (in->off == in->len) {
+        in->off = in->len = 0;
+    } else if (in->off > 0) {
+        memmove(in->b, in->b + in->off, in->len - in->off);
+        in->len -= in->off;
+        in->off = 0;
+    }
+    buf_reserve(in, 1 << 16);
+    ssize_t n;
+    do n = read(fd, in->b + in->len, in->cap - in->len); while (n < 0 && errno == EINTR);
+    if (n > 0) in->len += (size_t)n;
+    return n;
+}
+
+static int write_full(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n > 0) {
+        ssize_t w = write(fd, c, n);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        c += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static void buf_digest(Buf *b, const Digest *d) {
+    buf_u8(b, (unsigned)d->algo);
+    buf_u8(b, (unsigned)d->len);
+    buf_put(b, d->b, (size_t)d->len);
+}
+
+static void rd_digest(Rd *r, Digest *d) {
+    memset(d, 0, sizeof(*d));
+    d->algo = rd_u8(r) == HASH_SHA256 ? HASH_SHA256 : HASH_FAST;
+    d->len  = (int)rd_u8(r);
+    if (r->bad || d->len > (int)sizeof(d->b) || r->end - r->p < d->len) { r->bad = 1; d->len = 0; return; }
+    memcpy(d->b, r->p, (size_t)d->len);
+    r->p += d->len;
+}
+
+// --- delta encoding ---
+// A changed file travels as copy/insert ops against a version the receiver
+// already has. That basis is cut into fixed blocks indexed by a rolling
+// checksum and a strong hash; the new version is scanned a byte at a time,
+// so inserted or deleted bytes shift later matches instead of breaking them.
+
+#define DELTA_MIN       (64 * 1024)     // smaller files are always sent whole
+#define DELTA_OP_COPY   1               // u64 offset, u32 len: bytes of the basis
+#define DELTA_OP_INSERT 2               // u32 len, then the bytes
+
+typedef struct {
+    uint32_t block;
+    uint32_t count;
+    uint32_t *weak;
+    uint64_t *strong;
+    uint32_t *index;    // open addressing on weak: block + 1, 0 = empty
+    uint32_t index_cap;
+} DeltaSig;
+
+// About sqrt(size) sized blocks, at most 64k of them
+static uint32_t delta_block_size(size_t size) {
+    uint32_t b = 2048;
+    while (b < (1u << 20) && size / b > 65536) b <<= 1;
+    return b;
+}
+
+static uint32_t delta_weak(const unsigned char *p, uint32_t n) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < n; i++) { a += p[i]; b += (n - i) * p[i]; }
+    return (a & 0xffff) | (b << 16);
+}
+
+// First 8 bytes of the fast hash, read big-endian so both ends agree
+static uint64_t delta_strong(const unsigned char *p, size_t n) {
+    Hasher h;
+    Digest d;
+    hasher_init(&h, HASH_FAST);
+    hasher_update(&h, p, n);
+    hasher_final(&h, &d);
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | d.b[i];
+    return v;
+}
+
+static uint32_t delta_slot(const DeltaSig *s, uint32_t weak) {
+    return (weak * 0x9E3779B1u) & (s->index_cap - 1);
+}
+
+static void delta_sig_index(DeltaSig *s) {
+    s->index_cap = 16;
+    while (s->index_cap < s->count * 2) s->index_cap <<= 1;
+    s->index = calloc(s->index_cap, sizeof(uint32_t));
+    for (uint32_t i = 0; i < s->count; i++) {
+        uint32_t slot = delta_slot(s, s->weak[i]);
+        while (s->index[slot]) slot = (slot + 1) & (s->index_cap - 1);
+        s->index[slot] = i + 1;
+    }
+}
+
+static void delta_sig_alloc(DeltaSig *s, uint32_t block, uint32_t count) {
+    s->block  = block;
+    s->count  = count;
+    s->weak   = malloc((count ? count : 1) * sizeof(uint32_t));
+    s->strong = malloc((count ? count : 1) * sizeof(uint64_t));
+}
+
+static void delta_sig_make(const unsigned char *basis, size_t len, DeltaSig *s) {
+    uint32_t block = delta_block_size(len);
+    delta_sig_alloc(s, block, (uint32_t)(len / block));
+    for (uint32_t i = 0; i < s->count; i++) {
+        s->weak[i]   = delta_weak(basis + (size_t)i * block, block);
+        s->strong[i] = delta_strong(basis + (size_t)i * block, block);
+    }
+    delta_sig_index(s);
+}
+
+static void delta_sig_free(DeltaSig *s) {
+    free(s->weak);
+    free(s->strong);
+    free(s->index);
+    memset(s, 0, sizeof(*s));
+}
+
+static void delta_sig_put(Buf *b, const DeltaSig *s) {
+    buf_u32(b, s->block);
+    buf_u32(b, s->count);
+    for (uint32_t i = 0; i < s->count; i++) {
+        buf_u32(b, s->weak[i]);
+        buf_u64(b, s->strong[i]);
+    }
+}
+
+static int delta_sig_get(Rd *r, DeltaSig *s) {
+    uint32_t block = rd_u32(r), count = rd_u32(r);
+    if (r->bad || block == 0 || (size_t)(r->end - r->p) / 12 < count) return -1;
+    delta_sig_alloc(s, block, count);
+    for (uint32_t i = 0; i < count; i++) {
+        s->weak[i]   = rd_u32(r);
+        s->strong[i] = rd_u64(r);
+    }
+    delta_sig_index(s);
+    return 0;
+}
+
+// Pending COPY, so runs of matching blocks become a single op
+typedef struct { Buf *out; uint64_t off, len; } DeltaOut;
+
+static void delta_flush_copy(DeltaOut *d) {
+    if (!d->len) return;
+    buf_u8(d->out, DELTA_OP_COPY);
+    buf_u64(d->out, d->off);
+    buf_u32(d->out, (uint32_t)d->len);
+    d->len = 0;
+}
+
+static void delta_insert(DeltaOut *d, const unsigned char *p, size_t n) {
+    delta_flush_copy(d);
+    while (n > 0) {
+        uint32_t k = n > AGENT_CHUNK ? AGENT_CHUNK : (uint32_t)n;
+        buf_u8(d->out, DELTA_OP_INSERT);
+        buf_u32(d->out, k);
+        buf_put(d->out, p, k);
+        p += k;
+        n -= k;
+    }
+}
+
+static void delta_copy(DeltaOut *d, uint64_t off, uint64_t len) {
+    if (d->len && d->off + d->len == off && d->len + len <= 0xffffffffu) { d->len += len; return; }
+    delta_flush_copy(d);
+    d->off = off;
+    d->len = len;
+}
+
+// Append to out the ops that rebuild data[0..n) from the basis behind sig.
+static void delta_make(const DeltaSig *s, const unsigned char *data, size_t n, Buf *out) {
+    DeltaOut d = { out, 0, 0 };
+    size_t B = s->block, pos = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    int fresh = 1;
+    while (s->count > 0 && pos + B <= n) {
+        if (fresh) {
+            uint32_t w = delta_weak(data + pos, (uint32_t)B);
+            a = w & 0xffff;
+            b = w >> 16;
+            fresh = 0;
+        }
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        uint64_t strong = 0;
+        int have = 0;
+        long match = -1;
+        for (uint32_t slot = delta_slot(s, weak); s->index[slot]; slot = (slot + 1) & (s->index_cap - 1)) {
+            uint32_t blk = s->index[slot] - 1;
+            if (s->weak[blk] != weak) continue;
+            if (!have) { strong = delta_strong(data + pos, B); have = 1; }
+            if (s->strong[blk] == strong) { match = (long)blk; break; }
+        }
+        if (match >= 0) {
+            if (pos > lit) delta_insert(&d, data + lit, pos - lit);
+            delta_copy(&d, (uint64_t)match * B, B);
+            pos += B;
+            lit = pos;
+            fresh = 1;
+            continue;
+        }
+        if (pos + B < n) {
+            unsigned char o = data[pos], in = data[pos + B];
+            a = a - o + in;
+            b = b - (uint32_t)B * o + a;
+        }
+        pos++;
+    }
+    if (n > lit) delta_insert(&d, data + lit, n - lit);
+    delta_flush_copy(&d);
+}
+
+// Write the file that delta rebuilds from basis to fd, hashing it into h.
+static int delta_apply(const unsigned char *basis, size_t blen,
+                       const unsigned char *delta, size_t dlen, int fd, Hasher *h) {
+    Rd r = { delta, delta + dlen, 0 };
+    while (r.p < r.end) {
+        unsigned op = rd_u8(&r);
+        const unsigned char *src;
+        uint32_t len;
+        if (op == DELTA_OP_COPY) {
+            uint64_t off = rd_u64(&r);
+            len = rd_u32(&r);
+            if (r.bad || off > blen || len > blen - off) return -1;
+            src = basis + off;
+        } else if (op == DELTA_OP_INSERT) {
+            len = rd_u32(&r);
+            if (r.bad || (size_t)(r.end - r.p) < len) return -1;
+            src = r.p;
+            r.p += len;
+        } else {
+            return -1;
+        }
+        if (write_full(fd, src, len) != 0) return -1;
+        hasher_update(h, src, len);
+    }
+    return 0;
+}
+
+// --- chunked transfer ---
+// A file of CHUNK_MIN or more is cut into CHUNK_SIZE pieces. The pieces go
+// over several agent connections at once, each on its own ssh and TCP
+// stream, so one large file is not limited to what a single stream gets
+// out of a long, fat link. Both sides hash every piece, and only pieces
+// that differ from the destination's copy are sent. They land in a staging
+// file, which replaces the old file once every piece checks out.
+
+#define CHUNK_SIZE    (8u << 20)
+#define CHUNK_MIN     (64LL << 20)
+#define CHUNK_STREAMS 4
+
+static int g_streams = CHUNK_STREAMS;  // --streams=N: connections per chunked transfer
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    uint32_t chunk;
+    Digest *d;
+} ChunkSumCtx;
+
+static int chunk_sum_one(void *arg, int i) {
+    ChunkSumCtx *c = arg;
+    size_t off = (size_t)i * c->chunk;
+    size_t n = c->len - off < c->chunk ? c->len - off : c->chunk;
+    Hasher h;
+    hasher_init(&h, HASH_FAST);
+    hasher_update(&h, c->data + off, n);
+    hasher_final(&h, &c->d[i]);
+    return 0;
+}
+
+// Fast hash of each chunk-byte piece of path (the last may be short),
+// computed on the pool. *sums is malloc'd, or NULL for an empty file.
+static int chunk_sums(const char *path, uint32_t chunk, Digest **sums, uint32_t *n,
+                      long long *size) {
+    MappedFile mf;
+    *sums = NULL;
+    *n = 0;
+    if (map_file(path, &mf) != 0) return -1;
+    ChunkSumCtx c = { (const unsigned char *)mf.data, mf.len, chunk, NULL };
+    uint32_t count = (uint32_t)((mf.len + chunk - 1) / chunk);
+    if (count > 0) {
+        c.d = malloc(count * sizeof(Digest));
+        pool_run(chunk_sum_one, &c, (int)count, NULL);
+    }
+    *sums = c.d;
+    *n = count;
+    if (size) *size = (long long)mf.len;
+    unmap_file(&mf);
+    return 0;
+}
+
+// What a staged file must add up to: the hash of its piece hashes
+static void chunk_root(const Digest *sums, uint32_t n, Digest *root) {
+    Hasher h;
+    hasher_init(&h, HASH_FAST);
+    for (uint32_t i = 0; i < n; i++) hasher_update(&h, sums[i].b, (size_t)sums[i].len);
+    hasher_final(&h, root);
+}
+
+// --- agent side ---
+
+// Paths from the client stay under the root
+static int agent_rel_ok(const char *rel) {
+    if (!*rel || rel[0] == '/') return 0;
+    for (const char *p = rel; p; p = strchr(p, '/') ? strchr(p, '/') + 1 : NULL)
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+    return 1;
+}
+
+static int agent_flush(Buf *out) {
+    int rc = write_full(1, out->b, out->len);
+    out->len = 0;
+    return rc;
+}
+
+static void reply_ok(Buf *out) {
+    frame_end(out, frame_begin(out, AG_OK));
+}
+
+static void reply_err(Buf *out, const char *msg) {
+    size_t at = frame_begin(out, AG_ERR);
+    buf_str(out, msg);
+    frame_end(out, at);
+}
+
+// The AG_WRITE, AG_PATCH or AG_WRITE_RANGE in progress
+typedef struct {
+    int fd;             // -1 when none
+    int err;            // errno of the first failure, data is then discarded
+    int patch;          // data is a delta against the current file
+    int range;          // data is one piece of a staging file
+    Digest want;        // what the patched file or the piece must hash to
+    Hasher h;           // the piece so far
+    Buf delta;
+    unsigned mode;
+    struct timespec times[2];
+    char dst[MAX_PATH_LEN];
+    char tmp[MAX_PATH_LEN];
+    char **staged;      // AG_STAGE files not yet committed, removed at exit
+    int nstaged;
+} AgentWrite;
+
+// Drop a write that will not be finished; a staging file outlives its pieces
+static void agent_write_abort(AgentWrite *w) {
+    if (w->fd < 0) return;
+    close(w->fd);
+    if (!w->range) unlink(w->tmp);
+    w->fd = -1;
+    w->range = 0;
+}
+
+typedef struct {
+    ScanList *sl;
+    HashAlgo algo;
+    long long since;
+    Digest *d;
+    int *has;
+} AgentHashCtx;
+
+static int agent_hash_one(void *arg, int i) {
+    AgentHashCtx *c = arg;
+    const ScanEntry *se = &c->sl->e[i];
+    if (se->st.mtime_s > c->since)
+        c->has[i] = (hash_file(se->rel, c->algo, &c->d[i]) == 0);
+    return 0;
+}
+
+static void agent_list_reply(Rd *r, Buf *out) {
+    HashAlgo algo = rd_u8(r) == HASH_SHA256 ? HASH_SHA256 : HASH_FAST;
+    long long since = (long long)rd_u64(r);
+    int subset = (int)rd_u8(r);
+    uint32_t n = subset ? rd_u32(r) : 0;
+    if (r->bad || n > (size_t)(r->end - r->p)) { reply_err(out, "bad request"); return; }
+    char **rels = malloc((n ? n : 1) * sizeof(char *));
+    for (uint32_t i = 0; i < n; i++) rels[i] = (char *)rd_str(r);
+    if (r->bad) { free(rels); reply_err(out, "bad request"); return; }
+
+    ScanList *sl = subset ? scan_paths(".", rels, (int)n) : scan_tree(".");
+    free(rels);
+    if (!sl) { reply_err(out, "cannot read the whole tree"); return; }
+    AgentHashCtx hc = { sl, algo, since, NULL, NULL };
+    if (since > 0) {
+        hc.d   = malloc((sl->count ? sl->count : 1) * sizeof(Digest));
+        hc.has = calloc(sl->count ? sl->count : 1, sizeof(int));
+        pool_run(agent_hash_one, &hc, sl->count, NULL);
+    }
+
+    size_t at = frame_begin(out, AG_OK);
+    size_t count_at = out->len;
+    buf_u32(out, 0);
+    uint32_t count = 0;
+    for (int i = 0; i < sl->count; i++) {
+        const ScanEntry *se = &sl->e[i];
+        if (!se->dirlen && strncmp(se->rel, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0) continue;
+        buf_str(out, se->rel);
+        buf_u64(out, (uint64_t)se->st.size);
+        buf_u64(out, (uint64_t)se->st.mtime_s);
+        if (hc.has && hc.has[i]) {
+            buf_u8(out, (unsigned)hc.d[i].len);
+            buf_put(out, hc.d[i].b, (size_t)hc.d[i].len);
+        } else {
+            buf_u8(out, 0);
+        }
+        count++;
+    }
+    out->b[count_at] = count >> 24; out->b[count_at + 1] = count >> 16;
+    out->b[count_at + 2] = count >> 8; out->b[count_at + 3] = count;
+    frame_end(out, at);
+    free(hc.d);
+    free(hc.has);
+    scan_free(sl);
+}
+
+static int agent_read_reply(Rd *r, Buf *out) {
+    const char *rel = rd_str(r);
+    if (r->bad || !agent_rel_ok(rel)) { reply_err(out, "bad path"); return 0; }
+    int fd = open(rel, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        reply_err(out, fd < 0 ? strerror(errno) : "not a regular file");
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    for (;;) {
+        size_t at = frame_begin(out, AG_DATA);
+        buf_reserve(out, AGENT_CHUNK);
+        ssize_t n = read(fd, out->b + out->len, AGENT_CHUNK);
+        if (n < 0 && errno == EINTR) { out->len = at; continue; }
+        if (n <= 0) {
+            out->len = at;
+            if (n < 0) { reply_err(out, strerror(errno)); close(fd); return 0; }
+            break;
+        }
+        out->len += (size_t)n;
+        frame_end(out, at);
+        if (out->len >= AGENT_CHUNK && agent_flush(out) != 0) { close(fd); return -1; }
+    }
+    close(fd);
+    size_t at = frame_begin(out, AG_OK);
+    buf_u64(out, (uint64_t)st.st_mtime);
+    buf_u32(out, (uint32_t)ST_MTIME_NSEC(st));
+    buf_u32(out, (uint32_t)(st.st_mode & 07777));
+    frame_end(out, at);
+    return 0;
+}
+
+static void agent_write_begin(AgentWrite *w, Rd *r, int patch) {
+    const char *rel = rd_str(r);
+    w->mode = rd_u32(r);
+    w->times[0].tv_sec  = 0;
+    w->times[0].tv_nsec = UTIME_OMIT;
+    w->times[1].tv_sec  = (time_t)rd_u64(r);
+    w->times[1].tv_nsec = (long)rd_u32(r);
+    w->patch = patch;
+    w->delta.len = 0;
+    if (patch) rd_digest(r, &w->want);
+    w->err = 0;
+    if (r->bad || !agent_rel_ok(rel)) { w->err = EINVAL; return; }
+    snprintf(w->dst, sizeof(w->dst), "%s", rel);
+    snprintf(w->tmp, sizeof(w->tmp), "%s.tmp_XXXXXX", rel);
+    if (mkdir_parent(w->dst) != 0 || (w->fd = mkstemp(w->tmp)) < 0) w->err = errno;
+}
+
+// Rebuild the file from the delta and the file it replaces into the temp
+// file; -1 if that cannot be done or does not give the expected content.
+static int agent_patch(AgentWrite *w) {
+    MappedFile basis;
+    if (map_file(w->dst, &basis) != 0) return -1;
+    Hasher h;
+    Digest got;
+    hasher_init(&h, w->want.algo);
+    int rc = delta_apply((const unsigned char *)basis.data, basis.len,
+                         w->delta.b, w->delta.len, w->fd, &h);
+    unmap_file(&basis);
+    hasher_final(&h, &got);
+    return (rc == 0 && digest_eq(&got, &w->want)) ? 0 : -1;
+}
+
+static void agent_write_end(AgentWrite *w, int complete, Buf *out) {
+    if (w->fd < 0 && !w->err) w->err = EINVAL;     // no AG_WRITE before it
+    if (!complete && !w->err) w->err = ECANCELED;
+    if (w->range) {
+        Digest got;
+        hasher_final(&w->h, &got);
+        int mismatch = !w->err && !digest_eq(&got, &w->want);
+        if (w->fd >= 0 && close(w->fd) != 0 && !w->err) w->err = errno;
+        w->fd = -1;
+        w->range = 0;
+        if (mismatch)    reply_err(out, "piece does not match its hash");
+        else if (w->err) reply_err(out, strerror(w->err));
+        else             reply_ok(out);
+        w->err = 0;
+        return;
+    }
+    int mismatch = 0;
+    if (w->fd >= 0 && !w->err && w->patch && agent_patch(w) != 0) mismatch = w->err = EIO;
+    if (w->fd >= 0) {
+        if (!w->err && (fchmod(w->fd, w->mode & 07777) != 0 || futimens(w->fd, w->times) != 0))
+            w->err = errno;
+        if (close(w->fd) != 0 && !w->err) w->err = errno;
+        if (!w->err && rename(w->tmp, w->dst) != 0) w->err = errno;
+        if (w->err) unlink(w->tmp);
+        w->fd = -1;
+    }
+    if (mismatch)    reply_err(out, "delta does not apply");
+    else if (w->err) reply_err(out, strerror(w->err));
+    else             reply_ok(out);
+    w->err = 0;
+}
+
+// Like AG_READ, but when the client sent the signature of a version it
+// holds and that saves enough, the data is a delta against it.
+static int agent_read_delta_reply(Rd *r, Buf *out) {
+    const char *rel = rd_str(r);
+    DeltaSig sig;
+    memset(&sig, 0, sizeof(sig));
+    if (r->bad || !agent_rel_ok(rel) || delta_sig_get(r, &sig) != 0) {
+        delta_sig_free(&sig);
+        reply_err(out, "bad request");
+        return 0;
+    }
+    MappedFile mf;
+    struct stat st;
+    if (stat(rel, &st) != 0 || !S_ISREG(st.st_mode) || map_file(rel, &mf) != 0) {
+        delta_sig_free(&sig);
+        reply_err(out, "cannot read file");
+        return 0;
+    }
+    const unsigned char *data = (const unsigned char *)mf.data;
+    size_t len = mf.len;
+
+    Buf delta = {0};
+    if (len >= DELTA_MIN) delta_make(&sig, data, len, &delta);
+    int is_delta = len >= DELTA_MIN && delta.len < len / 2;
+    const unsigned char *p = is_delta ? delta.b : data;
+    size_t n = is_delta ? delta.len : len;
+    for (size_t off = 0; off < n; off += AGENT_CHUNK) {
+        size_t k = n - off < AGENT_CHUNK ? n - off : AGENT_CHUNK;
+        size_t at = frame_begin(out, AG_DATA);
+        buf_put(out, p + off, k);
+        frame_end(out, at);
+        if (out->len >= AGENT_CHUNK && agent_flush(out) != 0) {
+            free(delta.b);
+            delta_sig_free(&sig);
+            unmap_file(&mf);
+            return -1;
+        }
+    }
+    size_t at = frame_begin(out, AG_OK);
+    buf_u64(out, (uint64_t)st.st_mtime);
+    buf_u32(out, (uint32_t)ST_MTIME_NSEC(st));
+    buf_u32(out, (uint32_t)(st.st_mode & 07777));
+    buf_u64(out, (uint64_t)len);
+    buf_u8(out, (unsigned)is_delta);
+    if (is_delta) {
+        Hasher h;
+        Digest d;
+        hasher_init(&h, HASH_FAST);
+        hasher_update(&h, data, len);
+        hasher_final(&h, &d);
+        buf_digest(out, &d);
+    }
+    frame_end(out, at);
+    free(delta.b);
+    delta_sig_free(&sig);
+    unmap_file(&mf);
+    return 0;
+}
+
+// AG_CHUNK_SUMS: the piece hashes of the agent's copy of rel
+static void agent_chunk_sums_reply(Rd *r, Buf *out) {
+    const char *rel = rd_str(r);
+    uint32_t chunk = rd_u32(r);
+    if (r->bad || !agent_rel_ok(rel) || chunk < 4096) { reply_err(out, "bad request"); return; }
+    struct stat st;
+    Digest *sums;
+    uint32_t n;
+    long long size;
+    if (stat(rel, &st) != 0 || !S_ISREG(st.st_mode) || chunk_sums(rel, chunk, &sums, &n, &size) != 0) {
+        reply_err(out, "cannot read file");
+        return;
+    }
+    size_t at = frame_begin(out, AG_OK);
+    buf_u64(out, (uint64_t)size);
+    buf_u64(out, (uint64_t)st.st_mtime);
+    buf_u32(out, (uint32_t)ST_MTIME_NSEC(st));
+    buf_u32(out, (uint32_t)(st.st_mode & 07777));
+    buf_u32(out, n);
+    for (uint32_t i = 0; i < n; i++) buf_digest(out, &sums[i]);
+    frame_end(out, at);
+    free(sums);
+}
+
+static int agent_read_range_reply(Rd *r, Buf *out) {
+    const char *rel = rd_str(r);
+    uint64_t off = rd_u64(r), len = rd_u64(r);
+    if (r->bad || !agent_rel_ok(rel)) { reply_err(out, "bad path"); return 0; }
+    int fd = open(rel, O_RDONLY);
+    if (fd < 0) { reply_err(out, strerror(errno)); return 0; }
+    while (len > 0) {
+        size_t want = len < AGENT_CHUNK ? (size_t)len : AGENT_CHUNK;
+        size_t at = frame_begin(out, AG_DATA);
+        buf_reserve(out, want);
+        ssize_t n = pread(fd, out->b + out->len, want, (off_t)off);
+        if (n < 0 && errno == EINTR) { out->len = at; continue; }
+        if (n <= 0) {
+            out->len = at;
+            reply_err(out, n < 0 ? strerror(errno) : "file is shorter than listed");
+            close(fd);
+            return 0;
+        }
+        out->len += (size_t)n;
+        frame_end(out, at);
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+        if (out->len >= AGENT_CHUNK && agent_flush(out) != 0) { close(fd); return -1; }
+    }
+    close(fd);
+    reply_ok(out);
+    return 0;
+}
+
+// AG_STAGE: the file the pieces of rel's new version are written into,
+// starting out as a copy of rel so unchanged pieces need not travel
+static void agent_stage_reply(AgentWrite *w, Rd *r, Buf *out) {
+    const char *rel = rd_str(r);
+    uint64_t size = rd_u64(r);
+    if (r->bad || !agent_rel_ok(rel)) { reply_err(out, "bad path"); return; }
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", rel);
+    int fd = mkdir_parent(rel) == 0 ? mkstemp(tmp) : -1;
+    if (fd < 0) { reply_err(out, strerror(errno)); return; }
+    struct stat st;
+    int rc = 0;
+    if (stat(rel, &st) == 0 && S_ISREG(st.st_mode)) rc = copy_into(rel, fd, NULL);
+    if (rc == 0 && ftruncate(fd, (off_t)size) != 0) rc = -1;
+    int err = errno;
+    if (close(fd) != 0 && rc == 0) { rc = -1; err = errno; }
+    if (rc != 0) {
+        unlink(tmp);
+        reply_err(out, strerror(err ? err : EIO));
+        return;
+    }
+    w->staged = realloc(w->staged, (w->nstaged + 1) * sizeof(char *));
+    w->staged[w->nstaged++] = strdup(tmp);
+    size_t at = frame_begin(out, AG_OK);
+    buf_str(out, tmp);
+    frame_end(out, at);
+}
+
+static void agent_unstage(AgentWrite *w, const char *tmp) {
+    for (int i = 0; i < w->nstaged; i++) {
+        if (strcmp(w->staged[i], tmp) != 0) continue;
+        free(w->staged[i]);
+        w->staged[i] = w->staged[--w->nstaged];
+        return;
+    }
+}
+
+// AG_WRITE_RANGE: pieces may arrive on any connection, so the staging file
+// is opened by name and never created or removed here
+static void agent_range_begin(AgentWrite *w, Rd *r) {
+    const char *tmp = rd_str(r);
+    uint64_t off = rd_u64(r);
+    rd_digest(r, &w->want);
+    w->patch = 0;
+    w->range = 1;
+    w->err = 0;
+    hasher_init(&w->h, w->want.algo);
+    if (r->bad || !agent_rel_ok(tmp)) { w->err = EINVAL; return; }
+    snprintf(w->tmp, sizeof(w->tmp), "%s", tmp);
+    w->fd = open(tmp, O_WRONLY);
+    if (w->fd < 0 || lseek(w->fd, (off_t)off, SEEK_SET) < 0) w->err = errno;
+}
+
+static void agent_commit_reply(AgentWrite *w, Rd *r, Buf *out) {
+    const char *tmp = rd_str(r);
+    const char *rel = rd_str(r);
+    unsigned mode = rd_u32(r);
+    struct timespec ts[2];
+    ts[0].tv_sec  = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1].tv_sec  = (time_t)rd_u64(r);
+    ts[1].tv_nsec = (long)rd_u32(r);
+    uint32_t chunk = rd_u32(r);
+    Digest want, got;
+    rd_digest(r, &want);
+    if (r->bad || !agent_rel_ok(tmp) || !agent_rel_ok(rel) || chunk < 4096) {
+        reply_err(out, "bad request");
+        return;
+    }
+    agent_unstage(w, tmp);
+    Digest *sums;
+    uint32_t n;
+    const char *err = NULL;
+    if (chunk_sums(tmp, chunk, &sums, &n, NULL) != 0) {
+        err = "staging file is gone";
+    } else {
+        chunk_root(sums, n, &got);
+        free(sums);
+        if (!digest_eq(&got, &want)) err = "assembled file does not match";
+        else if (chmod(tmp, mode & 07777) != 0 || utimensat(AT_FDCWD, tmp, ts, 0) != 0
+                 || rename(tmp, rel) != 0) err = strerror(errno);
+    }
+    if (err) {
+        unlink(tmp);
+        reply_err(out, err);
+    } else {
+        reply_ok(out);
+    }
+}
+
+static int agent_handle(AgentWrite *w, int op, Rd *r, Buf *out) {
+    const char *a, *b;
+    switch (op) {
+    case AG_LIST:   agent_list_reply(r, out); return 0;
+    case AG_READ:   return agent_read_reply(r, out);
+    case AG_READ_DELTA: return agent_read_delta_reply(r, out);
+    case AG_CHUNK_SUMS:  agent_chunk_sums_reply(r, out); return 0;
+    case AG_READ_RANGE:  return agent_read_range_reply(r, out);
+    case AG_STAGE:       agent_stage_reply(w, r, out); return 0;
+    case AG_COMMIT:      agent_commit_reply(w, r, out); return 0;
+    case AG_WRITE:
+    case AG_PATCH:
+        agent_write_abort(w);
+        agent_write_begin(w, r, op == AG_PATCH);
+        return 0;
+    case AG_WRITE_RANGE:
+        agent_write_abort(w);
+        agent_range_begin(w, r);
+        return 0;
+    case AG_DATA:
+        if (w->fd < 0 || w->err) return 0;
+        if (w->range) hasher_update(&w->h, r->p, (size_t)(r->end - r->p));
+        if (w->patch) buf_put(&w->delta, r->p, (size_t)(r->end - r->p));
+        else if (write_full(w->fd, r->p, (size_t)(r->end - r->p)) != 0) w->err = errno;
+        return 0;
+    case AG_END:
+        agent_write_end(w, (int)rd_u8(r), out);
+        return 0;
+    case AG_MKDIR:
+        a = rd_str(r);
+        if (r->bad || !agent_rel_ok(a)) reply_err(out, "bad path");
+        else if (mkdir_p(a) != 0)      reply_err(out, strerror(errno));
+        else                           reply_ok(out);
+        return 0;
+    case AG_DELETE:
+        a = rd_str(r);
+        if (r->bad || !agent_rel_ok(a))          reply_err(out, "bad path");
+        else if (unlink(a) != 0 && errno != ENOENT) reply_err(out, strerror(errno));
+        else                                     reply_ok(out);
+        return 0;
+    case AG_RENAME:
+        a = rd_str(r);
+        b = rd_str(r);
+        if (r->bad || !agent_rel_ok(a) || !agent_rel_ok(b)) reply_err(out, "bad path");
+        else if (mkdir_parent(b) != 0 || rename(a, b) != 0) reply_err(out, strerror(errno));
+        else                                                reply_ok(out);
+        return 0;
+    default:
+        reply_err(out, "unknown request");
+        return 0;
+    }
+}
+
+// rmt serve: answer requests on stdin until the client closes it.
+static int agent_serve(const char *root) {
+    g_progress = PROGRESS_OFF;
+    int root_err = chdir(root) == 0 ? 0 : errno;
+    Buf in = {0}, out = {0};
+    AgentWrite w;
+    memset(&w, 0, sizeof(w));
+    w.fd = -1;
+
+    for (;;) {
+        int op;
+        Rd r;
+        int k = frame_next(&in, &op, &r);
+        if (k < 0) break;
+        if (k == 0) {
+            // Drained what arrived: send the replies before waiting for more
+            if (agent_flush(&out) != 0 || frame_fill(&in, 0) <= 0) break;
+            continue;
+        }
+        if (op == AG_HELLO) {
+            if (root_err) { reply_err(&out, strerror(root_err)); break; }
+            size_t at = frame_begin(&out, AG_OK);
+            buf_u32(&out, AGENT_PROTO);
+            buf_str(&out, VERSION);
+            frame_end(&out, at);
+        } else if (agent_handle(&w, op, &r, &out) != 0) {
+            break;
+        }
+        if (out.len >= AGENT_CHUNK && agent_flush(&out) != 0) break;
+    }
+    agent_flush(&out);
+    agent_write_abort(&w);
+    for (int i = 0; i < w.nstaged; i++) { unlink(w.staged[i]); free(w.staged[i]); }
+    free(w.staged);
+    free(w.delta.b);
+    free(in.b);
+    free(out.b);
+    return root_err ? 1 : 0;
+}
+
+// --- client side ---
+
+typedef struct Agent {
+    char *spec;
+    pid_t pid;
+    int to, from;       // the agent's stdin and stdout
+    int failed;         // no agent here: use the rsync/ssh commands
+    int ready;          // handshake done
+    int proto;          // AGENT_PROTO of the remote rmt
+    Buf in;
+    struct Agent *streams;  // extra connections for chunked transfers
+    int nstreams;           // spawned on first use, failed ones included
+} Agent;
+
+static struct { Agent *a; int n; } g_agents;
+
+// Append requests to out; return 0 once every request has been queued
+typedef int (*AgentProduce)(void *ctx, Buf *out);
+// Take one response frame; return -1 on a protocol error
+typedef int (*AgentConsume)(void *ctx, int op, Rd *r);
+
+static void agent_stop(Agent *a) {
+    if (a->to >= 0)   close(a->to);
+    if (a->from >= 0) close(a->from);
+    a->to = a->from = -1;
+    if (a->pid > 0) {
+        if (a->failed) kill(a->pid, SIGTERM);
+        waitpid(a->pid, NULL, 0);
+    }
+    a->pid = 0;
+    free(a->in.b);
+    memset(&a->in, 0, sizeof(a->in));
+}
+
+// Send produce's requests and feed the replies to consume until nreq of
+// them have been answered. Requests stream out while replies stream in, so
+// neither side ever blocks on a full pipe. Any I/O or framing failure
+// stops the agent and returns -1; callers then use the rsync path.
+static int agent_run(Agent *a, AgentProduce produce, AgentConsume consume, void *ctx,
+                     int nreq, const char *label) {
+    if (a->to < 0 || a->from < 0) return -1;    // stopped by an earlier failure
+    struct sigaction ign, old;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &old);     // a dead agent shows up as EPIPE
+
+    Buf out = {0};
+    int more = 1, done = 0, rc = 0;
+    if (label) progress_begin(label, nreq, 0);
+    while (done < nreq) {
+        while (more && out.len - out.off < AGENT_WINDOW) more = produce(ctx, &out);
+        struct pollfd pf[2];
+        pf[0].fd = a->from; pf[0].events = POLLIN;
+        pf[1].fd = a->to;   pf[1].events = POLLOUT;
+        int n = poll(pf, out.off < out.len ? 2 : 1, -1);
+        if (n < 0) { if (errno == EINTR) continue; rc = -1; break; }
+
+        if (out.off < out.len && (pf[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t w = write(a->to, out.b + out.off, out.len - out.off);
+            if (w < 0 && errno != EAGAIN && errno != EINTR) { rc = -1; break; }
+            if (w > 0) out.off += (size_t)w;
+            if (out.off == out.len) out.off = out.len = 0;
+            else if (out.off > AGENT_WINDOW) {
+                memmove(out.b, out.b + out.off, out.len - out.off);
+                out.len -= out.off;
+                out.off = 0;
+            }
+        }
+        if (pf[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            if (frame_fill(&a->in, a->from) <= 0) { rc = -1; break; }
+            int op, k;
+            Rd r;
+            while ((k = frame_next(&a->in, &op, &r)) == 1) {
+                if (op == AG_DATA) progress_add(0, r.end - r.p);
+                if (consume(ctx, op, &r) != 0) { k = -1; break; }
+                if (op == AG_OK || op == AG_ERR) {
+                    done++;
+                    if (label) progress_add(1, 0);
+                }
+            }
+            if (k < 0) { rc = -1; break; }
+        }
+    }
+    if (label) progress_end();
+    free(out.b);
+    sigaction(SIGPIPE, &old, NULL);
+    if (rc != 0) {
+        if (a->ready) fprintf(stderr, "Lost the rmt agent on %s, continuing with rsync\n", a->spec);
+        a->failed = 1;
+        agent_stop(a);
+    }
+    return rc;
+}
+
+static int hello_produce(void *ctx, Buf *out) {
+    (void)ctx;
+    frame_end(out, frame_begin(out, AG_HELLO));
+    return 0;
+}
+
+static int hello_consume(void *ctx, int op, Rd *r) {
+    int *proto = ctx;
+    if (op != AG_OK) return 0;
+    uint32_t v = rd_u32(r);
+    *proto = (v >= AGENT_PROTO_MIN && v <= AGENT_PROTO) ? (int)v : 0;
+    return 0;
+}
+
+// Start `rmt serve` on a's remote through ssh (the command line to use)
+// and shake hands; a->failed is left set when that does not work out.
+static void agent_spawn(Agent *a, const char *ssh) {
+    a->to = a->from = -1;
+    a->failed = 1;
+
+    char host[MAX_PATH_LEN], rpath[MAX_PATH_LEN];
+    if (split_remote_spec(a->spec, host, sizeof(host), rpath, sizeof(rpath)) != 0) return;
+    char *qpath = shell_quote(rpath);
+    char *qhost = shell_quote(host);
+    if (!qpath || !qhost) { free(qpath); free(qhost); return; }
+    char remote_cmd[MAX_PATH_LEN * 2 + 64];
+    snprintf(remote_cmd, sizeof(remote_cmd), "%s serve %s", g_agent_bin, qpath);
+    char *qremote = shell_quote(remote_cmd);
+    free(qpath);
+    if (!qremote) { free(qhost); return; }
+    char *cmd = malloc(strlen(ssh) + strlen(qhost) + strlen(qremote) + 8);
+    sprintf(cmd, "%s %s %s", ssh, qhost, qremote);
+    free(qhost);
+    free(qremote);
+
+    int to[2], from[2];
+    if (pipe(to) != 0) { free(cmd); return; }
+    if (pipe(from) != 0) { close(to[0]); close(to[1]); free(cmd); return; }
+    fflush(stdout);
+    fflush(stderr);
+    exec_begin(cmd);
+    long long t0 = timer_start();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to[0], 0);
+        dup2(from[1], 1);
+        int nul = open("/dev/null", O_WRONLY);
+        if (nul >= 0) dup2(nul, 2);
+        close(to[0]); close(to[1]); close(from[0]); close(from[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(to[0]);
+    close(from[1]);
+    if (pid < 0) { close(to[1]); close(from[0]); free(cmd); return; }
+    a->pid  = pid;
+    a->to   = to[1];
+    a->from = from[0];
+    // Other children must not hold the agent's stdin open past our close
+    fcntl(a->to, F_SETFD, FD_CLOEXEC);
+    fcntl(a->from, F_SETFD, FD_CLOEXEC);
+    fcntl(a->to, F_SETFL, fcntl(a->to, F_GETFL) | O_NONBLOCK);
+
+    // No rmt on the remote, a different protocol or a chatty login shell
+    // all end here, and the rsync path is used instead
+    a->failed = 0;
+    if (agent_run(a, hello_produce, hello_consume, &a->proto, 1, NULL) != 0 || !a->proto) {
+        a->failed = 1;
+        agent_stop(a);
+    }
+    a->ready = !a->failed;
+    exec_end(cmd, t0);
+    free(cmd);
+}
+
+// The agent for remote_spec, started on first use in this process (so each
+// multi-mount child runs its own). NULL when it cannot be used.
+static Agent *agent_get(const char *remote_spec) {
+    if (g_agent_off) return NULL;
+    for (int i = 0; i < g_agents.n; i++)
+        if (strcmp(g_agents.a[i].spec, remote_spec) == 0)
+            return g_agents.a[i].failed ? NULL : &g_agents.a[i];
+
+    g_agents.a = realloc(g_agents.a, (g_agents.n + 1) * sizeof(Agent));
+    Agent *a = &g_agents.a[g_agents.n++];
+    memset(a, 0, sizeof(*a));
+    a->spec = strdup(remote_spec);
+    agent_spawn(a, ssh_cmd());
+    return a->failed ? NULL : a;
+}
+
+static void agent_close_all(void) {
+    for (int i = 0; i < g_agents.n; i++) {
+        Agent *a = &g_agents.a[i];
+        for (int k = 0; k < a->nstreams; k++) {
+            agent_stop(&a->streams[k]);
+            free(a->streams[k].spec);
+        }
+        free(a->streams);
+        agent_stop(a);
+        free(g_agents.a[i].spec);
+    }
+    free(g_agents.a);
+    g_agents.a = NULL;
+    g_agents.n = 0;
+}
+
+typedef struct {
+    char **rels;
+    int count;
+    long long hash_since;
+    RemoteList *rl;
+    int failed;
+    int sent;
+} AgentListCtx;
+
+static int list_produce(void *ctx, Buf *out) {
+    AgentListCtx *c = ctx;
+    size_t at = frame_begin(out, AG_LIST);
+    buf_u8(out, (unsigned)g_hash_algo);
+    buf_u64(out, (uint64_t)c->hash_since);
+    buf_u8(out, c->rels != NULL);
+    if (c->rels) {
+        buf_u32(out, (uint32_t)c->count);
+        for (int i = 0; i < c->count; i++) buf_str(out, c->rels[i]);
+    }
+    frame_end(out, at);
+    return 0;
+}
+
+static int list_consume(void *ctx, int op, Rd *r) {
+    AgentListCtx *c = ctx;
+    if (op == AG_ERR) { c->failed = 1; return 0; }
+    if (op != AG_OK) return -1;
+    // Entry paths point into a private copy of the reply
+    size_t len = (size_t)(r->end - r->p);
+    RemoteList *rl = c->rl;
+    rl->buf = malloc(len ? len : 1);
+    memcpy(rl->buf, r->p, len);
+    Rd d = { (unsigned char *)rl->buf, (unsigned char *)rl->buf + len, 0 };
+    uint32_t n = rd_u32(&d);
+    if (n > len) return -1;
+    rl->cap = n ? (int)n : 1;
+    rl->e   = calloc(rl->cap, sizeof(RemoteEntry));
+    for (uint32_t i = 0; i < n && !d.bad; i++) {
+        RemoteEntry *re = &rl->e[rl->count++];
+        re->rel   = (char *)rd_str(&d);
+        re->size  = (long long)rd_u64(&d);
+        re->mtime = (long long)rd_u64(&d);
+        unsigned hlen = rd_u8(&d);
+        if (hlen == 0) continue;
+        if (hlen > sizeof(re->hash.b) || (size_t)(d.end - d.p) < hlen) { d.bad = 1; break; }
+        re->hash.algo = g_hash_algo;
+        re->hash.len  = (int)hlen;
+        memcpy(re->hash.b, d.p, hlen);
+        d.p += hlen;
+        re->has_hash = 1;
+    }
+    return d.bad ? -1 : 0;
+}
+
+// Listing through the agent hashes with whatever --hash is in use, where
+// the shell fallback can only offer sha256.
+static int agent_list(const char *remote_spec, long long hash_since,
+                      char **rels, int count, RemoteList *rl) {
+    Agent *a = agent_get(remote_spec);
+    if (!a) return remote_list(remote_spec, hash_since, rels, count, rl);
+    memset(rl, 0, sizeof(*rl));
+    AgentListCtx c = { rels, count, rels ? 0 : hash_since, rl, 0, 0 };
+    if (agent_run(a, list_produce, list_consume, &c, 1, NULL) != 0) {
+        rl_free(rl);
+        return remote_list(remote_spec, hash_since, rels, count, rl);
+    }
+    if (c.failed) { rl_free(rl); return -1; }
+    return 0;
+}
+
+// --- chunked transfer, client side ---
+
+#define CHUNK_PROTO 2   // agents that take the chunk requests
+
+typedef struct {
+    const char *rel;
+    long long size;
+    unsigned mode;
+    struct timespec mtime;
+    Digest *src;            // piece hashes of the version being sent
+    uint32_t nsrc;
+    Digest *dst;            // ...and of what the receiving side holds (push)
+    uint32_t ndst;
+    long long reused;       // bytes not sent because the receiver had them
+    int fd;                 // fetch: the local staging file; push: the local file
+    char tmp[MAX_PATH_LEN]; // staging file on the receiving side
+    int failed;             // set from any stream
+    int done;
+} ChunkFile;
+
+typedef struct { int file; uint32_t chunk; } ChunkJob;
+
+static long long chunk_off(uint32_t k) {
+    return (long long)k * CHUNK_SIZE;
+}
+
+static long long chunk_len(const ChunkFile *f, uint32_t k) {
+    long long left = f->size - chunk_off(k);
+    return left < CHUNK_SIZE ? left : CHUNK_SIZE;
+}
+
+static void chunk_fail(ChunkFile *f) {
+    __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+}
+
+static int pwrite_full(int fd, const void *p, size_t n, long long off) {
+    const char *c = p;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, c, n, (off_t)off);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        c += w;
+        off += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Up to --streams connections to a's remote, a itself first. The others
+// bypass the shared ssh master, which would carry them all over one TCP
+// connection again; they are started on first use and kept for the run.
+static int chunk_streams(Agent *a, Agent **out) {
+    if (a->nstreams == 0 && g_streams > 1) {
+        a->streams = calloc(g_streams - 1, sizeof(Agent));
+        for (int i = 0; i < g_streams - 1; i++) {
+            Agent *s = &a->streams[a->nstreams++];
+            s->spec = strdup(a->spec);
+            agent_spawn(s, "ssh -o ControlPath=none");
+        }
+    }
+    int n = 0;
+    out[n++] = a;
+    for (int i = 0; i < a->nstreams; i++)
+        if (!a->streams[i].failed) out[n++] = &a->streams[i];
+    return n;
+}
+
+// Before the pieces move: the piece hashes of the sending side's version
+// for a fetch; for a push the remote's current ones plus a staging file.
+typedef struct {
+    ChunkFile *files;
+    int count;
+    int push;
+    int next, cur;
+} ChunkPrepCtx;
+
+static int chunk_prep_produce(void *ctx, Buf *out) {
+    ChunkPrepCtx *c = ctx;
+    for (int k = 0; k < 64 && c->next < c->count; k++, c->next++) {
+        const ChunkFile *f = &c->files[c->next];
+        size_t at = frame_begin(out, AG_CHUNK_SUMS);
+        buf_str(out, f->rel);
+        buf_u32(out, CHUNK_SIZE);
+        frame_end(out, at);
+        if (!c->push) continue;
+        at = frame_begin(out, AG_STAGE);
+        buf_str(out, f->rel);
+        buf_u64(out, (uint64_t)f->size);
+        frame_end(out, at);
+    }
+    return c->next < c->count;
+}
+
+static int chunk_prep_consume(void *ctx, int op, Rd *r) {
+    ChunkPrepCtx *c = ctx;
+    int per = c->push ? 2 : 1;
+    if ((op != AG_OK && op != AG_ERR) || c->cur >= c->count * per) return -1;
+    ChunkFile *f = &c->files[c->cur / per];
+    int stage = c->cur++ % per == 1;
+    if (stage) {
+        const char *tmp = op == AG_OK ? rd_str(r) : NULL;
+        if (r->bad) return -1;
+        if (tmp) snprintf(f->tmp, sizeof(f->tmp), "%s", tmp);
+        else     f->failed = 1;
+        return 0;
+    }
+    if (op == AG_ERR) {
+        if (!c->push) f->failed = 1;    // a file new to the remote has nothing to reuse
+        return 0;
+    }
+    long long size = (long long)rd_u64(r);
+    long long mtime_s = (long long)rd_u64(r);
+    long mtime_ns = (long)rd_u32(r);
+    unsigned mode = rd_u32(r);
+    uint32_t n = rd_u32(r);
+    if (r->bad || n > (size_t)(r->end - r->p) / 2) return -1;
+    Digest *d = malloc((n ? n : 1) * sizeof(Digest));
+    for (uint32_t i = 0; i < n; i++) rd_digest(r, &d[i]);
+    if (r->bad) { free(d); return -1; }
+    if (c->push) {
+        f->dst  = d;
+        f->ndst = n;
+    } else {
+        f->src  = d;
+        f->nsrc = n;
+        f->size = size;
+        f->mode = mode;
+        f->mtime.tv_sec  = (time_t)mtime_s;
+        f->mtime.tv_nsec = mtime_ns;
+        if (n != (uint32_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE)) f->failed = 1;
+    }
+    return 0;
+}
+
+// One connection's share of the pieces
+typedef struct {
+    Agent *a;
+    ChunkFile *files;
+    ChunkJob *jobs;
+    int njobs;
+    int push;
+    int next, cur;          // next piece to request, piece being answered
+    long long sent;         // push: bytes of jobs[next] queued, -1 before its header
+    Hasher h;               // fetch: data of jobs[cur] so far
+    long long got;
+} ChunkStream;
+
+static int chunk_read_produce(void *ctx, Buf *out) {
+    ChunkStream *s = ctx;
+    for (int k = 0; k < 64 && s->next < s->njobs; k++, s->next++) {
+        const ChunkJob *j = &s->jobs[s->next];
+        const ChunkFile *f = &s->files[j->file];
+        size_t at = frame_begin(out, AG_READ_RANGE);
+        buf_str(out, f->rel);
+        buf_u64(out, (uint64_t)chunk_off(j->chunk));
+        buf_u64(out, (uint64_t)chunk_len(f, j->chunk));
+        frame_end(out, at);
+    }
+    return s->next < s->njobs;
+}
+
+// Pieces are written where they belong as they arrive and checked against
+// the sender's hash once complete
+static int chunk_read_consume(void *ctx, int op, Rd *r) {
+    ChunkStream *s = ctx;
+    if (s->cur >= s->njobs) return -1;
+    const ChunkJob *j = &s->jobs[s->cur];
+    ChunkFile *f = &s->files[j->file];
+    long long len = chunk_len(f, j->chunk);
+    if (op == AG_DATA) {
+        size_t n = (size_t)(r->end - r->p);
+        if (s->got + (long long)n > len
+            || pwrite_full(f->fd, r->p, n, chunk_off(j->chunk) + s->got) != 0)
+            chunk_fail(f);
+        hasher_update(&s->h, r->p, n);
+        s->got += (long long)n;
+        return 0;
+    }
+    if (op != AG_OK && op != AG_ERR) return -1;
+    Digest d;
+    hasher_final(&s->h, &d);
+    if (op == AG_ERR || s->got != len || !digest_eq(&d, &f->src[j->chunk])) chunk_fail(f);
+    hasher_init(&s->h, HASH_FAST);
+    s->got = 0;
+    s->cur++;
+    progress_add(1, 0);
+    return 0;
+}
+
+// One frame of the next piece: its header, a block of data, or its end
+static int chunk_write_produce(void *ctx, Buf *out) {
+    ChunkStream *s = ctx;
+    if (s->next >= s->njobs) return 0;
+    const ChunkJob *j = &s->jobs[s->next];
+    const ChunkFile *f = &s->files[j->file];
+    long long len = chunk_len(f, j->chunk);
+    if (s->sent < 0) {
+        size_t at = frame_begin(out, AG_WRITE_RANGE);
+        buf_str(out, f->tmp);
+        buf_u64(out, (uint64_t)chunk_off(j->chunk));
+        buf_digest(out, &f->src[j->chunk]);
+        frame_end(out, at);
+        s->sent = 0;
+        return 1;
+    }
+    int complete = 1;
+    if (s->sent < len) {
+        size_t want = len - s->sent < AGENT_CHUNK ? (size_t)(len - s->sent) : AGENT_CHUNK;
+        size_t at = frame_begin(out, AG_DATA);
+        buf_reserve(out, want);
+        ssize_t n;
+        do n = pread(f->fd, out->b + out->len, want, (off_t)(chunk_off(j->chunk) + s->sent));
+        while (n < 0 && errno == EINTR);
+        if (n > 0) {
+            out->len += (size_t)n;
+            frame_end(out, at);
+            s->sent += n;
+            return 1;
+        }
+        out->len = at;
+        complete = 0;       // the file shrank or cannot be read: the piece is refused
+    }
+    size_t at = frame_begin(out, AG_END);
+    buf_u8(out, (unsigned)complete);
+    frame_end(out, at);
+    s->sent = -1;
+    return ++s->next < s->njobs;
+}
+
+static int chunk_write_consume(void *ctx, int op, Rd *r) {
+    ChunkStream *s = ctx;
+    (void)r;
+    if (s->cur >= s->njobs || (op != AG_OK && op != AG_ERR)) return -1;
+    if (op == AG_ERR) chunk_fail(&s->files[s->jobs[s->cur].file]);
+    s->cur++;
+    progress_add(1, 0);
+    return 0;
+}
+
+static void *chunk_stream_main(void *arg) {
+    ChunkStream *s = arg;
+    int rc = agent_run(s->a, s->push ? chunk_write_produce : chunk_read_produce,
+                       s->push ? chunk_write_consume : chunk_read_consume, s, s->njobs, NULL);
+    // A lost connection takes the files of its unanswered pieces with it
+    if (rc != 0)
+        for (int i = s->cur; i < s->njobs; i++) chunk_fail(&s->files[s->jobs[i].file]);
+    return NULL;
+}
+
+// Deal the pieces out to the streams in turn and run them side by side;
+// the streams' traffic shows on one meter of pieces and bytes
+static void chunk_run(Agent **streams, int nstreams, ChunkFile *files,
+                      ChunkJob *jobs, int njobs, int push, const char *label) {
+    if (njobs == 0) return;
+    if (nstreams > njobs) nstreams = njobs;
+    ChunkStream *st = calloc(nstreams, sizeof(ChunkStream));
+    pthread_t *tids = malloc(nstreams * sizeof(pthread_t));
+    long long total = 0;
+    for (int i = 0; i < njobs; i++) total += chunk_len(&files[jobs[i].file], jobs[i].chunk);
+    for (int k = 0; k < nstreams; k++) {
+        ChunkStream *s = &st[k];
+        s->a       = streams[k];
+        s->files   = files;
+        s->push    = push;
+        s->sent    = -1;
+        s->jobs    = malloc(((njobs + nstreams - 1) / nstreams) * sizeof(ChunkJob));
+        for (int i = k; i < njobs; i += nstreams) s->jobs[s->njobs++] = jobs[i];
+        hasher_init(&s->h, HASH_FAST);
+    }
+
+    // agent_run saves and restores SIGPIPE; with it already ignored here,
+    // the streams cannot undo it under each other
+    struct sigaction ign, old;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &old);
+
+    if (label) progress_begin(label, njobs, total);
+    int *started = calloc(nstreams, sizeof(int));
+    for (int k = 0; k < nstreams; k++)
+        started[k] = pthread_create(&tids[k], NULL, chunk_stream_main, &st[k]) == 0;
+    for (int k = 0; k < nstreams; k++) if (!started[k]) chunk_stream_main(&st[k]);
+
+    for (int k = 0; k < nstreams; k++) if (started[k]) pthread_join(tids[k], NULL);
+    if (label) progress_end();
+    sigaction(SIGPIPE, &old, NULL);
+
+    for (int k = 0; k < nstreams; k++) free(st[k].jobs);
+    free(started);
+    free(st);
+    free(tids);
+}
+
+static void chunk_files_free(ChunkFile *files, int n) {
+    for (int i = 0; i < n; i++) {
+        free(files[i].src);
+        free(files[i].dst);
+    }
+    free(files);
+}
+
+static void chunk_job_add(ChunkJob **jobs, int *n, int *cap, int file, uint32_t chunk) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *jobs = realloc(*jobs, *cap * sizeof(ChunkJob));
+    }
+    (*jobs)[*n].file  = file;
+    (*jobs)[*n].chunk = chunk;
+    (*n)++;
+}
+
+// Fetch the files among rels of CHUNK_MIN or more (by sizes[]) into dst
+// in pieces over parallel streams; got[i] is set for each one now in
+// place, the rest are left to the caller. basis[i], if set, is a local
+// copy of an earlier version: pieces it already has are copied from it.
+static int chunk_fetch(Agent *a, const char *dst, char **rels, char **basis,
+                       const long long *sizes, int count, int *got) {
+    int *idx = malloc((count ? count : 1) * sizeof(int));
+    int nf = 0;
+    for (int i = 0; i < count; i++) if (sizes[i] >= CHUNK_MIN) idx[nf++] = i;
+    if (nf == 0) { free(idx); return 0; }
+
+    ChunkFile *files = calloc(nf, sizeof(ChunkFile));
+    for (int k = 0; k < nf; k++) {
+        files[k].rel = rels[idx[k]];
+        files[k].fd  = -1;
+    }
+    ChunkPrepCtx pc = { files, nf, 0, 0, 0 };
+    if (agent_run(a, chunk_prep_produce, chunk_prep_consume, &pc, nf, NULL) != 0) {
+        chunk_files_free(files, nf);
+        free(idx);
+        return 0;
+    }
+
+    ChunkJob *jobs = NULL;
+    int njobs = 0, cap = 0;
+    for (int k = 0; k < nf; k++) {
+        ChunkFile *f = &files[k];
+        if (f->failed) continue;
+        const char *b = basis ? basis[idx[k]] : NULL;
+        Digest *have = NULL;
+        uint32_t nhave = 0;
+        if (b && chunk_sums(b, CHUNK_SIZE, &have, &nhave, NULL) != 0) b = NULL;
+        int reuse = 0;
+        for (uint32_t c = 0; c < f->nsrc && c < nhave && !reuse; c++)
+            reuse = digest_eq(&have[c], &f->src[c]);
+
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", dst, f->rel);
+        snprintf(f->tmp, sizeof(f->tmp), "%s.tmp_XXXXXX", path);
+        f->fd = mkdir_parent(path) == 0 ? mkstemp(f->tmp) : -1;
+        if (f->fd < 0 || (reuse && copy_into(b, f->fd, NULL) != 0)
+            || ftruncate(f->fd, (off_t)f->size) != 0) {
+            f->failed = 1;
+            free(have);
+            continue;
+        }
+        for (uint32_t c = 0; c < f->nsrc; c++) {
+            if (reuse && c < nhave && digest_eq(&have[c], &f->src[c])) f->reused += chunk_len(f, c);
+            else chunk_job_add(&jobs, &njobs, &cap, k, c);
+        }
+        free(have);
+    }
+
+    Agent **streams = malloc(g_streams * sizeof(Agent *));
+    int ns = chunk_streams(a, streams);
+    char label[64];
+    snprintf(label, sizeof(label), "Fetching %d large file%s", nf, nf == 1 ? "" : "s");
+    chunk_run(streams, ns, files, jobs, njobs, 0, label);
+
+    int done = 0;
+    for (int k = 0; k < nf; k++) {
+        ChunkFile *f = &files[k];
+        if (f->fd < 0) continue;
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", dst, f->rel);
+        struct timespec ts[2];
+        ts[0].tv_sec  = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1] = f->mtime;
+        int ok = !f->failed && fchmod(f->fd, f->mode & 07777) == 0 && futimens(f->fd, ts) == 0;
+        if (close(f->fd) != 0) ok = 0;
+        if (ok && rename(f->tmp, path) == 0) {
+            got[idx[k]] = 1;
+            done++;
+            STAT_ADD(g_run_stats.chunk_files, 1);
+            STAT_ADD(g_run_stats.chunk_saved, f->reused);
+        } else {
+            unlink(f->tmp);
+        }
+    }
+    free(streams);
+    free(jobs);
+    chunk_files_free(files, nf);
+    free(idx);
+    return done;
+}
+
+// Once every piece is in: each staging file is checked and renamed over
+// its file, or removed when a piece of it failed
+typedef struct {
+    ChunkFile *files;
+    int count;
+    int next, cur;
+} ChunkCommitCtx;
+
+static int chunk_commit_produce(void *ctx, Buf *out) {
+    ChunkCommitCtx *c = ctx;
+    for (int k = 0; k < 64 && c->next < c->count; c->next++) {
+        const ChunkFile *f = &c->files[c->next];
+        if (!f->tmp[0]) continue;
+        k++;
+        if (f->failed) {
+            size_t at = frame_begin(out, AG_DELETE);
+            buf_str(out, f->tmp);
+            frame_end(out, at);
+            continue;
+        }
+        Digest root;
+        chunk_root(f->src, f->nsrc, &root);
+        size_t at = frame_begin(out, AG_COMMIT);
+        buf_str(out, f->tmp);
+        buf_str(out, f->rel);
+        buf_u32(out, f->mode);
+        buf_u64(out, (uint64_t)f->mtime.tv_sec);
+        buf_u32(out, (uint32_t)f->mtime.tv_nsec);
+        buf_u32(out, CHUNK_SIZE);
+        buf_digest(out, &root);
+        frame_end(out, at);
+    }
+    return c->next < c->count;
+}
+
+static int chunk_commit_consume(void *ctx, int op, Rd *r) {
+    ChunkCommitCtx *c = ctx;
+    (void)r;
+    if (op != AG_OK && op != AG_ERR) return -1;
+    while (c->cur < c->count && !c->files[c->cur].tmp[0]) c->cur++;
+    if (c->cur >= c->count) return -1;
+    ChunkFile *f = &c->files[c->cur++];
+    if (op == AG_OK && !f->failed) f->done = 1;
+    return 0;
+}
+
+// Push the files among rels of CHUNK_MIN or more in pieces over parallel
+// streams, sending only pieces the remote copy lacks; done[i] is set for
+// each one now in place, the rest are left to the caller.
+static int chunk_push(Agent *a, const char *local_root, char **rels, int count, int *done) {
+    int *idx = malloc((count ? count : 1) * sizeof(int));
+    ChunkFile *files = calloc(count ? count : 1, sizeof(ChunkFile));
+    int nf = 0;
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", local_root, rels[i]);
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < CHUNK_MIN) continue;
+        ChunkFile *f = &files[nf];
+        long long size;
+        f->fd = open(path, O_RDONLY);
+        if (f->fd < 0) continue;
+        if (fstat(f->fd, &st) != 0 || chunk_sums(path, CHUNK_SIZE, &f->src, &f->nsrc, &size) != 0
+            || size != (long long)st.st_size) {
+            close(f->fd);
+            free(f->src);
+            memset(f, 0, sizeof(*f));
+            continue;
+        }
+        f->rel   = rels[i];
+        f->size  = size;
+        f->mode  = st.st_mode & 07777;
+        f->mtime.tv_sec  = st.st_mtime;
+        f->mtime.tv_nsec = ST_MTIME_NSEC(st);
+        idx[nf++] = i;
+    }
+    if (nf == 0) { free(files); free(idx); return 0; }
+
+    ChunkPrepCtx pc = { files, nf, 1, 0, 0 };
+    int rc = agent_run(a, chunk_prep_produce, chunk_prep_consume, &pc, nf * 2, NULL);
+    ChunkJob *jobs = NULL;
+    int njobs = 0, cap = 0;
+    for (int k = 0; rc == 0 && k < nf; k++) {
+        ChunkFile *f = &files[k];
+        if (f->failed) continue;
+        for (uint32_t c = 0; c < f->nsrc; c++) {
+            if (c < f->ndst && digest_eq(&f->dst[c], &f->src[c])) f->reused += chunk_len(f, c);
+            else chunk_job_add(&jobs, &njobs, &cap, k, c);
+        }
+    }
+
+    int pushed = 0;
+    if (rc == 0) {
+        Agent **streams = malloc(g_streams * sizeof(Agent *));
+        int ns = chunk_streams(a, streams);
+        char label[64];
+        snprintf(label, sizeof(label), "Pushing %d large file%s", nf, nf == 1 ? "" : "s");
+        chunk_run(streams, ns, files, jobs, njobs, 1, label);
+        free(streams);
+
+        // The main connection may have died carrying its share of the
+        // pieces; then nothing is committed and the caller pushes it all
+        int nstaged = 0;
+        for (int k = 0; k < nf; k++) nstaged += files[k].tmp[0] != '\0';
+        ChunkCommitCtx cc = { files, nf, 0, 0 };
+        if (nstaged > 0 && !a->failed && agent_run(a, chunk_commit_produce, chunk_commit_consume, &cc, nstaged, NULL) == 0) {
+            for (int k = 0; k < nf; k++) {
+                if (!files[k].done) continue;
+                done[idx[k]] = 1;
+                pushed++;
+                STAT_ADD(g_run_stats.chunk_files, 1);
+                STAT_ADD(g_run_stats.chunk_saved, files[k].reused);
+            }
+        }
+    }
+    for (int k = 0; k < nf; k++) close(files[k].fd);
+    free(jobs);
+    chunk_files_free(files, nf);
+    free(idx);
+    return pushed;
+}
+
+typedef struct {
+    const char *dst;
+    char **rels;
+    char **basis;       // may be NULL
+    int count;
+    int next;           // next request to queue
+    int cur;            // request being answered
+    int fd;             // its local copy, -1 until data arrives
+    unsigned char *delta;   // per request: asked for as a delta
+    int *retry;         // per request: the delta did not check out
+    int failed;
+} AgentFetchCtx;
+
+static int fetch_produce(void *ctx, Buf *out) {
+    AgentFetchCtx *c = ctx;
+    for (int k = 0; k < 64 && c->next < c->count; k++, c->next++) {
+        const char *rel = c->rels[c->next];
+        MappedFile bm;
+        if (c->basis && c->basis[c->next] && map_file(c->basis[c->next], &bm) == 0) {
+            if (bm.len >= DELTA_MIN) {
+                DeltaSig sig;
+                delta_sig_make((const unsigned char *)bm.data, bm.len, &sig);
+                size_t at = frame_begin(out, AG_READ_DELTA);
+                buf_str(out, rel);
+                delta_sig_put(out, &sig);
+                frame_end(out, at);
+                delta_sig_free(&sig);
+                unmap_file(&bm);
+                c->delta[c->next++] = 1;
+                break;      // signatures are costly: let the queue drain
+            }
+            unmap_file(&bm);
+        }
+        size_t at = frame_begin(out, AG_READ);
+        buf_str(out, rel);
+        frame_end(out, at);
+    }
+    return c->next < c->count;
+}
+
+static int fetch_open(AgentFetchCtx *c) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", c->dst, c->rels[c->cur]);
+    if (mkdir_parent(path) != 0) return -1;
+    c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    return c->fd < 0 ? -1 : 0;
+}
+
+// The fetched file holds a delta: rebuild the remote version from it and
+// the basis in place, and check it against the remote's hash.
+static int fetch_patch(AgentFetchCtx *c, const Digest *want, long long size) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", c->dst, c->rels[c->cur]);
+    snprintf(tmp, sizeof(tmp), "%s.tmp_XXXXXX", path);
+    MappedFile delta, basis;
+    int md = map_file(path, &delta), mb = map_file(c->basis[c->cur], &basis);
+    int fd = (md == 0 && mb == 0) ? mkstemp(tmp) : -1;
+    size_t dlen = delta.len;
+    int rc = -1;
+    if (fd >= 0) {
+        Hasher h;
+        Digest got;
+        hasher_init(&h, want->algo);
+        rc = delta_apply((const unsigned char *)basis.data, basis.len,
+                         (const unsigned char *)delta.data, dlen, fd, &h);
+        hasher_final(&h, &got);
+        if (close(fd) != 0 || !digest_eq(&got, want)) rc = -1;
+        if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+        if (rc != 0) unlink(tmp);
+    }
+    unmap_file(&delta);
+    unmap_file(&basis);
+    if (rc == 0) {
+        STAT_ADD(g_run_stats.delta_files, 1);
+        STAT_ADD(g_run_stats.delta_saved, size - (long long)dlen);
+    }
+    return rc;
+}
+
+static int fetch_consume(void *ctx, int op, Rd *r) {
+    AgentFetchCtx *c = ctx;
+    if (c->cur >= c->count) return -1;
+    if (op == AG_DATA) {
+        if (c->fd == -1 && fetch_open(c) != 0) c->fd = -2;
+        if (c->fd >= 0 && write_full(c->fd, r->p, (size_t)(r->end - r->p)) != 0) {
+            close(c->fd);
+            c->fd = -2;
+        }
+        return 0;
+    }
+    if (op == AG_OK) {
+        struct timespec ts[2];
+        ts[0].tv_sec  = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec  = (time_t)rd_u64(r);
+        ts[1].tv_nsec = (long)rd_u32(r);
+        unsigned mode = rd_u32(r);
+        long long size = 0;
+        int is_delta = 0;
+        Digest want;
+        if (c->delta[c->cur]) {
+            size = (long long)rd_u64(r);
+            is_delta = (int)rd_u8(r);
+            if (is_delta) rd_digest(r, &want);
+        }
+        if (r->bad) return -1;
+        if (c->fd == -1 && fetch_open(c) != 0) c->fd = -2;   // empty file
+        if (c->fd >= 0 && is_delta) {
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%s/%s", c->dst, c->rels[c->cur]);
+            if (close(c->fd) != 0 || fetch_patch(c, &want, size) != 0) c->retry[c->cur] = 1;
+            else if (chmod(path, mode & 07777) != 0 || utimensat(AT_FDCWD, path, ts, 0) != 0) c->failed++;
+        } else if (c->fd >= 0) {
+            if (fchmod(c->fd, mode & 07777) != 0 || futimens(c->fd, ts) != 0) c->failed++;
+            if (close(c->fd) != 0) c->failed++;
+        } else {
+            c->failed++;
+        }
+    } else if (op == AG_ERR) {
+        if (c->fd >= 0) close(c->fd);
+        c->failed++;
+    } else {
+        return -1;
+    }
+    c->fd = -1;
+    c->cur++;
+    return 0;
+}
+
+static int agent_fetch(const char *remote_spec, const char *dst, char **rels,
+                       char **basis, const long long *sizes, int count) {
+    if (count == 0) return 0;
+    Agent *a = agent_get(remote_spec);
+    if (!a) return rsync_fetch_files(remote_spec, dst, rels, count);
+    // Large files go in pieces over several streams, the rest below
+    if (sizes && a->proto >= CHUNK_PROTO) {
+        int *got = calloc(count, sizeof(int));
+        if (chunk_fetch(a, dst, rels, basis, sizes, count, got) > 0) {
+            char **rest = malloc(count * sizeof(char *));
+            char **rest_basis = malloc(count * sizeof(char *));
+            int n = 0;
+            for (int i = 0; i < count; i++) {
+                if (got[i]) continue;
+                rest_basis[n] = basis ? basis[i] : NULL;
+                rest[n++] = rels[i];
+            }
+            int rc = agent_fetch(remote_spec, dst, rest, rest_basis, NULL, n);
+            free(rest);
+            free(rest_basis);
+            free(got);
+            return rc;
+        }
+        free(got);
+    }
+    AgentFetchCtx c = { dst, rels, basis, count, 0, 0, -1, NULL, NULL, 0 };
+    c.delta = calloc(count, 1);
+    c.retry = calloc(count, sizeof(int));
+    char label[64];
+    snprintf(label, sizeof(label), "Fetching %d changed file%s", count, count == 1 ? "" : "s");
+    int rc = agent_run(a, fetch_produce, fetch_consume, &c, count, label);
+    if (rc != 0) {
+        if (c.fd >= 0) close(c.fd);
+        rc = rsync_fetch_files(remote_spec, dst, rels, count);
+    } else {
+        // Deltas that did not reproduce the remote file are fetched whole
+        char **again = malloc(count * sizeof(char *));
+        int n = 0;
+        for (int i = 0; i < count; i++) if (c.retry[i]) again[n++] = rels[i];
+        rc = c.failed ? -1 : 0;
+        if (n > 0 && agent_fetch(remote_spec, dst, again, NULL, NULL, n) != 0) rc = -1;
+        free(again);
+    }
+    free(c.delta);
+    free(c.retry);
+    return rc;
+}
+
+typedef struct {
+    const char *root;
+    char **rels;
+    char **basis;       // may be NULL
+    int count;
+    int *ok;
+    int next;
+    int fd;             // file being streamed, -1 between files
+    Buf delta;          // or the delta being streamed
+    size_t delta_off;
+    int in_delta;
+    long long *saved;   // per request: bytes its delta saves, 0 if sent whole
+    int *retry;         // per request: the delta did not apply remotely
+    int cur;
+} AgentPushCtx;
+
+static void push_end(Buf *out, int complete) {
+    size_t at = frame_begin(out, AG_END);
+    buf_u8(out, (unsigned)complete);
+    frame_end(out, at);
+}
+
+// Encode the file as a delta against its basis into c->delta; 0 and its
+// digest in *d when that is worth sending instead of the file.
+static int push_make_delta(AgentPushCtx *c, const char *path, Digest *d) {
+    MappedFile mf, mb;
+    int md = map_file(path, &mf), mbr = map_file(c->basis[c->next], &mb);
+    const unsigned char *data = (const unsigned char *)mf.data;
+    size_t len = mf.len;
+    int rc = -1;
+    if (md == 0 && mbr == 0 && len >= DELTA_MIN) {
+        DeltaSig sig;
+        delta_sig_make((const unsigned char *)mb.data, mb.len, &sig);
+        c->delta.len = 0;
+        delta_make(&sig, data, len, &c->delta);
+        delta_sig_free(&sig);
+        if (c->delta.len < len / 2) {
+            Hasher h;
+            hasher_init(&h, HASH_FAST);
+            hasher_update(&h, data, len);
+            hasher_final(&h, d);
+            c->saved[c->next] = (long long)(len - c->delta.len);
+            rc = 0;
+        }
+    }
+    unmap_file(&mf);
+    unmap_file(&mb);
+    return rc;
+}
+
+// Queue one more frame of the push: a file header, a chunk of data or
+// delta, or an end
+static int push_produce(void *ctx, Buf *out) {
+    AgentPushCtx *c = ctx;
+    if (c->next >= c->count) return 0;
+    const char *rel = c->rels[c->next];
+    if (c->in_delta) {
+        size_t k = c->delta.len - c->delta_off;
+        if (k > 0) {
+            if (k > AGENT_CHUNK) k = AGENT_CHUNK;
+            size_t at = frame_begin(out, AG_DATA);
+            buf_put(out, c->delta.b + c->delta_off, k);
+            frame_end(out, at);
+            c->delta_off += k;
+            return 1;
+        }
+        push_end(out, 1);
+        c->in_delta = 0;
+        return ++c->next < c->count;
+    }
+    if (c->fd < 0) {
+        char path[MAX_PATH_LEN];
+        struct stat st;
+        Digest d;
+        snprintf(path, sizeof(path), "%s/%s", c->root, rel);
+        c->fd = open(path, O_RDONLY);
+        int ok = c->fd >= 0 && fstat(c->fd, &st) == 0 && S_ISREG(st.st_mode);
+        int patch = ok && c->basis && c->basis[c->next] && st.st_size >= DELTA_MIN
+                    && push_make_delta(c, path, &d) == 0;
+        size_t at = frame_begin(out, patch ? AG_PATCH : AG_WRITE);
+        buf_str(out, rel);
+        buf_u32(out, ok ? (uint32_t)(st.st_mode & 07777) : 0);
+        buf_u64(out, ok ? (uint64_t)st.st_mtime : 0);
+        buf_u32(out, ok ? (uint32_t)ST_MTIME_NSEC(st) : 0);
+        if (patch) buf_digest(out, &d);
+        frame_end(out, at);
+        if (patch) {
+            close(c->fd);
+            c->fd = -1;
+            c->in_delta = 1;
+            c->delta_off = 0;
+            return 1;
+        }
+        if (!ok) {
+            // Still answered, as a failure, so replies stay in step
+            if (c->fd >= 0) close(c->fd);
+            c->fd = -1;
+            push_end(out, 0);
+            return ++c->next < c->count;
+        }
+        return 1;
+    }
+    size_t at = frame_begin(out, AG_DATA);
+    buf_reserve(out, AGENT_CHUNK);
+    ssize_t n;
+    do n = read(c->fd, out->b + out->len, AGENT_CHUNK); while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        out->len += (size_t)n;
+        frame_end(out, at);
+        return 1;
+    }
+    out->len = at;
+    push_end(out, n == 0);
+    close(c->fd);
+    c->fd = -1;
+    return ++c->next < c->count;
+}
+
+static int push_consume(void *ctx, int op, Rd *r) {
+    AgentPushCtx *c = ctx;
+    (void)r;
+    if (c->cur >= c->count || (op != AG_OK && op != AG_ERR)) return -1;
+    if (op == AG_OK && c->saved[c->cur] > 0) {
+        STAT_ADD(g_run_stats.delta_files, 1);
+        STAT_ADD(g_run_stats.delta_saved, c->saved[c->cur]);
+    }
+    // A delta the remote could not apply (its copy moved on) is resent whole
+    if (op == AG_ERR && c->saved[c->cur] > 0) c->retry[c->cur] = 1;
+    c->ok[c->cur++] = (op == AG_OK);
+    return 0;
+}
+
+static int agent_push_files(const char *local_root, const char *remote_spec,
+                            char **rels, char **basis, int count, int *ok) {
+    Agent *a = agent_get(remote_spec);
+    if (!a) return rsync_push_files(local_root, remote_spec, rels, count, ok);
+    AgentPushCtx c;
+    memset(&c, 0, sizeof(c));
+    c.root  = local_root;
+    c.rels  = rels;
+    c.basis = basis;
+    c.count = count;
+    c.ok    = ok;
+    c.fd    = -1;
+    c.saved = calloc(count, sizeof(long long));
+    c.retry = calloc(count, sizeof(int));
+    char label[64];
+    snprintf(label, sizeof(label), "Pushing %d file%s", count, count == 1 ? "" : "s");
+    int rc = agent_run(a, push_produce, push_consume, &c, count, label);
+    if (rc != 0) {
+        if (c.fd >= 0) close(c.fd);
+        rc = rsync_push_files(local_root, remote_spec, rels, count, ok);
+    } else {
+        char **again = malloc(count * sizeof(char *));
+        int *again_ok = calloc(count, sizeof(int));
+        int n = 0;
+        for (int i = 0; i < count; i++) if (c.retry[i]) again[n++] = rels[i];
+        if (n > 0) agent_push_files(local_root, remote_spec, again, NULL, n, again_ok);
+        for (int i = 0, j = 0; i < count; i++) if (c.retry[i]) ok[i] = again_ok[j++];
+        for (int i = 0; i < count; i++) if (!ok[i]) rc = 1;
+        free(again);
+        free(again_ok);
+    }
+    free(c.delta.b);
+    free(c.saved);
+    free(c.retry);
+    return rc;
+}
+
+// Large files go in pieces over several streams first; whatever they did
+// not deliver is pushed whole or as deltas on the main connection
+static int agent_push(const char *local_root, const char *remote_spec,
+                      char **rels, char **basis, int count, int *ok) {
+    Agent *a = agent_get(remote_spec);
+    if (!a || a->proto < CHUNK_PROTO || count == 0)
+        return agent_push_files(local_root, remote_spec, rels, basis, count, ok);
+    int *done = calloc(count, sizeof(int));
+    if (chunk_push(a, local_root, rels, count, done) == 0) {
+        free(done);
+        return agent_push_files(local_root, remote_spec, rels, basis, count, ok);
+    }
+    char **rest = malloc(count * sizeof(char *));
+    char **rest_basis = malloc(count * sizeof(char *));
+    int *rest_ok = calloc(count, sizeof(int));
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (done[i]) continue;
+        rest_basis[n] = basis ? basis[i] : NULL;
+        rest[n++] = rels[i];
+    }
+    int rc = n > 0 ? agent_push_files(local_root, remote_spec, rest, rest_basis, n, rest_ok) : 0;
+    for (int i = 0, j = 0; i < count; i++) ok[i] = done[i] ? 1 : rest_ok[j++];
+    free(rest);
+    free(rest_basis);
+    free(rest_ok);
+    free(done);
+    return rc;
+}
+
+typedef struct { char **rels; int count; int *ok; int next; int cur; } AgentDeleteCtx;
+
+static int delete_produce(void *ctx, Buf *out) {
+    AgentDeleteCtx *c = ctx;
+    for (int k = 0; k < 256 && c->next < c->count; k++, c->next++) {
+        size_t at = frame_begin(out, AG_DELETE);
+        buf_str(out, c->rels[c->next]);
+        frame_end(out, at);
+    }
+    return c->next < c->count;
+}
+
+static int delete_consume(void *ctx, int op, Rd *r) {
+    AgentDeleteCtx *c = ctx;
+    (void)r;
+    if (c->cur >= c->count || (op != AG_OK && op != AG_ERR)) return -1;
+    c->ok[c->cur++] = (op == AG_OK);
+    return 0;
+}
+
+static int agent_remove(const char *remote_spec, char **rels, int count, int *ok) {
+    Agent *a = agent_get(remote_spec);
+    if (!a) return ssh_delete_files(remote_spec, rels, count, ok);
+    AgentDeleteCtx c = { rels, count, ok, 0, 0 };
+    if (agent_run(a, delete_produce, delete_consume, &c, count, NULL) != 0)
+        return ssh_delete_files(remote_spec, rels, count, ok);
+    for (int i = 0; i < count; i++) if (!ok[i]) return 1;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Transports — every remote operation goes through one of these, picked by
+// the mount's remote spec: [user@]host:/path is reached over ssh (through
+// the rmt agent when the remote has one, rsync otherwise), file:///path is a directory on this machine (local disk, NFS, any mounted
+// filesystem) and is read and written with direct syscalls and the copy
+// engine. Operations take whole batches so the ssh backend stays at one
+// round trip each.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char *name;
+    // Called before a run of operations against remote_spec
+    void (*open)(const char *remote_spec);
+    // Regular files under the remote root, sorted; see remote_list()
+    int (*list)(const char *remote_spec, long long hash_since,
+                char **rels, int count, RemoteList *rl);
+    // Copy rels into dst, keeping their mtimes. basis (may be NULL, as may
+    // any entry) names a local file holding an earlier version of rels[i];
+    // sizes (may be NULL) are the listed remote sizes
+    int (*fetch)(const char *remote_spec, const char *dst, char **rels,
+                 char **basis, const long long *sizes, int count);
+    // Copy rels from local_root to the remote; ok[i] set per delivered file.
+    // basis[i], if set, is a local copy of what the remote holds now
+    int (*push)(const char *local_root, const char *remote_spec,
+                char **rels, char **basis, int count, int *ok);
+    // Delete rels on the remote; ok[i] set per removed file
+    int (*remove)(const char *remote_spec, char **rels, int count, int *ok);
+    // Whole-tree copies (mount, sync --pull, sync --push): files whose size
+    // or mtime differ are copied, nothing is deleted
+    int (*pull_tree)(const char *remote_spec, const char *local, int dry_run);
+    int (*push_tree)(const char *local, const char *remote_spec, int dry_run);
+} Transport;
+
+// Whole-tree pulls leave the large files that changed to the chunked
+// streams, which also reuse the pieces the local copy already has
+static int ssh_pull_tree(const char *remote, const char *local, int dry_run) {
+    Agent *a = dry_run ? NULL : agent_get(remote);
+    RemoteList rl;
+    if (!a || a->proto < CHUNK_PROTO || agent_list(remote, 0, NULL, 0, &rl) != 0)
+        return rsync_pull(remote, local, dry_run);
+    rl_apply_ignore(&rl);
+
+    char **rels = malloc((rl.count ? rl.count : 1) * sizeof(char *));
+    char **basis = malloc((rl.count ? rl.count : 1) * sizeof(char *));
+    long long *sizes = malloc((rl.count ? rl.count : 1) * sizeof(long long));
+    Arena ar;
+    memset(&ar, 0, sizeof(ar));
+    int n = 0;
+    for (int i = 0; i < rl.count; i++) {
+        const RemoteEntry *re = &rl.e[i];
+        if (re->size < CHUNK_MIN) continue;
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", local, re->rel);
+        struct stat st;
+        int have = lstat(path, &st) == 0 && S_ISREG(st.st_mode);
+        if (have && st.st_size == re->size && (long long)st.st_mtime == re->mtime) continue;
+        basis[n] = have ? arena_strndup(&ar, path, strlen(path)) : NULL;
+        sizes[n] = re->size;
+        rels[n++] = re->rel;
+    }
+
+    int rc = rsync_pull_sized(remote, local, 0, CHUNK_MIN);
+    if (n > 0) {
+        int *got = calloc(n, sizeof(int));
+        chunk_fetch(a, local, rels, basis, sizes, n, got);
+        int left = 0;
+        for (int i = 0; i < n; i++) if (!got[i]) rels[left++] = rels[i];
+        if (left > 0 && rsync_fetch_files(remote, local, rels, left) != 0 && rc == 0) rc = -1;
+        free(got);
+    }
+    free(rels);
+    free(basis);
+    free(sizes);
+    arena_free(&ar);
+    rl_free(&rl);
+    return rc;
+}
+
+static const Transport ssh_transport = {
+    "ssh", ssh_mux_begin, agent_list, agent_fetch, agent_push,
+    agent_remove, ssh_pull_tree, rsync_push,
+};
+
+static const char *file_spec_root(const char *remote_spec) {
+    return remote_spec + strlen(FILE_SCHEME);
+}
+
+static int local_root_ok(const char *root) {
+    struct stat st;
+    if (stat(root, &st) == 0 && S_ISDIR(st.st_mode)) return 1;
+    fprintf(stderr, "%s: not a directory\n", root);
+    return 0;
+}
+
+static void local_open(const char *remote_spec) {
+    (void)remote_spec;  // nothing to connect to
+}
+
+// hash_since is ignored: fetching a changed file is a local copy, which costs
+// no more than hashing it in place would.
+static int local_list(const char *remote_spec, long long hash_since,
+                      char **rels, int count, RemoteList *rl) {
+    (void)hash_since;
+    memset(rl, 0, sizeof(*rl));
+    const char *root = file_spec_root(remote_spec);
+    if (!local_root_ok(root)) return -1;
+
+    // Same skips as the local side: the base dir and the manifest
+    ScanList *sl = rels ? scan_paths(root, rels, count) : scan_tree(root);
+    if (!sl) return -1;
+    size_t total = 1;
+    for (int i = 0; i < sl->count; i++) total += sl->e[i].len + 1;
+    rl->buf = malloc(total);
+    rl->cap = sl->count ? sl->count : 1;
+    rl->e   = calloc(rl->cap, sizeof(RemoteEntry));
+    if (!rl->buf || !rl->e) { scan_free(sl); rl_free(rl); return -1; }
+
+    // Already sorted by path, as rl_find needs
+    char *p = rl->buf;
+    for (int i = 0; i < sl->count; i++) {
+        const ScanEntry *se = &sl->e[i];
+        memcpy(p, se->rel, se->len + 1);
+        RemoteEntry *re = &rl->e[rl->count++];
+        re->rel   = p;
+        re->size  = se->st.size;
+        re->mtime = se->st.mtime_s;
+        p += se->len + 1;
+    }
+    scan_free(sl);
+    return 0;
+}
+
+typedef struct {
+    const char *src_root;
+    const char *dst_root;
+    char **rels;
+    int *ok;
+} LocalCopyCtx;
+
+// Copy one file atomically with its mtime, which the manifest compares
+// against the next listing just as it does after an rsync -a.
+static int local_copy_one(void *arg, int i) {
+    LocalCopyCtx *c = arg;
+    char src[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+    snprintf(src, sizeof(src), "%s/%s", c->src_root, c->rels[i]);
+    snprintf(dst, sizeof(dst), "%s/%s", c->dst_root, c->rels[i]);
+    struct stat st;
+    if (mkdir_parent(dst) != 0 || copy_file(src, dst, &st) != 0) return 0;
+    struct timespec ts[2];
+    ts[0].tv_sec  = st.st_atime;
+    ts[0].tv_nsec = 0;
+    ts[1].tv_sec  = st.st_mtime;
+    ts[1].tv_nsec = ST_MTIME_NSEC(st);
+    if (utimensat(AT_FDCWD, dst, ts, 0) != 0) return 0;
+    c->ok[i] = 1;
+    return 0;
+}
+
+// Copy rels from src_root to dst_root on the pool; returns the number of
+// files that failed.
+static int local_copy_files(const char *src_root, const char *dst_root,
+                            char **rels, int count, int *ok, const char *label) {
+    LocalCopyCtx c = { src_root, dst_root, rels, ok };
+    pool_run(local_copy_one, &c, count, label);
+    int failed = 0;
+    for (int i = 0; i < count; i++) if (!ok[i]) failed++;
+    return failed;
+}
+
+// A local copy is already the cheapest transfer, so basis is not used
+static int local_fetch(const char *remote_spec, const char *dst, char **rels,
+                       char **basis, const long long *sizes, int count) {
+    (void)basis;
+    (void)sizes;
+    if (count == 0) return 0;
+    const char *root = file_spec_root(remote_spec);
+    if (!local_root_ok(root)) return -1;
+    int *ok = calloc(count, sizeof(int));
+    if (!ok) return -1;
+    char label[64];
+    snprintf(label, sizeof(label), "Fetching %d changed file%s", count, count == 1 ? "" : "s");
+    int failed = local_copy_files(root, dst, rels, count, ok, label);
+    free(ok);
+    return failed ? -1 : 0;
+}
+
+static int local_push(const char *local_root, const char *remote_spec,
+                      char **rels, char **basis, int count, int *ok) {
+    (void)basis;
+    const char *root = file_spec_root(remote_spec);
+    if (!local_root_ok(root)) return -1;
+    char label[64];
+    snprintf(label, sizeof(label), "Pushing %d file%s", count, count == 1 ? "" : "s");
+    return local_copy_files(local_root, root, rels, count, ok, label) ? 1 : 0;
+}
+
+static int local_remove(const char *remote_spec, char **rels, int count, int *ok) {
+    const char *root = file_spec_root(remote_spec);
+    if (!local_root_ok(root)) return -1;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", root, rels[i]);
+        // Like rm -f, a file that is already gone counts as removed
+        if (unlink(path) == 0 || errno == ENOENT) ok[i] = 1;
+        else failed++;
+    }
+    return failed ? 1 : 0;
+}
+
+// Copy every file of src that is missing from dst or differs in size or
+// mtime, like rsync -a without --delete. Only regular files are carried.
+static int local_copy_tree(const char *src, const char *dst, int dry_run, const char *label) {
+    if (!local_root_ok(src)) return -1;
+    ScanList *sl = scan_tree(src);
+    if (!sl) { fprintf(stderr, "Cannot read %s\n", src); return -1; }
+    char **rels = malloc((sl->count ? sl->count : 1) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < sl->count; i++) {
+        const ScanEntry *se = &sl->e[i];
+        char path[MAX_PATH_LEN];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dst, se->rel);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)
+            && (long long)st.st_size == se->st.size
+            && (long long)st.st_mtime == se->st.mtime_s
+            && ST_MTIME_NSEC(st) == se->st.mtime_ns) continue;
+        rels[n++] = (char *)se->rel;
+    }
+
+    int rc = 0;
+    if (dry_run) {
+        for (int i = 0; i < n; i++) printf("%s\n", rels[i]);
+    } else if (n > 0) {
+        int *ok = calloc(n, sizeof(int));
+        if (!ok || mkdir_p(dst) != 0) rc = -1;
+        else if (local_copy_files(src, dst, rels, n, ok, label) > 0) rc = 1;
+        free(ok);
+    }
+    free(rels);
+    scan_free(sl);
+    return rc;
+}
+
+static int local_pull_tree(const char *remote_spec, const char *local, int dry_run) {
+    if (dry_run) printf("Dry run (pull): %s -> %s\n", remote_spec, local);
+    return local_copy_tree(file_spec_root(remote_spec), local, dry_run, "Pulling from remote");
+}
+
+static int local_push_tree(const char *local, const char *remote_spec, int dry_run) {
+    if (dry_run) printf("Dry run (push): %s -> %s\n", local, remote_spec);
+    return local_copy_tree(local, file_spec_root(remote_spec), dry_run, "Pushing to remote");
+}
+
+static const Transport local_transport = {
+    "file", local_open, local_list, local_fetch, local_push,
+    local_remove, local_pull_tree, local_push_tree,
+};
+
+static const Transport *transport_for(const char *remote_spec) {
+    return is_file_spec(remote_spec) ? &local_transport : &ssh_transport;
+}
+
+static void transport_open(const char *remote_spec) {
+    transport_for(remote_spec)->open(remote_spec);
+}
+
+// Stop agents before the ssh masters they run through
+static void transport_close_all(void) {
+    agent_close_all();
+    ssh_mux_end_all();
+}
+
+
+// ---------------------------------------------------------------------------
+// Text merge — in-process diff3. Lines are interned to ints, each side is
+// diffed against base with linear-space Myers, and the two matchings are
+// walked together: stable runs are copied, and each unstable chunk is taken
+// from whichever side changed it or written out with conflict markers.
+// ---------------------------------------------------------------------------
+
+static int g_merge_comp = 0;   // --merge=comp: fork COMP_BIN merge instead
+
+typedef struct {
+    const char *p;
+    size_t len;         // including the trailing '\n', if any
+} TextLine;
+
+typedef struct {
+    TextLine *line;
+    int *id;            // interned line ids: equal lines <=> equal ids
+    int n;
+} TextFile;
+
+static int split_lines(Arena *ar, const MappedFile *mf, TextFile *tf) {
+    int n = 0;
+    for (const char *p = mf->data, *end = p + mf->len; p < end; n++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        p = nl ? nl + 1 : end;
+    }
+    tf->n    = n;
+    tf->line = arena_alloc(ar, (n ? n : 1) * sizeof(TextLine));
+    tf->id   = arena_alloc(ar, (n ? n : 1) * sizeof(int));
+    if (!tf->line || !tf->id) return -1;
+    const char *p = mf->data, *end = p + mf->len;
+    for (int i = 0; i < n; i++) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *next = nl ? nl + 1 : end;
+        tf->line[i].p   = p;
+        tf->line[i].len = (size_t)(next - p);
+        p = next;
+    }
+    return 0;
+}
+
+// Give every distinct line across the three files a small integer id.
+static int intern_lines(Arena *ar, TextFile *files, int nfiles) {
+    int total = 0;
+    for (int f = 0; f < nfiles; f++) total += files[f].n;
+    size_t cap = 16;
+    while (cap < (size_t)total * 2) cap <<= 1;
+    const TextLine **slot = arena_alloc(ar, cap * sizeof(*slot));
+    int *slot_id = arena_alloc(ar, cap * sizeof(int));
+    if (!slot || !slot_id) return -1;
+    memset(slot, 0, cap * sizeof(*slot));
+
+    int next_id = 0;
+    for (int f = 0; f < nfiles; f++) {
+        for (int i = 0; i < files[f].n; i++) {
+            const TextLine *l = &files[f].line[i];
+            size_t h = (size_t)fnv1a(l->p, l->len, FNV_SEED) & (cap - 1);
+            while (slot[h] && (slot[h]->len != l->len || memcmp(slot[h]->p, l->p, l->len) != 0))
+                h = (h + 1) & (cap - 1);
+            if (!slot[h]) { slot[h] = l; slot_id[h] = next_id++; }
+            files[f].id[i] = slot_id[h];
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const int *a, *b;
+    int *fv, *bv;       // forward/backward furthest x per diagonal, offset by voff
+    int voff;
+    int *match;         // match[i] = index in b of a[i], or -1
+} MyersCtx;
+
+// Find the middle snake of a[a0,a1) vs b[b0,b1): a diagonal run that lies on
+// some shortest edit script and splits it into two halves of ~D/2 edits.
+static void myers_snake(MyersCtx *c, int a0, int a1, int b0, int b1,
+                        int *sx, int *sy, int *ex, int *ey) {
+    int n = a1 - a0, m = b1 - b0, delta = n - m, odd = delta & 1;
+    int max = (n + m + 1) / 2;
+    int *fv = c->fv + c->voff, *bv = c->bv + c->voff;
+    fv[1] = 0;
+    bv[1] = 0;
+    for (int d = 0; d <= max; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && fv[k - 1] < fv[k + 1])) ? fv[k + 1] : fv[k - 1] + 1;
+            int y = x - k, x0 = x, y0 = y;
+            while (x < n && y < m && c->a[a0 + x] == c->b[b0 + y]) { x++; y++; }
+            fv[k] = x;
+            int r = delta - k;
+            if (odd && r >= -(d - 1) && r <= d - 1 && fv[k] + bv[r] >= n) {
+                *sx = a0 + x0; *sy = b0 + y0; *ex = a0 + x; *ey = b0 + y;
+                return;
+            }
+        }
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && bv[k - 1] < bv[k + 1])) ? bv[k + 1] : bv[k - 1] + 1;
+            int y = x - k, x0 = x, y0 = y;
+            while (x < n && y < m && c->a[a1 - 1 - x] == c->b[b1 - 1 - y]) { x++; y++; }
+            bv[k] = x;
+            int r = delta - k;
+            if (!odd && r >= -d && r <= d && bv[k] + fv[r] >= n) {
+                *sx = a1 - x; *sy = b1 - y; *ex = a1 - x0; *ey = b1 - y0;
+                return;
+            }
+        }
+    }
+    // Unreachable for a0 < a1 or b0 < b1; fall back to "replace everything"
+    *sx = *ex = a0;
+    *sy = *ey = b0;
+}
+
+static void myers_compare(MyersCtx *c, int a0, int a1, int b0, int b1) {
+    for (;;) {
+        while (a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) c->match[a0++] = b0++;
+        while (a0 < a1 && b0 < b1 && c->a[a1 - 1] == c->b[b1 - 1]) c->match[--a1] = --b1;
+        if (a0 == a1 || b0 == b1) return;
+
+        int sx, sy, ex, ey;
+        myers_snake(c, a0, a1, b0, b1, &sx, &sy, &ex, &ey);
+        if (sx == a0 && sy == b0 && ex == a1 && ey == b1) return;   // defensive
+        for (int x = sx, y = sy; x < ex; x++, y++) c->match[x] = y;
+        myers_compare(c, a0, sx, b0, sy);
+        a0 = ex;    // the second half iteratively keeps recursion depth down
+        b0 = ey;
+    }
+}
+
+// match[i] = line of b matched to line i of a, or -1 if a[i] was removed.
+static int *myers_match(Arena *ar, const TextFile *a, const TextFile *b) {
+    MyersCtx c;
+    c.a     = a->id;
+    c.b     = b->id;
+    c.voff  = (a->n + b->n + 1) / 2 + 1;
+    c.fv    = arena_alloc(ar, (2 * c.voff + 1) * sizeof(int));
+    c.bv    = arena_alloc(ar, (2 * c.voff + 1) * sizeof(int));
+    c.match = arena_alloc(ar, (a->n ? a->n : 1) * sizeof(int));
+    if (!c.fv || !c.bv || !c.match) return NULL;
+    for (int i = 0; i < a->n; i++) c.match[i] = -1;
+    myers_compare(&c, 0, a->n, 0, b->n);
+    return c.match;
+}
+
+static int lines_equal(const TextFile *x, int x0, int x1, const TextFile *y, int y0, int y1) {
+    if (x1 - x0 != y1 - y0) return 0;
+    for (int i = 0; i < x1 - x0; i++) if (x->id[x0 + i] != y->id[y0 + i]) return 0;
+    return 1;
+}
+
+// Lines of one file are contiguous in its mapping, so a run is one write.
+static void write_lines(FILE *f, const TextFile *t, int from, int to) {
+    if (to <= from) return;
+    const char *end = t->line[to - 1].p + t->line[to - 1].len;
+    fwrite(t->line[from].p, 1, (size_t)(end - t->line[from].p), f);
+}
+
+// Conflict sides must each end on a line break so the markers stay on their own lines.
+static void write_side(FILE *f, const TextFile *t, int from, int to) {
+    write_lines(f, t, from, to);
+    if (to > from && t->line[to - 1].p[t->line[to - 1].len - 1] != '\n') fputc('\n', f);
+}
+
+// Three-way merge of ours and theirs against base into out.
+// Returns 0 if clean, 1 if conflict markers were written, -1 on error.
+static int merge3_files(const char *base, const char *ours, const char *theirs,
+                        const char *out) {
+    MappedFile mb, mo, mt;
+    if (map_file(base, &mb) != 0) return -1;
+    if (map_file(ours, &mo) != 0) { unmap_file(&mb); return -1; }
+    if (map_file(theirs, &mt) != 0) { unmap_file(&mb); unmap_file(&mo); return -1; }
+
+    int rc = -1;
+    Arena ar = {0};
+    FILE *f = NULL;
+    const MappedFile *maps[3] = { &mb, &mo, &mt };
+    for (int i = 0; i < 3; i++) {
+        size_t probe = maps[i]->len < 8000 ? maps[i]->len : 8000;
+        if (probe && memchr(maps[i]->data, '\0', probe)) {
+            fprintf(stderr, "Cannot merge binary file %s\n", ours);
+            goto done;
+        }
+    }
+
+    TextFile t[3];      // base, ours, theirs
+    for (int i = 0; i < 3; i++) if (split_lines(&ar, maps[i], &t[i]) != 0) goto done;
+    if (intern_lines(&ar, t, 3) != 0) goto done;
+    int *mo_ = myers_match(&ar, &t[0], &t[1]);
+    int *mt_ = myers_match(&ar, &t[0], &t[2]);
+    if (!mo_ || !mt_) goto done;
+
+    f = fopen(out, "wb");
+    if (!f) goto done;
+
+    const TextFile *B = &t[0], *O = &t[1], *T = &t[2];
+    int conflicts = 0;
+    int ib = 0, io = 0, it = 0;
+    while (ib < B->n || io < O->n || it < T->n) {
+        // Stable: the next base line is kept, in place, by both sides
+        if (ib < B->n && mo_[ib] == io && mt_[ib] == it) {
+            int run = ib;
+            while (run < B->n && mo_[run] == io + (run - ib) && mt_[run] == it + (run - ib)) run++;
+            write_lines(f, B, ib, run);
+            io += run - ib; it += run - ib; ib = run;
+            continue;
+        }
+        // Unstable chunk runs up to the next base line both sides kept
+        int eb = ib;
+        while (eb < B->n && (mo_[eb] < 0 || mt_[eb] < 0)) eb++;
+        int eo = eb < B->n ? mo_[eb] : O->n;
+        int et = eb < B->n ? mt_[eb] : T->n;
+
+        if (lines_equal(O, io, eo, B, ib, eb))       write_lines(f, T, it, et);  // theirs only
+        else if (lines_equal(T, it, et, B, ib, eb))  write_lines(f, O, io, eo);  // ours only
+        else if (lines_equal(O, io, eo, T, it, et))  write_lines(f, O, io, eo);  // same change
+        else {
+            fputs("<<<<<<< ours\n", f);
+            write_side(f, O, io, eo);
+            fputs("=======\n", f);
+            write_side(f, T, it, et);
+            fputs(">>>>>>> theirs\n", f);
+            conflicts++;
+        }
+        ib = eb; io = eo; it = et;
+    }
+    rc = conflicts ? 1 : 0;
+
+done:
+    if (f && fclose(f) != 0) rc = -1;
+    arena_free(&ar);
+    unmap_file(&mb);
+    unmap_file(&mo);
+    unmap_file(&mt);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// comp-based smart sync
+// ---------------------------------------------------------------------------
+
+static int run_comp_diff(const char *a, const char *b) {
+    char *qa = shell_quote(a);
+    char *qb = shell_quote(b);
+    if (!qa || !qb) { free(qa); free(qb); return -1; }
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd), COMP_BIN " diff %s %s > /dev/null 2>&1", qa, qb);
+    free(qa);
+    free(qb);
+    STAT_ADD(g_hash_stats.comp_forks, 1);
+    int rc = run_system(cmd);
+    if (!WIFEXITED(rc)) return -1;
+    int ex = WEXITSTATUS(rc);
+    if (ex == 0) return 0;
+    if (ex == 1) return 1;
+    return -1;
+}
+
+static int run_comp_merge(const char *base, const char *ours, const char *theirs,
+                          const char *out) {
+    char *qb   = shell_quote(base);
+    char *qo   = shell_quote(ours);
+    char *qt   = shell_quote(theirs);
+    char *qout = shell_quote(out);
+    if (!qb || !qo || !qt || !qout) {
+        free(qb); free(qo); free(qt); free(qout); return -1;
+    }
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd),
+             COMP_BIN " merge %s %s %s %s 2>/dev/null", qb, qo, qt, qout);
+    free(qb); free(qo); free(qt); free(qout);
+    STAT_ADD(g_hash_stats.comp_forks, 1);
+    int rc = run_system(cmd);
+    if (!WIFEXITED(rc)) return -1;
+    int ex = WEXITSTATUS(rc);
+    if (ex == 0) return 0;
+    if (ex == 1) return 1;
+    return -1;
+}
+
+static int run_merge(const char *base, const char *ours, const char *theirs,
+                     const char *out) {
+    if (g_merge_comp) return run_comp_merge(base, ours, theirs, out);
+    return merge3_files(base, ours, theirs, out);
+}
+
+// Has the local file changed since the last sync? The stat tuple answers
+// most files without any I/O; a touched file is settled by its content hash,
+// and only a path the manifest knows nothing about is compared byte-for-byte.
+static int local_changed_since_base(Manifest *mf, const char *rel, const FileStat *fs,
+                                    const char *local_file, const char *base_file)
+{
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (e && manifest_stat_matches(mf, e, fs)) return 0;
+    if (g_hash_comp) return run_comp_diff(base_file, local_file) == 1;
+    if (e && e->has_hash) {
+        Digest h;
+        if (hash_file(local_file, e->hash.algo, &h) == 0) {
+            if (!digest_eq(&h, &e->hash)) return 1;
+            pthread_mutex_lock(&mf->lock);
+            manifest_set_local(e, fs);   // touched but identical: remember new tuple
+            mf->dirty = 1;
+            pthread_mutex_unlock(&mf->lock);
+            return 0;
+        }
+    }
+    return files_differ(base_file, local_file) == 1;
+}
+
+// Did the remote change since base, judging only by the listing? rsync
+// preserves mtimes, so a matching size + mtime (seconds) means untouched;
+// a remote hash from --remote-hash settles a touched-but-identical file.
+static int remote_meta_unchanged(Manifest *mf, ManifestEntry *e, const RemoteEntry *re) {
+    if (!e) return 0;
+    if (!manifest_racy(mf, e->rmtime) && e->rsize == re->size && e->rmtime == re->mtime)
+        return 1;
+    if (re->has_hash && e->has_hash && digest_eq(&re->hash, &e->hash)) {
+        e->rsize  = re->size;
+        e->rmtime = re->mtime;
+        mf->dirty = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Content check for a remote file that was fetched because its metadata moved.
+static int remote_changed_since_base(Manifest *mf, const char *rel,
+                                     const char *remote_file, const char *base_file)
+{
+    struct stat st;
+    if (stat(remote_file, &st) != 0) return 0;
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (g_hash_comp) return run_comp_diff(base_file, remote_file) == 1;
+    if (e && e->has_hash) {
+        Digest h;
+        if (hash_file(remote_file, e->hash.algo, &h) == 0) {
+            if (!digest_eq(&h, &e->hash)) return 1;
+            pthread_mutex_lock(&mf->lock);
+            e->rsize  = (long long)st.st_size;
+            e->rmtime = (long long)st.st_mtime;
+            mf->dirty = 1;
+            pthread_mutex_unlock(&mf->lock);
+            return 0;
+        }
+    }
+    return files_differ(base_file, remote_file) == 1;
+}
+
+// Record the remote size/mtime for rel. After a push the remote carries the
+// local file's mtime (rsync -a), after a pull it is the fetched copy's.
+static void manifest_set_remote(Manifest *mf, const char *rel, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+    pthread_mutex_lock(&mf->lock);
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (e) {
+        e->rsize  = (long long)st.st_size;
+        e->rmtime = (long long)st.st_mtime;
+        mf->dirty = 1;
+    }
+    pthread_mutex_unlock(&mf->lock);
+}
+
+static void print_conflict(const char *local_file) {
+    printf("\n");
+    printf("╔══════════════════════════════════════════════════════════╗\n");
+    printf("║                   MERGE CONFLICT                        ║\n");
+    printf("╠══════════════════════════════════════════════════════════╣\n");
+    printf("║  File: %-50s║\n", local_file);
+    printf("╠══════════════════════════════════════════════════════════╣\n");
+    printf("║  Both local and remote changed this file since last      ║\n");
+    printf("║  sync and the changes could not be merged automatically. ║\n");
+    printf("║                                                          ║\n");
+    printf("║  The file has been written with conflict markers:        ║\n");
+    printf("║    <<<<<<< ours                                          ║\n");
+    printf("║    =======                                               ║\n");
+    printf("║    >>>>>>> theirs                                        ║\n");
+    printf("║                                                          ║\n");
+    printf("║  Resolve the conflict, then run:                        ║\n");
+    printf("║    rmt sync <path> --push                                ║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n");
+    printf("\n");
+}
+
+// One planned step of a sync; smart_sync classifies every path first and
+// only then applies the plan, so remote work can be batched.
+typedef enum {
+    ACT_NONE,           // gone on both sides
+    ACT_SKIP,           // unchanged since base
+    ACT_PULL,           // copy fetched remote version over local
+    ACT_PUSH,           // send local version to remote
+    ACT_DELETE_REMOTE,  // deleted locally, unchanged remotely
+    ACT_MERGE,          // both changed: 3-way merge, then push
+    ACT_DELETE_LOCAL,   // deleted remotely, unchanged locally
+} ActionKind;
+
+#define ACT_PENDING 2   // Action.status before the apply phase reaches it
+
+typedef struct {
+    const char *rel;
+    ActionKind kind;
+    const char *label;  // action column in the sync log
+    const char *note;   // optional explanation after the path
+    const FileStat *lst; // local stat from the scan; NULL if not present locally
+    const RemoteEntry *re; // remote listing entry; NULL if not present remotely
+    int base;           // manifest entry index, -1 if never synced
+    int has_base;
+    int status;         // apply result: 0 ok, 1 conflict, -1 error
+} Action;
+
+// ---------------------------------------------------------------------------
+// Action journal — a sync writes its plan to <mount>/.rmt-manifest.journal
+// before applying anything and appends each action as it completes (remote
+// pushes and deletes as each batch of them lands), so an
+// interrupted sync resumes from the last completed action instead of
+// listing and classifying the tree again. Base objects, the manifest and
+// the journal are made durable together at checkpoints, one syncfs per
+// filesystem, rather than file by file.
+//
+//   P <kind> <lsize> <lmtime> <lmtime_ns> <rsize> <rmtime> <base|-> <path>
+//   G                                    the plan is complete
+//   L <path>                             merge written locally, push pending
+//   D <base|-> <rsize> <rmtime> <path>   done, with the base it left behind
+//   C                                    the manifest holds every D above
+//   A                                    a resume started
+//
+// A size of -1 marks a side the file was missing from. Only complete lines
+// count, so a record torn by a crash is ignored and its action redone.
+// ---------------------------------------------------------------------------
+
+// Shares the manifest's prefix, so every filter that hides it hides this too
+#define JOURNAL_NAME        MANIFEST_NAME ".journal"
+#define JOURNAL_MAX_RESUMES 3   // then plan afresh: the same action keeps failing
+#define JOURNAL_BATCH       512 // pushes or remote deletes recorded together
+
+static const char *const act_names[]  = { "none", "skip", "pull", "push", "delete", "merge", "unlink" };
+static const char *const act_labels[] = { "", "", "pull", "push", "delete remote", "merge", "delete local" };
+
+typedef struct {
+    FILE *f;                    // NULL when the run keeps no journal
+    pthread_mutex_t lock;       // held by pool workers around appends
+} Journal;
+
+static void journal_path_for(const char *local_root, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/%s", local_root, JOURNAL_NAME);
+}
+
+// Flush everything written to the filesystem holding path. One syncfs
+// commits a whole batch of files where fsync would need a call per file.
+static void fs_sync(const char *path) {
+#if defined(__linux__) && defined(SYS_syncfs)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    int rc = (int)syscall(SYS_syncfs, fd);
+    close(fd);
+    if (rc == 0) return;
+#else
+    (void)path;
+#endif
+    sync();
+}
+
+static int journal_open(Journal *jn, const char *local_root, const char *mode) {
+    char path[MAX_PATH_LEN];
+    journal_path_for(local_root, path, sizeof(path));
+    jn->f = fopen(path, mode);
+    if (!jn->f) return -1;
+    pthread_mutex_init(&jn->lock, NULL);
+    return 0;
+}
+
+// Record the plan of a fresh sync: every action that changes something,
+// with the local, remote and base state it was decided on.
+static int journal_begin(Journal *jn, const char *local_root, const char *remote_spec,
+                         const Action *plan, int count, Manifest *mf) {
+    if (journal_open(jn, local_root, "w") != 0) return -1;
+    fprintf(jn->f, "# rmt journal v1 do not edit manually\nR %s\n", remote_spec);
+    for (int i = 0; i < count; i++) {
+        const Action *a = &plan[i];
+        if (a->kind == ACT_NONE || a->kind == ACT_SKIP) continue;
+        char base_s[80] = "-";
+        if (a->has_base) digest_format(&mf->entries[a->base].hash, base_s, sizeof(base_s));
+        fprintf(jn->f, "P %s %lld %lld %ld %lld %lld %s %s\n", act_names[a->kind],
+                a->lst ? a->lst->size : -1LL, a->lst ? a->lst->mtime_s : 0LL,
+                a->lst ? a->lst->mtime_ns : 0L,
+                a->re ? a->re->size : -1LL, a->re ? a->re->mtime : 0LL, base_s, a->rel);
+    }
+    fprintf(jn->f, "G\n");
+    return fflush(jn->f) == 0 ? 0 : -1;
+}
+
+// Records are flushed to the kernel as they are made, so killing the
+// process loses none; only a crash of the machine needs the checkpoints.
+static void journal_put(Journal *jn, const char *rec) {
+    if (!jn->f) return;
+    pthread_mutex_lock(&jn->lock);
+    fputs(rec, jn->f);
+    fflush(jn->f);
+    pthread_mutex_unlock(&jn->lock);
+}
+
+// rel is done; its manifest entry is the base and remote state it left.
+static void journal_done(Journal *jn, Manifest *mf, const char *rel) {
+    if (!jn->f) return;
+    char rec[MAX_PATH_LEN + 160];
+    pthread_mutex_lock(&mf->lock);
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (e && e->has_hash) {
+        char base_s[80];
+        digest_format(&e->hash, base_s, sizeof(base_s));
+        snprintf(rec, sizeof(rec), "D %s %lld %lld %s\n", base_s, e->rsize, e->rmtime, rel);
+    } else {
+        snprintf(rec, sizeof(rec), "D - -1 0 %s\n", rel);
+    }
+    pthread_mutex_unlock(&mf->lock);
+    journal_put(jn, rec);
+}
+
+static void journal_merged(Journal *jn, const char *rel) {
+    char rec[MAX_PATH_LEN + 8];
+    snprintf(rec, sizeof(rec), "L %s\n", rel);
+    journal_put(jn, rec);
+}
+
+// Group commit: the objects first, then the manifest that names them, then
+// the checkpoint record that lets a resume skip replaying what came before.
+static void journal_checkpoint(Journal *jn, const char *local_root, Manifest *mf) {
+    if (!jn->f) return;
+    long long t = timer_start();
+    fs_sync(get_objects_dir());
+    if (!mf->dirty || manifest_save(local_root, mf) == 0) {
+        journal_put(jn, "C\n");
+        fs_sync(local_root);
+    }
+    timer_stop("phase", "checkpoint", t, NULL);
+}
+
+// Close the journal; it stays behind only when keep asks for a resume.
+static void journal_end(Journal *jn, const char *local_root, int keep) {
+    if (jn->f) {
+        fclose(jn->f);
+        pthread_mutex_destroy(&jn->lock);
+        jn->f = NULL;
+    }
+    char path[MAX_PATH_LEN];
+    journal_path_for(local_root, path, sizeof(path));
+    if (!keep) unlink(path);
+}
+
+// Size of the mount after the last full sync, for the registry's stats
+static long long g_sync_files = -1;
+static long long g_sync_bytes = -1;
+
+// Shared, read-mostly state handed to pool workers
+typedef struct {
+    const char *local_root;
+    const char *tmp_remote;
+    Manifest *mf;
+    Action *plan;
+    Journal *jn;
+} SyncCtx;
+
+// Decide what to do with one path. Reads only; the manifest is touched
+// just to remember the stat tuple of touched-but-identical files.
+static int classify_file(SyncCtx *c, Action *a) {
+    const char *rel = a->rel;
+
+    char local_file[MAX_PATH_LEN], base_file[MAX_PATH_LEN], remote_file[MAX_PATH_LEN];
+    snprintf(local_file,  sizeof(local_file),  "%s/%s", c->local_root, rel);
+    snprintf(remote_file, sizeof(remote_file), "%s/%s", c->tmp_remote, rel);
+
+    const RemoteEntry *re = a->re;
+    int has_local  = (a->lst != NULL);
+    int has_remote = (re != NULL);
+    int has_base   = 0, lazy = 0;
+    if (a->base >= 0) {
+        pthread_mutex_lock(&c->mf->lock);
+        const ManifestEntry *be = &c->mf->entries[a->base];
+        Digest d = be->hash;
+        has_base = be->has_hash;
+        lazy     = be->lazy;
+        pthread_mutex_unlock(&c->mf->lock);
+        if (has_base) object_path(&d, base_file, sizeof(base_file));
+    }
+
+    a->has_base = has_base;
+    a->kind     = ACT_NONE;
+    if (!has_local && !has_remote) return 0;
+
+    /* Placeholder of a lazy mount: remote-owned and unchanged until fetched */
+    if (!has_local && has_remote && lazy) {
+        a->kind = ACT_SKIP;
+        return 0;
+    }
+
+    /* New file only on remote */
+    if (!has_local && has_remote && !has_base) {
+        a->kind = ACT_PULL; a->label = "pull (new)";
+        return 0;
+    }
+
+    /* File deleted locally, existed at base */
+    if (!has_local && has_base) {
+        int remote_changed = (has_remote && re->fetched)
+            ? remote_changed_since_base(c->mf, rel, remote_file, base_file) : 0;
+        if (remote_changed) {
+            a->kind  = ACT_PULL; a->label = "conflict";
+            a->note  = " (deleted locally, modified remotely — keeping remote)";
+        } else {
+            a->kind  = ACT_DELETE_REMOTE; a->label = "delete remote";
+        }
+        return 0;
+    }
+
+    /* File only local (new) */
+    if (has_local && !has_remote && !has_base) {
+        a->kind = ACT_PUSH; a->label = "push (new)";
+        return 0;
+    }
+
+    /* File deleted remotely, existed at base */
+    if (has_local && !has_remote && has_base) {
+        if (local_changed_since_base(c->mf, rel, a->lst, local_file, base_file)) {
+            a->kind = ACT_PUSH; a->label = "conflict";
+            a->note = " (deleted remotely, modified locally — keeping local)";
+        } else {
+            a->kind = ACT_DELETE_LOCAL; a->label = "delete local";
+        }
+        return 0;
+    }
+
+    /* Both exist — diff against base */
+    int local_changed  = has_base ? local_changed_since_base(c->mf, rel, a->lst, local_file, base_file) : 1;
+    int remote_changed = !has_base ? 1
+        : re->fetched ? remote_changed_since_base(c->mf, rel, remote_file, base_file) : 0;
+
+    if      (!local_changed && !remote_changed) { a->kind = ACT_SKIP; }
+    else if ( local_changed && !remote_changed) { a->kind = ACT_PUSH;  a->label = "push"; }
+    else if (!local_changed &&  remote_changed) { a->kind = ACT_PULL;  a->label = "pull"; }
+    else                                        { a->kind = ACT_MERGE; a->label = "merge"; }
+    return 0;
+}
+
+// Pool task: classify plan[i], timed per file for --stats and --trace.
+static int classify_one(void *arg, int i) {
+    SyncCtx *c = arg;
+    Action *a = &c->plan[i];
+    long long t = timer_start();
+    int rc = classify_file(c, a);
+    timer_stop("file", "classify", t, a->rel);
+    return rc;
+}
+
+// The local half of an action — pulls, merges and local deletes. Pushes and
+// remote deletes are batched afterwards. Returns non-zero to stop the pool.
+static int apply_file(SyncCtx *c, Action *a) {
+    const char *rel = a->rel;
+
+    char local_file[MAX_PATH_LEN], base_file[MAX_PATH_LEN], remote_file[MAX_PATH_LEN];
+    snprintf(local_file,  sizeof(local_file),  "%s/%s", c->local_root, rel);
+    snprintf(remote_file, sizeof(remote_file), "%s/%s", c->tmp_remote, rel);
+    base_path_for(c->mf, rel, base_file, sizeof(base_file));
+
+    if (a->kind == ACT_DELETE_LOCAL) {
+        if (unlink(local_file) != 0 && errno != ENOENT) {
+            fprintf(stderr, "  delete failed %s: %s\n", rel, strerror(errno));
+            a->status = -1;
+            return 1;
+        }
+        base_delete(c->local_root, rel, c->mf);
+        journal_done(c->jn, c->mf, rel);
+        a->status = 0;
+        return 0;
+    }
+
+    if (a->kind == ACT_PULL) {
+        if (mkdir_parent(local_file) != 0 || copy_file(remote_file, local_file, NULL) != 0) {
+            fprintf(stderr, "  pull failed   %s: %s\n", rel, strerror(errno));
+            a->status = -1;
+            return 1;
+        }
+        base_update(c->local_root, rel, local_file, c->mf);
+        manifest_set_remote(c->mf, rel, remote_file);
+        journal_done(c->jn, c->mf, rel);
+        a->status = 0;
+        return 0;
+    }
+
+    /* Both changed — 3-way merge */
+    char merged_file[MAX_PATH_LEN];
+    snprintf(merged_file, sizeof(merged_file), "%s.rmt_merge_XXXXXX", local_file);
+    int mfd = mkstemp(merged_file);
+    if (mfd < 0) { perror("mkstemp"); a->status = -1; return 1; }
+    close(mfd);
+
+    struct stat lst;
+    if (stat(local_file, &lst) == 0) chmod(merged_file, lst.st_mode & 07777);
+
+    const char *bpath = (a->has_base && access(base_file, F_OK) == 0) ? base_file : "/dev/null";
+    int mrc = run_merge(bpath, local_file, remote_file, merged_file);
+
+    if (mrc == 0) {
+        rename(merged_file, local_file);
+        journal_merged(c->jn, rel);
+        a->status = 0;
+        return 0;
+    }
+    if (mrc == 1) {
+        rename(merged_file, local_file);
+        a->status = 1;
+        return 1;
+    }
+    unlink(merged_file);
+    a->status = -1;
+    return 1;
+}
+
+// Pool task: apply plan[i] if it changes anything locally.
+static int apply_one(void *arg, int i) {
+    SyncCtx *c = arg;
+    Action *a = &c->plan[i];
+    if (a->status != ACT_PENDING) return 0;     // merged before an interruption
+    if (a->kind != ACT_PULL && a->kind != ACT_MERGE && a->kind != ACT_DELETE_LOCAL) {
+        a->status = 0;
+        return 0;
+    }
+    long long t = timer_start();
+    int rc = apply_file(c, a);
+    timer_stop("file", act_names[a->kind], t, a->rel);
+    return rc;
+}
+
+// Is rel a placeholder that is still not fetched? A local file at its path
+// (created by hand) turns it back into an ordinary path.
+static int lazy_placeholder(const char *local_root, Manifest *mf, const char *rel) {
+    ManifestEntry *e = manifest_find(mf, rel);
+    if (!e || !e->lazy) return 0;
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", local_root, rel);
+    return lstat(path, &st) != 0;
+}
+
+typedef struct { int pushed, pulled, merged, skipped; } SyncCounts;
+
+static void remove_tree(const char *path) {
+    char *q = shell_quote(path);
+    if (!q) return;
+    char cmd[MAX_PATH_LEN * 2 + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", q);
+    run_system(cmd);
+    free(q);
+}
+
+#define HYDRATE_STAGE MANIFEST_NAME ".fetch_"
+// Where a staging dir is created and locked before it is renamed to
+// HYDRATE_STAGE, out of the sweep's sight
+#define HYDRATE_STAGE_NEW MANIFEST_NAME ".newfetch_"
+
+// Remove the staging dirs of fetches killed before they cleaned up. A
+// running fetch holds a flock on its own dir, so only abandoned ones yield.
+static void hydrate_sweep(const char *local_root) {
+    DIR *d = opendir(local_root);
+    if (!d) return;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (strncmp(ent->d_name, HYDRATE_STAGE, strlen(HYDRATE_STAGE)) != 0) continue;
+        char stage[MAX_PATH_LEN];
+        snprintf(stage, sizeof(stage), "%s/%s", local_root, ent->d_name);
+        int fd = open(stage, O_RDONLY);
+        if (fd < 0) continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) remove_tree(stage);
+        close(fd);
+    }
+    closedir(d);
+}
+
+// Carry out a classified plan: pulls and merges locally, then the pushes
+// and the remote deletes, a batch per transfer or session so the journal
+// (if any) records them as they land. It gets a checkpoint after each
+// phase that changed the manifest.
+static int sync_execute(SyncCtx *c, const Transport *tp, const char *remote_spec,
+                        int unique, SyncCounts *n) {
+    const char *local_root = c->local_root;
+    Action *plan = c->plan;
+    Manifest *mf = c->mf;
+    int result = 0;
+
+    // --- Apply pulls and merges in parallel; stop at the first conflict ---
+    int nlocal = 0;
+    for (int i = 0; i < unique; i++)
+        if (plan[i].status == ACT_PENDING && (plan[i].kind == ACT_PULL || plan[i].kind == ACT_MERGE
+                                              || plan[i].kind == ACT_DELETE_LOCAL))
+            nlocal++;
+    long long t = timer_start();
+    pool_run(apply_one, c, unique, nlocal > 0 ? "Applying" : NULL);
+    timer_stop("phase", "apply", t, NULL);
+    if (nlocal > 0) journal_checkpoint(c->jn, local_root, mf);
+
+    // The first failure in path order decides the outcome, and only
+    // work queued before it reaches the remote — as with a serial run.
+    int cutoff = unique;
+    for (int i = 0; i < unique; i++) {
+        if (plan[i].status == 1 || plan[i].status == -1) {
+            cutoff = i;
+            if (plan[i].status == 1) {
+                char local_file[MAX_PATH_LEN];
+                snprintf(local_file, sizeof(local_file), "%s/%s", local_root, plan[i].rel);
+                print_conflict(local_file);
+                result = 1;
+            } else {
+                if (plan[i].kind == ACT_MERGE)
+                    fprintf(stderr, "merge failed for %s\n", plan[i].rel);
+                result = -1;
+            }
+            break;
+        }
+    }
+
+    Arena basis_names;
+    memset(&basis_names, 0, sizeof(basis_names));
+    char **push_rels = malloc((unique ? unique : 1) * sizeof(char *));
+    char **push_basis = malloc((unique ? unique : 1) * sizeof(char *));
+    int  *push_merge = malloc((unique ? unique : 1) * sizeof(int));
+    char **del_rels  = malloc((unique ? unique : 1) * sizeof(char *));
+    int npush = 0, ndel = 0;
+    for (int i = 0; i < cutoff; i++) {
+        const Action *a = &plan[i];
+        if (a->status != 0) continue;
+        if (a->kind == ACT_PULL || a->kind == ACT_DELETE_LOCAL) n->pulled++;
+        else if (a->kind == ACT_PUSH || a->kind == ACT_MERGE) {
+            // What the remote holds now: the base, or for a merge the
+            // remote version that was fetched to merge with
+            char basis[MAX_PATH_LEN];
+            int has = a->kind == ACT_MERGE
+                ? snprintf(basis, sizeof(basis), "%s/%s", c->tmp_remote, a->rel) > 0
+                : base_path_for(mf, a->rel, basis, sizeof(basis)) == 0;
+            push_basis[npush] = has ? arena_strndup(&basis_names, basis, strlen(basis)) : NULL;
+            push_merge[npush]  = (a->kind == ACT_MERGE);
+            push_rels[npush++] = (char *)a->rel;
+        } else if (a->kind == ACT_DELETE_REMOTE) {
+            del_rels[ndel++] = (char *)a->rel;
+        }
+    }
+
+    // --- Remote side: pushes, then deletes. A connection dropped mid-way
+    // loses at most the batch in flight to the journal.
+    if (npush > 0) {
+        t = timer_start();
+        int *ok = calloc(npush, sizeof(int));
+        for (int lo = 0; lo < npush; lo += JOURNAL_BATCH) {
+            int cnt = npush - lo < JOURNAL_BATCH ? npush - lo : JOURNAL_BATCH;
+            tp->push(local_root, remote_spec, push_rels + lo, push_basis + lo, cnt, ok + lo);
+            for (int i = lo; i < lo + cnt; i++) {
+                if (!ok[i]) {
+                    fprintf(stderr, "  push failed   %s\n", push_rels[i]);
+                    if (result == 0) result = -1;
+                    continue;
+                }
+                char local_file[MAX_PATH_LEN];
+                snprintf(local_file, sizeof(local_file), "%s/%s", local_root, push_rels[i]);
+                base_update(local_root, push_rels[i], local_file, mf);
+                manifest_set_remote(mf, push_rels[i], local_file);
+                journal_done(c->jn, mf, push_rels[i]);
+                if (push_merge[i]) n->merged++; else n->pushed++;
+                struct stat pst;
+                g_run_stats.files_up++;
+                if (stat(local_file, &pst) == 0) g_run_stats.bytes_up += pst.st_size;
+            }
+        }
+        free(ok);
+        timer_stop("phase", "push", t, NULL);
+        if (ndel > 0) journal_checkpoint(c->jn, local_root, mf);
+    }
+    if (ndel > 0) {
+        t = timer_start();
+        int *ok = calloc(ndel, sizeof(int));
+        for (int lo = 0; lo < ndel; lo += JOURNAL_BATCH) {
+            int cnt = ndel - lo < JOURNAL_BATCH ? ndel - lo : JOURNAL_BATCH;
+            tp->remove(remote_spec, del_rels + lo, cnt, ok + lo);
+            for (int i = lo; i < lo + cnt; i++) {
+                if (!ok[i]) {
+                    fprintf(stderr, "  delete failed %s\n", del_rels[i]);
+                    if (result == 0) result = -1;
+                    continue;
+                }
+                base_delete(local_root, del_rels[i], mf);
+                journal_done(c->jn, mf, del_rels[i]);
+                n->pushed++;
+            }
+        }
+        free(ok);
+        timer_stop("phase", "delete", t, NULL);
+    }
+
+    free(push_rels);
+    free(push_basis);
+    free(push_merge);
+    free(del_rels);
+    arena_free(&basis_names);
+    return result;
+}
+
+// One planned action as read back from the journal
+typedef struct {
+    const char *rel;
+    ActionKind kind;
+    long long lsize, lmtime_s;
+    long lmtime_ns;
+    long long rsize, rmtime;
+    Digest base;
+    int has_base;
+    int merged;         // L: the merge's local half is done
+    int done;           // D
+    int replay;         // D not yet covered by a C
+    Digest dhash;       // the base a D left, if dhas
+    int dhas;
+    long long drsize, drmtime;
+} JournalEntry;
+
+static int je_cmp(const void *a, const void *b) {
+    return strcmp(((const JournalEntry *)a)->rel, ((const JournalEntry *)b)->rel);
+}
+
+static JournalEntry *je_find(JournalEntry *v, int n, const char *rel) {
+    JournalEntry key;
+    key.rel = rel;
+    return bsearch(&key, v, n, sizeof(JournalEntry), je_cmp);
+}
+
+// Read the journal into entries (path order, as the plan was written).
+// Returns 0 for a complete plan for remote_spec, -1 otherwise.
+static int journal_load(const char *path, const char *remote_spec, Arena *ar,
+                        JournalEntry **out, int *out_n, int *resumes) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    JournalEntry *v = NULL;
+    int n = 0, cap = 0, planned = 0, ok = 1;
+    *resumes = 0;
+    char line[MAX_PATH_LEN + 256];
+    while (ok && fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') break;  // torn by the interruption
+        line[len - 1] = '\0';
+        char kind[16], base_s[80];
+        int off = 0;
+        if (line[0] == '#') continue;
+        if (line[0] == 'R') {
+            ok = strncmp(line, "R ", 2) == 0 && strcmp(line + 2, remote_spec) == 0;
+        } else if (line[0] == 'P' && !planned) {
+            JournalEntry e;
+            memset(&e, 0, sizeof(e));
+            if (sscanf(line, "P %15s %lld %lld %ld %lld %lld %79s %n", kind, &e.lsize, &e.lmtime_s,
+                       &e.lmtime_ns, &e.rsize, &e.rmtime, base_s, &off) != 7 || !line[off]) { ok = 0; break; }
+            e.kind = ACT_NONE;
+            for (int k = ACT_PULL; k <= ACT_DELETE_LOCAL; k++) if (strcmp(kind, act_names[k]) == 0) e.kind = k;
+            e.has_base = digest_parse(base_s, &e.base) == 0;
+            e.rel = arena_strndup(ar, line + off, strlen(line + off));
+            if (e.kind == ACT_NONE || (n > 0 && strcmp(v[n - 1].rel, e.rel) >= 0)) { ok = 0; break; }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                v = realloc(v, cap * sizeof(JournalEntry));
+            }
+            v[n++] = e;
+        } else if (line[0] == 'G') {
+            planned = 1;
+        } else if (!planned) {
+            ok = 0;
+        } else if (line[0] == 'L' && line[1] == ' ') {
+            JournalEntry *e = je_find(v, n, line + 2);
+            if (e) e->merged = 1;
+        } else if (line[0] == 'D') {
+            long long rsize, rmtime;
+            if (sscanf(line, "D %79s %lld %lld %n", base_s, &rsize, &rmtime, &off) != 3 || !line[off])
+                continue;
+            JournalEntry *e = je_find(v, n, line + off);
+            if (!e) continue;
+            e->done = e->replay = 1;
+            e->dhas   = digest_parse(base_s, &e->dhash) == 0;
+            e->drsize = rsize;
+            e->drmtime = rmtime;
+        } else if (line[0] == 'C') {
+            for (int i = 0; i < n; i++) v[i].replay = 0;
+        } else if (line[0] == 'A') {
+            (*resumes)++;
+        }
+    }
+    fclose(f);
+    if (!ok || !planned) { free(v); return -1; }
+    *out = v;
+    *out_n = n;
+    return 0;
+}
+
+// Does the tree still look the way the plan left it for e? Local and remote
+// must be as planned (or as the action itself leaves them), and the base
+// the action was decided against must still be the manifest's.
+static int journal_entry_current(const JournalEntry *e, const char *local_root,
+                                 Manifest *mf, RemoteList *rl) {
+    ManifestEntry *me = manifest_find(mf, e->rel);
+    int has = me && me->has_hash;
+    if (has != e->has_base || (has && !digest_eq(&me->hash, &e->base))) return 0;
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", local_root, e->rel);
+    struct stat st;
+    int present = lstat(path, &st) == 0 && S_ISREG(st.st_mode);
+    if (e->kind == ACT_PUSH || (e->kind == ACT_MERGE && e->merged)) {
+        if (!present) return 0;
+    } else if (e->kind == ACT_DELETE_LOCAL && !present) {
+        // already carried out
+    } else if (e->lsize < 0) {
+        if (present) return 0;
+    } else if (!present || (long long)st.st_size != e->lsize
+               || (long long)st.st_mtime != e->lmtime_s || ST_MTIME_NSEC(st) != e->lmtime_ns) {
+        return 0;
+    }
+
+    const RemoteEntry *re = rl_find(rl, e->rel);
+    if (e->kind == ACT_DELETE_REMOTE && !re) return 1;
+    // A push the interrupted batch delivered left the remote like the local file
+    if ((e->kind == ACT_PUSH || (e->kind == ACT_MERGE && e->merged)) && re
+        && re->size == (long long)st.st_size && re->mtime == (long long)st.st_mtime) return 1;
+    if (e->rsize < 0) return re == NULL;
+    return re && re->size == e->rsize && re->mtime == e->rmtime;
+}
+
+// Resume an interrupted sync of local_root from its journal. Completed
+// actions the last checkpoint missed are replayed into mf, the rest are
+// checked against the tree and carried out without a new plan. Returns 1
+// when it resumed (the outcome in *result), 0 when there was nothing to
+// resume or the tree has moved on and a fresh plan is needed.
+static int sync_resume(const char *local_root, const char *remote_spec, const Transport *tp,
+                       Manifest *mf, Journal *jn, SyncCounts *n, int *result) {
+    char path[MAX_PATH_LEN];
+    journal_path_for(local_root, path, sizeof(path));
+    if (access(path, F_OK) != 0) return 0;
+
+    Arena ar;
+    memset(&ar, 0, sizeof(ar));
+    JournalEntry *v = NULL;
+    int nv = 0, resumes = 0;
+    if (journal_load(path, remote_spec, &ar, &v, &nv, &resumes) != 0
+        || resumes >= JOURNAL_MAX_RESUMES) {
+        if (resumes >= JOURNAL_MAX_RESUMES)
+            printf("Interrupted sync failed to resume %d times; planning it again\n", resumes);
+        unlink(path);
+        free(v);
+        arena_free(&ar);
+        return 0;
+    }
+
+    // Replay what finished after the last checkpoint, unless the object it
+    // names did not survive; then the action is simply done again
+    char **pending = malloc((nv ? nv : 1) * sizeof(char *));
+    int npending = 0;
+    for (int i = 0; i < nv; i++) {
+        JournalEntry *e = &v[i];
+        if (e->replay) {
+            char obj[MAX_PATH_LEN];
+            if (e->dhas) object_path(&e->dhash, obj, sizeof(obj));
+            if (e->dhas && access(obj, F_OK) != 0) {
+                e->done = 0;
+            } else if (e->dhas) {
+                ManifestEntry *me = manifest_get(mf, e->rel);
+                me->hash     = e->dhash;
+                me->has_hash = 1;
+                me->rsize    = e->drsize;
+                me->rmtime   = e->drmtime;
+                me->mtime_s  = -1;      // force a content check of the local file
+                mf->dirty    = 1;
+            } else {
+                manifest_remove(mf, e->rel);
+            }
+        }
+        if (!e->done) pending[npending++] = (char *)e->rel;
+    }
+
+    int resumed = 0;
+    RemoteList rl;
+    memset(&rl, 0, sizeof(rl));
+    if (npending == 0) {
+        printf("Interrupted sync had finished; recorded its last actions\n");
+        *result = 0;
+        resumed = 1;
+        goto out;
+    }
+
+    // One listing of just the pending paths tells whether the remote moved
+    printf("Checking %d path%s left by an interrupted sync...\n",
+           npending, npending == 1 ? "" : "s");
+    if (tp->list(remote_spec, 0, pending, npending, &rl) != 0) goto out;
+    for (int i = 0; i < nv; i++) {
+        if (v[i].done || journal_entry_current(&v[i], local_root, mf, &rl)) continue;
+        printf("%s changed since the interrupted sync; planning it again\n", v[i].rel);
+        unlink(path);
+        goto out;
+    }
+
+    printf("Resuming interrupted sync: %d of %d action%s left\n",
+           npending, nv, nv == 1 ? "" : "s");
+    Action *plan = calloc(npending, sizeof(Action));
+    char **want = malloc(npending * sizeof(char *));
+    char **want_basis = malloc(npending * sizeof(char *));
+    int unique = 0, nwant = 0;
+    for (int i = 0; i < nv; i++) {
+        const JournalEntry *e = &v[i];
+        if (e->done) continue;
+        Action *a = &plan[unique++];
+        a->rel      = e->rel;
+        a->kind     = e->kind;
+        a->label    = act_labels[e->kind];
+        a->base     = -1;
+        a->has_base = e->has_base;
+        a->status   = (e->kind == ACT_MERGE && e->merged) ? 0 : ACT_PENDING;
+        printf("  %-13s %s\n", a->label, a->rel);
+        // Pulls and merges need the remote version again
+        if (e->kind == ACT_PULL || e->kind == ACT_MERGE) {
+            char basis[MAX_PATH_LEN];
+            int has = base_path_for(mf, e->rel, basis, sizeof(basis)) == 0;
+            want_basis[nwant] = has ? arena_strndup(&ar, basis, strlen(basis)) : NULL;
+            want[nwant++] = (char *)e->rel;
+        }
+    }
+
+    char tmp_remote[] = "/tmp/rmt_remote_XXXXXX";
+    if (!mkdtemp(tmp_remote)) {
+        perror("mkdtemp");
+    } else if (tp->fetch(remote_spec, tmp_remote, want, want_basis, NULL, nwant) != 0) {
+        fprintf(stderr, "Failed to fetch remote files\n");
+        remove_tree(tmp_remote);
+    } else {
+        g_run_stats.files_down += nwant;
+        if (journal_open(jn, local_root, "a") == 0) journal_put(jn, "A\n");
+        SyncCtx ctx = { local_root, tmp_remote, mf, plan, jn };
+        *result = sync_execute(&ctx, tp, remote_spec, unique, n);
+        remove_tree(tmp_remote);
+        resumed = 1;
+    }
+    free(plan);
+    free(want);
+    free(want_basis);
+    if (!resumed) {             // nothing was applied: retry on the next run
+        *result = -1;
+        resumed = 1;
+    }
+
+out:
+    rl_free(&rl);
+    free(pending);
+    free(v);
+    arena_free(&ar);
+    return resumed;
+}
+
+// Final group commit of a run: the objects, then the manifest naming them.
+// The journal goes once the manifest holds all it recorded, unless the run
+// failed part way and should resume.
+static int sync_commit(const char *local_root, Manifest *mf, Journal *jn, int keep) {
+    long long t = timer_start();
+    int rc = 0;
+    if (mf->dirty) {
+        fs_sync(get_objects_dir());
+        rc = manifest_save(local_root, mf);
+        if (rc != 0) fprintf(stderr, "Warning: failed to save manifest\n");
+    }
+    timer_stop("phase", "save manifest", t, NULL);
+    journal_end(jn, local_root, keep || rc != 0);
+    return rc;
+}
+
+static void print_sync_summary(const SyncCounts *n) {
+    printf("\n");
+    printf("  pushed:  %d\n", n->pushed);
+    printf("  pulled:  %d\n", n->pulled);
+    printf("  merged:  %d\n", n->merged);
+    printf("  skipped: %d\n", n->skipped);
+    print_hash_stats();
+}
+
+// Size of the mount for the registry's stats, after a full sync
+static void sync_record_size(const Manifest *mf) {
+    g_sync_files = g_sync_bytes = 0;
+    for (int i = 0; i < mf->count; i++) {
+        if (!mf->entries[i].live) continue;
+        g_sync_files++;
+        g_sync_bytes += mf->entries[i].size;
+    }
+}
+
+// Sync every path of the mount, or only only[0..nonly) when only is non-NULL
+// (rmt watch); either way each path goes through the same classification.
+// An interrupted earlier sync is finished first.
+static int sync_paths_locked(const char *local_root, const char *remote_spec, int dry_run,
+                             char **only, int nonly) {
+    const Transport *tp = transport_for(remote_spec);
+    ignore_load(local_root);
+
+    long long t = timer_start();
+    Manifest mf;
+    if (manifest_load(local_root, &mf) != 0)
+        fprintf(stderr, "Warning: could not read manifest, comparing every file\n");
+    base_migrate_legacy(local_root, &mf);
+    if (!dry_run) hydrate_sweep(local_root);
+    timer_stop("phase", "load manifest", t, NULL);
+
+    SyncCounts n;
+    memset(&n, 0, sizeof(n));
+    Journal jn;
+    memset(&jn, 0, sizeof(jn));
+    int result = 0;
+    if (dry_run) {
+        char jpath[MAX_PATH_LEN];
+        journal_path_for(local_root, jpath, sizeof(jpath));
+        if (access(jpath, F_OK) == 0)
+            printf("An interrupted sync is pending; the next rmt sync resumes it\n");
+    } else if (sync_resume(local_root, remote_spec, tp, &mf, &jn, &n, &result)) {
+        if (sync_commit(local_root, &mf, &jn, result < 0) != 0 && result == 0) result = -1;
+        // A watch batch still has its own paths to sync
+        if (!only || result != 0) {
+            if (!only && result == 0) sync_record_size(&mf);
+            manifest_free(&mf);
+            if (result == 0) print_sync_summary(&n);
+            return result;
+        }
+    }
+
+    char tmp_remote[MAX_PATH_LEN];
+    snprintf(tmp_remote, sizeof(tmp_remote), "/tmp/rmt_remote_XXXXXX");
+    if (!mkdtemp(tmp_remote)) { perror("mkdtemp"); manifest_free(&mf); return -1; }
+
+    // One round trip for remote metadata; file contents only move if needed
+    if (only) printf("Listing %d remote path%s...\n", nonly, nonly == 1 ? "" : "s");
+    else      printf("Listing remote tree...\n");
+    long long hash_since = 0;
+    if (g_remote_hash && !g_hash_comp && mf.saved_at > 0)
+        hash_since = mf.saved_at - REMOTE_HASH_SKEW;
+
+    t = timer_start();
+    RemoteList rl;
+    int lrc = tp->list(remote_spec, hash_since, only, nonly, &rl);
+    timer_stop("phase", "list remote", t, NULL);
+    if (lrc != 0) {
+        fprintf(stderr, "Failed to list remote tree\n");
+        manifest_free(&mf);
+        rmdir(tmp_remote);
+        return -1;
+    }
+    rl_apply_ignore(&rl);
+
+    // Fetch only remote files whose size/mtime moved since the last sync;
+    // their bases let the transport send just the difference
+    Arena basis_names;
+    memset(&basis_names, 0, sizeof(basis_names));
+    char **want = malloc((rl.count ? rl.count : 1) * sizeof(char *));
+    char **want_basis = malloc((rl.count ? rl.count : 1) * sizeof(char *));
+    long long *want_size = malloc((rl.count ? rl.count : 1) * sizeof(long long));
+    int nwant = 0;
+    for (int i = 0; i < rl.count; i++) {
+        RemoteEntry *re = &rl.e[i];
+        char base_file[MAX_PATH_LEN];
+        int has_base = base_path_for(&mf, re->rel, base_file, sizeof(base_file)) == 0;
+        if (has_base && remote_meta_unchanged(&mf, manifest_find(&mf, re->rel), re)) continue;
+        if (!has_base && lazy_placeholder(local_root, &mf, re->rel)) continue;
+        re->fetched = 1;
+        want_basis[nwant] = has_base ? arena_strndup(&basis_names, base_file, strlen(base_file)) : NULL;
+        want_size[nwant] = re->size;
+        want[nwant++] = re->rel;
+        g_run_stats.bytes_down += re->size;
+    }
+    g_run_stats.files_down += nwant;
+    t = timer_start();
+    int frc = tp->fetch(remote_spec, tmp_remote, want, want_basis, want_size, nwant);
+    timer_stop("phase", "fetch", t, NULL);
+    free(want);
+    free(want_basis);
+    free(want_size);
+    arena_free(&basis_names);
+    if (frc != 0) {
+        fprintf(stderr, "Failed to fetch remote files\n");
+        remove_tree(tmp_remote);
+        rl_free(&rl);
+        manifest_free(&mf);
+        return -1;
+    }
+
+    t = timer_start();
+    ScanList *files = only ? scan_paths(local_root, only, nonly) : scan_tree(local_root);
+    timer_stop("phase", "scan local", t, NULL);
+    if (!files) {
+        fprintf(stderr, "Failed to scan local tree\n");
+        remove_tree(tmp_remote);
+        rl_free(&rl);
+        manifest_free(&mf);
+        return -1;
+    }
+
+    t = timer_start();
+    int nbase;
+    ManifestEntry **base = manifest_sorted(&mf, only, nonly, &nbase);
+
+    // Merge-join the three sorted listings into one plan slot per path
+    int total = files->count + rl.count + nbase;
+    Action *plan = calloc(total ? total : 1, sizeof(Action));
+    int unique = 0;
+    int li = 0, ri = 0, bi = 0;
+    while (li < files->count || ri < rl.count || bi < nbase) {
+        const char *rel = NULL;
+        if (li < files->count) rel = files->e[li].rel;
+        if (ri < rl.count && (!rel || strcmp(rl.e[ri].rel, rel) < 0)) rel = rl.e[ri].rel;
+        if (bi < nbase    && (!rel || strcmp(base[bi]->rel, rel) < 0)) rel = base[bi]->rel;
+
+        Action *a = &plan[unique++];
+        a->rel    = rel;
+        a->base   = -1;
+        a->status = ACT_PENDING;
+        if (li < files->count && strcmp(files->e[li].rel, rel) == 0) a->lst = &files->e[li++].st;
+        if (ri < rl.count     && strcmp(rl.e[ri].rel, rel) == 0)     a->re  = &rl.e[ri++];
+        if (bi < nbase        && strcmp(base[bi]->rel, rel) == 0)    a->base = (int)(base[bi++] - mf.entries);
+    }
+    free(base);
+    timer_stop("phase", "join", t, NULL);
+
+    SyncCtx ctx = { local_root, tmp_remote, &mf, plan, &jn };
+
+    // --- Plan: classify every path in parallel; nothing is changed yet ---
+    if (unique > 0) {
+        printf("Comparing %d file%s...\n", unique, unique == 1 ? "" : "s");
+        t = timer_start();
+        pool_run(classify_one, &ctx, unique, "Analysing");
+        timer_stop("phase", "plan", t, NULL);
+    }
+
+    // Action log in path order, whatever order the workers finished in.
+    // A path gone from both sides only leaves a stale manifest entry behind.
+    int nactions = 0;
+    for (int i = 0; i < unique; i++) {
+        const Action *a = &plan[i];
+        if (a->kind == ACT_SKIP) { n.skipped++; continue; }
+        if (a->kind == ACT_NONE) {
+            if (!dry_run && a->base >= 0) manifest_remove(&mf, a->rel);
+            continue;
+        }
+        nactions++;
+        printf("  %-13s %s%s\n", a->label, a->rel, a->note ? a->note : "");
+    }
+
+    if (dry_run) {
+        for (int i = 0; i < unique; i++) {
+            switch (plan[i].kind) {
+                case ACT_PULL:
+                case ACT_DELETE_LOCAL:  n.pulled++; break;
+                case ACT_PUSH:
+                case ACT_DELETE_REMOTE: n.pushed++; break;
+                case ACT_MERGE:         n.merged++; break;
+                default: break;
+            }
+        }
+    } else {
+        // The plan is on disk before the first action changes anything
+        if (nactions > 0 && journal_begin(&jn, local_root, remote_spec, plan, unique, &mf) != 0) {
+            fprintf(stderr, "Warning: could not write sync journal; this run cannot be resumed\n");
+            journal_end(&jn, local_root, 0);
+        }
+        result = sync_execute(&ctx, tp, remote_spec, unique, &n);
+    }
+    free(plan);
+
+    scan_free(files);
+    rl_free(&rl);
+
+    if (!dry_run && sync_commit(local_root, &mf, &jn, result < 0) != 0 && result == 0) result = -1;
+    if (!only && !dry_run && result == 0) sync_record_size(&mf);
+    manifest_free(&mf);
+    remove_tree(tmp_remote);
+
+    if (result == 0 && !dry_run) print_sync_summary(&n);
+    return result;
+}
+
+static int sync_paths(const char *local_root, const char *remote_spec, int dry_run,
+                      char **only, int nonly) {
+    int lk = mount_lock(local_root);
+    int rc = sync_paths_locked(local_root, remote_spec, dry_run, only, nonly);
+    mount_unlock(lk);
+    return rc;
+}
+
+static int smart_sync(const char *local_root, const char *remote_spec, int dry_run) {
+    return sync_paths(local_root, remote_spec, dry_run, NULL, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Lazy mounts — `rmt mount --lazy` lists the remote once, creates its
+// directories and records every file as a placeholder in the manifest.
+// Content arrives through `rmt fetch` or the background hydrator
+// (`rmt hydrate`). Both stage a batch in a temp dir inside the mount and
+// take the mount lock only to move it into place and record its bases, so
+// a sync never waits for their transfers.
+// ---------------------------------------------------------------------------
+
+#define HYDRATE_BATCH_FILES 256
+#define HYDRATE_BATCH_BYTES (64LL << 20)
+#define HYDRATE_SMALL       (1 << 20)   // files up to this size come first
+
+// Set by main: how to start this binary again, and the global options to
+// pass along to the hydrator it starts
+static const char *g_self = "rmt";
+static char **g_global_argv;
+static int g_global_argc;
+
+// Record remote_spec's tree under local_root as placeholders.
+static int lazy_init(const char *local_root, const char *remote_spec) {
+    RemoteList rl;
+    if (transport_for(remote_spec)->list(remote_spec, 0, NULL, 0, &rl) != 0) return -1;
+    rl_apply_ignore(&rl);
+
+    Manifest mf;
+    manifest_init(&mf);
+    long long bytes = 0;
+    char last_dir[MAX_PATH_LEN] = "";
+    for (int i = 0; i < rl.count; i++) {
+        const RemoteEntry *re = &rl.e[i];
+        // The listing is sorted, so siblings share one mkdir
+        const char *slash = strrchr(re->rel, '/');
+        size_t dlen = slash ? (size_t)(slash - re->rel) : 0;
+        if (dlen && (strlen(last_dir) != dlen || strncmp(last_dir, re->rel, dlen) != 0)) {
+            char dir[MAX_PATH_LEN];
+            snprintf(dir, sizeof(dir), "%s/%.*s", local_root, (int)dlen, re->rel);
+            if (mkdir_p(dir) != 0) {
+                fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+                manifest_free(&mf);
+                rl_free(&rl);
+                return -1;
+            }
+            snprintf(last_dir, sizeof(last_dir), "%.*s", (int)dlen, re->rel);
+        }
+        ManifestEntry *e = manifest_get(&mf, re->rel);
+        e->lazy   = 1;
+        e->size   = re->size;
+        e->rsize  = re->size;
+        e->rmtime = re->mtime;
+        bytes += re->size;
+    }
+    printf("      %d file%s (%.1f MiB) to fetch on demand\n",
+           rl.count, rl.count == 1 ? "" : "s", bytes / (1024.0 * 1024.0));
+    int rc = manifest_save(local_root, &mf);
+    manifest_free(&mf);
+    rl_free(&rl);
+    return rc;
+}
+
+// Fetch placeholders rels of local_root and move them into place. Paths
+// that did not arrive are added to failed. Returns how many were filled.
+static int hydrate_batch(const char *local_root, const char *remote_spec,
+                         char **rels, int count, Manifest *failed) {
+    char fresh[MAX_PATH_LEN], stage[MAX_PATH_LEN];
+    snprintf(fresh, sizeof(fresh), "%s/%sXXXXXX", local_root, HYDRATE_STAGE_NEW);
+    if (!mkdtemp(fresh)) { perror("mkdtemp"); return -1; }
+    // Held until the dir is gone so hydrate_sweep leaves it alone; taken
+    // before the rename so the sweep never sees the dir unlocked
+    int sfd = open(fresh, O_RDONLY);
+    if (sfd < 0 || flock(sfd, LOCK_EX) != 0) {
+        perror(fresh);
+        if (sfd >= 0) close(sfd);
+        rmdir(fresh);
+        return -1;
+    }
+    snprintf(stage, sizeof(stage), "%s/%s%s", local_root, HYDRATE_STAGE,
+             fresh + strlen(local_root) + 1 + strlen(HYDRATE_STAGE_NEW));
+    if (rename(fresh, stage) != 0) {
+        perror(stage);
+        close(sfd);
+        rmdir(fresh);
+        return -1;
+    }
+
+    // Placeholders carry the remote size, which picks the large files
+    // worth splitting into pieces
+    long long *sizes = calloc(count ? count : 1, sizeof(long long));
+    Manifest mf;
+    if (manifest_load(local_root, &mf) == 0) {
+        for (int i = 0; i < count; i++) {
+            ManifestEntry *e = manifest_find(&mf, rels[i]);
+            if (e) sizes[i] = e->rsize;
+        }
+        manifest_free(&mf);
+    }
+    // Whatever arrived is used even when part of the batch failed
+    transport_for(remote_spec)->fetch(remote_spec, stage, rels, NULL, sizes, count);
+    free(sizes);
+
+    int lk = mount_lock(local_root);
+    if (manifest_load(local_root, &mf) != 0) {
+        mount_unlock(lk);
+        remove_tree(stage);
+        close(sfd);
+        return -1;
+    }
+    int filled = 0;
+    for (int i = 0; i < count; i++) {
+        char staged[MAX_PATH_LEN], local[MAX_PATH_LEN];
+        snprintf(staged, sizeof(staged), "%s/%s", stage, rels[i]);
+        snprintf(local,  sizeof(local),  "%s/%s", local_root, rels[i]);
+        struct stat st;
+        if (lstat(staged, &st) != 0) { manifest_get(failed, rels[i]); continue; }
+        // Synced, removed or written by hand meanwhile: leave it alone
+        if (!lazy_placeholder(local_root, &mf, rels[i])) continue;
+        if (mkdir_parent(local) != 0 || rename(staged, local) != 0) {
+            fprintf(stderr, "  fetch failed  %s: %s\n", rels[i], strerror(errno));
+            manifest_get(failed, rels[i]);
+            continue;
+        }
+        if (base_update(local_root, rels[i], local, &mf) != 0) continue;
+        manifest_set_remote(&mf, rels[i], local);
+        filled++;
+        g_run_stats.files_down++;
+        g_run_stats.bytes_down += (long long)st.st_size;
+    }
+    if (mf.dirty) {
+        fs_sync(get_objects_dir());
+        if (manifest_save(local_root, &mf) != 0) fprintf(stderr, "Warning: failed to save manifest\n");
+    }
+    manifest_free(&mf);
+    mount_unlock(lk);
+    remove_tree(stage);
+    close(sfd);
+    return filled;
+}
+
+// Fetch order of the hydrator: small files first, since they are most of
+// what a user opens and cost little, then the most recently modified.
+static int hydrate_cmp(const void *a, const void *b) {
+    const ManifestEntry *x = *(const ManifestEntry **)a, *y = *(const ManifestEntry **)b;
+    int xs = x->rsize > HYDRATE_SMALL, ys = y->rsize > HYDRATE_SMALL;
+    if (xs != ys) return xs - ys;
+    if (x->rmtime != y->rmtime) return x->rmtime > y->rmtime ? -1 : 1;
+    return strcmp(x->rel, y->rel);
+}
+
+// A directory pattern also matches everything below it.
+static int lazy_match(const char *pat, const char *rel) {
+    if (!*pat || fnmatch(pat, rel, FNM_PATHNAME) == 0) return 1;
+    char buf[MAX_PATH_LEN];
+    snprintf(buf, sizeof(buf), "%s", rel);
+    for (char *p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int hit = fnmatch(pat, buf, FNM_PATHNAME) == 0;
+        *p = '/';
+        if (hit) return 1;
+    }
+    return 0;
+}
+
+// Absolute form of a path that may not exist yet (a placeholder or glob):
+// its directory is resolved, the last component kept as given.
+static void resolve_pattern(const char *arg, char *out, size_t out_len) {
+    if (realpath(arg, out)) { normalize_path(out); return; }
+    char dir[MAX_PATH_LEN], rdir[MAX_PATH_LEN];
+    const char *slash = strrchr(arg, '/');
+    if (slash) snprintf(dir, sizeof(dir), "%.*s", (int)(slash - arg), arg);
+    else       snprintf(dir, sizeof(dir), ".");
+    if (!dir[0]) snprintf(dir, sizeof(dir), "/");
+    if (!realpath(dir, rdir)) snprintf(rdir, sizeof(rdir), "%s", dir);
+    snprintf(out, out_len, "%s/%s", rdir, slash ? slash + 1 : arg);
+    normalize_path(out);
+}
+
+// The mount holding abs, with *rel set to abs below its root ("" for the root)
+static Mount *mount_containing(MountRegistry *reg, const char *abs, const char **rel) {
+    Mount *best = NULL;
+    size_t best_len = 0;
+    for (int i = 0; i < reg->count; i++) {
+        const char *lp = reg->mounts[i].local_path;
+        size_t n = strlen(lp);
+        if (n <= best_len || strncmp(abs, lp, n) != 0 || (abs[n] != '\0' && abs[n] != '/')) continue;
+        best = &reg->mounts[i];
+        best_len = n;
+    }
+    if (best) *rel = abs[best_len] ? abs + best_len + 1 : "";
+    return best;
+}
+
+// rmt fetch <path|glob>...: fill the placeholders that match now
+static int cmd_fetch(char **args, int nargs) {
+    MountRegistry reg = {0};
+    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+
+    Mount *m = NULL;
+    char **pats = malloc(nargs * sizeof(char *));
+    Arena ar;
+    memset(&ar, 0, sizeof(ar));
+    for (int i = 0; i < nargs; i++) {
+        char abs[MAX_PATH_LEN];
+        const char *rel;
+        resolve_pattern(args[i], abs, sizeof(abs));
+        Mount *am = mount_containing(&reg, abs, &rel);
+        if (!am || (m && am != m)) {
+            fprintf(stderr, "%s is not inside %s\n", args[i], m ? m->local_path : "a mounted path");
+            free(pats);
+            arena_free(&ar);
+            free_registry(&reg);
+            return 1;
+        }
+        m = am;
+        pats[i] = arena_strndup(&ar, rel, strlen(rel));
+    }
+
+    Manifest mf;
+    if (manifest_load(m->local_path, &mf) != 0) {
+        fprintf(stderr, "Cannot read manifest of %s\n", m->local_path);
+        free(pats);
+        arena_free(&ar);
+        free_registry(&reg);
+        return 1;
+    }
+    char **rels = malloc((mf.count ? mf.count : 1) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < mf.count; i++) {
+        const ManifestEntry *e = &mf.entries[i];
+        if (!e->live || !e->lazy) continue;
+        for (int k = 0; k < nargs; k++) {
+            if (!lazy_match(pats[k], e->rel)) continue;
+            rels[n++] = arena_strndup(&ar, e->rel, strlen(e->rel));
+            break;
+        }
+    }
+    manifest_free(&mf);
+    qsort(rels, n, sizeof(char *), pl_cmp);
+
+    int rc = 0;
+    if (n == 0) {
+        printf("Nothing to fetch: no placeholder matches\n");
+    } else {
+        hydrate_sweep(m->local_path);
+        transport_open(m->remote_spec);
+        Manifest failed;
+        manifest_init(&failed);
+        int got = hydrate_batch(m->local_path, m->remote_spec, rels, n, &failed);
+        if (got < 0) rc = 1;
+        else {
+            printf("✓ Fetched %d file%s\n", got, got == 1 ? "" : "s");
+            if (got < n) { printf("  %d could not be fetched\n", n - got); rc = 1; }
+        }
+        manifest_free(&failed);
+    }
+    free(rels);
+    free(pats);
+    arena_free(&ar);
+    free_registry(&reg);
+    return rc;
+}
+
+// rmt hydrate <path>: fill every placeholder of the mount, a batch at a
+// time, in hydrate_cmp order. One hydrator runs per mount.
+static int cmd_hydrate(const char *local) {
+    MountRegistry reg = {0};
+    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+    Mount *m = find_mount(&reg, local);
+    if (!m) {
+        fprintf(stderr, "%s is not a mounted path\n", local);
+        free_registry(&reg);
+        return 1;
+    }
+    char local_root[MAX_PATH_LEN], remote_spec[MAX_PATH_LEN];
+    snprintf(local_root,  sizeof(local_root),  "%s", m->local_path);
+    snprintf(remote_spec, sizeof(remote_spec), "%s", m->remote_spec);
+    free_registry(&reg);
+
+    char lock[MAX_PATH_LEN];
+    snprintf(lock, sizeof(lock), "%s/%s.hydrate", local_root, MANIFEST_NAME);
+    int lfd = open(lock, O_RDWR | O_CREAT, 0600);
+    if (lfd < 0 || flock(lfd, LOCK_EX | LOCK_NB) != 0) {
+        printf("%s is already being hydrated\n", local_root);
+        if (lfd >= 0) close(lfd);
+        return 0;
+    }
+    hydrate_sweep(local_root);
+
+    transport_open(remote_spec);
+    Manifest failed;
+    manifest_init(&failed);
+    int filled = 0, rc = 0;
+    for (;;) {
+        // Re-read each round: syncs and fetches change the manifest meanwhile
+        Manifest mf;
+        if (manifest_load(local_root, &mf) != 0) { rc = 1; break; }
+        ManifestEntry **todo = malloc((mf.count ? mf.count : 1) * sizeof(ManifestEntry *));
+        int ntodo = 0;
+        for (int i = 0; i < mf.count; i++) {
+            ManifestEntry *e = &mf.entries[i];
+            if (e->live && e->lazy && !manifest_find(&failed, e->rel)) todo[ntodo++] = e;
+        }
+        if (ntodo == 0) { free(todo); manifest_free(&mf); break; }
+        qsort(todo, ntodo, sizeof(ManifestEntry *), hydrate_cmp);
+
+        char **rels = malloc(ntodo * sizeof(char *));
+        long long bytes = 0;
+        int n = 0;
+        while (n < ntodo && n < HYDRATE_BATCH_FILES && (n == 0 || bytes < HYDRATE_BATCH_BYTES)) {
+            bytes += todo[n]->rsize;
+            rels[n] = strdup(todo[n]->rel);
+            n++;
+        }
+        free(todo);
+        manifest_free(&mf);
+
+        printf("Fetching %d of %d remaining file%s (%.1f MiB)...\n",
+               n, ntodo, ntodo == 1 ? "" : "s", bytes / (1024.0 * 1024.0));
+        fflush(stdout);
+        qsort(rels, n, sizeof(char *), pl_cmp);
+        int got = hydrate_batch(local_root, remote_spec, rels, n, &failed);
+        for (int i = 0; i < n; i++) free(rels[i]);
+        free(rels);
+        if (got < 0) { rc = 1; break; }
+        filled += got;
+    }
+
+    int nfailed = 0;
+    for (int i = 0; i < failed.count; i++) if (failed.entries[i].live) nfailed++;
+    printf("✓ Hydrated %s: %d file%s fetched", local_root, filled, filled == 1 ? "" : "s");
+    if (nfailed > 0) printf(", %d could not be fetched", nfailed);
     printf("\n");
+    manifest_free(&failed);
+    flock(lfd, LOCK_UN);
+    close(lfd);
+    return rc != 0 || nfailed > 0 ? 1 : 0;
 }
 
-static int smart_sync(const char *local_root, const char *remote_spec, int dry_run) {
-    char tmp_remote[MAX_PATH_LEN];
-    snprintf(tmp_remote, sizeof(tmp_remote), "/tmp/rmt_remote_XXXXXX");
-    if (!mkdtemp(tmp_remote)) { perror("mkdtemp"); return -1; }
-
-    // Fetch remote tree — spinner covers this blocking rsync
-    printf("Fetching remote tree...\n");
-    if (rsync_pull(remote_spec, tmp_remote, 0) != 0) {
-        fprintf(stderr, "Failed to fetch remote tree\n");
-        char *qtmp = shell_quote(tmp_remote);
-        if (qtmp) {
-            char cmd[MAX_PATH_LEN * 2];
-            snprintf(cmd, sizeof(cmd), "rm -rf %s", qtmp);
-            system(cmd);
-            free(qtmp);
-        }
-        return -1;
+// Start `rmt hydrate local_root` detached from the terminal, logging to
+// ~/.rmt/hydrate.log. A fresh process rather than a fork of this one, which
+// is about to close the ssh connections it would share.
+static void hydrate_spawn(const char *local_root) {
+    char log[MAX_PATH_LEN];
+    snprintf(log, sizeof(log), "%s/hydrate.log", get_rmt_dir());
+    fflush(stdout);
+    fflush(stderr);
+    STAT_ADD(g_run_stats.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return; }
+    if (pid > 0) {
+        printf("  Fetching files in the background (pid %d, log %s)\n", (int)pid, log);
+        return;
     }
 
-    PathList *files = local_files(local_root);
-
-    PathList *remote_only = malloc(sizeof(PathList));
-    remote_only->cap   = 64;
-    remote_only->count = 0;
-    remote_only->paths = malloc(remote_only->cap * sizeof(char *));
-    walk_dir(tmp_remote, "", remote_only);
-    qsort(remote_only->paths, remote_only->count, sizeof(char *), pl_cmp);
+    setsid();
+    int in  = open("/dev/null", O_RDONLY);
+    int out = open(log, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (in >= 0)  { dup2(in, STDIN_FILENO); close(in); }
+    if (out >= 0) { dup2(out, STDOUT_FILENO); dup2(out, STDERR_FILENO); close(out); }
 
-    int total = files->count + remote_only->count;
-    char **all = malloc((total ? total : 1) * sizeof(char *));
+    char **argv = malloc((g_global_argc + 4) * sizeof(char *));
     int n = 0;
-    for (int i = 0; i < files->count;       i++) all[n++] = files->paths[i];
-    for (int i = 0; i < remote_only->count; i++) all[n++] = remote_only->paths[i];
-    qsort(all, n, sizeof(char *), pl_cmp);
+    argv[n++] = (char *)g_self;
+    for (int i = 0; i < g_global_argc; i++) argv[n++] = g_global_argv[i];
+    argv[n++] = "hydrate";
+    argv[n++] = (char *)local_root;
+    argv[n] = NULL;
+#ifdef __linux__
+    execv("/proc/self/exe", argv);
+#endif
+    execvp(g_self, argv);
+    perror("exec");
+    _exit(127);
+}
 
-    int pushed = 0, pulled = 0, merged = 0, skipped = 0;
-    int result = 0;
+// ---------------------------------------------------------------------------
+// Watch — inotify marks paths dirty as they change; after a short quiet
+// period only those paths are synced. A periodic full sync picks up remote
+// edits, which inotify cannot see.
+// ---------------------------------------------------------------------------
 
-    // Count unique files for the progress bar
-    int unique = 0;
-    {
-        const char *p = NULL;
-        for (int i = 0; i < n; i++) {
-            if (!p || strcmp(all[i], p) != 0) { unique++; p = all[i]; }
-        }
-    }
+#define WATCH_INTERVAL_MS 250   // quiet time before dirty paths are synced
+#define WATCH_MAX_DELAY_MS 2000 // ...but never hold an edit back longer than this
+#define WATCH_POLL_S      30    // full sync (remote changes) this often
 
-    // Action log lines print below the bar — we'll keep bar on stderr, log on stdout
-    if (unique > 0) {
-        printf("Comparing %d file%s...\n", unique, unique == 1 ? "" : "s");
-        draw_bar(0, unique, "Analysing");
-    }
+static volatile sig_atomic_t g_watch_stop = 0;
 
-    int done = 0;
-    const char *prev = NULL;
-    for (int i = 0; i < n && result == 0; i++) {
-        const char *rel = all[i];
-        if (prev && strcmp(rel, prev) == 0) continue;
-        prev = rel;
-
-        // Update bar before processing each file
-        draw_bar(done, unique, "Analysing");
-
-        char local_file[MAX_PATH_LEN], base_file[MAX_PATH_LEN], remote_file[MAX_PATH_LEN];
-        snprintf(local_file,  sizeof(local_file),  "%s/%s", local_root, rel);
-        snprintf(remote_file, sizeof(remote_file), "%s/%s", tmp_remote, rel);
-        base_path_for(local_root, rel, base_file, sizeof(base_file));
-
-        int has_local  = (access(local_file,  F_OK) == 0);
-        int has_remote = (access(remote_file, F_OK) == 0);
-        int has_base   = (access(base_file,   F_OK) == 0);
-
-        done++;
-
-        if (!has_local && !has_remote) continue;
-
-        /* New file only on remote */
-        if (!has_local && has_remote && !has_base) {
-            fprintf(stderr, "\r\033[2K");  // clear bar line before printing action
-            printf("  pull (new)    %s\n", rel);
-            if (!dry_run) {
-                char lf_copy[MAX_PATH_LEN];
-                strncpy(lf_copy, local_file, sizeof(lf_copy) - 1);
-                mkdir_p(dirname(lf_copy));
-                char *qrf = shell_quote(remote_file);
-                char *qlf = shell_quote(local_file);
-                if (qrf && qlf) {
-                    char cmd[8192];
-                    snprintf(cmd, sizeof(cmd), "cp %s %s", qrf, qlf);
-                    system(cmd);
-                }
-                free(qrf); free(qlf);
-                base_update(local_root, rel, local_file);
-            }
-            pulled++;
-            continue;
-        }
+static void watch_on_signal(int sig) {
+    (void)sig;
+    g_watch_stop = 1;
+}
 
-        /* File deleted locally, existed at base */
-        if (!has_local && has_base) {
-            int remote_changed = has_remote ? (run_comp_diff(base_file, remote_file) == 1) : 0;
-            if (remote_changed) {
-                fprintf(stderr, "\r\033[2K");
-                printf("  conflict      %s (deleted locally, modified remotely — keeping remote)\n", rel);
-                if (!dry_run) {
-                    char lf_copy[MAX_PATH_LEN];
-                    strncpy(lf_copy, local_file, sizeof(lf_copy) - 1);
-                    mkdir_p(dirname(lf_copy));
-                    char *qrf = shell_quote(remote_file);
-                    char *qlf = shell_quote(local_file);
-                    if (qrf && qlf) {
-                        char cmd[8192];
-                        snprintf(cmd, sizeof(cmd), "cp %s %s", qrf, qlf);
-                        system(cmd);
-                    }
-                    free(qrf); free(qlf);
-                    base_update(local_root, rel, local_file);
-                }
-            } else {
-                fprintf(stderr, "\r\033[2K");
-                printf("  delete remote %s\n", rel);
-                if (!dry_run) {
-                    char ssh_host[MAX_PATH_LEN], remote_path[MAX_PATH_LEN];
-                    const char *colon = strchr(remote_spec, ':');
-                    if (colon) {
-                        size_t hlen = colon - remote_spec;
-                        strncpy(ssh_host, remote_spec, hlen); ssh_host[hlen] = '\0';
-                        snprintf(remote_path, sizeof(remote_path), "%s/%s", colon+1, rel);
-                        char *qhost  = shell_quote(ssh_host);
-                        char *qrpath = shell_quote(remote_path);
-                        if (qhost && qrpath) {
-                            char cmd[8192];
-                            snprintf(cmd, sizeof(cmd), "ssh %s rm -f %s 2>/dev/null", qhost, qrpath);
-                            system(cmd);
-                        }
-                        free(qhost); free(qrpath);
-                    }
-                    base_delete(local_root, rel);
-                }
-                pushed++;
+#ifdef __linux__
+
+static long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+// Drop dirty paths whose content is still their base, such as our own
+// pulls, and expand a removed or renamed directory into the
+// tracked files that were under it.
+static int watch_collect(const char *local_root, PathList *dirty, char ***out) {
+    Manifest mf;
+    if (manifest_load(local_root, &mf) != 0) return -1;
+    PathList *want = pl_new();
+    for (int i = 0; i < dirty->count; i++) {
+        const char *rel = dirty->paths[i];
+        char full[MAX_PATH_LEN];
+        snprintf(full, sizeof(full), "%s/%s", local_root, rel);
+        struct stat st;
+        ManifestEntry *e = manifest_find(&mf, rel);
+        if (lstat(full, &st) == 0) {
+            FileStat fs;
+            filestat_from(&fs, &st);
+            if (S_ISREG(st.st_mode) && !(e && manifest_stat_matches(&mf, e, &fs))) {
+                // Racily-clean or merely touched: the base hash settles it
+                Digest h;
+                if (!(e && e->has_hash && hash_file(full, e->hash.algo, &h) == 0
+                      && digest_eq(&h, &e->hash)))
+                    pl_push(want, rel);
             }
-            continue;
+            if (!S_ISDIR(st.st_mode)) continue;
+        } else if (e) {
+            pl_push(want, rel);
         }
-
-        /* File only local (new) */
-        if (has_local && !has_remote && !has_base) {
-            fprintf(stderr, "\r\033[2K");
-            printf("  push (new)    %s\n", rel);
-            if (!dry_run) {
-                rsync_push_file(local_file, remote_spec, rel);
-                base_update(local_root, rel, local_file);
+        size_t n = strlen(rel);
+        for (int j = 0; j < mf.count; j++) {
+            const ManifestEntry *me = &mf.entries[j];
+            if (me->live && strncmp(me->rel, rel, n) == 0 && me->rel[n] == '/') {
+                snprintf(full, sizeof(full), "%s/%s", local_root, me->rel);
+                if (access(full, F_OK) != 0) pl_push(want, me->rel);
             }
-            pushed++;
-            continue;
         }
+    }
+    manifest_free(&mf);
 
-        /* Both exist — diff against base */
-        int local_changed  = has_base ? (run_comp_diff(base_file, local_file)  == 1) : 1;
-        int remote_changed = has_base ? (run_comp_diff(base_file, remote_file) == 1) : 1;
+    qsort(want->paths, want->count, sizeof(char *), pl_cmp);
+    int n = 0;
+    for (int i = 0; i < want->count; i++) {
+        if (n > 0 && strcmp(want->paths[i], want->paths[n - 1]) == 0) { free(want->paths[i]); continue; }
+        want->paths[n++] = want->paths[i];
+    }
+    *out = want->paths;
+    free(want);
+    return n;
+}
 
-        if (!local_changed && !remote_changed) {
-            skipped++;
-            continue;
-        }
+typedef struct {
+    int fd;
+    const char *root;
+    int *wd;            // wd[i] watches directory rel[i] ("" = root)
+    char **rel;
+    int count, cap;
+    int overflow;       // events were lost: next flush is a full sync
+} Watcher;
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+static const char *watch_dir_of(const Watcher *w, int wd) {
+    for (int i = 0; i < w->count; i++) if (w->wd[i] == wd) return w->rel[i];
+    return NULL;
+}
 
-        if (local_changed && !remote_changed) {
-            fprintf(stderr, "\r\033[2K");
-            printf("  push          %s\n", rel);
-            if (!dry_run) {
-                rsync_push_file(local_file, remote_spec, rel);
-                base_update(local_root, rel, local_file);
-            }
-            pushed++;
-            continue;
-        }
+static void watch_forget(Watcher *w, int wd) {
+    for (int i = 0; i < w->count; i++) {
+        if (w->wd[i] != wd) continue;
+        free(w->rel[i]);
+        w->wd[i]  = w->wd[--w->count];
+        w->rel[i] = w->rel[w->count];
+        return;
+    }
+}
 
-        if (!local_changed && remote_changed) {
-            fprintf(stderr, "\r\033[2K");
-            printf("  pull          %s\n", rel);
-            if (!dry_run) {
-                char lf_copy[MAX_PATH_LEN];
-                strncpy(lf_copy, local_file, sizeof(lf_copy) - 1);
-                mkdir_p(dirname(lf_copy));
-                char *qrf = shell_quote(remote_file);
-                char *qlf = shell_quote(local_file);
-                if (qrf && qlf) {
-                    char cmd[8192];
-                    snprintf(cmd, sizeof(cmd), "cp %s %s", qrf, qlf);
-                    system(cmd);
-                }
-                free(qrf); free(qlf);
-                base_update(local_root, rel, local_file);
-            }
-            pulled++;
-            continue;
+// Watch rel and every directory below it. Files found on the way are
+// marked dirty when the whole tree is new (created or moved in).
+static void watch_add_tree(Watcher *w, const char *rel, PathList *dirty) {
+    char full[MAX_PATH_LEN];
+    if (rel[0] == '\0') snprintf(full, sizeof(full), "%s", w->root);
+    else                snprintf(full, sizeof(full), "%s/%s", w->root, rel);
+
+    int wd = inotify_add_watch(w->fd, full, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC)
+            fprintf(stderr, "Warning: out of inotify watches (fs.inotify.max_user_watches)\n");
+        return;
+    }
+    watch_forget(w, wd);    // a reused wd is now this directory
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->wd  = realloc(w->wd,  w->cap * sizeof(int));
+        w->rel = realloc(w->rel, w->cap * sizeof(char *));
+    }
+    w->wd[w->count]    = wd;
+    w->rel[w->count++] = strdup(rel);
+
+    DIR *d = opendir(full);
+    if (!d) return;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (strcmp(ent->d_name, BASE_DIR_NAME) == 0) continue;
+        if (rel[0] == '\0' && strncmp(ent->d_name, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0) continue;
+
+        char entry_rel[MAX_PATH_LEN];
+        if (rel[0] == '\0') snprintf(entry_rel, sizeof(entry_rel), "%s", ent->d_name);
+        else                snprintf(entry_rel, sizeof(entry_rel), "%s/%s", rel, ent->d_name);
+        char entry_full[MAX_PATH_LEN];
+        snprintf(entry_full, sizeof(entry_full), "%s/%s", w->root, entry_rel);
+
+        struct stat st;
+        if (lstat(entry_full, &st) != 0) continue;
+        if (ignore_match(&g_ignore, entry_rel, S_ISDIR(st.st_mode))) continue;
+        if (S_ISDIR(st.st_mode))                watch_add_tree(w, entry_rel, dirty);
+        else if (S_ISREG(st.st_mode) && dirty)  pl_push(dirty, entry_rel);
+    }
+    closedir(d);
+}
+
+// Drain pending inotify events into the dirty set.
+static void watch_read(Watcher *w, PathList *dirty) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len <= 0) return;
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) { w->overflow = 1; continue; }
+            if (ev->mask & IN_IGNORED)    { watch_forget(w, ev->wd); continue; }
+            const char *dir = watch_dir_of(w, ev->wd);
+            if (!dir || ev->len == 0 || ev->name[0] == '\0') continue;
+            if (strcmp(ev->name, BASE_DIR_NAME) == 0) continue;
+            if (dir[0] == '\0' && strncmp(ev->name, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0) continue;
+
+            char rel[MAX_PATH_LEN];
+            if (dir[0] == '\0') snprintf(rel, sizeof(rel), "%s", ev->name);
+            else                snprintf(rel, sizeof(rel), "%s/%s", dir, ev->name);
+            if (ignore_match(&g_ignore, rel, (ev->mask & IN_ISDIR) != 0)) continue;
+
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                watch_add_tree(w, rel, dirty);
+            else if (!(ev->mask & IN_ISDIR) && (ev->mask & IN_CREATE))
+                continue;   // the IN_CLOSE_WRITE that follows is what matters
+            pl_push(dirty, rel);
         }
+    }
+}
 
-        /* Both changed — 3-way merge */
-        fprintf(stderr, "\r\033[2K");
-        printf("  merge         %s\n", rel);
-        if (!dry_run) {
-            char merged_file[MAX_PATH_LEN];
-            snprintf(merged_file, sizeof(merged_file), "%s.rmt_merge_XXXXXX", local_file);
-            int mfd = mkstemp(merged_file);
-            if (mfd < 0) { perror("mkstemp"); result = -1; break; }
-            close(mfd);
-
-            const char *bpath = has_base ? base_file : "/dev/null";
-            int mrc = run_comp_merge(bpath, local_file, remote_file, merged_file);
-
-            if (mrc == 0) {
-                rename(merged_file, local_file);
-                rsync_push_file(local_file, remote_spec, rel);
-                base_update(local_root, rel, local_file);
-                merged++;
-            } else if (mrc == 1) {
-                rename(merged_file, local_file);
-                print_conflict(local_file);
-                result = 1;
-            } else {
-                unlink(merged_file);
-                fprintf(stderr, "comp merge failed for %s\n", rel);
-                result = -1;
+static int watch_loop(const char *local_root, const char *remote_spec,
+                      int interval_ms, int poll_s) {
+    Watcher w;
+    memset(&w, 0, sizeof(w));
+    w.root = local_root;
+    w.fd   = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0) { perror("inotify_init1"); return 1; }
+    ignore_load(local_root);
+    watch_add_tree(&w, "", NULL);
+    printf("Watching %s (%d director%s) — Ctrl-C to stop\n",
+           local_root, w.count, w.count == 1 ? "y" : "ies");
+
+    PathList *dirty = pl_new();
+    long long first_dirty = 0, last_event = 0;
+    long long next_poll = now_ms();     // start with a full sync
+    int failures = 0;
+
+    while (!g_watch_stop) {
+        long long now = now_ms();
+        long long deadline = next_poll;
+        if (dirty->count > 0 || w.overflow) {
+            long long flush_at = last_event + interval_ms;
+            if (flush_at > first_dirty + WATCH_MAX_DELAY_MS) flush_at = first_dirty + WATCH_MAX_DELAY_MS;
+            if (flush_at < deadline) deadline = flush_at;
+        }
+        int timeout = deadline > now ? (int)(deadline - now) : 0;
+
+        struct pollfd pfd = { w.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) > 0) {
+            int before = dirty->count;
+            watch_read(&w, dirty);
+            if (dirty->count > before || w.overflow) {
+                last_event = now_ms();
+                if (first_dirty == 0) first_dirty = last_event;
             }
-        } else {
-            merged++;
+            continue;   // recompute deadlines
+        }
+        if (g_watch_stop) break;
+        now = now_ms();
+
+        int full = w.overflow || now >= next_poll;
+        char **paths = NULL;
+        int npaths = 0;
+        if (!full) {
+            if (dirty->count == 0) continue;
+            npaths = watch_collect(local_root, dirty, &paths);
+            if (npaths < 0) full = 1;
+        }
+        for (int i = 0; i < dirty->count; i++) free(dirty->paths[i]);
+        dirty->count = 0;
+        first_dirty = 0;
+        w.overflow  = 0;
+
+        int rc = 0;
+        if (full) {
+            time_t t = time(NULL);
+            char when[16];
+            strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+            printf("\n[%s] full sync\n", when);
+            rc = smart_sync(local_root, remote_spec, 0);
+            next_poll = now_ms() + (long long)poll_s * 1000;
+        } else if (npaths > 0) {
+            time_t t = time(NULL);
+            char when[16];
+            strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+            printf("\n[%s] %d changed path%s\n", when, npaths, npaths == 1 ? "" : "s");
+            rc = sync_paths(local_root, remote_spec, 0, paths, npaths);
+        }
+        for (int i = 0; i < npaths; i++) free(paths[i]);
+        free(paths);
+
+        fflush(stdout);     // keep logs current when redirected to a file
+        if (rc == 1) printf("Still watching.\n");
+        else if (rc != 0 && ++failures >= 3) {
+            fprintf(stderr, "Sync failed %d times in a row; stopping\n", failures);
+            break;
         }
+        if (rc == 0) failures = 0;
+    }
+
+    pl_free(dirty);
+    for (int i = 0; i < w.count; i++) free(w.rel[i]);
+    free(w.wd);
+    free(w.rel);
+    close(w.fd);
+    return g_watch_stop ? 0 : 1;
+}
+
+#else
+
+// Without inotify, fall back to a full sync every poll interval.
+static int watch_loop(const char *local_root, const char *remote_spec,
+                      int interval_ms, int poll_s) {
+    (void)interval_ms;
+    printf("Watching %s by polling every %ds (no inotify on this platform)\n", local_root, poll_s);
+    while (!g_watch_stop) {
+        int rc = smart_sync(local_root, remote_spec, 0);
+        if (rc < 0) fprintf(stderr, "Sync failed\n");
+        for (int i = 0; i < poll_s * 10 && !g_watch_stop; i++) usleep(100000);
     }
+    return 0;
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Multi-mount sync — `rmt sync` with no path runs one child process per
+// mount, up to --parallel at once and --per-host against any one server.
+// Each child's output is collected and printed as one section when it ends.
+// ---------------------------------------------------------------------------
 
-    // Finalise bar
-    if (unique > 0) draw_bar(unique, unique, "Analysing");
+#define SYNC_PARALLEL 4
+#define SYNC_PER_HOST 2
 
-    free(all);
-    pl_free(files);
-    pl_free(remote_only);
+static int g_sync_parallel = SYNC_PARALLEL;
+static int g_sync_per_host = SYNC_PER_HOST;
 
-    char *qtmp = shell_quote(tmp_remote);
-    if (qtmp) {
-        char cmd[MAX_PATH_LEN * 2 + 16];
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", qtmp);
-        system(cmd);
-        free(qtmp);
+typedef struct {
+    Mount *m;
+    char host[MAX_PATH_LEN];
+    pid_t pid;          // 0 = waiting, -1 = finished
+    int fd;             // read end of the child's stdout + stderr
+    char *out;
+    size_t len, cap;
+    int rc;             // 0 ok, 1 conflict, -1 failed
+    long long t0, t1;
+} SyncJob;
+
+// Runs in a child when syncing several mounts, so a successful sync is
+// recorded in the registry from here rather than by the caller.
+static int sync_mount(Mount *m, int dry_run, int pull_only, int push_only) {
+    int rc;
+    long long t0 = now_ns();
+    g_sync_files = g_sync_bytes = -1;
+    ignore_load(m->local_path);
+    if (pull_only) {
+        rc = transport_for(m->remote_spec)->pull_tree(m->remote_spec, m->local_path, dry_run);
+        if (rc == 0 && !dry_run) base_init(m->local_path);
+    } else if (push_only) {
+        rc = transport_for(m->remote_spec)->push_tree(m->local_path, m->remote_spec, dry_run);
+    } else {
+        rc = smart_sync(m->local_path, m->remote_spec, dry_run);
+    }
+    if (rc == 0 && !dry_run
+        && registry_record_sync(m->local_path, g_sync_files, g_sync_bytes,
+                                (now_ns() - t0) / 1000000) != 0)
+        fprintf(stderr, "Warning: Failed to save registry\n");
+    return rc;
+}
+
+static int sync_job_start(SyncJob *jobs, int njobs, SyncJob *j,
+                          int dry_run, int pull_only, int push_only) {
+    // Started here rather than in the child so that mounts on the same host
+    // share one master and it outlives every child that uses it
+    transport_open(j->m->remote_spec);
+
+    int p[2];
+    if (pipe(p) != 0) { perror("pipe"); return -1; }
+    fflush(stdout);
+    fflush(stderr);
+    STAT_ADD(g_run_stats.forks, 1);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); close(p[0]); close(p[1]); return -1; }
+    if (pid == 0) {
+        for (int i = 0; i < njobs; i++) if (jobs[i].pid > 0) close(jobs[i].fd);
+        close(p[0]);
+        dup2(p[1], STDOUT_FILENO);
+        dup2(p[1], STDERR_FILENO);
+        close(p[1]);
+        g_progress = PROGRESS_OFF;
+        int rc = sync_mount(j->m, dry_run, pull_only, push_only);
+        print_stats_table();
+        if (g_trace_path) {
+            // One trace per mount next to the parent's: FILE.1, FILE.2, ...
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%s.%d", g_trace_path, (int)(j - jobs) + 1);
+            g_trace_path = path;
+            write_trace();
+        }
+        fflush(stdout);
+        fflush(stderr);
+        _exit(rc == 0 ? 0 : rc == 1 ? 1 : 2);   // no atexit handlers: they belong to the parent
+    }
+    close(p[1]);
+    j->pid = pid;
+    j->fd  = p[0];
+    j->t0  = now_ns();
+    return 0;
+}
+
+static void sync_job_finish(SyncJob *j) {
+    int status;
+    while (waitpid(j->pid, &status, 0) < 0 && errno == EINTR) {}
+    close(j->fd);
+    j->pid = -1;
+    j->t1  = now_ns();
+    int ex = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+    j->rc  = ex == 0 ? 0 : ex == 1 ? 1 : -1;
+
+    printf("=== %s (%.1fs) ===\n", j->m->local_path, (j->t1 - j->t0) / 1e9);
+    if (j->len > 0) {
+        fwrite(j->out, 1, j->len, stdout);
+        if (j->out[j->len - 1] != '\n') putchar('\n');
     }
+    if      (j->rc == 0) printf("✓ Synced\n\n");
+    else if (j->rc == 1) printf("⚠ Conflict\n\n");
+    else                 printf("✗ Failed\n\n");
+    fflush(stdout);
+}
 
-    if (result == 0 && !dry_run) {
-        printf("\n");
-        printf("  pushed:  %d\n", pushed);
-        printf("  pulled:  %d\n", pulled);
-        printf("  merged:  %d\n", merged);
-        printf("  skipped: %d\n", skipped);
+static int sync_all_mounts(MountRegistry *reg, int dry_run, int pull_only, int push_only) {
+    int n = reg->count;
+    SyncJob *jobs = calloc(n, sizeof(SyncJob));
+    for (int i = 0; i < n; i++) {
+        char rpath[MAX_PATH_LEN];
+        jobs[i].m = &reg->mounts[i];
+        if (split_remote_spec(jobs[i].m->remote_spec, jobs[i].host, sizeof(jobs[i].host),
+                              rpath, sizeof(rpath)) != 0)
+            snprintf(jobs[i].host, sizeof(jobs[i].host), "%s", jobs[i].m->remote_spec);
     }
 
-    return result;
+    printf("Syncing %d mount%s (up to %d at once, %d per host)...\n\n",
+           n, n == 1 ? "" : "s", g_sync_parallel, g_sync_per_host);
+    long long t0 = now_ns();
+    int running = 0, finished = 0;
+    struct pollfd *pfd = malloc(n * sizeof(struct pollfd));
+    int *pidx = malloc(n * sizeof(int));
+
+    while (finished < n) {
+        // Start waiting mounts in registry order while the limits allow
+        for (int i = 0; i < n && running < g_sync_parallel; i++) {
+            if (jobs[i].pid != 0) continue;
+            int on_host = 0;
+            for (int k = 0; k < n; k++)
+                if (jobs[k].pid > 0 && strcmp(jobs[k].host, jobs[i].host) == 0) on_host++;
+            if (on_host >= g_sync_per_host) continue;
+            if (sync_job_start(jobs, n, &jobs[i], dry_run, pull_only, push_only) != 0) {
+                jobs[i].pid = -1;
+                jobs[i].rc  = -1;
+                finished++;
+                continue;
+            }
+            running++;
+        }
+
+        int np = 0;
+        for (int i = 0; i < n; i++) {
+            if (jobs[i].pid <= 0) continue;
+            pfd[np].fd = jobs[i].fd;
+            pfd[np].events = POLLIN;
+            pidx[np++] = i;
+        }
+        if (np == 0) break;
+        if (poll(pfd, np, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        for (int k = 0; k < np; k++) {
+            if (!(pfd[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            SyncJob *j = &jobs[pidx[k]];
+            if (j->cap - j->len < 4096) {
+                j->cap = j->cap ? j->cap * 2 : 8192;
+                j->out = realloc(j->out, j->cap);
+            }
+            ssize_t r = read(j->fd, j->out + j->len, j->cap - j->len);
+            if (r > 0) { j->len += (size_t)r; continue; }
+            if (r < 0 && errno == EINTR) continue;
+            sync_job_finish(j);
+            running--;
+            finished++;
+        }
+    }
+    free(pfd);
+    free(pidx);
+
+    int ok = 0, conflicts = 0, failed = 0;
+    for (int i = 0; i < n; i++) {
+        if      (jobs[i].rc == 0) ok++;
+        else if (jobs[i].rc == 1) conflicts++;
+        else                      failed++;
+    }
+    printf("Summary: %d synced, %d conflict%s, %d failed (%.1fs)\n",
+           ok, conflicts, conflicts == 1 ? "" : "s", failed, (now_ns() - t0) / 1e9);
+    for (int i = 0; i < n; i++) {
+        if (jobs[i].rc == 1) printf("  conflict  %s\n", jobs[i].m->local_path);
+        if (jobs[i].rc <  0) printf("  failed    %s\n", jobs[i].m->local_path);
+        free(jobs[i].out);
+    }
+    free(jobs);
+    return (conflicts || failed) ? 1 : 0;
 }
 
 // ---------------------------------------------------------------------------
 // Command implementations
 // ---------------------------------------------------------------------------
 
-static int cmd_mount(const char *remote, const char *local) {
+static int cmd_mount(const char *remote, const char *local, int lazy) {
     if (!validate_remote_spec(remote)) {
         fprintf(stderr, "Invalid remote spec: %s\n", remote);
-        fprintf(stderr, "Expected format: [user@]host:/path\n");
+        fprintf(stderr, "Expected format: [user@]host:/path or file:///path\n");
         return 1;
     }
 
@@ -1026,45 +8465,79 @@ static int cmd_mount(const char *remote, const char *local) {
         fprintf(stderr, "Already mounted at %s\n", resolved_local);
         return 1;
     }
-    if (reg.count >= MAX_MOUNTS) { fprintf(stderr, "Max mounts reached\n"); return 1; }
     if (mkdir_p(resolved_local) != 0) {
         fprintf(stderr, "Failed to create %s: %s\n", resolved_local, strerror(errno));
         return 1;
     }
 
-    printf("Mounting %s → %s\n\n", remote, resolved_local);
-
-    // [1/3] Initial pull — spinner shown inside rsync_pull
-    printf("[1/3] Pulling remote files...\n");
-    if (rsync_pull(remote, resolved_local, 0) != 0) {
-        fprintf(stderr, "\nMount failed: rsync error\n");
-        return 1;
+    printf("Mounting %s → %s%s\n\n", remote, resolved_local, lazy ? " (lazy)" : "");
+    transport_open(remote);
+    // The remote's ignore rules govern the first copy too
+    const Transport *tp = transport_for(remote);
+    char *ignore_rel[] = { IGNORE_FILE };
+    RemoteList irl;
+    if (tp->list(remote, 0, ignore_rel, 1, &irl) == 0) {
+        if (irl.count > 0) tp->fetch(remote, resolved_local, ignore_rel, NULL, NULL, 1);
+        rl_free(&irl);
+    }
+    ignore_load(resolved_local);
+
+    if (lazy) {
+        // [1/2] Placeholders only; content follows from the hydrator
+        printf("[1/2] Listing remote files...\n");
+        long long t = timer_start();
+        int lrc = lazy_init(resolved_local, remote);
+        timer_stop("phase", "list remote", t, NULL);
+        if (lrc != 0) {
+            fprintf(stderr, "\nMount failed: could not list remote files\n");
+            return 1;
+        }
+        printf("      Done.\n\n");
     }
-    printf("      Done.\n\n");
 
-    // [2/3] Base cache — spinner shown inside base_init
-    printf("[2/3] Building base cache...\n");
-    if (base_init(resolved_local) != 0) {
-        fprintf(stderr, "Warning: failed to initialise base cache\n");
-        fprintf(stderr, "First sync will treat all files as locally changed\n");
+    else {
+        // [1/3] Initial pull — progress shown by the transport
+        printf("[1/3] Pulling remote files...\n");
+        if (tp->pull_tree(remote, resolved_local, 0) != 0) {
+            fprintf(stderr, "\nMount failed: could not copy remote files\n");
+            return 1;
+        }
+        printf("      Done.\n\n");
+
+        // [2/3] Base cache — hash the tree, store missing objects (bar inside base_init)
+        printf("[2/3] Building base cache...\n");
+        long long t = timer_start();
+        int brc = base_init(resolved_local);
+        timer_stop("phase", "index", t, NULL);
+        if (brc != 0) {
+            fprintf(stderr, "Warning: failed to initialise base cache\n");
+            fprintf(stderr, "First sync will treat all files as locally changed\n");
+        }
+        printf("      Done.\n\n");
     }
-    printf("      Done.\n\n");
 
     // [3/3] Register
-    printf("[3/3] Registering mount...\n");
-    Mount *m = &reg.mounts[reg.count++];
-    strncpy(m->local_path,   resolved_local, MAX_PATH_LEN - 1);
-    strncpy(m->remote_spec,  remote,         MAX_PATH_LEN - 1);
-    m->mounted_at = time(NULL);
-    m->last_sync  = time(NULL);
-
-    if (save_registry(&reg) != 0)
+    printf(lazy ? "[2/2] Registering mount...\n" : "[3/3] Registering mount...\n");
+    free_registry(&reg);
+    int lk = registry_lock();
+    if (lk < 0 || load_registry(&reg) != 0) {
+        fprintf(stderr, "Warning: Failed to save registry\n");
+    } else if (registry_lookup(&reg, resolved_local)) {
+        fprintf(stderr, "Warning: %s was registered by another rmt meanwhile\n", resolved_local);
+    } else if (!registry_add(&reg, resolved_local, remote) || save_registry(&reg) != 0) {
         fprintf(stderr, "Warning: Failed to save registry\n");
+    }
+    free_registry(&reg);
+    registry_unlock(lk);
     printf("      Done.\n\n");
 
     printf("✓ Mounted successfully\n");
     printf("  Local:  %s\n", resolved_local);
     printf("  Remote: %s\n", remote);
+    if (lazy) {
+        hydrate_spawn(resolved_local);
+        printf("\nFetch files ahead of it with: rmt fetch <path|glob>\n");
+    }
     printf("\nSync changes with: rmt sync %s\n", resolved_local);
     return 0;
 }
@@ -1075,34 +8548,9 @@ static int cmd_sync(const char *local, int dry_run, int pull_only, int push_only
 
     if (!local) {
         if (reg.count == 0) { printf("No active mounts\n"); return 0; }
-        printf("Syncing all mounts...\n\n");
-        int failed = 0;
-        for (int i = 0; i < reg.count; i++) {
-            Mount *m = &reg.mounts[i];
-            printf("=== %s ===\n", m->local_path);
-
-            int rc;
-            if (pull_only) {
-                rc = rsync_pull(m->remote_spec, m->local_path, dry_run);
-                if (rc == 0 && !dry_run) base_init(m->local_path);
-            } else if (push_only) {
-                rc = rsync_push(m->local_path, m->remote_spec, dry_run);
-            } else {
-                rc = smart_sync(m->local_path, m->remote_spec, dry_run);
-            }
-
-            if (rc == 1) {
-                return 1;
-            } else if (rc == 0) {
-                if (!dry_run) m->last_sync = time(NULL);
-                if (!pull_only && !push_only) printf("✓ Synced\n\n");
-            } else {
-                printf("✗ Failed\n\n");
-                failed++;
-            }
-        }
-        if (!dry_run) save_registry(&reg);
-        return failed > 0 ? 1 : 0;
+        int rc = sync_all_mounts(&reg, dry_run, pull_only, push_only);
+        free_registry(&reg);
+        return rc;
     }
 
     Mount *m = find_mount(&reg, local);
@@ -1113,25 +8561,14 @@ static int cmd_sync(const char *local, int dry_run, int pull_only, int push_only
     }
 
     printf("Syncing %s <-> %s...\n\n", m->local_path, m->remote_spec);
+    transport_open(m->remote_spec);
 
-    int rc;
-    if (pull_only) {
-        rc = rsync_pull(m->remote_spec, m->local_path, dry_run);
-        if (rc == 0 && !dry_run) base_init(m->local_path);
-    } else if (push_only) {
-        rc = rsync_push(m->local_path, m->remote_spec, dry_run);
-    } else {
-        rc = smart_sync(m->local_path, m->remote_spec, dry_run);
-    }
-
+    int rc = sync_mount(m, dry_run, pull_only, push_only);
+    free_registry(&reg);
+    print_stats_table();
     if (rc == 1) return 1;
     if (rc != 0) { fprintf(stderr, "\nSync failed\n"); return 1; }
 
-    if (!dry_run) {
-        m->last_sync = time(NULL);
-        save_registry(&reg);
-    }
-
     printf("\n✓ Sync complete\n");
     return 0;
 }
@@ -1158,8 +8595,26 @@ static int cmd_status(void) {
         if      (days  > 0) printf("      Last sync: %d day%s ago\n",  days,  days  == 1 ? "" : "s");
         else if (hours > 0) printf("      Last sync: %d hour%s ago\n", hours, hours == 1 ? "" : "s");
         else                printf("      Last sync: <1 hour ago\n");
+        if (m->files >= 0)
+            printf("      Files: %lld (%.1f MiB)\n", m->files, m->bytes / (1024.0 * 1024.0));
+        if (m->sync_ms >= 0)
+            printf("      Last sync took: %.1fs\n", m->sync_ms / 1000.0);
+        Manifest mf;
+        if (manifest_load(m->local_path, &mf) == 0) {
+            long long lazy = 0, lazy_bytes = 0;
+            for (int k = 0; k < mf.count; k++) {
+                if (!mf.entries[k].live || !mf.entries[k].lazy) continue;
+                lazy++;
+                lazy_bytes += mf.entries[k].rsize;
+            }
+            if (lazy > 0)
+                printf("      Not fetched yet: %lld file%s (%.1f MiB)\n",
+                       lazy, lazy == 1 ? "" : "s", lazy_bytes / (1024.0 * 1024.0));
+        }
+        manifest_free(&mf);
         printf("\n");
     }
+    free_registry(&reg);
 
     printf("Commands:\n");
     printf("  rmt sync [path]     Sync mount (or all if no path given)\n");
@@ -1167,35 +8622,214 @@ static int cmd_status(void) {
     return 0;
 }
 
+static int cmd_watch(const char *local, int interval_ms, int poll_s) {
+    MountRegistry reg = {0};
+    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+    Mount *m = find_mount(&reg, local);
+    if (!m) {
+        fprintf(stderr, "%s is not a mounted path\n", local);
+        fprintf(stderr, "Use 'rmt status' to see active mounts\n");
+        return 1;
+    }
+    char local_path[MAX_PATH_LEN], remote_spec[MAX_PATH_LEN];
+    snprintf(local_path,  sizeof(local_path),  "%s", m->local_path);
+    snprintf(remote_spec, sizeof(remote_spec), "%s", m->remote_spec);
+    free_registry(&reg);
+
+    // No SA_RESTART: Ctrl-C must interrupt poll() so the loop can exit cleanly
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    transport_open(remote_spec);
+    int rc = watch_loop(local_path, remote_spec, interval_ms, poll_s);
+    printf("\nStopped watching %s\n", local_path);
+
+    registry_record_sync(local_path, -1, -1, -1);
+    return rc;
+}
+
+// Prune objects that no mount's manifest references. Objects touched within
+// OBJECT_GC_GRACE are kept so a sync running alongside never loses its base.
+static int cmd_gc(int dry_run) {
+    MountRegistry reg = {0};
+    if (load_registry(&reg) != 0) { fprintf(stderr, "Failed to load registry\n"); return 1; }
+
+    // Referenced object names ("<2 hex><rest>"), indexed like manifest paths
+    Manifest refs;
+    manifest_init(&refs);
+    for (int i = 0; i < reg.count; i++) {
+        Manifest mf;
+        if (manifest_load(reg.mounts[i].local_path, &mf) != 0) {
+            fprintf(stderr, "Cannot read manifest of %s; not collecting\n", reg.mounts[i].local_path);
+            manifest_free(&refs);
+            free_registry(&reg);
+            return 1;
+        }
+        for (int j = 0; j < mf.count; j++) {
+            const ManifestEntry *e = &mf.entries[j];
+            if (!e->live || !e->has_hash) continue;
+            char hex[72];
+            digest_format(&e->hash, hex, sizeof(hex));
+            manifest_get(&refs, strchr(hex, ':') + 1);
+        }
+        manifest_free(&mf);
+    }
+    free_registry(&reg);
+
+    const char *root = get_objects_dir();
+    DIR *top = opendir(root);
+    if (!top) {
+        manifest_free(&refs);
+        if (errno == ENOENT) { printf("Object store is empty\n"); return 0; }
+        fprintf(stderr, "Cannot open %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+
+    time_t cutoff = time(NULL) - OBJECT_GC_GRACE;
+    long long kept = 0, removed = 0, recent = 0, freed = 0;
+    struct dirent *d;
+    while ((d = readdir(top))) {
+        char sub[MAX_PATH_LEN];
+        snprintf(sub, sizeof(sub), "%s/%s", root, d->d_name);
+        struct stat st;
+
+        // Temp files left by an interrupted object_store
+        if (strncmp(d->d_name, ".tmp_", 5) == 0) {
+            if (lstat(sub, &st) == 0 && st.st_mtime < cutoff && !dry_run) unlink(sub);
+            continue;
+        }
+        if (strlen(d->d_name) != 2 || !isxdigit((unsigned char)d->d_name[0])
+            || !isxdigit((unsigned char)d->d_name[1])) continue;
+
+        DIR *dir = opendir(sub);
+        if (!dir) continue;
+        struct dirent *o;
+        while ((o = readdir(dir))) {
+            if (o->d_name[0] == '.') continue;
+            char obj[MAX_PATH_LEN], name[MAX_PATH_LEN];
+            snprintf(obj,  sizeof(obj),  "%s/%s", sub, o->d_name);
+            snprintf(name, sizeof(name), "%s%s", d->d_name, o->d_name);
+            if (lstat(obj, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (manifest_find(&refs, name))  { kept++;   continue; }
+            if (st.st_mtime >= cutoff)       { recent++; continue; }
+            if (dry_run || unlink(obj) == 0) { removed++; freed += (long long)st.st_size; }
+        }
+        closedir(dir);
+        if (!dry_run) rmdir(sub);   // only succeeds once empty
+    }
+    closedir(top);
+    manifest_free(&refs);
+
+    printf("%s %lld unreferenced object%s (%.1f MiB)\n", dry_run ? "Would remove" : "Removed",
+           removed, removed == 1 ? "" : "s", freed / (1024.0 * 1024.0));
+    printf("Kept %lld referenced, %lld recent\n", kept, recent);
+    return 0;
+}
+
 static void usage(const char *prog) {
     printf("rmt - Remote Mount Tool v%s\n\n", VERSION);
     printf("Usage:\n");
-    printf("  %s mount <user@host:/remote> <local-path>\n", prog);
-    printf("  %s sync [local-path] [--dry-run] [--pull] [--push]\n", prog);
+    printf("  %s mount [--lazy] <remote> <local-path>\n", prog);
+    printf("  %s sync [local-path] [--dry-run] [--pull] [--push] [--parallel=N] [--per-host=N]\n", prog);
     printf("  %s unmount <local-path> [--keep]\n", prog);
     printf("  %s status\n", prog);
+    printf("  %s fetch <path|glob>...\n", prog);
+    printf("  %s hydrate <local-path>\n", prog);
+    printf("  %s watch <local-path> [--interval=MS] [--poll=SEC]\n", prog);
+    printf("  %s gc [--dry-run]\n", prog);
     printf("  %s reset\n", prog);
     printf("\n");
     printf("Commands:\n");
     printf("  mount    Mount a remote directory locally\n");
-    printf("  sync     Smart sync using comp for conflict detection and merge\n");
+    printf("  sync     Smart sync: hash-based change detection, 3-way merge\n");
     printf("  unmount  Final sync, then unmount and remove from registry\n");
     printf("  status   Show all active mounts\n");
+    printf("  fetch    Fetch files of a lazy mount now; a directory or glob\n");
+    printf("           takes everything that matches below it\n");
+    printf("  hydrate  Fetch every file a lazy mount still lacks (mount --lazy\n");
+    printf("           starts this in the background)\n");
+    printf("  watch    Sync a mount continuously: local edits as they happen,\n");
+    printf("           remote changes every --poll seconds (default %d)\n", WATCH_POLL_S);
+    printf("  gc       Remove base objects no mount references any more\n");
     printf("  reset    Clear the registry\n");
+    printf("  serve    Remote agent; started over ssh by the other commands\n");
+    printf("\n");
+    printf("Remotes:\n");
+    printf("  [user@]host:/path  Reached over ssh: through the rmt agent when rmt is\n");
+    printf("                     installed there, with rsync otherwise\n");
+    printf("  file:///path       A directory on this machine (local disk, NFS, ...),\n");
+    printf("                     read and written directly, no ssh or rsync\n");
     printf("\n");
     printf("Sync options:\n");
     printf("  --dry-run  Show what would be synced without doing it\n");
     printf("  --pull     Only pull changes from remote (one-way, updates base)\n");
     printf("  --push     Only push changes to remote (one-way)\n");
+    printf("  --parallel=N  With no path: sync up to N mounts at once (default %d)\n", SYNC_PARALLEL);
+    printf("  --per-host=N  ...and at most N against the same host (default %d)\n", SYNC_PER_HOST);
+    printf("\n");
+    printf("Global options:\n");
+    printf("  --hash=fast|sha256|comp  Change detection: in-process fast hash (default),\n");
+    printf("                           SHA-256, or fork comp diff per file (legacy)\n");
+    printf("  --merge=builtin|comp     3-way merge in process (default), or fork\n");
+    printf("                           %s merge per file\n", COMP_BIN);
+    printf("  --remote-hash            Have the remote hash files modified since the\n");
+    printf("                           last sync so touched-but-identical files are\n");
+    printf("                           not fetched (without the agent: --hash=sha256)\n");
+    printf("  --agent=PATH             rmt binary to run on the remote as the agent\n");
+    printf("                           (default: rmt on the remote PATH)\n");
+    printf("  --no-agent               Use rsync and shell commands only\n");
+    printf("  --compress=auto|none|fast|high\n");
+    printf("                           rsync compression; auto (default) picks per\n");
+    printf("                           transfer from file types, content and the\n");
+    printf("                           link and CPU speed seen on earlier transfers\n");
+    printf("  --exclude=PAT            Leave paths matching PAT out of scans and\n");
+    printf("                           transfers, as a line of %s would\n", IGNORE_FILE);
+    printf("  --include=PAT            Take back paths an earlier rule excluded\n");
+    printf("  --keep-ssh               Leave the shared ssh connection up for %s\n", SSH_KEEP_PERSIST);
+    printf("                           so the next run skips the handshake\n");
+    printf("  --no-mux                 Open a separate ssh connection per operation\n");
+    printf("  --streams=N              Move files of %lld MiB or more in %u MiB pieces\n",
+           CHUNK_MIN >> 20, CHUNK_SIZE >> 20);
+    printf("                           over N agent connections (default: %d)\n", CHUNK_STREAMS);
+    printf("  -j, --jobs N             Compare and apply files on N threads\n");
+    printf("                           (default: number of CPUs)\n");
+    printf("  --progress=bar|json|none\n");
+    printf("                           Progress on stderr: a bar with throughput and\n");
+    printf("                           ETA (default), a JSON object per line at most\n");
+    printf("                           once a second, or nothing\n");
+    printf("  --stats                  After a sync, show time per phase, external\n");
+    printf("                           command and per-file step, plus counters\n");
+    printf("  --trace=FILE             Write every timed span to FILE as Chrome trace\n");
+    printf("                           events (chrome://tracing, ui.perfetto.dev);\n");
+    printf("                           syncing all mounts adds FILE.1, FILE.2, ...\n");
+    printf("\n");
+    printf("Mount options:\n");
+    printf("  --lazy     Create the directories and a placeholder per file only;\n");
+    printf("             files are fetched by rmt fetch or in the background,\n");
+    printf("             and sync leaves placeholders alone until then\n");
+    printf("\n");
+    printf("Ignore rules:\n");
+    printf("  <mount>/%s lists paths sync leaves alone, in .gitignore syntax:\n", IGNORE_FILE);
+    printf("  name, *.ext, dir/, /anchored/path, a/**/b and !negation; the last rule\n");
+    printf("  that matches wins. --exclude and --include apply after the file's rules.\n");
     printf("\n");
     printf("Unmount options:\n");
     printf("  --keep     Keep local files (default: final sync then delete)\n");
     printf("\n");
+    printf("Environment:\n");
+    printf("  RMT_STATS_JSON=FILE  On exit, write fork and transfer counters to FILE\n");
+    printf("                       (used by make bench)\n");
+    printf("\n");
     printf("How sync works:\n");
-    printf("  Each file is compared against its last-synced state (.rmt-base/).\n");
+    printf("  Each file is compared against its last-synced state, kept once per\n");
+    printf("  content hash in ~/.rmt/objects/ and shared by all mounts.\n");
     printf("  Only local changed  -> push\n");
     printf("  Only remote changed -> pull\n");
-    printf("  Both changed        -> 3-way merge via comp\n");
+    printf("  Both changed        -> 3-way merge\n");
     printf("  Conflict            -> write conflict markers, stop, report\n");
 }
 
@@ -1204,16 +8838,132 @@ static void usage(const char *prog) {
 // ---------------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
+    g_instr.t0 = now_ns();
+    atexit(write_run_stats);
+    atexit(write_trace);
+
+    // Global options may appear anywhere on the command line
+    g_self = argv[0];
+    char **given = malloc(argc * sizeof(char *));
+    memcpy(given, argv, argc * sizeof(char *));
+    int ngiven = argc;
+    int nargs = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--remote-hash") == 0) { g_remote_hash = 1;   continue; }
+        if (strcmp(argv[i], "--keep-ssh")    == 0) { g_mux.keep = 1;     continue; }
+        if (strcmp(argv[i], "--no-mux")      == 0) { g_mux.disabled = 1; continue; }
+        if (strcmp(argv[i], "--no-agent")    == 0) { g_agent_off = 1;    continue; }
+        if (strncmp(argv[i], "--agent=", 8) == 0 && argv[i][8]) { g_agent_bin = argv[i] + 8; continue; }
+        if (strcmp(argv[i], "--stats")       == 0) { g_stats_table = 1;  continue; }
+        if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8]) { g_trace_path = argv[i] + 8; continue; }
+        if (strncmp(argv[i], "--progress=", 11) == 0) {
+            const char *v = argv[i] + 11;
+            if      (strcmp(v, "bar")  == 0) g_progress = PROGRESS_BAR;
+            else if (strcmp(v, "json") == 0) g_progress = PROGRESS_JSON;
+            else if (strcmp(v, "none") == 0) g_progress = PROGRESS_OFF;
+            else {
+                fprintf(stderr, "Unknown progress style: %s (expected bar, json or none)\n", v);
+                return 1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--streams=", 10) == 0) {
+            char *end;
+            long n = strtol(argv[i] + 10, &end, 10);
+            if (argv[i][10] == '\0' || *end != '\0' || n < 1 || n > 64) {
+                fprintf(stderr, "Invalid --streams value: %s (expected 1-64)\n", argv[i] + 10);
+                return 1;
+            }
+            g_streams = (int)n;
+            continue;
+        }
+        if (strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0
+            || strncmp(argv[i], "--jobs=", 7) == 0) {
+            const char *v = strchr(argv[i], '=');
+            if (v) v++;
+            else   v = (i + 1 < argc) ? argv[++i] : "";
+            char *end;
+            long n = strtol(v, &end, 10);
+            if (*v == '\0' || *end != '\0' || n < 1 || n > 1024) {
+                fprintf(stderr, "Invalid --jobs value: %s (expected 1-1024)\n", v);
+                return 1;
+            }
+            g_jobs = (int)n;
+            continue;
+        }
+        if (strncmp(argv[i], "--merge=", 8) == 0) {
+            if      (strcmp(argv[i] + 8, "builtin") == 0) g_merge_comp = 0;
+            else if (strcmp(argv[i] + 8, "comp")    == 0) g_merge_comp = 1;
+            else {
+                fprintf(stderr, "Unknown merger: %s (expected builtin or comp)\n", argv[i] + 8);
+                return 1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--compress=", 11) == 0) {
+            const char *v = argv[i] + 11;
+            if      (strcmp(v, "auto") == 0) g_compress = COMP_AUTO;
+            else if (strcmp(v, "none") == 0) g_compress = COMP_NONE;
+            else if (strcmp(v, "fast") == 0) g_compress = COMP_FAST;
+            else if (strcmp(v, "high") == 0) g_compress = COMP_HIGH;
+            else {
+                fprintf(stderr, "Unknown compression: %s (expected auto, none, fast or high)\n", v);
+                return 1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--exclude=", 10) == 0 || strncmp(argv[i], "--include=", 10) == 0) {
+            const char *pat = argv[i] + 10;
+            size_t len = strlen(pat);
+            char *rule = malloc(len + 2);
+            // An include is a negated rule; a literal leading '!' or '#' is escaped
+            if (argv[i][2] == 'i')                  snprintf(rule, len + 2, "!%s", pat);
+            else if (pat[0] == '!' || pat[0] == '#') snprintf(rule, len + 2, "\\%s", pat);
+            else                                     snprintf(rule, len + 2, "%s", pat);
+            g_ignore_cli = realloc(g_ignore_cli, (g_ignore_ncli + 1) * sizeof(char *));
+            g_ignore_cli[g_ignore_ncli++] = rule;
+            continue;
+        }
+        if (strncmp(argv[i], "--hash=", 7) == 0) {
+            if (parse_hash_option(argv[i] + 7) != 0) {
+                fprintf(stderr, "Unknown hash: %s (expected fast, sha256 or comp)\n", argv[i] + 7);
+                return 1;
+            }
+            continue;
+        }
+        argv[nargs++] = argv[i];
+    }
+    argc = nargs;
+
+    // What was taken as a global option, for processes started later;
+    // instrumentation stays with this one
+    g_global_argv = malloc(ngiven * sizeof(char *));
+    for (int i = 1, k = 1; i < ngiven; i++) {
+        if (k < nargs && given[i] == argv[k]) { k++; continue; }
+        if (strcmp(given[i], "--stats") == 0 || strncmp(given[i], "--trace=", 8) == 0) continue;
+        g_global_argv[g_global_argc++] = given[i];
+    }
+    free(given);
+
     if (argc < 2) { usage(argv[0]); return 1; }
 
     const char *cmd = argv[1];
 
     if (strcmp(cmd, "mount") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage: %s mount <user@host:/remote> <local-path>\n", argv[0]);
+        const char *pos[2];
+        int npos = 0, lazy = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--lazy") == 0) lazy = 1;
+            else if (npos < 2)                  pos[npos++] = argv[i];
+            else                                npos = 3;
+        }
+        if (npos != 2) {
+            fprintf(stderr, "Usage: %s mount [--lazy] <remote> <local-path>\n", argv[0]);
             return 1;
         }
-        return cmd_mount(argv[2], argv[3]);
+        int rc = cmd_mount(pos[0], pos[1], lazy);
+        transport_close_all();
+        return rc;
     }
 
     if (strcmp(cmd, "sync") == 0) {
@@ -1223,21 +8973,73 @@ int main(int argc, char *argv[]) {
             if      (strcmp(argv[i], "--dry-run") == 0) dry_run   = 1;
             else if (strcmp(argv[i], "--pull")    == 0) pull_only = 1;
             else if (strcmp(argv[i], "--push")    == 0) push_only = 1;
+            else if (strncmp(argv[i], "--parallel=", 11) == 0) g_sync_parallel = atoi(argv[i] + 11);
+            else if (strncmp(argv[i], "--per-host=", 11) == 0) g_sync_per_host = atoi(argv[i] + 11);
             else if (argv[i][0] != '-')                 path      = argv[i];
         }
         if (pull_only && push_only) { fprintf(stderr, "Cannot use both --pull and --push\n"); return 1; }
-        return cmd_sync(path, dry_run, pull_only, push_only);
+        if (g_sync_parallel < 1 || g_sync_per_host < 1) {
+            fprintf(stderr, "--parallel and --per-host must be at least 1\n");
+            return 1;
+        }
+        int rc = cmd_sync(path, dry_run, pull_only, push_only);
+        transport_close_all();
+        return rc;
     }
 
     if (strcmp(cmd, "unmount") == 0) {
         if (argc < 3) { fprintf(stderr, "Usage: %s unmount <local-path> [--keep]\n", argv[0]); return 1; }
         int keep = 0;
         for (int i = 3; i < argc; i++) if (strcmp(argv[i], "--keep") == 0) keep = 1;
-        return cmd_unmount(argv[2], keep);
+        int rc = cmd_unmount(argv[2], keep);
+        transport_close_all();
+        return rc;
     }
 
     if (strcmp(cmd, "status") == 0) return cmd_status();
 
+    if (strcmp(cmd, "fetch") == 0) {
+        if (argc < 3) { fprintf(stderr, "Usage: %s fetch <path|glob>...\n", argv[0]); return 1; }
+        int rc = cmd_fetch(argv + 2, argc - 2);
+        transport_close_all();
+        return rc;
+    }
+
+    if (strcmp(cmd, "hydrate") == 0) {
+        if (argc != 3) { fprintf(stderr, "Usage: %s hydrate <local-path>\n", argv[0]); return 1; }
+        int rc = cmd_hydrate(argv[2]);
+        transport_close_all();
+        return rc;
+    }
+
+    if (strcmp(cmd, "serve") == 0) {
+        if (argc != 3) { fprintf(stderr, "Usage: %s serve <root>\n", argv[0]); return 1; }
+        return agent_serve(argv[2]);
+    }
+
+    if (strcmp(cmd, "watch") == 0) {
+        const char *path = NULL;
+        int interval_ms = WATCH_INTERVAL_MS, poll_s = WATCH_POLL_S;
+        for (int i = 2; i < argc; i++) {
+            if      (strncmp(argv[i], "--interval=", 11) == 0) interval_ms = atoi(argv[i] + 11);
+            else if (strncmp(argv[i], "--poll=", 7) == 0)      poll_s      = atoi(argv[i] + 7);
+            else if (argv[i][0] != '-')                        path        = argv[i];
+        }
+        if (!path || interval_ms < 0 || poll_s < 1) {
+            fprintf(stderr, "Usage: %s watch <local-path> [--interval=MS] [--poll=SEC]\n", argv[0]);
+            return 1;
+        }
+        int rc = cmd_watch(path, interval_ms, poll_s);
+        transport_close_all();
+        return rc;
+    }
+
+    if (strcmp(cmd, "gc") == 0) {
+        int dry_run = 0;
+        for (int i = 2; i < argc; i++) if (strcmp(argv[i], "--dry-run") == 0) dry_run = 1;
+        return cmd_gc(dry_run);
+    }
+
     if (strcmp(cmd, "reset") == 0) {
         const char *registry = get_registry_path();
         printf("This will delete the registry at: %s\n", registry);